@@ -95,7 +95,7 @@
          SHADOWD=0 # shadow page cleanup
         MOUNTING=0 # be able to mount multiple file systems
           GETCWD=0 # getcwd(3) syscall-like functionality
-        UPREEMPT=0 # userland preemption
+        UPREEMPT=1 # userland preemption
              MTP=0 # multiple kernel threads per process
            PIPES=0 # pipe(2) functionality
 
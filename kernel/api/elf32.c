@@ -665,8 +665,10 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
         map->vmm_proc = NULL;
 
         /* Flush the process pagetables and TLB */
-        pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
-        tlb_flush_all();
+        tlb_batch_t tb;
+        tlb_batch_init(&tb);
+        pt_unmap_range_batch(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH, &tb);
+        tlb_batch_flush(&tb);
 
         /* Set the process break and starting break (immediately after the mapped-in
          * text/data/bss from the executable) */
@@ -1,8 +1,11 @@
 
+#include "globals.h"
+
 #include "util/debug.h"
 
 #include "main/interrupt.h"
 #include "main/gdt.h"
+#include "main/fpu.h"
 
 #include "api/exec.h"
 #include "api/binfmt.h"
@@ -45,6 +48,9 @@ int do_execve(const char *filename, char *const *argv, char *const *envp, struct
         if (ret < 0) {
                 return ret;
         }
+        /* The new image starts out with a freshly initialized FPU */
+        fpu_reset(curthr);
+
         /* Make sure we "return" into the start of the newly loaded binary */
         regs->r_eip = eip;
         regs->r_useresp = esp;
@@ -57,6 +63,14 @@ void kernel_execve(const char *filename, char *const *argv, char *const *envp)
         int ret = binfmt_load(filename, argv, envp, &eip, &esp);
         KASSERT(0 == ret); /* Should never fail to load the first binary */
 
+        userland_start(eip, esp);
+}
+
+/* Enters userland at the entry point of a binary which binfmt_load has
+ * just loaded into the current process, with the stack pointer it gave
+ * back. Does not return. */
+void userland_start(uint32_t eip, uint32_t esp)
+{
         dbg(DBG_EXEC, "Entering userland with eip %#08x, esp %#08x\n", eip, esp);
 
         /* To enter userland, we build a set of saved registers to "trick" the processor
@@ -13,6 +13,7 @@
 #include "util/string.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/timer.h"
 
 #include "mm/mman.h"
 #include "mm/mm.h"
@@ -688,6 +689,207 @@ static int sys_munmap(munmap_args_t *args)
         return 0;
 }
 
+static int sys_madvise(madvise_args_t *args)
+{
+        madvise_args_t          kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(madvise_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_madvise(kargs.addr, kargs.len, kargs.advice);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_mlock(mlock_args_t *args)
+{
+        mlock_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(mlock_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_mlock(kargs.addr, kargs.len);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_munlock(mlock_args_t *args)
+{
+        mlock_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(mlock_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_munlock(kargs.addr, kargs.len);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * The nice value is returned less PRIO_MIN so that it can not be
+ * mistaken for an error.
+ */
+static int sys_getpriority(pid_t pid)
+{
+        proc_t *p = (0 == pid) ? curproc : proc_lookup(pid);
+
+        if (NULL == p) {
+                curthr->kt_errno = ESRCH;
+                return -1;
+        }
+        return p->p_nice - PRIO_MIN;
+}
+
+static int sys_setpriority(priority_args_t *args)
+{
+        priority_args_t         kargs;
+        proc_t                 *p;
+
+        if (copy_from_user(&kargs, args, sizeof(priority_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+        p = (0 == kargs.pa_pid) ? curproc : proc_lookup(kargs.pa_pid);
+        if (NULL == p) {
+                curthr->kt_errno = ESRCH;
+                return -1;
+        }
+
+        /* out of range values are clamped rather than refused */
+        sched_renice(p, MAX(PRIO_MIN, MIN(PRIO_MAX, kargs.pa_prio)));
+        return 0;
+}
+
+static int sys_setdeadline(deadline_args_t *args)
+{
+        deadline_args_t         kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(deadline_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = sched_setdeadline(curthr, kargs.dla_runtime, kargs.dla_deadline,
+                                kargs.dla_period);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+#define USECS_PER_TICK          (TICK_MSECS * 1000)
+
+/* The clock ticks to wait to be sure the given time has gone by. The
+ * current tick is already partly over, so it takes one more. */
+static uint32_t usecs_to_ticks(uint64_t usecs)
+{
+        uint64_t ticks;
+
+        if (0 == usecs) {
+                return 0;
+        }
+        ticks = (usecs + USECS_PER_TICK - 1) / USECS_PER_TICK + 1;
+        return (uint32_t)MIN(ticks, 0x7fffffffULL);
+}
+
+static int sys_nanosleep(nanosleep_args_t *args)
+{
+        nanosleep_args_t        kargs;
+        struct timespec         req, rem;
+        ktqueue_t               q;
+        uint32_t                deadline, left;
+        uint64_t                usecs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(nanosleep_args_t))
+            || copy_from_user(&req, kargs.nsa_req, sizeof(struct timespec))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+        if (req.tv_nsec >= 1000000000) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        /* nothing ever wakes the queue, only the timeout or a cancel */
+        sched_queue_init(&q);
+        usecs = req.tv_sec * 1000000ULL + (req.tv_nsec + 999) / 1000;
+        deadline = timer_now() + usecs_to_ticks(usecs);
+        err = sched_cancellable_sleep_on_timeout(&q, usecs_to_ticks(usecs));
+        if (-EINTR != err) {
+                return 0;
+        }
+
+        if (NULL != kargs.nsa_rem) {
+                left = timer_after(deadline, timer_now()) ? deadline - timer_now() : 0;
+                usecs = (uint64_t)left * USECS_PER_TICK;
+                rem.tv_sec = (uint32_t)(usecs / 1000000);
+                rem.tv_nsec = (uint32_t)(usecs % 1000000) * 1000;
+                if (copy_to_user(kargs.nsa_rem, &rem, sizeof(struct timespec))) {
+                        curthr->kt_errno = EFAULT;
+                        return -1;
+                }
+        }
+        curthr->kt_errno = EINTR;
+        return -1;
+}
+
+/* Rounds usecs up to whole ticks, in 64 bits so that values near
+ * UINT_MAX do not wrap. */
+static uint32_t usecs_to_alarm_ticks(uint32_t usecs)
+{
+        return (uint32_t)(((uint64_t)usecs + USECS_PER_TICK - 1) / USECS_PER_TICK);
+}
+
+static int sys_ualarm(ualarm_args_t *args)
+{
+        ualarm_args_t           kargs;
+        uint64_t                left;
+
+        if (copy_from_user(&kargs, args, sizeof(ualarm_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+        /* an alarm is due on a tick, so no extra tick for the first one.
+         * The time left can be up to UINT_MAX rounded up to a tick, so
+         * it is clamped to what fits in the (non-negative) return value */
+        left = (uint64_t)do_ualarm(usecs_to_alarm_ticks(kargs.ua_value),
+                                   usecs_to_alarm_ticks(kargs.ua_interval))
+               * USECS_PER_TICK;
+        return (int)MIN(left, 0x7fffffffULL);
+}
+
+static int sys_pause(void)
+{
+        int ret;
+
+        if (0 > (ret = do_pause())) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        return ret;
+}
+
 static void *sys_mmap(mmap_args_t *arg)
 {
         mmap_args_t             kargs;
@@ -719,7 +921,9 @@ static pid_t sys_waitpid(waitpid_args_t *args)
                 return -1;
         }
 
-        if (0 > (p = do_waitpid(kargs.wpa_pid, kargs.wpa_options, &s))) {
+        if (0 > (p = do_waitpid_timeout(kargs.wpa_pid, kargs.wpa_options, &s,
+                                        kargs.wpa_timeout < 0 ? -1 :
+                                        (int)usecs_to_ticks(kargs.wpa_timeout * 1000ULL)))) {
                 curthr->kt_errno = -p;
                 return -1;
         }
@@ -755,6 +959,11 @@ static void sys_halt(void)
         proc_kill_all();
 }
 
+static size_t sys_get_free_mem(void)
+{
+        return (size_t)page_free_count() * PAGE_SIZE;
+}
+
 static int sys_stat(stat_args_t *arg)
 {
         stat_args_t kern_args;
@@ -913,6 +1122,86 @@ cleanup:
         return 0;
 }
 
+static void free_actions(spawn_action_t *actions, int nactions)
+{
+        int i;
+        for (i = 0; i < nactions; i++) {
+                if (SPAWN_OPEN == actions[i].sa_op && actions[i].sa_path.as_str)
+                        kfree((void *)actions[i].sa_path.as_str);
+        }
+        kfree(actions);
+}
+
+static int sys_spawn(spawn_args_t *args)
+{
+        spawn_args_t kern_args;
+        spawn_action_t *kern_actions = NULL;
+        char *kern_filename = NULL;
+        char **kern_argv = NULL;
+        char **kern_envp = NULL;
+        int i, nactions = 0, err;
+
+        if ((err = copy_from_user(&kern_args, args, sizeof(kern_args))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        if (kern_args.nactions < 0 || kern_args.nactions > 2 * NFILES) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        /* copy the name of the executable */
+        err = -1;
+        if ((kern_filename = user_strdup(&kern_args.filename)) == NULL)
+                goto cleanup;
+
+        /* copy the argument and environment lists */
+        if (kern_args.argv.av_vec) {
+                if ((kern_argv = user_vecdup(&kern_args.argv)) == NULL)
+                        goto cleanup;
+        }
+        if (kern_args.envp.av_vec) {
+                if ((kern_envp = user_vecdup(&kern_args.envp)) == NULL)
+                        goto cleanup;
+        }
+
+        /* copy the file actions, and the path of each open */
+        if (kern_args.nactions > 0) {
+                if (NULL == (kern_actions = kmalloc(kern_args.nactions * sizeof(spawn_action_t)))) {
+                        curthr->kt_errno = ENOMEM;
+                        goto cleanup;
+                }
+                if ((err = copy_from_user(kern_actions, kern_args.actions,
+                                          kern_args.nactions * sizeof(spawn_action_t))) < 0) {
+                        curthr->kt_errno = -err;
+                        err = -1;
+                        goto cleanup;
+                }
+                for (i = 0; i < kern_args.nactions; i++, nactions++) {
+                        if (SPAWN_OPEN == kern_actions[i].sa_op
+                            && NULL == (kern_actions[i].sa_path.as_str =
+                                                user_strdup(&kern_actions[i].sa_path)))
+                                goto cleanup;
+                }
+        }
+
+        if ((err = do_spawn(kern_filename, kern_argv, kern_envp, kern_actions, nactions)) < 0) {
+                curthr->kt_errno = -err;
+                err = -1;
+        }
+
+cleanup:
+        if (kern_filename)
+                kfree(kern_filename);
+        if (kern_argv)
+                free_vector(kern_argv);
+        if (kern_envp)
+                free_vector(kern_envp);
+        if (kern_actions)
+                free_actions(kern_actions, nactions);
+        return err;
+}
+
 static int sys_debug(argstr_t *arg)
 {
         argstr_t kern_args;
@@ -1004,8 +1293,7 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                         return 0;
 
                 case SYS_thr_yield:
-                        sched_make_runnable(curthr);
-                        sched_switch();
+                        sched_yield();
                         return 0;
 
                 case SYS_fork:
@@ -1032,6 +1320,15 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_munmap:
                         return sys_munmap((munmap_args_t *) args);
 
+                case SYS_madvise:
+                        return sys_madvise((madvise_args_t *) args);
+
+                case SYS_mlock:
+                        return sys_mlock((mlock_args_t *) args);
+
+                case SYS_munlock:
+                        return sys_munlock((mlock_args_t *) args);
+
                 case SYS_open:
                         return sys_open((open_args_t *) args);
 
@@ -1081,6 +1378,9 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                         sys_halt();
                         return -1;
 
+                case SYS_get_free_mem:
+                        return (int) sys_get_free_mem();
+
                 case SYS_set_errno:
                         curthr->kt_errno = (int)args;
                         return 0;
@@ -1091,6 +1391,27 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_execve:
                         return sys_execve((execve_args_t *)args, regs);
 
+                case SYS_spawn:
+                        return sys_spawn((spawn_args_t *)args);
+
+                case SYS_setpriority:
+                        return sys_setpriority((priority_args_t *)args);
+
+                case SYS_getpriority:
+                        return sys_getpriority((pid_t)args);
+
+                case SYS_setdeadline:
+                        return sys_setdeadline((deadline_args_t *)args);
+
+                case SYS_nanosleep:
+                        return sys_nanosleep((nanosleep_args_t *)args);
+
+                case SYS_ualarm:
+                        return sys_ualarm((ualarm_args_t *)args);
+
+                case SYS_pause:
+                        return sys_pause();
+
                 case SYS_stat:
                         return sys_stat((stat_args_t *)args);
 
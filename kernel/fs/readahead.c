@@ -0,0 +1,231 @@
+/*
+ * Sequential readahead for vnode-backed memory objects.
+ *
+ * Each open file and each vmarea keeps a readahead_t describing its
+ * stream of accesses. read(2) and page faults report every access through
+ * readahead_access; once a stream is seen to be sequential, the pages
+ * ahead of it are queued for readaheadd, which reads them into the page
+ * cache with pframe_get while the reader carries on. A new window is
+ * queued as soon as the reader enters the previous one, so the next one is
+ * in flight before it is needed. Random access resets the stream and
+ * nothing is read ahead for it.
+ *
+ * The queue is a small fixed ring; when it is full, windows are dropped
+ * rather than waited for, since readahead is only ever a hint. Every
+ * queued window holds a reference on its vnode.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "config.h"
+#include "errno.h"
+
+#include "fs/readahead.h"
+#include "fs/vnode.h"
+
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+typedef struct readahead_req {
+        vnode_t         *rr_vnode;
+        uint32_t        rr_start;
+        uint32_t        rr_npages;
+} readahead_req_t;
+
+static readahead_req_t readahead_queue[READAHEAD_QUEUE_SIZE];
+static uint32_t readahead_head = 0;     /* next request readaheadd takes */
+static uint32_t readahead_count = 0;
+
+static int readahead_enabled = 1;
+static readahead_stats_t readahead_stats;
+
+static proc_t *readaheadd_proc = NULL;
+static kthread_t *readaheadd_thr = NULL;
+static ktqueue_t readaheadd_waitq;
+
+void
+readahead_init(readahead_t *ra)
+{
+        memset(ra, 0, sizeof(*ra));
+}
+
+static void
+readahead_queue_window(vnode_t *vn, uint32_t start, uint32_t npages)
+{
+        readahead_req_t *req;
+
+        if (NULL == readaheadd_thr || (uint32_t)vn->vn_len <= start * PAGE_SIZE)
+                return;
+        if (READAHEAD_QUEUE_SIZE == readahead_count) {
+                readahead_stats.ras_dropped++;
+                return;
+        }
+
+        req = &readahead_queue[(readahead_head + readahead_count) % READAHEAD_QUEUE_SIZE];
+        vref(vn);
+        req->rr_vnode = vn;
+        req->rr_start = start;
+        req->rr_npages = npages;
+        readahead_count++;
+        readahead_stats.ras_windows++;
+
+        sched_broadcast_on(&readaheadd_waitq);
+}
+
+void
+readahead_access(readahead_t *ra, vnode_t *vn, uint32_t pagenum, uint32_t npages)
+{
+        uint32_t end = pagenum + npages;
+        int sequential;
+
+        /* Continuing from (or re-reading) the last access is sequential,
+         * and so is skipping ahead into the window already read, which is
+         * what a fault after fault-around has mapped the rest of it does.
+         * A stream advised to be sequential only has to move forward. */
+        if (READAHEAD_SEQUENTIAL == ra->ra_mode) {
+                sequential = pagenum >= ra->ra_prev;
+        } else {
+                sequential = (pagenum >= ra->ra_prev && pagenum <= ra->ra_next)
+                             || (0 != ra->ra_size && pagenum >= ra->ra_next
+                                 && pagenum < ra->ra_start + ra->ra_size);
+        }
+        ra->ra_prev = pagenum;
+        ra->ra_next = end;
+
+        if (!readahead_enabled || !sequential || READAHEAD_RANDOM == ra->ra_mode) {
+                ra->ra_size = 0;
+                return;
+        }
+
+        if (0 == ra->ra_size) {
+                ra->ra_start = end;
+                ra->ra_size = (READAHEAD_SEQUENTIAL == ra->ra_mode)
+                              ? READAHEAD_MAX_PAGES : READAHEAD_MIN_PAGES;
+        } else if (end > ra->ra_start) {
+                ra->ra_start = MAX(ra->ra_start + ra->ra_size, end);
+                ra->ra_size = MIN(2 * ra->ra_size, READAHEAD_MAX_PAGES);
+        } else {
+                return;
+        }
+        readahead_queue_window(vn, ra->ra_start, ra->ra_size);
+}
+
+void
+readahead_set_mode(readahead_t *ra, int mode)
+{
+        readahead_init(ra);
+        ra->ra_mode = mode;
+}
+
+void
+readahead_prefetch(vnode_t *vn, uint32_t pagenum, uint32_t npages)
+{
+        uint32_t n;
+
+        while (npages > 0 && READAHEAD_QUEUE_SIZE > readahead_count) {
+                n = MIN(npages, READAHEAD_MAX_PAGES);
+                readahead_queue_window(vn, pagenum, n);
+                pagenum += n;
+                npages -= n;
+        }
+}
+
+void
+readahead_set_enabled(int enabled)
+{
+        readahead_enabled = enabled;
+}
+
+void
+readahead_get_stats(readahead_stats_t *stats)
+{
+        *stats = readahead_stats;
+}
+
+/* Reads in whatever part of the window is not already resident, stopping
+ * early if memory runs low or readaheadd is cancelled */
+static void
+readaheadd_fill(readahead_req_t *req)
+{
+        vnode_t *vn = req->rr_vnode;
+        uint32_t pn;
+        pframe_t *pf;
+
+        for (pn = req->rr_start; pn < req->rr_start + req->rr_npages; ++pn) {
+                if ((uint32_t)vn->vn_len <= pn * PAGE_SIZE
+                    || page_free_count() < READAHEAD_MIN_FREE_PAGES
+                    || curthr->kt_cancelled) {
+                        return;
+                }
+                if (NULL != pframe_get_resident(&vn->vn_mmobj, pn))
+                        continue;
+                if (0 > pframe_get(&vn->vn_mmobj, pn, &pf))
+                        return;
+                readahead_stats.ras_pages++;
+        }
+}
+
+static void *
+readaheadd_run(int arg1, void *arg2)
+{
+        readahead_req_t req;
+
+        while (1) {
+                while (0 < readahead_count && !curthr->kt_cancelled) {
+                        req = readahead_queue[readahead_head];
+                        readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_SIZE;
+                        readahead_count--;
+
+                        readaheadd_fill(&req);
+                        vput(req.rr_vnode);
+                }
+                if (curthr->kt_cancelled || sched_cancellable_sleep_on(&readaheadd_waitq))
+                        kthread_exit((void *)0);
+        }
+        return NULL;
+}
+
+static __attribute__((unused)) void
+readaheadd_init(void)
+{
+        sched_queue_init(&readaheadd_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        readaheadd_proc = proc_create("readaheadd");
+        KASSERT(NULL != readaheadd_proc);
+        readaheadd_thr = kthread_create(readaheadd_proc, readaheadd_run, 0, NULL);
+        KASSERT(NULL != readaheadd_thr);
+
+        sched_make_runnable(readaheadd_thr);
+}
+init_func(readaheadd_init);
+init_depends(sched_init);
+
+void
+readahead_shutdown(void)
+{
+        KASSERT(NULL != readaheadd_thr);
+        KASSERT(PID_IDLE == curproc->p_pid);
+
+        kthread_cancel(readaheadd_thr, (void *)0);
+        readaheadd_thr = NULL;
+        int pid = readaheadd_proc->p_pid;
+        int child = do_waitpid(pid, 0, NULL);
+        KASSERT(child == pid && "waited on process other than readaheadd");
+
+        /* drop the references held by windows which were never read */
+        while (0 < readahead_count) {
+                vput(readahead_queue[readahead_head].rr_vnode);
+                readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_SIZE;
+                readahead_count--;
+        }
+}
@@ -74,6 +74,13 @@ do_read(int fd, void *buf, size_t nbytes)
         dbg(DBG_PRINT, "(GRADING2B)\n");
         return -EBADF;   // or -EBADF per your handout; vfstest usually doesn't hit this
     }
+        if (nbytes > 0 && ft->f_pos < ft->f_vnode->vn_len) {
+                /* queue anything worth reading ahead before blocking on
+                 * this read, so the two go to the disk together */
+                uint32_t first = ft->f_pos / PAGE_SIZE;
+                uint32_t last = (MIN(ft->f_pos + nbytes, (size_t)ft->f_vnode->vn_len) - 1) / PAGE_SIZE;
+                readahead_access(&ft->f_ra, ft->f_vnode, first, last - first + 1);
+        }
         int count = ft->f_vnode->vn_ops->read(ft->f_vnode, ft->f_pos, buf, nbytes);
         if (count >= 0){
                 ft->f_pos += count;
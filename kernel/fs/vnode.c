@@ -43,14 +43,36 @@ static mmobj_ops_t vnode_mmobj_ops = {
         .cleanpage = vcleanpage
 };
 
+vnode_t *
+vnode_from_mmobj(mmobj_t *o)
+{
+        return (&vnode_mmobj_ops == o->mmo_ops) ? CONTAINER_OF(o, vnode_t, vn_mmobj) : NULL;
+}
+
 /*
  * Initialization:
  */
+
+/* Slab constructor: sets up the members which are the same for every
+ * unused vnode. vput hands vnodes back in this state (unlocked mutex, no
+ * waiters, no resident pages). */
+void
+vnode_ctor(void *obj)
+{
+        vnode_t *vn = (vnode_t *)obj;
+        memset(vn, 0, sizeof(vnode_t));
+        kmutex_init(&vn->vn_mutex);
+        mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
+        sched_queue_init(&vn->vn_waitq);
+        list_link_init(&vn->vn_link);
+}
+
 static __attribute__((unused)) void
 vnode_init(void)
 {
         list_init(&vnode_inuse_list);
-        vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
+        vnode_allocator = slab_allocator_create_ctor("vnode", sizeof(vnode_t),
+                                                     vnode_ctor, NULL);
 	dbg(DBG_TEST, "vnode_mmobj_ops at %p\n", &vnode_mmobj_ops);
 }
 init_func(vnode_init);
@@ -120,14 +142,23 @@ find:
                 sched_switch();
                 goto find;
         }
-        memset(vn, 0, sizeof(vnode_t));
         /*   initialize its contents: */
+        /*     the mutex, mmobj and wait queue come from vnode_ctor; the
+         *     rest was left over by the previous user: */
+        KASSERT(NULL == vn->vn_mutex.km_holder);
+        KASSERT(0 == vn->vn_refcount && 0 == vn->vn_nrespages);
+        KASSERT(sched_queue_empty(&vn->vn_waitq));
+        vn->vn_ops = NULL;
+        vn->vn_mode = 0;
+        vn->vn_len = 0;
+        vn->vn_i = NULL;
+        vn->vn_devid = 0;
+        vn->vn_cdev = NULL;
+        vn->vn_bdev = NULL;
+        vn->vn_flags = 0;
         /*     members that can be initialized here: */
         vn->vn_fs = fs;
         vn->vn_vno = vno;
-        kmutex_init(&vn->vn_mutex);
-        mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
-        sched_queue_init(&vn->vn_waitq);
 
 #ifdef __MOUNTING__
         vn->vn_mount = vn;
@@ -10,4 +10,6 @@ int do_execve(const char *filename, char *const *argv, char *const *envp, struct
 
 void kernel_execve(const char *filename, char *const *argv, char *const *envp);
 
+void userland_start(uint32_t eip, uint32_t esp);
+
 void userland_entry(const struct regs *regs);
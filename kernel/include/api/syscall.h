@@ -51,13 +51,23 @@
 #define SYS_getpid              35
 #define SYS_errno               39
 #define SYS_halt                40
-#define SYS_get_free_mem        41 /* NYI */
+#define SYS_get_free_mem        41
 #define SYS_set_errno           42
 #define SYS_dup2                43
 #define SYS_brk                 44
 #define SYS_mount               45
 #define SYS_umount              46
 #define SYS_stat                47
+#define SYS_madvise             48
+#define SYS_mlock               49
+#define SYS_munlock             50
+#define SYS_spawn               51
+#define SYS_setpriority         52
+#define SYS_getpriority         53
+#define SYS_setdeadline         54
+#define SYS_nanosleep           55
+#define SYS_ualarm              56
+#define SYS_pause               57
 
 /*
  * ... what does the scouter say about his syscall?
@@ -84,6 +94,7 @@ typedef struct waitpid_args {
         pid_t  wpa_pid;
         int    wpa_options;
         int   *wpa_status;
+        int    wpa_timeout;     /* msecs, or -1 to wait for as long as it takes */
 } waitpid_args_t;
 
 typedef struct mmap_args {
@@ -100,6 +111,17 @@ typedef struct munmap_args {
         size_t  len;
 } munmap_args_t;
 
+typedef struct madvise_args {
+        void   *addr;
+        size_t  len;
+        int     advice;
+} madvise_args_t;
+
+typedef struct mlock_args {
+        const void *addr;
+        size_t      len;
+} mlock_args_t;
+
 typedef struct open_args {
         argstr_t filename;
         int      flags;
@@ -134,6 +156,55 @@ typedef struct execve_args {
         argvec_t envp;
 } execve_args_t;
 
+/* File actions a spawned child applies before loading its program */
+#define SPAWN_OPEN      1       /* open sa_path as sa_fd */
+#define SPAWN_CLOSE     2       /* close sa_fd */
+#define SPAWN_DUP2      3       /* duplicate sa_fd onto sa_newfd */
+
+typedef struct spawn_action {
+        int      sa_op;
+        int      sa_fd;
+        int      sa_newfd;
+        argstr_t sa_path;
+        int      sa_flags;
+} spawn_action_t;
+
+typedef struct spawn_args {
+        argstr_t        filename;
+        argvec_t        argv;
+        argvec_t        envp;
+        spawn_action_t *actions;
+        int             nactions;
+} spawn_args_t;
+
+typedef struct priority_args {
+        pid_t   pa_pid;         /* 0 for the calling process */
+        int     pa_prio;        /* nice value, PRIO_MIN to PRIO_MAX */
+} priority_args_t;
+
+/* In TSC cycles, all zero to leave the deadline class */
+typedef struct deadline_args {
+        uint64_t dla_runtime;   /* CPU time reserved every period */
+        uint64_t dla_deadline;  /* due this far into the period, 0 for the end */
+        uint64_t dla_period;
+} deadline_args_t;
+
+struct timespec {
+        uint32_t tv_sec;
+        uint32_t tv_nsec;       /* below a billion */
+};
+
+typedef struct nanosleep_args {
+        const struct timespec *nsa_req;
+        struct timespec       *nsa_rem;     /* time left if woken early, or NULL */
+} nanosleep_args_t;
+
+/* In microseconds, rounded up to clock ticks */
+typedef struct ualarm_args {
+        uint32_t ua_value;      /* first expiry, 0 to turn the alarm off */
+        uint32_t ua_interval;   /* between later ones, 0 for just the one */
+} ualarm_args_t;
+
 typedef struct rename_args {
         argstr_t oldname;
         argstr_t newname;
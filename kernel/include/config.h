@@ -13,7 +13,26 @@
  * kernel configuration parameters
  */
 #define DEFAULT_STACK_SIZE      (56*1024) /* size of stacks */
+/*     Kernel stacks, see proc/kthread.c. Each is mapped at the top of its
+ *     own power of two sized slot in a window of kernel address space,
+ *     with at least one unmapped guard page below it: */
+#define KSTACK_SIZE_USER        DEFAULT_STACK_SIZE /* threads of user processes */
+#define KSTACK_SIZE_KERNEL      DEFAULT_STACK_SIZE /* kernel-only threads */
+#define KSTACK_SLOT_SHIFT       16                 /* log2 of a slot, 64kb */
+#define KSTACK_AREA_SIZE        (32*1024*1024)     /* the window, 512 slots */
+#define KSTACK_CACHE_MAX        16                 /* free stacks kept per class */
 #define TICK_MSECS              10        /* msecs between clock interrupts */
+#define PROC_PID_HASH_BITS      8         /* log2 of buckets in the pid hash */
+/*     Scheduling, see proc/sched.c. A process' nice value picks the run
+ *     queue level its threads start at; they drop a level each time they
+ *     use up a slice and move back up when they wake from a sleep: */
+#define PRIO_MIN                (-20)     /* first to run... */
+#define PRIO_MAX                19        /* ...and last, the nicest */
+#define SCHED_NLEVELS           32        /* run queue levels, 0 runs first */
+#define SCHED_SLICE_TICKS       1         /* slice at the top 8 levels, doubling every 8 below */
+#define SCHED_WAKE_BOOST        4         /* levels a thread moves up when woken */
+#define SCHED_BOOST_CYCLES      1000000000 /* all threads get their start level back this often */
+#define SCHED_DL_UTIL_MAX       900       /* per mille of the CPU deadline threads may reserve */
 
 /*
  * Memory-management-related:
@@ -26,10 +45,25 @@
 #define KMEM_FRAC(x)               (((x)>>2)+((x)>>3)) /* 37.5%-ish */
 
 /*     pframe/mmobj-system-related: */
-#define PF_HASH_SIZE                  17 /* Number of buckets in pn/mmobj->pframe hash */
+#define PF_OBJ_HASH_BITS               6 /* log2 of buckets in mmobj->page index hash */
 /*         Pageout-related: */
 #define PAGEOUTD_FREE_TARGET_SHIFT     5 /* 3.125% */
 #define PAGEOUTD_FREE_MIN_SHIFT        4 /* 6.25% */
+/*         Pages kept zeroed ahead of anonymous faults: */
+#define PAGE_ZERO_POOL_SIZE            64
+/*         Resident pages mapped around a faulting address (power of 2): */
+#define PAGEFAULT_AROUND_PAGES         16
+/*         Sequential readahead of vnode pages, see fs/readahead.c: */
+#define READAHEAD_MIN_PAGES            4  /* first window */
+#define READAHEAD_MAX_PAGES            32 /* largest window */
+#define READAHEAD_QUEUE_SIZE           16 /* windows waiting for readaheadd */
+#define READAHEAD_MIN_FREE_PAGES       512 /* stop reading ahead below this */
+/*         Pages one process may lock (mlock, MAP_LOCKED), which is also the
+ *         most one MAP_POPULATE mapping faults in up front: */
+#define VMMAP_MAX_LOCKED_PAGES         4096 /* 16MB */
+/*         Shadow objects a page fault looks through for ones it can
+ *         collapse into the object above them, see vm/shadow.c: */
+#define SHADOW_COLLAPSE_WALK           8
 
 
 /*
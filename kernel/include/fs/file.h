@@ -3,6 +3,8 @@
 
 #include "types.h"
 
+#include "fs/readahead.h"
+
 #define FMODE_READ    1
 #define FMODE_WRITE   2
 #define FMODE_APPEND  4
@@ -35,6 +37,12 @@ typedef struct file {
          * The vnode which corresponds to this file.
          */
         struct vnode            *f_vnode;
+
+        /*
+         * Readahead state for reads through this file. Zeroed along with
+         * the rest of the file_t by fget.
+         */
+        readahead_t             f_ra;
 } file_t;
 
 /*
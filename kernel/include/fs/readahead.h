@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.h"
+
+struct vnode;
+
+/* Access patterns a stream can be advised to follow (madvise) */
+#define READAHEAD_NORMAL        0       /* detect sequential access */
+#define READAHEAD_SEQUENTIAL    1       /* read ahead aggressively from the start */
+#define READAHEAD_RANDOM        2       /* never read ahead */
+
+/*
+ * Per-stream readahead state. Every open file and every vmarea has one,
+ * since each is a separate stream of accesses to the same vnode. An
+ * all-zero readahead_t is a fresh stream, for which an access starting at
+ * page 0 already counts as sequential.
+ */
+typedef struct readahead {
+        uint32_t        ra_prev;        /* first page of the last access */
+        uint32_t        ra_next;        /* page after the last access */
+        uint32_t        ra_start;       /* first page of the last window read ahead */
+        uint32_t        ra_size;        /* its size in pages, 0 if not sequential */
+        int             ra_mode;        /* READAHEAD_NORMAL, _SEQUENTIAL or _RANDOM */
+} readahead_t;
+
+typedef struct readahead_stats {
+        uint32_t        ras_windows;    /* windows handed to readaheadd */
+        uint32_t        ras_pages;      /* pages it read in */
+        uint32_t        ras_dropped;    /* windows dropped with the queue full */
+} readahead_stats_t;
+
+void readahead_init(readahead_t *ra);
+
+/*
+ * Tells the readahead code that the stream ra has just accessed pages
+ * [pagenum, pagenum + npages) of vn. If the stream looks sequential the
+ * pages following it are queued to be read into the page cache by
+ * readaheadd, in windows that double on every sequential access from
+ * READAHEAD_MIN_PAGES up to READAHEAD_MAX_PAGES; an access anywhere else
+ * resets the stream. Never blocks.
+ */
+void readahead_access(readahead_t *ra, struct vnode *vn, uint32_t pagenum, uint32_t npages);
+
+/* Sets the access pattern a stream follows, forgetting its history */
+void readahead_set_mode(readahead_t *ra, int mode);
+
+/* Queues pages [pagenum, pagenum + npages) of vn to be read in, as far as
+ * there is room in the queue. Never blocks. */
+void readahead_prefetch(struct vnode *vn, uint32_t pagenum, uint32_t npages);
+
+void readahead_set_enabled(int enabled);
+void readahead_get_stats(readahead_stats_t *stats);
+
+/* Stops readaheadd and drops anything still queued; called from idleproc
+ * before the VFS is shut down. */
+void readahead_shutdown(void);
@@ -169,6 +169,10 @@ void vo_vref(mmobj_t *o);
 void vo_vput(mmobj_t *o);
 
 int  vlookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
+
+/* Returns the vnode whose memory object o is, or NULL if o belongs to
+ * something other than a vnode (an anonymous or shadow object). */
+struct vnode *vnode_from_mmobj(mmobj_t *o);
 int  vreadpage(mmobj_t *o, pframe_t *pf);
 int  vdirtypage(mmobj_t *o, pframe_t *pf);
 int  vcleanpage(mmobj_t *o, pframe_t *pf);
@@ -327,6 +331,12 @@ typedef struct vnode {
  */
 struct vnode *vget(struct fs *fs, ino_t vnum);
 
+/*
+ *     Slab constructor of the vnode allocator. Exported so that
+ *     slab_bench can build a cache of identical vnodes.
+ */
+void vnode_ctor(void *obj);
+
 /*
  *     Increment the reference count of the provided vnode.
  */
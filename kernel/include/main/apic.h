@@ -11,8 +11,13 @@ void apic_init();
 /* Maps the given IRQ to the given interrupt number. */
 void apic_setredir(uint32_t irq, uint8_t intr);
 
-/* Starts the APIC timer */
-void apic_enable_periodic_timer(uint32_t freq);
+/* Starts the APIC timer interrupting hz times a second on interrupt 32,
+ * after timing it against the PIT. The TSC is timed as well. */
+void apic_enable_periodic_timer(uint32_t hz);
+
+/* Returns the TSC frequency measured when the timer was started, or 0
+ * if it has not been. */
+uint32_t apic_tsc_khz();
 
 /* Stops the APIC timer */
 void apic_disable_periodic_timer();
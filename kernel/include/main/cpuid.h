@@ -88,7 +88,7 @@ enum cpuid_requests {
 
 static inline void cpuid(int request, uint32_t *a, uint32_t *d)
 {
-        __asm__ volatile("cpuid":"=a"(*a), "=d"(*d):"0"(request));
+        __asm__ volatile("cpuid":"=a"(*a), "=d"(*d):"0"(request):"ebx", "ecx");
 }
 
 static inline void cpuid_get_msr(uint32_t msr, uint32_t* lo, uint32_t* hi)
@@ -107,3 +107,10 @@ static inline void io_wait(void)
 			 "1:jmp 2f\n\t"
 			 "2:" );
 }
+
+static inline uint64_t rdtsc(void)
+{
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+}
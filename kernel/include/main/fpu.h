@@ -0,0 +1,39 @@
+#pragma once
+
+#include "types.h"
+
+/* Size and required alignment of the area written by FXSAVE and read
+ * back by FXRSTOR. */
+#define FPU_STATE_SIZE          512
+#define FPU_STATE_ALIGN         16
+
+/* Per-thread x87/MMX/SSE register state. The buffer is over-allocated so
+ * that an aligned save area can always be carved out of it no matter
+ * where the containing kthread_t lands inside its slab. */
+typedef struct fpu_state {
+        int     fs_used;        /* 1 once the thread has executed an FPU instruction */
+        uint8_t fs_buf[FPU_STATE_SIZE + FPU_STATE_ALIGN - 1];
+} fpu_state_t;
+
+struct kthread;
+
+/* Enables the FPU and SSE units, arms CR0.TS and registers the
+ * device-not-available handler. Must be called after intr_init(). */
+void fpu_init(void);
+
+/* Called by the scheduler right before switching to next. If next still
+ * owns the live FPU registers TS is cleared, otherwise it is set so the
+ * first FPU instruction next executes traps and loads its state. */
+void fpu_switch(struct kthread *next);
+
+/* Copies the FPU state of from into to (used by fork). If from owns the
+ * live registers they are flushed to memory first. */
+void fpu_clone(struct kthread *from, struct kthread *to);
+
+/* Discards the FPU state of thr so that it starts with a freshly
+ * initialized FPU the next time it uses one (used by exec). */
+void fpu_reset(struct kthread *thr);
+
+/* Forgets about thr if it currently owns the live FPU registers. Must be
+ * called before thr is freed. */
+void fpu_release(struct kthread *thr);
@@ -11,6 +11,7 @@
 #define GDT_USER_TEXT   0x18
 #define GDT_USER_DATA   0x20
 #define GDT_TSS         0x28
+#define GDT_DOUBLE_FAULT_TSS 0x30
 
 void gdt_init(void);
 
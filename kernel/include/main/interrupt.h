@@ -8,6 +8,7 @@
 
 #define INTR_DIVIDE_BY_ZERO 0x00
 #define INTR_INVALID_OPCODE 0x06
+#define INTR_DEVICE_NOT_AVAILABLE 0x07
 #define INTR_GPF 0x0d
 #define INTR_PAGE_FAULT 0x0e
 
@@ -24,3 +24,15 @@
 */
 #define MAP_FIXED       4
 #define MAP_ANON        8
+#define MAP_LARGEPAGE   0x10  /* hint: back with 4mb pages where possible */
+#define MAP_POPULATE    0x20  /* fault the whole mapping in now */
+#define MAP_LOCKED      0x40  /* fault the mapping in and lock it, as mlock() */
+
+/* Advice for madvise().
+*/
+#define MADV_NORMAL     0     /* no particular pattern */
+#define MADV_RANDOM     1     /* no readahead */
+#define MADV_SEQUENTIAL 2     /* aggressive readahead, drop pages once read */
+#define MADV_WILLNEED   3     /* read the range in now */
+#define MADV_DONTNEED   4     /* discard the range now */
+#define MADV_FREE       8     /* discard the range when memory is needed */
@@ -21,7 +21,17 @@
 
 #define PAGE_ALIGNED(x) (0 == ((uintptr_t)(x)) % PAGE_SIZE)
 
-#define PAGE_NSIZES  8
+/* Large pages are mapped by a single page directory entry (PSE). The
+ * page allocator's largest blocks are exactly one large page and are
+ * aligned to one in physical memory. */
+#define PAGE_LARGE_SHIFT   22
+#define PAGE_LARGE_SIZE    ((uint32_t)(1UL<<PAGE_LARGE_SHIFT))
+#define PAGE_LARGE_NPAGES  (1 << (PAGE_LARGE_SHIFT - PAGE_SHIFT))
+#define PAGE_LARGE_MASK    (0xffffffff<<PAGE_LARGE_SHIFT)
+#define PAGE_LARGE_OFFSET(x) ((uintptr_t)(x)&~PAGE_LARGE_MASK)
+#define PAGE_LARGE_ALIGNED(x) (0 == PAGE_LARGE_OFFSET(x))
+
+#define PAGE_NSIZES  (PAGE_LARGE_SHIFT - PAGE_SHIFT + 1)
 
 #define PAGE_SAME(addr1, addr2) (PAGE_ALIGN_DOWN(addr1) == PAGE_ALIGN_DOWN(addr2))
 
@@ -40,6 +50,29 @@ void page_add_range(uintptr_t start, uintptr_t end);
 void *page_alloc(void);
 void  page_free(void *addr);
 
+/* Takes one zero-filled page from a small pool of pages zeroed while
+ * the system is idle; free it with page_free. Returns NULL if the pool
+ * is empty, in which case the caller should zero a page itself. */
+void *page_zero_take(void);
+
+/* Zeroes up to npages free pages into the pool used by
+ * page_zero_take, returning how many were added. Called from the
+ * scheduler's idle loop; does nothing once the pool is full or when free
+ * memory is low. */
+int   page_zero_refill(int npages);
+
+/* Enables or disables (and empties) the pre-zeroed page pool. */
+void  page_zero_set_enabled(int enabled);
+
+typedef struct page_zero_stats {
+        uint32_t pzs_hits;      /* page_zero_take calls served from the pool */
+        uint32_t pzs_misses;    /* page_zero_take calls finding the pool empty */
+        uint32_t pzs_refilled;  /* pages zeroed into the pool */
+        uint32_t pzs_pooled;    /* pages currently in the pool */
+} page_zero_stats_t;
+
+void  page_zero_get_stats(page_zero_stats_t *stats);
+
 /* These functions allocate and free a page-aligned
  * block of memory which are npages pages in length.
  * A call to page_alloc_n will allocate a block, to free
@@ -53,3 +86,7 @@ void  page_free_n(void *start, uint32_t npages);
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
 uint32_t page_free_count();
+
+/* Returns the number of free blocks of exactly 2^order pages, a measure
+ * of how fragmented free memory is. */
+uint32_t page_free_blocks(uint32_t order);
@@ -7,6 +7,8 @@
 #define PD_WRITE_THROUGH  0x008
 #define PD_CACHE_DISABLED 0x010
 #define PD_ACCESSED       0x020
+#define PD_DIRTY          0x040 /* large pages only */
+#define PD_LARGE          0x080 /* maps a 4mb page rather than a page table */
 
 #define PT_PRESENT        0x001
 #define PT_WRITE          0x002
@@ -50,15 +52,79 @@ uintptr_t pt_virt_to_phys(uintptr_t vaddr);
  * Note that the TLB is not flushed by this function. */
 int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags);
 
+/* Maps the large page at physical address paddr in at vaddr in the given
+ * page directory with a single page directory entry, replacing any page
+ * table for that part of the address space. Both addresses must be
+ * aligned to PAGE_LARGE_SIZE and the whole large page must be in the
+ * user address space. Returns -ENOTSUP if the processor has no large
+ * page support. Like pt_map, other functions here accept any page
+ * inside a large page and break it up into small pages as needed.
+ * Note that the TLB is not flushed by this function. */
+int pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags);
+
+/* Returns whether pt_map_large can be used. */
+int pt_large_pages_enabled(void);
+
 /* Unmaps the page for the given virtual page from the given page
  * directory. vaddr must be in the user address space. vaddr must
  * be page aligned. Note that the TLB is not flushed by this function. */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
+/* Kernel stacks are mapped a page at a time in this window of kernel
+ * address space, just below the page table used for temporary mappings.
+ * Its page tables are set up before the template page directory is
+ * saved, so every page directory shares them and a stack mapped here is
+ * visible in all of them. */
+#define KSTACK_AREA_HIGH  0xffc00000 /* exclusive */
+#define KSTACK_AREA_LOW   (KSTACK_AREA_HIGH - KSTACK_AREA_SIZE)
+
+/* Maps the page at kernel address page in at vaddr in the kernel stack
+ * window, writable by the kernel only. */
+void pt_kstack_map(uintptr_t vaddr, void *page);
+
+/* Unmaps vaddr in the kernel stack window, flushing it from the TLB, and
+ * returns the kernel address of the page which was mapped there so that
+ * it can be freed. */
+void *pt_kstack_unmap(uintptr_t vaddr);
+
+/* Returns 1 if the given virtual page of the given page directory is
+ * mapped, 0 otherwise. vaddr must be page aligned in the user address
+ * space. */
+int pt_is_mapped(pagedir_t *pd, uintptr_t vaddr);
+
+/* Returns the physical page the given virtual page of the given page
+ * directory maps, or 0 if it is not mapped. vaddr must be page aligned
+ * in the user address space. */
+uintptr_t pt_user_to_phys(pagedir_t *pd, uintptr_t vaddr);
+
+/* If the given virtual page of the given page directory maps the physical
+ * page paddr and has been accessed since the last call, clears its
+ * accessed bit and returns 1; otherwise returns 0. vaddr must be in the
+ * user address space. Both vaddr and paddr must be page aligned. */
+int pt_test_and_clear_accessed(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr);
+
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
  * the addresses must be page aligned in the user address space */
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
 
+/* Like pt_unmap_range, but also adds every address which was actually
+ * mapped, and one address of each page table freed, to the given batch,
+ * so that the caller can invalidate just those with tlb_batch_flush once
+ * it is done. */
+struct tlb_batch;
+void pt_unmap_range_batch(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, struct tlb_batch *tb);
+
+/* Makes every page mapped in [vlow, vhigh) read-only, so that the next
+ * write to one of them faults, and adds the addresses changed to the
+ * given batch for the caller to invalidate. */
+void pt_write_protect_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, struct tlb_batch *tb);
+
+/* Maps every page src maps in [vlow, vhigh) at the same address in dst,
+ * read-only. Large pages are not copied. Returns 0, or -ENOMEM if a page
+ * table could not be allocated, in which case the pages not copied are
+ * simply left unmapped in dst. */
+int pt_copy_range(pagedir_t *dst, pagedir_t *src, uintptr_t vlow, uintptr_t vhigh);
+
 /* Creates a new page directory which is initialized to contain
  * mappings for all kernel memory. If there is not enough memory
  * to allocate the directory NULL is returned. Note that destroying
@@ -12,6 +12,9 @@ struct mmobj;
 
 #define PF_BUSY                 0x01
 #define PF_DIRTY                0x02
+#define PF_REFERENCED           0x04
+#define PF_LARGE                0x08    /* frame is part of a large page */
+#define PF_FREEABLE             0x10    /* contents may be discarded, see pframe_set_freeable */
 
 #define pframe_is_busy(pf)          ((pf)->pf_flags & PF_BUSY)
 #define pframe_set_busy(pf)         do { (pf)->pf_flags |= PF_BUSY; } while (0)
@@ -21,7 +24,16 @@ struct mmobj;
 #define pframe_set_dirty(pf)        do { (pf)->pf_flags |= PF_DIRTY; } while (0)
 #define pframe_clear_dirty(pf)      do { (pf)->pf_flags &= ~PF_DIRTY; } while (0)
 
+#define pframe_is_referenced(pf)    ((pf)->pf_flags & PF_REFERENCED)
+#define pframe_set_referenced(pf)   do { (pf)->pf_flags |= PF_REFERENCED; } while (0)
+#define pframe_clear_referenced(pf) do { (pf)->pf_flags &= ~PF_REFERENCED; } while (0)
+
+#define pframe_is_large(pf)         ((pf)->pf_flags & PF_LARGE)
+
+#define pframe_is_freeable(pf)      ((pf)->pf_flags & PF_FREEABLE)
+
 #define pframe_is_pinned(pf)        ((pf)->pf_pincount)
+#define pframe_is_locked(pf)        ((pf)->pf_lockcount)
 #define pframe_is_free(pf)          (!(pf)->pf_obj)
 
 /* A pframe structure represents a page frame in physical memory available to the
@@ -39,17 +51,32 @@ typedef struct pframe {
         void               *pf_addr;
 
         /* Private: */
-        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY */
+        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY, PF_REFERENCED, PF_LARGE,
+                                          * PF_FREEABLE */
         ktqueue_t           pf_waitq;    /* wait on this if page is busy */
         int                 pf_pincount;
         list_link_t         pf_link;     /* link on {free,allocated,pinned}_list */
-        list_link_t         pf_hlink;    /* link on hash chain of resident page hash */
+        list_link_t         pf_hlink;    /* unused; keeps pf_olink at the offset
+                                          * precompiled code expects */
         list_link_t         pf_olink;    /* link on object's list of resident pages */
+        int                 pf_lockcount;/* pins held for locked mappings (mlock),
+                                          * never more than pf_pincount */
 } pframe_t;
 
+/* Page cache activity counters, see pframe_get_stats() */
+typedef struct pframe_stats {
+        uint32_t            ps_hits;          /* pframe_get found the page resident */
+        uint32_t            ps_misses;        /* pframe_get had to fill a new page */
+        uint32_t            ps_evictions;     /* pages reclaimed by the clock */
+        uint32_t            ps_second_chances;/* referenced pages the clock skipped */
+        uint32_t            ps_lazy_frees;    /* freeable pages the clock discarded */
+} pframe_stats_t;
+
 void pframe_init(void);
 void pframe_add_range(uint32_t startpfn, uint32_t endpfn);
 void pframe_pageoutd_init(void);
+/* slab constructor of the pframe allocator, exported for slab_bench */
+void pframe_ctor(void *obj);
 
 void pframe_shutdown(void);
 
@@ -57,15 +84,24 @@ pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result);
-void pframe_migrate(pframe_t *pf, mmobj_t *dest);
+int pframe_get_large(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+int  pframe_migrate(pframe_t *pf, mmobj_t *dest);
 
 void pframe_pin(pframe_t *pf);
 void pframe_unpin(pframe_t *pf);
+void pframe_lock(pframe_t *pf);
+void pframe_unlock(pframe_t *pf);
 
 int  pframe_dirty(pframe_t *pf);
 int  pframe_clean(pframe_t *pf);
 void pframe_free(pframe_t *pf);
 
 void pframe_clean_all(void);
+int  pframe_reclaim(uint32_t npages);
+void pframe_get_stats(pframe_stats_t *stats);
 
 void pframe_remove_from_pts(pframe_t *pf);
+
+void pframe_deactivate(pframe_t *pf);
+void pframe_set_freeable(pframe_t *pf);
+void pframe_free_range(struct mmobj *o, uint32_t lopage, uint32_t hipage);
@@ -20,7 +20,21 @@
  */
 typedef struct slab_allocator slab_allocator_t;
 
+/*
+ * Constructors and destructors. The constructor is run when an object is
+ * first handed out from a slab and the destructor when the object is
+ * eventually returned to it; in between, an object may be freed and
+ * reallocated any number of times through the allocator's magazines
+ * without either being run. Code using a constructor must therefore free
+ * objects in their constructed state (e.g. with empty wait queues and
+ * unlocked mutexes). Neither may allocate memory or block.
+ */
+typedef void (*slab_ctor_t)(void *obj);
+typedef void (*slab_dtor_t)(void *obj);
+
 slab_allocator_t *slab_allocator_create(const char *name, size_t size);
+slab_allocator_t *slab_allocator_create_ctor(const char *name, size_t size,
+                                             slab_ctor_t ctor, slab_dtor_t dtor);
 int slab_allocators_reclaim(int target);
 
 void *slab_obj_alloc(slab_allocator_t *allocator);
@@ -13,22 +13,73 @@ static inline void tlb_flush(uintptr_t vaddr)
         __asm__ volatile("invlpg (%0)" :: "r"(vaddr));
 }
 
+/* Invalidating more pages than this one at a time costs more than
+ * reloading cr3 and refilling the TLB afterward. */
+#define TLB_FLUSH_CEILING 32
+
+/* Invalidates the entire TLB. */
+static inline void tlb_flush_all()
+{
+        uintptr_t pdir;
+        __asm__ volatile("movl %%cr3, %0" : "=r"(pdir));
+        __asm__ volatile("movl %0, %%cr3" :: "r"(pdir) : "memory");
+}
+
 /* Invalidates any entries for the count virtual addresses
- * starting at vaddr from the TLB. If this range is very
- * large it may be more efficient to call tlb_flush_all
- * to invalidate the entire TLB. */
+ * starting at vaddr from the TLB, or the entire TLB if the
+ * range is larger than TLB_FLUSH_CEILING pages. */
 static inline void tlb_flush_range(uintptr_t vaddr, uint32_t count)
 {
         uint32_t i;
+        if (count > TLB_FLUSH_CEILING) {
+                tlb_flush_all();
+                return;
+        }
         for (i = 0; i < count; ++i, vaddr += PAGE_SIZE) {
                 tlb_flush(vaddr);
         }
 }
 
-/* Invalidates the entire TLB. */
-static inline void tlb_flush_all()
+/* Collects the virtual addresses whose mappings an operation changes so
+ * they can be invalidated together once it is done. Only as many as
+ * TLB_FLUSH_CEILING are remembered; past that tlb_batch_flush flushes
+ * the entire TLB instead. */
+typedef struct tlb_batch {
+        uint32_t        tb_count;       /* TLB_FLUSH_CEILING + 1 once full */
+        uintptr_t       tb_addrs[TLB_FLUSH_CEILING];
+} tlb_batch_t;
+
+static inline void tlb_batch_init(tlb_batch_t *tb)
 {
-        uintptr_t pdir;
-        __asm__ volatile("movl %%cr3, %0" : "=r"(pdir));
-        __asm__ volatile("movl %0, %%cr3" :: "r"(pdir) : "memory");
+        tb->tb_count = 0;
+}
+
+/* Whether the batch will flush the entire TLB, in which case there is
+ * no need to add any more addresses to it. */
+static inline int tlb_batch_full(tlb_batch_t *tb)
+{
+        return tb->tb_count > TLB_FLUSH_CEILING;
+}
+
+static inline void tlb_batch_add(tlb_batch_t *tb, uintptr_t vaddr)
+{
+        if (tb->tb_count < TLB_FLUSH_CEILING) {
+                tb->tb_addrs[tb->tb_count++] = vaddr;
+        } else {
+                tb->tb_count = TLB_FLUSH_CEILING + 1;
+        }
+}
+
+/* Invalidates everything collected in the batch and empties it. */
+static inline void tlb_batch_flush(tlb_batch_t *tb)
+{
+        uint32_t i;
+        if (tlb_batch_full(tb)) {
+                tlb_flush_all();
+        } else {
+                for (i = 0; i < tb->tb_count; ++i) {
+                        tlb_flush(tb->tb_addrs[i]);
+                }
+        }
+        tb->tb_count = 0;
 }
@@ -11,6 +11,8 @@
 #include "proc/sched.h"
 #include "proc/context.h"
 
+#include "main/fpu.h"
+
 typedef context_func_t kthread_func_t;
 
 /* thread states */
@@ -23,6 +25,14 @@ typedef enum
         KT_EXITED              /* has exited, waiting to be joined */
 } kthread_state_t;
 
+/* Kernel stack classes, each with its own stack size (see config.h) */
+typedef enum
+{
+        KSTACK_USER,           /* threads which run a user process */
+        KSTACK_KERNEL,         /* threads which never leave the kernel */
+        KSTACK_NCLASSES
+} kstack_class_t;
+
 struct proc;
 typedef struct kthread {
         context_t       kt_ctx;         /* this thread's context */
@@ -42,14 +52,65 @@ typedef struct kthread {
          */
         list_link_t     kt_qlink;       /* link on ktqueue */
         list_link_t     kt_plink;       /* link on proc thread list, p_threads */
+
+        fpu_state_t     kt_fpu;         /* saved x87/SSE state, loaded lazily */
 #ifdef __MTP__
         int             kt_detached;    /* if the thread has been detached */
         ktqueue_t       kt_joinq;       /* thread waiting to join with this thread */
 #endif
+        size_t          kt_kstacksz;    /* size of kt_kstack */
+        kstack_class_t  kt_kstack_class; /* the class kt_kstack came from */
+        int             kt_prio;        /* run queue level, 0 runs first */
+        uint64_t        kt_slice_used;  /* cycles run at this level */
+        uint64_t        kt_oncpu;       /* when this thread last started running */
+        /* deadline class, see sched.c; all in TSC cycles */
+        uint64_t        kt_dl_runtime;  /* budget per period, 0 if not in the class */
+        uint64_t        kt_dl_deadline; /* how far into a period the budget is due */
+        uint64_t        kt_dl_period;
+        uint64_t        kt_dl_budget;   /* left this period, 0 if demoted or throttled */
+        uint64_t        kt_dl_abs;      /* this period's deadline */
+        uint64_t        kt_dl_next;     /* when the next period starts */
+        uint32_t        kt_dl_overruns; /* periods it ran out of budget in */
+        list_link_t     kt_dl_link;     /* link on the list of deadline threads */
 } kthread_t;
 
+typedef struct kstack_stats {
+        uint32_t kss_inuse;     /* stacks held by threads */
+        uint32_t kss_cached;    /* free stacks kept mapped for reuse */
+        uint32_t kss_hits;      /* allocations served from the cache */
+        uint32_t kss_misses;    /* allocations which mapped fresh pages */
+        uint32_t kss_failed;    /* allocations which found no slot or memory */
+} kstack_stats_t;
+
 void kthread_init(void);
 
+/**
+ * Allocates a kernel stack of the given class. The stack is mapped a
+ * page at a time in the kernel stack window with an unmapped guard page
+ * below it, so it needs no physically contiguous memory.
+ *
+ * @param kclass the class of thread the stack is for
+ * @return the lowest address of the stack, or NULL if there is not
+ * enough memory or no free slot in the window
+ */
+char *kstack_alloc(kstack_class_t kclass);
+
+/**
+ * Frees a stack allocated with kstack_alloc, keeping it mapped for
+ * reuse if there are not already enough free stacks of its class.
+ *
+ * @param stack the stack to free
+ * @param kclass the class it was allocated for
+ */
+void kstack_free(char *stack, kstack_class_t kclass);
+
+/**
+ * Returns the size of the stacks of the given class.
+ */
+size_t kstack_size(kstack_class_t kclass);
+
+void kstack_get_stats(kstack_stats_t *stats);
+
 /**
  * Allocates and initializes a kernel thread.
  *
@@ -62,6 +123,14 @@ void kthread_init(void);
  */
 kthread_t *kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2);
 
+/**
+ * Like kthread_create, but the thread's kernel stack is of the given
+ * class rather than KSTACK_KERNEL. Threads which will go on to run a
+ * user program should be created with KSTACK_USER.
+ */
+kthread_t *kthread_create_class(struct proc *p, kthread_func_t func, long arg1, void *arg2,
+                                kstack_class_t kclass);
+
 /**
  * Free resources associated with a thread.
  *
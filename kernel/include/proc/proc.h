@@ -9,12 +9,15 @@
 
 #include "vm/vmmap.h"
 
+#include "util/timer.h"
+
 #include "config.h"
 
 #define PROC_MAX_COUNT  65536
 #define PROC_NAME_LEN   256
 
 struct regs;
+struct spawn_action;
 
 /* Process states. */
 typedef enum
@@ -58,6 +61,14 @@ typedef struct proc {
         struct vmmap   *p_vmmap;         /* list of areas mapped into
                                           * process' user address
                                           * space */
+        list_link_t     p_hash_link;     /* link on the pid hash chain */
+        int             p_nice;          /* PRIO_MIN..PRIO_MAX, see sched.c */
+
+        /* ualarm(2) and pause(2): */
+        timer_t         p_alarm;
+        uint32_t        p_alarm_interval; /* ticks between expiries, 0 for one */
+        uint32_t        p_alarm_count;   /* expiries pause has not yet seen */
+        ktqueue_t       p_alarm_wait;    /* threads in pause */
 } proc_t;
 
 /* Special PIDs for Kernel Deamons */
@@ -74,6 +85,14 @@ void proc_init(void);
  */
 proc_t *proc_create(char *name);
 
+/**
+ * Takes a process which is being thrown away without ever having run
+ * out of the process list and the pid hash, and frees its pid.
+ *
+ * @param p the process
+ */
+void proc_remove(proc_t *p);
+
 /**
  * Finds the process with the specified PID.
  *
@@ -132,6 +151,37 @@ void do_exit(int status);
  */
 pid_t do_waitpid(pid_t pid, int options, int *status);
 
+/**
+ * Like do_waitpid, but gives up once the given number of clock ticks
+ * have gone by without a child to reap.
+ *
+ * @param ticks the longest to wait, 0 to only reap a child which has
+ * already exited, or negative to wait for as long as it takes
+ * @return as do_waitpid, or -ETIMEDOUT if the time ran out
+ */
+pid_t do_waitpid_timeout(pid_t pid, int options, int *status, int ticks);
+
+/**
+ * Sets the process' alarm to go off the given number of clock ticks
+ * from now, and every interval ticks after that. This implements
+ * ualarm(2), except that there are no signals: pause(2) waits for it.
+ *
+ * @param ticks when the alarm first goes off, 0 to turn it off
+ * @param interval ticks between later expiries, 0 for just the one
+ * @return the ticks which were left until the alarm would have gone
+ * off, or 0 if it was off
+ */
+uint32_t do_ualarm(uint32_t ticks, uint32_t interval);
+
+/**
+ * Waits for the process' alarm to go off, if it has not gone off since
+ * the last call. This implements pause(2).
+ *
+ * @return the number of times the alarm has gone off since the last
+ * call, or -EINTR if the thread was cancelled
+ */
+int do_pause(void);
+
 /**
  * This function implements the fork(2) system call.
  *
@@ -139,6 +189,23 @@ pid_t do_waitpid(pid_t pid, int options, int *status);
  */
 int do_fork(struct regs *regs);
 
+/**
+ * Creates a child process running the given program without copying
+ * the caller's address space. The child applies the file actions to the
+ * file table it inherits and then loads the program into its own empty
+ * address space; the caller waits until it has done so.
+ *
+ * @param filename the program to run
+ * @param argv the arguments, in kernel memory
+ * @param envp the environment, in kernel memory
+ * @param actions file actions to apply in the child, in kernel memory
+ * @param nactions the number of file actions
+ * @return the pid of the child, or an error from the file actions or
+ * from loading the program, in which case the child has been reaped
+ */
+int do_spawn(const char *filename, char *const *argv, char *const *envp,
+             const struct spawn_action *actions, int nactions);
+
 /**
  * Provides detailed debug information about a given process.
  *
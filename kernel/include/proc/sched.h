@@ -1,9 +1,11 @@
 
 #pragma once
 
+#include "types.h"
 #include "util/list.h"
 
 struct kthread;
+struct proc;
 typedef struct ktqueue {
         list_t          tq_list;
         int             tq_size;
@@ -53,6 +55,27 @@ void sched_sleep_on(ktqueue_t *q);
  */
 int sched_cancellable_sleep_on(ktqueue_t *q);
 
+/**
+ * Like sched_sleep_on, but also wakes up once the given number of
+ * clock ticks have gone by, see util/timer.h.
+ *
+ * @param q the queue to sleep on
+ * @param ticks the longest to sleep
+ * @return 0 if woken from the queue and -ETIMEDOUT if the time ran out
+ */
+int sched_sleep_on_timeout(ktqueue_t *q, uint32_t ticks);
+
+/**
+ * Like sched_cancellable_sleep_on, but also wakes up once the given
+ * number of clock ticks have gone by.
+ *
+ * @param q the queue to sleep on
+ * @param ticks the longest to sleep
+ * @return 0 if woken from the queue, -EINTR if the thread was cancelled
+ * and -ETIMEDOUT if the time ran out
+ */
+int sched_cancellable_sleep_on_timeout(ktqueue_t *q, uint32_t ticks);
+
 /**
  * Wakes a single thread from sleep if there are any waiting on the
  * queue.
@@ -75,3 +98,58 @@ void sched_broadcast_on(ktqueue_t *q);
  * @param the thread to cancel sleep from
  */
 void sched_cancel(struct kthread *kthr);
+
+/**
+ * Returns the run queue level threads of a process with the given
+ * nice value start at.
+ *
+ * @param nice the nice value, PRIO_MIN to PRIO_MAX
+ * @return the level, 0 being the first to run
+ */
+int sched_nice_level(int nice);
+
+/**
+ * Sets the nice value of a process and moves each of its threads to
+ * the level it starts at.
+ *
+ * @param p the process
+ * @param nice the new nice value, PRIO_MIN to PRIO_MAX
+ */
+void sched_renice(struct proc *p, int nice);
+
+/**
+ * Charges the running thread for the time since the last clock tick,
+ * and marks it to be preempted if it has used up its slice.
+ */
+void sched_tick(void);
+
+/**
+ * Gives up the CPU if the running thread has been marked to be
+ * preempted. Only called on the way back to user mode, as the kernel
+ * does not expect to lose the CPU anywhere but where it sleeps.
+ */
+void sched_preempt(void);
+
+/**
+ * Gives up the CPU, staying runnable. A thread in the deadline class
+ * instead gives up the rest of its budget and sleeps until its next
+ * period starts.
+ */
+void sched_yield(void);
+
+/**
+ * Moves a thread into the deadline class, or changes its parameters if
+ * it is already in it. Every period it is given runtime cycles of CPU
+ * to be used within deadline cycles, ahead of all normal threads and
+ * in order of deadline. All zeros move the thread back to the normal
+ * class.
+ *
+ * @param thr the thread
+ * @param runtime the budget per period
+ * @param deadline the relative deadline, or 0 for the period
+ * @param period the period
+ * @return 0 on success, -EINVAL unless runtime <= deadline <= period,
+ * or -EBUSY if the deadline class can not fit the thread
+ */
+int sched_setdeadline(struct kthread *thr, uint64_t runtime, uint64_t deadline,
+                      uint64_t period);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A small linear congruential generator shared by the kshell benchmarks.
+ * Seeding it with bench_srand() makes a run repeatable; the state is
+ * global, which is fine since only one benchmark runs at a time.
+ */
+void bench_srand(uint32_t seed);
+uint32_t bench_rand(void);
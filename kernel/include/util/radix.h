@@ -0,0 +1,52 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Radix tree mapping 32-bit keys to non-NULL pointers.
+ *
+ * Each interior node has RADIX_FANOUT children, so a lookup touches at
+ * most one node per RADIX_SHIFT bits of key. The tree only grows as tall
+ * as its largest key needs: a tree holding keys below 4096 is two levels
+ * deep no matter how many of them it holds. Nodes are freed as soon as
+ * they become empty, so an empty tree owns no memory.
+ *
+ * radix_init() must be called once (after slab_init()) before any tree
+ * is used. Insertion may fail with -ENOMEM; lookup and removal never
+ * allocate and never fail.
+ */
+
+#define RADIX_SHIFT             6
+#define RADIX_FANOUT            (1 << RADIX_SHIFT)
+#define RADIX_MASK              (RADIX_FANOUT - 1)
+#define RADIX_MAX_HEIGHT        ((32 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+
+struct radix_node;
+
+typedef struct radix_tree {
+        struct radix_node *rt_root;
+        int                rt_height;   /* levels below and including root */
+        uint32_t           rt_count;    /* number of keys present */
+} radix_tree_t;
+
+void radix_init(void);
+
+static inline void radix_tree_init(radix_tree_t *t)
+{
+        t->rt_root = NULL;
+        t->rt_height = 0;
+        t->rt_count = 0;
+}
+
+#define radix_tree_empty(t)     (0 == (t)->rt_count)
+
+/* Returns the item stored under key, or NULL. */
+void *radix_lookup(radix_tree_t *t, uint32_t key);
+
+/* Stores item (which must not be NULL) under key. Returns 0 on success,
+ * -EEXIST if the key is already present or -ENOMEM. */
+int radix_insert(radix_tree_t *t, uint32_t key, void *item);
+
+/* Removes key from the tree and returns the item it mapped to, or NULL
+ * if it was not present. */
+void *radix_remove(radix_tree_t *t, uint32_t key);
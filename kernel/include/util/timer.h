@@ -0,0 +1,55 @@
+#pragma once
+
+#include "types.h"
+#include "config.h"
+
+#include "util/list.h"
+
+/*
+ * One-shot timers kept in a hierarchical timer wheel and run from the
+ * clock interrupt, so time is measured in ticks of TICK_MSECS.
+ *
+ * A timer set to expire n ticks from now runs on the n-th tick from
+ * now, which is anywhere from n - 1 to n ticks of real time away; ask
+ * for one more tick to wait at least n. Its function is called from
+ * interrupt context with the timer no longer pending, and may set the
+ * timer again. Setting, cancelling and running a timer are O(1) apart
+ * from the cascades described in util/timer.c.
+ */
+
+typedef struct timer {
+        list_link_t     t_link;                 /* on a wheel slot while pending */
+        uint32_t        t_expires;              /* tick it is due at */
+        void          (*t_func)(struct timer *);
+        void           *t_data;
+} timer_t;
+
+/* Ticks since boot, wrapping after about 16 months at 100Hz */
+uint32_t timer_now(void);
+
+#define TIMER_MSECS_TO_TICKS(ms)        (((ms) + TICK_MSECS - 1) / TICK_MSECS)
+#define TIMER_TICKS_TO_MSECS(ticks)     ((ticks) * TICK_MSECS)
+
+/* True if tick a is after tick b, across a wrap of the tick count */
+#define timer_after(a, b)               ((int32_t)((b) - (a)) < 0)
+
+static inline void timer_init(timer_t *t, void (*func)(timer_t *), void *data)
+{
+        list_link_init(&t->t_link);
+        t->t_expires = 0;
+        t->t_func = func;
+        t->t_data = data;
+}
+
+#define timer_pending(t)        list_link_is_linked(&(t)->t_link)
+
+/* Has the timer run ticks from now, replacing any earlier setting. At
+ * most 2^31 - 1 ticks. */
+void timer_set(timer_t *t, uint32_t ticks);
+
+/* Stops the timer. Returns true if it was pending and will now not run. */
+int timer_cancel(timer_t *t);
+
+/* Advances the tick count and runs the timers that are due. Called from
+ * the clock interrupt. */
+void timer_tick(void);
@@ -6,5 +6,8 @@ struct mmobj;
 void anon_init();
 struct mmobj *anon_create(void);
 
+void *anon_zero_page(void);
+int mmobj_is_anon(struct mmobj *o);
+
 extern int anon_count;
 
@@ -5,4 +5,7 @@ struct proc;
 struct vmarea;
 
 int do_munmap(void *addr, size_t len);
+int do_madvise(void *addr, size_t len, int advice);
+int do_mlock(const void *addr, size_t len);
+int do_munlock(const void *addr, size_t len);
 int do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off, void **ret);
@@ -9,4 +9,29 @@
 #define FAULT_RESERVED 0x08
 #define FAULT_EXEC     0x10
 
+typedef struct pagefault_stats {
+        uint32_t        pfs_faults;     /* calls to handle_pagefault */
+        uint32_t        pfs_around;     /* pages mapped by fault-around */
+        uint32_t        pfs_zero;       /* reads given the shared zero page */
+} pagefault_stats_t;
+
+struct vmarea;
+
 void handle_pagefault(uintptr_t vaddr, uint32_t cause);
+
+/* Faults in pages [lopage, hipage) of an area of the current address
+ * space before they are used, and with lock set locks them in memory.
+ * Returns the number of pages faulted in, or -errno. */
+int pagefault_populate(struct vmarea *vma, uint32_t lopage, uint32_t hipage, int lock);
+
+/* Unlocks pages [lopage, hipage) of an area locked by pagefault_populate.
+ * Returns the number of pages unlocked. */
+uint32_t pagefault_unlock(struct vmarea *vma, uint32_t lopage, uint32_t hipage);
+
+/* Sets how many pages around a faulting address are mapped along with it
+ * if they are already resident. npages is rounded down to a power of two
+ * and capped at one page table; 0 or 1 turns fault-around off. Returns
+ * the previous setting. */
+uint32_t pagefault_set_around(uint32_t npages);
+
+void pagefault_get_stats(pagefault_stats_t *stats);
@@ -6,5 +6,10 @@ struct mmobj;
 void shadow_init();
 struct mmobj *shadow_create(void);
 
+/* Merges into o, a shadow object, the shadow objects below it which no
+ * one else can see, looking through at most maxwalk of them. Returns the
+ * number of objects removed from the chain. */
+int shadow_collapse(struct mmobj *o, int maxwalk);
+
 extern int shadow_count;
 
@@ -5,6 +5,8 @@
 
 #include "util/list.h"
 
+#include "fs/readahead.h"
+
 #define VMMAP_DIR_LOHI 1
 #define VMMAP_DIR_HILO 2
 
@@ -13,8 +15,11 @@ struct proc;
 struct vnode;
 
 typedef struct vmmap {
-        list_t       vmm_list;
+        list_t       vmm_list;     /* areas in address order */
         struct proc *vmm_proc;
+        uint32_t     vmm_nlocked;  /* pages locked by MAP_LOCKED areas, at most
+                                    * VMMAP_MAX_LOCKED_PAGES */
+        struct vmarea *vmm_root;   /* root of the tree of the same areas */
 } vmmap_t;
 
 /* make sure you understand why mapping boundaries are in terms of frame
@@ -25,7 +30,9 @@ typedef struct vmarea {
         uint32_t       vma_off;      /* offset from beginning of vma_obj in pages */
 
         int            vma_prot;     /* permissions on mapping */
-        int            vma_flags;    /* either MAP_SHARED or MAP_PRIVATE */
+        int            vma_flags;    /* either MAP_SHARED or MAP_PRIVATE, plus
+                                      * MAP_LARGEPAGE if large pages may be used
+                                      * and MAP_LOCKED if its pages are locked */
 
         struct vmmap  *vma_vmmap;    /* address space that this area belongs to */
         struct mmobj  *vma_obj;      /* the vm object to read pages from */
@@ -33,22 +40,48 @@ typedef struct vmarea {
         list_link_t    vma_olink;    /* link on the list of all vm_areas
                                       * having the same vm_object at the
                                       * bottom of their chain */
+        readahead_t    vma_ra;       /* readahead state for faults on a file */
+
+        /* The vmmap's AVL tree of areas, keyed by vma_start: */
+        struct vmarea *vma_tparent;
+        struct vmarea *vma_tleft;
+        struct vmarea *vma_tright;
+        int            vma_theight;  /* height of this subtree */
+        uint32_t       vma_gap;      /* free pages between the previous area
+                                      * (or USER_MEM_LOW) and this one */
+        uint32_t       vma_maxgap;   /* largest vma_gap in this subtree */
 } vmarea_t;
 
+/* Whether writes to the area go to private copies of its pages, so that
+ * it needs a shadow object of its own. A private mapping which can never
+ * be written shares its object directly, the same as a shared one. */
+#define vmarea_is_cow(vma) \
+        (((vma)->vma_flags & MAP_PRIVATE) && ((vma)->vma_prot & PROT_WRITE))
+
 void vmmap_init(void);
 
+vmarea_t *vmarea_alloc(void);
+void vmarea_free(vmarea_t *vma);
+
 vmmap_t *vmmap_create(void);
 void vmmap_destroy(vmmap_t *map);
+void vmmap_collapse(vmmap_t *map);
 
 vmarea_t *vmmap_lookup(vmmap_t *map, uint32_t vfn);
+void vmmap_resize(vmarea_t *vma, uint32_t start, uint32_t end);
 int vmmap_map(vmmap_t *map, struct vnode *file, uint32_t lopage, uint32_t npages, int prot, int flags, off_t off, int dir, vmarea_t **new);
 int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages);
+int vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice);
+int vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages);
+int vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages);
 int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages);
 int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
+int vmmap_find_range_aligned(vmmap_t *map, uint32_t npages, int dir, uint32_t align);
 
 int vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count);
 int vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count);
 
 vmmap_t *vmmap_clone(vmmap_t *map);
 
+uint32_t vmarea_chain_length(vmarea_t *vma);
 size_t vmmap_mapping_info(const void *map, char *buf, size_t size);
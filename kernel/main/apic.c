@@ -1,5 +1,5 @@
 
-
+#include "kernel.h"
 #include "types.h"
 
 #include "main/io.h"
@@ -251,40 +251,57 @@ void apic_disable_periodic_timer() {
         *(uint32_t*)(apic->at_addr + LOCAL_APIC_TASKPRIOR) = 0;
 }
 
-void apic_enable_periodic_timer(uint32_t freq) {
-        uint32_t tmp;
-        uint32_t cpubusfreq;
+/* The PIT's input clock, and the window it times while the APIC timer
+ * and the TSC are calibrated against it */
+#define PIT_HZ                  1193182
+#define PIT_CALIBRATE_MSECS     10
+#define PIT_CALIBRATE_COUNT     (PIT_HZ * PIT_CALIBRATE_MSECS / 1000)
+
+static uint32_t apic_timer_tsc_khz;
+
+void apic_enable_periodic_timer(uint32_t hz) {
+        uint32_t elapsed, apic_hz, initcnt;
+        uint64_t tsc;
+        uint8_t gate;
 
         dbgq(DBG_CORE, "--- Enabling APIC Timer ---\n");
 
+        /* The APIC timer counts at the bus clock, divided by 16 here,
+         * which nothing tells us; count it down, masked, for as long as
+         * PIT channel 2 takes to count PIT_CALIBRATE_COUNT in one-shot
+         * mode. Channel 2 is started by raising its gate, bit 0 of port
+         * 0x61, with the speaker (bit 1) kept off, and bit 5 comes up
+         * when it reaches zero. */
         *(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
-        /* Initialize PIT Ch 2 in one-shot mode */
-        /* Some crazy magic numbers here */
-        outb(0x61, (inb(0x61) & 0xfd) | 1);
+        *(uint32_t*)(apic->at_addr + LOCAL_APIC_LVT_TMR) = LOCAL_APIC_DISABLE;
+        gate = inb(0x61) & 0xfc;
+        outb(0x61, gate);
         outb(0x43, 0xb2);
-        outb(0x42, 0x9b);
-        inb(0x60);
-        outb(0x42, 0x2e);
-
-        /* reset PIT one-shot counter (start counting) */
-        tmp = (uint32_t)(inb(0x61) & 0xfe);
-        outb(0x61, (uint8_t)tmp);
-        outb(0x61, (uint8_t)tmp | 1);
-        /* reset APIC timer (set counter to -1) */
+        outb(0x42, PIT_CALIBRATE_COUNT & 0xff);
+        outb(0x42, PIT_CALIBRATE_COUNT >> 8);
+
+        outb(0x61, gate | 1);
         *(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = 0xffffffff;
-        /* wait until the PIT reaches zero */
-        while(!(inb(0x61) & 0x20));
-        /* Stop the APIC timer */
-        *(uint32_t*)(apic->at_addr + LOCAL_APIC_LVT_TMR) = LOCAL_APIC_DISABLE;
-        /* some math */
-        cpubusfreq = ((0xffffffff - *(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT)) + 1) * 16 * 100;
-        tmp = (cpubusfreq / freq / 16) * 10000;
-        dbgq(DBG_CORE, "CPU Bus Freq: %u\n", cpubusfreq);
-        dbgq(DBG_CORE, "APIC Timer initial count %u\n", tmp);
+        tsc = rdtsc();
+        while (!(inb(0x61) & 0x20));
+        elapsed = 0xffffffff - *(volatile uint32_t*)(apic->at_addr + LOCAL_APIC_TMRCURRCNT);
+        tsc = rdtsc() - tsc;
+        *(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = 0;
+        outb(0x61, gate);
+
+        apic_hz = elapsed * (1000 / PIT_CALIBRATE_MSECS);
+        apic_timer_tsc_khz = (uint32_t)(tsc / PIT_CALIBRATE_MSECS);
+        initcnt = MAX(apic_hz / hz, 16U);
+        dbgq(DBG_CORE, "APIC Timer %u Hz after dividing, TSC %u kHz\n", apic_hz, apic_timer_tsc_khz);
+        dbgq(DBG_CORE, "APIC Timer initial count %u for %u Hz\n", initcnt, hz);
+
         /* Set up the APIC timer for periodic mode */
-        *(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = (tmp < 16 ? 16 : tmp);
         *(uint32_t*)(apic->at_addr + LOCAL_APIC_LVT_TMR) = 32 | LOCAL_APIC_TMR_PERIODIC;
-        *(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
+        *(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = initcnt;
+}
+
+uint32_t apic_tsc_khz() {
+        return apic_timer_tsc_khz;
 }
 
 static void apic_disable_8259() {
@@ -0,0 +1,212 @@
+/*
+ * Lazy x87/SSE context switching.
+ *
+ * Only one thread's FPU registers can be live in the processor at a
+ * time; that thread is the FPU owner. Whenever any other thread is
+ * switched in CR0.TS is set, so the first FPU or SSE instruction it
+ * executes raises a device-not-available (#NM) trap. The trap handler
+ * writes the owner's registers back to its kthread_t, loads the
+ * registers of the current thread and makes it the new owner. Threads
+ * that never touch the FPU therefore never pay for a save or restore.
+ */
+
+#include "globals.h"
+#include "types.h"
+
+#include "main/cpuid.h"
+#include "main/fpu.h"
+#include "main/interrupt.h"
+
+#include "proc/kthread.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#define CR0_MP                  0x00000002 /* monitor coprocessor */
+#define CR0_EM                  0x00000004 /* emulate coprocessor */
+#define CR0_TS                  0x00000008 /* task switched */
+#define CR0_NE                  0x00000020 /* native FPU error reporting */
+
+#define CR4_OSFXSR              0x00000200 /* FXSAVE/FXRSTOR and SSE enabled */
+#define CR4_OSXMMEXCPT          0x00000400 /* unmasked SSE exceptions raise #XM */
+
+#define FPU_STATE_AREA(fs) \
+        ((void *)(((uintptr_t)(fs)->fs_buf + FPU_STATE_ALIGN - 1) & ~(FPU_STATE_ALIGN - 1)))
+
+/* The thread whose FPU registers are currently loaded, or NULL */
+static kthread_t *fpu_owner = NULL;
+
+/* Whether the processor supports FXSAVE/FXRSTOR; if it does not we fall
+ * back on FNSAVE/FRSTOR, which only covers the x87 registers. */
+static int fpu_has_fxsr = 0;
+
+/* The register contents of a freshly initialized FPU, loaded the first
+ * time a thread uses the FPU. */
+static fpu_state_t fpu_initial_state;
+
+static inline uint32_t fpu_read_cr0(void)
+{
+        uint32_t cr0;
+        __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+        return cr0;
+}
+
+static inline void fpu_write_cr0(uint32_t cr0)
+{
+        __asm__ volatile("movl %0, %%cr0" :: "r"(cr0));
+}
+
+static inline uint32_t fpu_read_cr4(void)
+{
+        uint32_t cr4;
+        __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+        return cr4;
+}
+
+static inline void fpu_write_cr4(uint32_t cr4)
+{
+        __asm__ volatile("movl %0, %%cr4" :: "r"(cr4));
+}
+
+static inline void clts(void)
+{
+        __asm__ volatile("clts");
+}
+
+static inline void stts(void)
+{
+        fpu_write_cr0(fpu_read_cr0() | CR0_TS);
+}
+
+static void fpu_save(fpu_state_t *fs)
+{
+        void *area = FPU_STATE_AREA(fs);
+        if (fpu_has_fxsr) {
+                __asm__ volatile("fxsave (%0)" :: "r"(area) : "memory");
+        } else {
+                /* fnsave reinitializes the FPU, which is fine since the
+                 * registers are about to be overwritten anyway */
+                __asm__ volatile("fnsave (%0)" :: "r"(area) : "memory");
+        }
+}
+
+static void fpu_restore(fpu_state_t *fs)
+{
+        void *area = FPU_STATE_AREA(fs);
+        if (fpu_has_fxsr) {
+                __asm__ volatile("fxrstor (%0)" :: "r"(area) : "memory");
+        } else {
+                __asm__ volatile("frstor (%0)" :: "r"(area) : "memory");
+        }
+}
+
+/* Device-not-available trap: curthr just executed an FPU or SSE
+ * instruction while CR0.TS was set. */
+static void fpu_dna_handler(regs_t *regs)
+{
+        clts();
+        if (fpu_owner == curthr) {
+                return;
+        }
+
+        if (NULL != fpu_owner) {
+                fpu_save(&fpu_owner->kt_fpu);
+        }
+
+        if (!curthr->kt_fpu.fs_used) {
+                memcpy(FPU_STATE_AREA(&curthr->kt_fpu),
+                       FPU_STATE_AREA(&fpu_initial_state), FPU_STATE_SIZE);
+                curthr->kt_fpu.fs_used = 1;
+        }
+        fpu_restore(&curthr->kt_fpu);
+
+        fpu_owner = curthr;
+}
+
+void
+fpu_init(void)
+{
+        uint32_t eax, edx;
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        KASSERT((edx & CPUID_FEAT_EDX_FPU) && "no FPU present");
+
+        fpu_has_fxsr = (0 != (edx & CPUID_FEAT_EDX_FXSR));
+        if (fpu_has_fxsr) {
+                uint32_t cr4 = fpu_read_cr4() | CR4_OSFXSR;
+                if (edx & CPUID_FEAT_EDX_SSE) {
+                        cr4 |= CR4_OSXMMEXCPT;
+                }
+                fpu_write_cr4(cr4);
+        }
+
+        fpu_write_cr0((fpu_read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+        /* Capture a pristine register image to hand out on first use. The
+         * reset value of MXCSR masks all SIMD exceptions. */
+        __asm__ volatile("fninit");
+        if (fpu_has_fxsr && (edx & CPUID_FEAT_EDX_SSE)) {
+                uint32_t mxcsr = 0x1f80;
+                __asm__ volatile("ldmxcsr %0" :: "m"(mxcsr));
+        }
+        fpu_save(&fpu_initial_state);
+
+        intr_register(INTR_DEVICE_NOT_AVAILABLE, fpu_dna_handler);
+
+        /* Nobody owns the FPU yet, so the first use anywhere must trap */
+        stts();
+
+        dbgq(DBG_CORE, "FPU: lazy switching enabled (%s)\n",
+             fpu_has_fxsr ? "fxsave" : "fnsave");
+}
+
+void
+fpu_switch(kthread_t *next)
+{
+        if (next == fpu_owner) {
+                clts();
+        } else {
+                stts();
+        }
+}
+
+void
+fpu_clone(kthread_t *from, kthread_t *to)
+{
+        to->kt_fpu.fs_used = from->kt_fpu.fs_used;
+        if (!from->kt_fpu.fs_used) {
+                return;
+        }
+
+        if (from == fpu_owner) {
+                /* from is running and its registers are live (if they were
+                 * not, TS would be set and the save would trap) */
+                KASSERT(from == curthr);
+                clts();
+                fpu_save(&from->kt_fpu);
+                if (!fpu_has_fxsr) {
+                        /* fnsave wiped the registers, put them back */
+                        fpu_restore(&from->kt_fpu);
+                }
+        }
+
+        memcpy(FPU_STATE_AREA(&to->kt_fpu), FPU_STATE_AREA(&from->kt_fpu),
+               FPU_STATE_SIZE);
+}
+
+void
+fpu_reset(kthread_t *thr)
+{
+        thr->kt_fpu.fs_used = 0;
+        if (thr == fpu_owner) {
+                fpu_owner = NULL;
+                stts();
+        }
+}
+
+void
+fpu_release(kthread_t *thr)
+{
+        if (thr == fpu_owner) {
+                fpu_owner = NULL;
+        }
+}
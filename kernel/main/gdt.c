@@ -1,7 +1,11 @@
 
 
+#include "config.h"
+
 #include "main/gdt.h"
 
+#include "mm/pagetable.h"
+
 #include "util/printf.h"
 #include "util/debug.h"
 #include "util/string.h"
@@ -56,6 +60,40 @@ static struct gdt_location gdtl = {
         .gl_offset = (uint32_t) &gdt
 };
 
+/*
+ * Double faults are handled by a task of their own, reached through a task
+ * gate, so the handler gets a good stack even if the fault came from
+ * running off the end of a kernel stack. In that case the page fault on the
+ * guard page cannot push its frame and turns into a double fault. The task
+ * switch saves the faulting state in tss.
+ */
+#define DF_STACK_SIZE           8192
+
+static struct tss_entry df_tss;
+static char df_stack[DF_STACK_SIZE] __attribute__((aligned(16)));
+
+static void
+gdt_double_fault(void)
+{
+        uintptr_t vaddr;
+        __asm__ volatile("movl %%cr2, %0" : "=r"(vaddr));
+
+        if (KSTACK_AREA_LOW <= vaddr && KSTACK_AREA_HIGH > vaddr) {
+                panic("\nKernel stack overflow into the guard page at 0x%08x "
+                      "(eip 0x%08x, esp 0x%08x)\n", vaddr, tss.ts_eip, tss.ts_esp);
+        }
+        panic("\nDouble fault (eip 0x%08x, esp 0x%08x)\n", tss.ts_eip, tss.ts_esp);
+}
+
+static void
+gdt_set_tss(uint32_t segment, struct tss_entry *t)
+{
+        gdt_set_entry(segment, (uint32_t)t, sizeof(*t), 0, 1, 0, 0);
+        gdt[segment / 8].ge_access &= ~(0b10000);
+        gdt[segment / 8].ge_access |= 0b1;
+        gdt[segment / 8].ge_flags &= ~(0b10000000);
+}
+
 void gdt_init(void)
 {
         struct gdt_location *data = &gdtl;
@@ -69,15 +107,29 @@ void gdt_init(void)
 
         __asm__ volatile("lgdt (%0)" :: "p"(data));
 
-        gdt_set_entry(GDT_TSS, (uint32_t)&tss, sizeof(tss), 0, 1, 0, 0);
-        gdt[GDT_TSS / 8].ge_access &= ~(0b10000);
-        gdt[GDT_TSS / 8].ge_access |= 0b1;
-        gdt[GDT_TSS / 8].ge_flags &= ~(0b10000000);
+        gdt_set_tss(GDT_TSS, &tss);
 
         memset(&tss, 0, sizeof(tss));
         tss.ts_ss0 = GDT_KERNEL_DATA;
         tss.ts_iopb = sizeof(tss);
 
+        /* the kernel is mapped the same in every page directory, so the
+         * one in use now will do for the double fault task */
+        gdt_set_tss(GDT_DOUBLE_FAULT_TSS, &df_tss);
+
+        memset(&df_tss, 0, sizeof(df_tss));
+        __asm__ volatile("movl %%cr3, %0" : "=r"(df_tss.ts_cr3));
+        df_tss.ts_eip = (uint32_t)gdt_double_fault;
+        df_tss.ts_eflags = 0x2; /* interrupts off */
+        df_tss.ts_esp = (uint32_t)(df_stack + DF_STACK_SIZE);
+        df_tss.ts_cs = GDT_KERNEL_TEXT;
+        df_tss.ts_ss = GDT_KERNEL_DATA;
+        df_tss.ts_ds = GDT_KERNEL_DATA;
+        df_tss.ts_es = GDT_KERNEL_DATA;
+        df_tss.ts_fs = GDT_KERNEL_DATA;
+        df_tss.ts_gd = GDT_KERNEL_DATA;
+        df_tss.ts_iopb = sizeof(df_tss);
+
         int segment = GDT_TSS;
         __asm__ volatile("ltr %0" :: "m"(segment));
 }
@@ -9,6 +9,8 @@
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
+#include "proc/sched.h"
+
 #define MAX_INTERRUPTS          256
 
 #define INTR_SPURIOUS      0xef
@@ -16,6 +18,7 @@
 /* Convenient definitions for intr_desc.attr */
 
 #define IDT_DESC_TRAP           0x01
+#define IDT_DESC_TASK           0x05
 #define IDT_DESC_BIT16          0x06
 #define IDT_DESC_BIT32          0x0E
 #define IDT_DESC_RING0          0x00
@@ -385,6 +388,13 @@ static __attribute__((used)) void __intr_handler(regs_t regs)
         }
 
         _intr_regs = NULL;
+
+#ifdef __UPREEMPT__
+        /* user mode code can be preempted, the kernel only gives up the
+         * CPU where it sleeps */
+        if (3 == (regs.r_cs & 0x3))
+                sched_preempt();
+#endif
 }
 
 static void __intr_divide_by_zero_handler(regs_t *regs)
@@ -443,7 +453,8 @@ void intr_init()
         __intr_set_entry(5,   (uint32_t)&INTR(5),   GDT_KERNEL_TEXT, IDT_DESC_PRESENT | IDT_DESC_BIT32 | IDT_DESC_RING0);
         __intr_set_entry(6,   (uint32_t)&INTR(6),   GDT_KERNEL_TEXT, IDT_DESC_PRESENT | IDT_DESC_BIT32 | IDT_DESC_RING0);
         __intr_set_entry(7,   (uint32_t)&INTR(7),   GDT_KERNEL_TEXT, IDT_DESC_PRESENT | IDT_DESC_BIT32 | IDT_DESC_RING0);
-        __intr_set_entry(8,   (uint32_t)&INTR(8),   GDT_KERNEL_TEXT, IDT_DESC_PRESENT | IDT_DESC_BIT32 | IDT_DESC_RING0);
+        /* double faults switch to a task with its own stack, see gdt.c */
+        __intr_set_entry(8,   0,                    GDT_DOUBLE_FAULT_TSS, IDT_DESC_PRESENT | IDT_DESC_TASK | IDT_DESC_RING0);
         __intr_set_entry(9,   (uint32_t)&INTR(9),   GDT_KERNEL_TEXT, IDT_DESC_PRESENT | IDT_DESC_BIT32 | IDT_DESC_RING0);
         __intr_set_entry(10,  (uint32_t)&INTR(10),  GDT_KERNEL_TEXT, IDT_DESC_PRESENT | IDT_DESC_BIT32 | IDT_DESC_RING0);
         __intr_set_entry(11,  (uint32_t)&INTR(11),  GDT_KERNEL_TEXT, IDT_DESC_PRESENT | IDT_DESC_BIT32 | IDT_DESC_RING0);
@@ -222,7 +222,7 @@ initproc_create(void)
 {
 	proc_t *init = proc_create("init");
 	KASSERT(init != NULL);
-	kthread_t *thr = kthread_create(init, initproc_run, 0, NULL);
+	kthread_t *thr = kthread_create_class(init, initproc_run, 0, NULL, KSTACK_USER);
 	KASSERT(thr != NULL);
 
         KASSERT(NULL != init);
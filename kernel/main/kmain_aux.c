@@ -9,6 +9,7 @@
 #include "util/init.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/radix.h"
 #include "util/printf.h"
 
 #include "mm/mm.h"
@@ -23,6 +24,7 @@
 
 #include "main/acpi.h"
 #include "main/apic.h"
+#include "main/fpu.h"
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
@@ -41,6 +43,7 @@
 
 #include "fs/vfs.h"
 #include "fs/vnode.h"
+#include "fs/readahead.h"
 #include "fs/vfs_syscall.h"
 #include "fs/fcntl.h"
 #include "fs/stat.h"
@@ -76,12 +79,14 @@ kmain()
 
         pt_init();
         slab_init();
+        radix_init();
         pframe_init();
 
         acpi_init();
         apic_init();
         pci_init();
         intr_init();
+        fpu_init();
 
         gdt_init();
 
@@ -146,6 +151,9 @@ final_shutdown()
         kthread_reapd_shutdown();
 #endif
 
+        /* stop readaheadd, dropping its vnode references before the vfs
+         * goes away */
+        readahead_shutdown();
 
 #ifdef __SHADOWD__
         /* wait for shadowd to shutdown */
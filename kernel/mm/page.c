@@ -2,9 +2,11 @@
 
 #include "types.h"
 #include "kernel.h"
+#include "config.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
 #include "mm/slab.h"
 
 #include "util/gdb.h"
@@ -29,25 +31,117 @@ struct pagegroup {
         uintptr_t    pg_baseaddr;
         uintptr_t    pg_endaddr;
         list_link_t  pg_link;
+        uint32_t     pg_nfree[PAGE_NSIZES]; /* blocks on each pg_freelist */
+        uint32_t     pg_ordermap;           /* bit n set iff pg_nfree[n] > 0 */
 };
 
 struct freepage {
         list_link_t fp_link;
 };
 
+/* Free block counts of each order summed over all page groups, and a
+ * summary bitmap with bit n set iff some group has a free block of order
+ * n. Finding the smallest order that can satisfy a request is then a
+ * single bit scan instead of a walk over every free list. */
+static uint32_t page_nfree[PAGE_NSIZES];
+static uint32_t page_ordermap;
+
+/* Maps each PAGE_REGION_SIZE-aligned region of the address space to the
+ * page group managing it, so page_free does not need to search the list
+ * of groups. If two groups share a region the table holds the first and
+ * the list is searched for the rest. */
+#define PAGE_REGION_SHIFT       22
+#define PAGE_REGION_SIZE        (1UL << PAGE_REGION_SHIFT)
+#define PAGE_REGION_COUNT       (1UL << (32 - PAGE_REGION_SHIFT))
+#define addr_to_region(addr)    (((uint32_t)(addr)) >> PAGE_REGION_SHIFT)
+static struct pagegroup *pagegroup_table[PAGE_REGION_COUNT];
+
+/* Recently freed single pages are kept on a small LIFO stack rather than
+ * returned to the buddy lists right away. Their contents are likely still
+ * in the cache, so page_alloc hands them out first; it also saves the
+ * split and join work for the common alloc/free/alloc pattern. Pages on
+ * the stack still count as free. */
+#define PAGE_HOT_CACHE_SIZE     32
+static void *page_hot_cache[PAGE_HOT_CACHE_SIZE];
+static int page_hot_count;
+
+/* Pages zeroed ahead of time for page_zero_take. The pool is refilled
+ * a page at a time while the cpu has nothing else to do (see
+ * page_zero_refill) and is never refilled at the expense of the buddy
+ * lists running low. Like the hot stack, pages in the pool count as free
+ * and are given back when a larger block cannot otherwise be formed. */
+static void *page_zero_pool[PAGE_ZERO_POOL_SIZE];
+static int page_zero_count;
+static int page_zero_enabled = 1;
+static page_zero_stats_t page_zero_stats;
+
+/**
+ * Calculates the address's index in to the buddy bitmap for the
+ * specified order. The address must be within the range of addresses
+ * managed by the given group and should be either the exact address
+ * of one of the pages of the given order or the address of one of
+ * the pages resulting from splitting a page of the given order
+ * exactly once.
+ *
+ * @param group the page group the address falls in
+ * @param order the order within the page group which we are interested in
+ * @param addr the address whose index is being calculated
+ * @return the index of the given address
+ */
+static inline uintptr_t
+_pagegroup_calculate_index(struct pagegroup *group, uint32_t order, uintptr_t addr)
+{
+        KASSERT(PAGE_ALIGNED(addr));
+        KASSERT(PAGE_NSIZES > order);
+        KASSERT(addr >= group->pg_baseaddr && addr < group->pg_endaddr);
+
+        uintptr_t offset = addr - group->pg_baseaddr;
+        KASSERT(0 == (offset & ((1 << order) - 1)));
+        return (offset >> order) >> PAGE_SHIFT;
+}
+
+/* Puts the block at addr on the order free list of group. */
+static inline void
+_freelist_insert(struct pagegroup *group, uint32_t order, uintptr_t addr)
+{
+        list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+        if (0 == group->pg_nfree[order]++)
+                group->pg_ordermap |= BIT(order);
+        if (0 == page_nfree[order]++)
+                page_ordermap |= BIT(order);
+}
+
+/* Takes the block at addr off the order free list of group. */
+static inline void
+_freelist_remove(struct pagegroup *group, uint32_t order, uintptr_t addr)
+{
+        list_remove(&((struct freepage *)addr)->fp_link);
+        if (0 == --group->pg_nfree[order])
+                group->pg_ordermap &= ~BIT(order);
+        if (0 == --page_nfree[order])
+                page_ordermap &= ~BIT(order);
+}
+
+/*
+ * Creates a page group managing the pages in [start, end). Blocks are
+ * aligned relative to base, which may lie below start so that blocks of
+ * the largest order line up with large pages in physical memory; the
+ * pages between base and start are simply never free.
+ */
 static struct pagegroup *
-_pagegroup_create(uintptr_t start, uintptr_t end)
+_pagegroup_create(uintptr_t base, uintptr_t start, uintptr_t end)
 {
         KASSERT(PAGE_NSIZES > 0);
         KASSERT(sizeof(struct pagegroup) <= PAGE_SIZE);
+        KASSERT(base <= start);
 
-        uintptr_t npages = (end - start) >> PAGE_SHIFT;
+        uintptr_t npages = (end - base) >> PAGE_SHIFT;
         struct pagegroup *group;
 
         end -= sizeof(*group);
         group = (struct pagegroup *)end;
 
-        group->pg_baseaddr = start;
+        group->pg_baseaddr = base;
         group->pg_map[0] = NULL;
 
         /* allocate some of the space for the buddy bit maps,
@@ -67,25 +161,31 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
         /* discard the remainder of the page being used for
          * mappings and read just npages */
         end = (uintptr_t)PAGE_ALIGN_DOWN(end);
-        npages = (end - start) >> PAGE_SHIFT;
         group->pg_endaddr = end;
 
-        /* put pages which do not fit nicely into the largest
-         * order and add them to smaller buckets */
-        for (order = 0; order < PAGE_NSIZES - 1; ++order) {
+        for (order = 0; order < PAGE_NSIZES; ++order) {
                 list_init(&group->pg_freelist[order]);
-                if (npages & (1 << order)) {
-                        end -= (1 << order) << PAGE_SHIFT;
-                        list_insert_head(&group->pg_freelist[order], &((struct freepage *)end)->fp_link);
-                }
+                group->pg_nfree[order] = 0;
         }
+        group->pg_ordermap = 0;
 
-        /* put the remaining pages into the largest bucket */
-        KASSERT(0 == (end - start) % (1 << order));
-        list_init(&group->pg_freelist[order]);
+        /* carve [start, end) into the largest aligned blocks that fit. A
+         * block smaller than the largest order is only used when its buddy
+         * is not entirely free (it lies outside the range or is made up of
+         * smaller blocks), so mark the pair as split or freeing the block
+         * later would try to join it with its buddy */
         uintptr_t current = start;
         while (current < end) {
-                list_insert_head(&group->pg_freelist[order], &((struct freepage *)current)->fp_link);
+                uintptr_t offset = (current - base) >> PAGE_SHIFT;
+                for (order = PAGE_NSIZES - 1; order > 0; --order) {
+                        if (0 == (offset & ((1 << order) - 1))
+                            && current + ((1 << order) << PAGE_SHIFT) <= end)
+                                break;
+                }
+                _freelist_insert(group, order, current);
+                if (PAGE_NSIZES - 1 > order)
+                        bit_flip(group->pg_map[order + 1],
+                                 _pagegroup_calculate_index(group, order + 1, current));
                 current += (1 << order) << PAGE_SHIFT;
         }
 
@@ -95,7 +195,10 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
 static struct pagegroup *
 _pagegroup_from_address(uintptr_t addr)
 {
-        struct pagegroup *group;
+        struct pagegroup *group = pagegroup_table[addr_to_region(addr)];
+        if (NULL != group && addr >= group->pg_baseaddr && addr < group->pg_endaddr)
+                return group;
+
         list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
                 if (addr >= group->pg_baseaddr && addr < group->pg_endaddr)
                         return group;
@@ -108,6 +211,9 @@ page_init()
 {
         list_init(&pagegroup_list);
         page_freecount = 0;
+        page_ordermap = 0;
+        page_hot_count = 0;
+        page_zero_count = 0;
 }
 
 void
@@ -119,36 +225,22 @@ page_add_range(uintptr_t start, uintptr_t end)
         start = (uintptr_t) PAGE_ALIGN_DOWN(start);
         end = (uintptr_t) PAGE_ALIGN_DOWN(end);
 
-        struct pagegroup *group = _pagegroup_create(start, end);
-        if (group->pg_baseaddr < group->pg_endaddr) {
-                list_insert_tail(&pagegroup_list, &group->pg_link);
-                page_freecount += ADDR_TO_PN(group->pg_endaddr - group->pg_baseaddr);
-        }
-}
+        /* Line the buddy system up with physical memory so that every
+         * block of the largest order can be mapped as a large page */
+        uintptr_t base = start - PAGE_LARGE_OFFSET(pt_virt_to_phys(start));
 
-/**
- * Calculates the address's index in to the buddy bitmap for the
- * specified order. The address must be within the range of addresses
- * managed by the given group and should be either the exact address
- * of one of the pages of the given order or the address of one of
- * the pages resulting from splitting a page of the given order
- * exactly once.
- *
- * @param group the page group the address falls in
- * @param order the order within the page group which we are interested in
- * @param addr the address whose index is being calculated
- * @return the index of the given address
- */
-static inline uintptr_t
-_pagegroup_calculate_index(struct pagegroup *group, uint32_t order, uintptr_t addr)
-{
-        KASSERT(PAGE_ALIGNED(addr));
-        KASSERT(PAGE_NSIZES > order);
-        KASSERT(addr >= group->pg_baseaddr && addr < group->pg_endaddr);
+        struct pagegroup *group = _pagegroup_create(base, start, end);
+        if (start < group->pg_endaddr) {
+                list_insert_tail(&pagegroup_list, &group->pg_link);
+                page_freecount += ADDR_TO_PN(group->pg_endaddr - start);
 
-        uintptr_t offset = addr - group->pg_baseaddr;
-        KASSERT(0 == (offset & ((1 << order) - 1)));
-        return (offset >> order) >> PAGE_SHIFT;
+                uint32_t region;
+                for (region = addr_to_region(start);
+                     region <= addr_to_region(group->pg_endaddr - 1); ++region) {
+                        if (NULL == pagegroup_table[region])
+                                pagegroup_table[region] = group;
+                }
+        }
 }
 
 static void
@@ -160,7 +252,7 @@ __page_split(struct pagegroup *group, uint32_t order)
         KASSERT(PAGE_SIZE >= sizeof(uintptr_t));
 
         uintptr_t target = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage, fp_link);
-        list_remove_head(&group->pg_freelist[order]);
+        _freelist_remove(group, order, target);
 
         /* splitting the page requires marking it as allocated */
         if (likely(order < PAGE_NSIZES - 1)) {
@@ -171,11 +263,22 @@ __page_split(struct pagegroup *group, uint32_t order)
         KASSERT(!bit_check(group->pg_map[order], _pagegroup_calculate_index(group, order, target)));
 
         uintptr_t buddy = (target + ((1 << (order - 1)) << PAGE_SHIFT));
-        list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)target)->fp_link);
-        list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)buddy)->fp_link);
+        _freelist_insert(group, order - 1, target);
+        _freelist_insert(group, order - 1, buddy);
         dbg(DBG_PAGEALLOC, "split 0x%.8x (%u) into 0x%.8x and 0x%.8x\n", target, order, target, buddy);
 }
 
+/**
+ * Returns every page on the hot page stack to the buddy lists so they can
+ * be joined into larger blocks again.
+ */
+static void _page_hot_drain(void);
+
+/**
+ * Returns every page in the zeroed page pool to the buddy lists.
+ */
+static void _page_zero_drain(void);
+
 /**
  * Finds a block of pages strictly bigger than a block of the given order and
  * splits it into blocks of the given order. Used, for example, when the user
@@ -193,14 +296,18 @@ _page_split(int order)
 #else
         uint32_t num_retrys = 0;
 #endif
+        uint32_t bigger;
         int norder;
 
         do {
-                /* Find the first free block of greater size than requested. */
-                for (norder = order + 1; norder < PAGE_NSIZES; norder++) {
+                /* Find the first free block at least as big as requested
+                 * (there may be one of the requested size if memory was
+                 * freed while we were trying to find some). */
+                if (0 != (bigger = page_ordermap & ~(BIT(order) - 1))) {
                         struct pagegroup *group;
+                        norder = __builtin_ctz(bigger);
                         list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                                if (!list_empty(&group->pg_freelist[norder])) {
+                                if (group->pg_ordermap & BIT(norder)) {
                                         while (norder > order) {
                                                 __page_split(group, norder);
                                                 --norder;
@@ -209,6 +316,18 @@ _page_split(int order)
                                         return group;
                                 }
                         } list_iterate_end();
+                        panic("page_ordermap out of sync with page groups\n");
+                }
+
+                /* Single pages held back for reuse may be all that keeps
+                 * a larger block from forming */
+                if (0 < page_hot_count || 0 < page_zero_count) {
+                        _page_hot_drain();
+                        _page_zero_drain();
+                        if (page_ordermap & ~(BIT(order) - 1)) {
+                                num_retrys++;
+                                continue;
+                        }
                 }
 
                 dbg(DBG_PAGEALLOC, "WARNING, cannot allocate order=%u\n", order);
@@ -240,23 +359,30 @@ _page_alloc_order(uint32_t order)
         uintptr_t addr;
         struct pagegroup *group;
 
-        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                if (!list_empty(&group->pg_freelist[order]))
-                        goto found;
-        } list_iterate_end();
+        if (0 == order && 0 < page_hot_count) {
+                addr = (uintptr_t)page_hot_cache[--page_hot_count];
+                goto out;
+        }
 
-        if (NULL != (group = _page_split(order))) {
-                KASSERT(!list_empty(&group->pg_freelist[order]));
-                goto found;
+        if (!(page_ordermap & BIT(order))) {
+                if (NULL == (group = _page_split(order)))
+                        return NULL;
+        } else {
+                list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                        if (group->pg_ordermap & BIT(order))
+                                goto found;
+                } list_iterate_end();
+                panic("page_ordermap out of sync with page groups\n");
         }
-        return NULL;
 
 found:
+        KASSERT(!list_empty(&group->pg_freelist[order]));
         addr = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage, fp_link);
-        list_remove_head(&group->pg_freelist[order]);
+        _freelist_remove(group, order, addr);
         if (PAGE_NSIZES - 1 > order)
                 bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, addr));
 
+out:
         dbg(DBG_MM, "allocating %d pages (addr 0x%x)\n", (1 << order), addr);
 
 #ifdef MM_POISON
@@ -284,11 +410,11 @@ __page_join(struct pagegroup *group, int order, uintptr_t addr)
 
                 dbg(DBG_PAGEALLOC, "joining 0x%.8x and 0x%.8x (%u) into 0x%.8x\n", addr, buddy, order, MIN(offset, buddy));
 
-                list_remove(&((struct freepage *)addr)->fp_link);
-                list_remove(&((struct freepage *)buddy)->fp_link);
+                _freelist_remove(group, order, addr);
+                _freelist_remove(group, order, buddy);
                 addr = MIN(addr, buddy);
                 ++order;
-                list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+                _freelist_insert(group, order, addr);
 
                 if (PAGE_NSIZES - 1 > order)
                         bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr));
@@ -302,6 +428,8 @@ __page_join(struct pagegroup *group, int order, uintptr_t addr)
  * @param addr the start of the block being freed
  * @param order the order of the block size being freed
  */
+static void _page_free_buddy(struct pagegroup *group, void *addr, int order);
+
 static void
 _page_free_order(void *addr, int order)
 {
@@ -317,17 +445,47 @@ _page_free_order(void *addr, int order)
         if (NULL == group)
                 return;
 
-        list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+        _page_free_buddy(group, addr, order);
         page_freecount += (1 << order);
 
+        dbg(DBG_MM, "page_free: freed %d pages (addr 0x%p); %u pages currently free\n",
+            (1 << order), addr, page_freecount);
+}
+
+/* Returns a block to the buddy lists of group, joining it with its buddies
+ * as far as possible. Does not touch page_freecount. */
+static void
+_page_free_buddy(struct pagegroup *group, void *addr, int order)
+{
+        _freelist_insert(group, order, (uintptr_t)addr);
+
         if (PAGE_NSIZES - 1 > order) {
                 uintptr_t index = _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr);
                 bit_flip(group->pg_map[order + 1], index);
                 __page_join(group, order, (uintptr_t)addr);
         }
+}
 
-        dbg(DBG_MM, "page_free: freed %d pages (addr 0x%p); %u pages currently free\n",
-            (1 << order), addr, page_freecount);
+static void
+_page_hot_drain(void)
+{
+        while (0 < page_hot_count) {
+                void *addr = page_hot_cache[--page_hot_count];
+                struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+                KASSERT(NULL != group);
+                _page_free_buddy(group, addr, 0);
+        }
+}
+
+static void
+_page_zero_drain(void)
+{
+        while (0 < page_zero_count) {
+                void *addr = page_zero_pool[--page_zero_count];
+                struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+                KASSERT(NULL != group);
+                _page_free_buddy(group, addr, 0);
+        }
 }
 
 /*
@@ -350,9 +508,84 @@ void
 page_free(void *addr)
 {
         GDB_CALL_HOOK(page_free, addr, 1);
+        if (PAGE_HOT_CACHE_SIZE > page_hot_count
+            && NULL != _pagegroup_from_address((uintptr_t)addr)) {
+#ifdef MM_POISON
+                memset(addr, MM_POISON_FREE, PAGE_SIZE);
+#endif /* MM_POISON */
+                page_hot_cache[page_hot_count++] = addr;
+                page_freecount++;
+                return;
+        }
         _page_free_order(addr, 0);
 }
 
+/*
+ * Takes a page from the pool of pre-zeroed pages. The caller owns the
+ * page and frees it with page_free as usual.
+ * @return the address of a zero-filled page, or NULL if the pool is empty
+ */
+void *
+page_zero_take(void)
+{
+        void *addr;
+
+        if (0 == page_zero_count) {
+                page_zero_stats.pzs_misses++;
+                return NULL;
+        }
+
+        addr = page_zero_pool[--page_zero_count];
+        page_freecount--;
+        page_zero_stats.pzs_hits++;
+        GDB_CALL_HOOK(page_alloc, addr, 1);
+        return addr;
+}
+
+/*
+ * Zeroes up to npages free pages and adds them to the pre-zeroed pool.
+ * Stops early once the pool is full, or if taking another page would
+ * leave the buddy lists with fewer free pages than the pool holds.
+ * @return the number of pages added to the pool
+ */
+int
+page_zero_refill(int npages)
+{
+        int added = 0;
+
+        while (added < npages && page_zero_enabled
+               && PAGE_ZERO_POOL_SIZE > page_zero_count
+               && page_freecount - page_zero_count > 2 * PAGE_ZERO_POOL_SIZE) {
+                void *addr = _page_alloc_order(0);
+                KASSERT(NULL != addr);
+                memset(addr, 0, PAGE_SIZE);
+                page_zero_pool[page_zero_count++] = addr;
+                page_freecount++;
+                page_zero_stats.pzs_refilled++;
+                added++;
+        }
+        return added;
+}
+
+/*
+ * Turns the pre-zeroed pool on or off. Turning it off empties the pool,
+ * so every page_zero_take misses until it is turned back on.
+ */
+void
+page_zero_set_enabled(int enabled)
+{
+        page_zero_enabled = enabled;
+        if (!enabled)
+                _page_zero_drain();
+}
+
+void
+page_zero_get_stats(page_zero_stats_t *stats)
+{
+        *stats = page_zero_stats;
+        stats->pzs_pooled = page_zero_count;
+}
+
 /*
  * Allocates a block of at least npages pages.
  * @param npages the number of pages to allocate
@@ -401,3 +634,17 @@ page_free_count()
 {
         return page_freecount;
 }
+
+/**
+ * Returns the number of free blocks of 2^order pages on the buddy free
+ * lists, not counting single pages held on the hot cache.
+ *
+ * @param order the order of block to count
+ * @return the number of free blocks of that order
+ */
+uint32_t
+page_free_blocks(uint32_t order)
+{
+        KASSERT(PAGE_NSIZES > order);
+        return page_nfree[order];
+}
@@ -7,6 +7,7 @@
 #include "limits.h"
 #include "globals.h"
 
+#include "main/cpuid.h"
 #include "main/interrupt.h"
 
 #include "mm/mm.h"
@@ -27,6 +28,8 @@
 #define PT_ENTRY_COUNT    (PAGE_SIZE / sizeof (uint32_t))
 #define PT_VADDR_SIZE     (PAGE_SIZE * PT_ENTRY_COUNT)
 
+#define CR4_PSE           0x010 /* page size extensions */
+
 struct pagedir {
         pde_t      pd_physical[PT_ENTRY_COUNT];
         uintptr_t *pd_virtual[PT_ENTRY_COUNT];
@@ -43,6 +46,11 @@ struct pagedir {
 #define vaddr_to_offset(vaddr) \
         (((uint32_t)(vaddr)) & (~PAGE_MASK))
 
+/* whether a page directory entry maps a large page rather than
+ * pointing to a page table */
+#define pde_is_large(pde) \
+        ((PD_PRESENT | PD_LARGE) == ((pde) & (PD_PRESENT | PD_LARGE)))
+
 /* the virtual address of the page directory in cr3 */
 static pagedir_t *current_pagedir = NULL;
 static pagedir_t *template_pagedir = NULL;
@@ -50,6 +58,9 @@ static pagedir_t *template_pagedir = NULL;
 static uint32_t phys_map_count = 1;
 static pte_t *final_page;
 
+/* set once PSE has been turned on, see pt_template_init */
+static int pt_large_pages = 0;
+
 uintptr_t
 pt_phys_tmp_map(uintptr_t paddr)
 {
@@ -87,6 +98,11 @@ pt_virt_to_phys(uintptr_t vaddr)
         uint32_t entry = vaddr_to_ptindex(vaddr);
         uint32_t offset = vaddr_to_offset(vaddr);
 
+        if (pde_is_large(current_pagedir->pd_physical[table])) {
+                return (current_pagedir->pd_physical[table] & PAGE_LARGE_MASK)
+                       + PAGE_LARGE_OFFSET(vaddr);
+        }
+
         pte_t *pagetable = (pte_t *)pt_phys_tmp_map(current_pagedir->pd_physical[table] & PAGE_MASK);
         uintptr_t page = pagetable[entry] & PAGE_MASK;
         return page + offset;
@@ -106,6 +122,43 @@ pt_get(void)
         return current_pagedir;
 }
 
+/*
+ * Replaces the large page mapped by page directory entry index with a page
+ * table mapping the same memory a page at a time with the same permissions,
+ * so that part of it can be remapped or unmapped. If no page table can be
+ * allocated the large page is unmapped entirely instead; the pages are
+ * still resident, so touching them again just faults them back in.
+ * Returns 0 if the entry now points to a page table.
+ */
+static int
+_pt_demote(pagedir_t *pd, int index)
+{
+        pde_t pde = pd->pd_physical[index];
+        uintptr_t vaddr = (uintptr_t)index * PT_VADDR_SIZE;
+        pte_t *pt;
+        uint32_t i;
+
+        KASSERT(pde_is_large(pde));
+
+        if (NULL == (pt = page_alloc())) {
+                pd->pd_physical[index] = 0;
+        } else {
+                pte_t flags = pde & (PT_PRESENT | PT_WRITE | PT_USER | PT_ACCESSED | PT_DIRTY);
+                for (i = 0; i < PT_ENTRY_COUNT; ++i) {
+                        pt[i] = ((pde & PAGE_LARGE_MASK) + i * PAGE_SIZE) | flags;
+                }
+                pd->pd_physical[index] = pt_virt_to_phys((uintptr_t)pt)
+                                         | (pde & (PD_PRESENT | PD_WRITE | PD_USER));
+                pd->pd_virtual[index] = pt;
+        }
+
+        /* invalidating any address in a large page drops the whole entry */
+        if (pd == current_pagedir) {
+                tlb_flush(vaddr);
+        }
+        return (NULL == pt) ? -ENOMEM : 0;
+}
+
 int
 pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags)
 {
@@ -114,6 +167,10 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
 
         int index = vaddr_to_pdindex(vaddr);
 
+        if (pde_is_large(pd->pd_physical[index])) {
+                _pt_demote(pd, index);
+        }
+
         pte_t *pt;
         if (!(PT_PRESENT & pd->pd_physical[index])) {
                 if (NULL == (pt = page_alloc())) {
@@ -138,6 +195,29 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
         return 0;
 }
 
+int
+pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags)
+{
+        KASSERT(PAGE_LARGE_ALIGNED(vaddr) && PAGE_LARGE_ALIGNED(paddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr + PAGE_LARGE_SIZE - 1);
+        KASSERT((pdflags & ~PAGE_MASK) == pdflags);
+
+        if (!pt_large_pages) {
+                return -ENOTSUP;
+        }
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        /* Whatever the page table held is superseded by the large page */
+        if ((PT_PRESENT & pd->pd_physical[index]) && !pde_is_large(pd->pd_physical[index])) {
+                page_free(pd->pd_virtual[index]);
+        }
+        pd->pd_physical[index] = paddr | pdflags | PD_LARGE;
+        pd->pd_virtual[index] = NULL;
+
+        return 0;
+}
+
 void
 pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 {
@@ -146,6 +226,10 @@ pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 
         int index = vaddr_to_pdindex(vaddr);
 
+        if (pde_is_large(pd->pd_physical[index]) && 0 > _pt_demote(pd, index)) {
+                return;
+        }
+
         if (PT_PRESENT & pd->pd_physical[index]) {
                 pte_t *pt = (pte_t *)pd->pd_virtual[index];
 
@@ -154,41 +238,298 @@ pt_unmap(pagedir_t *pd, uintptr_t vaddr)
         }
 }
 
+/* The page tables of the kernel stack window, indexed from KSTACK_AREA_LOW */
+static pte_t *kstack_pts[KSTACK_AREA_SIZE / PT_VADDR_SIZE];
+
+/* Gives the current page directory, which pt_template_init is about to
+ * save as the template, page tables for the kernel stack window */
+static void
+_pt_kstack_init(void)
+{
+        uint32_t i, index;
+
+        KASSERT(0 == KSTACK_AREA_SIZE % PT_VADDR_SIZE);
+        for (i = 0; i < KSTACK_AREA_SIZE / PT_VADDR_SIZE; ++i) {
+                index = vaddr_to_pdindex(KSTACK_AREA_LOW) + i;
+                if (PT_PRESENT & current_pagedir->pd_physical[index])
+                        panic("kernel stack window at 0x%08x overlaps mapped memory\n",
+                              KSTACK_AREA_LOW);
+                if (NULL == (kstack_pts[i] = page_alloc()))
+                        panic("no memory for kernel stack page tables\n");
+                memset(kstack_pts[i], 0, PAGE_SIZE);
+                current_pagedir->pd_physical[index] = pt_virt_to_phys((uintptr_t)kstack_pts[i])
+                                                      | PD_PRESENT | PD_WRITE;
+                current_pagedir->pd_virtual[index] = kstack_pts[i];
+        }
+}
+
+static inline pte_t *
+_pt_kstack_pte(uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(KSTACK_AREA_LOW <= vaddr && KSTACK_AREA_HIGH > vaddr);
+
+        vaddr -= KSTACK_AREA_LOW;
+        return &kstack_pts[vaddr / PT_VADDR_SIZE][vaddr_to_ptindex(vaddr)];
+}
+
+void
+pt_kstack_map(uintptr_t vaddr, void *page)
+{
+        pte_t *pte = _pt_kstack_pte(vaddr);
+
+        KASSERT(!(PT_PRESENT & *pte));
+        *pte = pt_virt_to_phys((uintptr_t)page) | PT_PRESENT | PT_WRITE;
+}
+
+void *
+pt_kstack_unmap(uintptr_t vaddr)
+{
+        pte_t *pte = _pt_kstack_pte(vaddr);
+        uintptr_t paddr = *pte & PAGE_MASK;
+
+        KASSERT(PT_PRESENT & *pte);
+        *pte = 0;
+        tlb_flush(vaddr);
+        return (void *)(paddr - KERNEL_PHYS_BASE + (uintptr_t)&kernel_start);
+}
+
+int
+pt_is_mapped(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if (!(PT_PRESENT & pd->pd_physical[index])) {
+                return 0;
+        }
+        if (pde_is_large(pd->pd_physical[index])) {
+                return 1;
+        }
+        pte_t *pt = (pte_t *)pd->pd_virtual[index];
+        return PT_PRESENT & pt[vaddr_to_ptindex(vaddr)] ? 1 : 0;
+}
+
+uintptr_t
+pt_user_to_phys(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if (!(PT_PRESENT & pd->pd_physical[index])) {
+                return 0;
+        }
+        if (pde_is_large(pd->pd_physical[index])) {
+                return (pd->pd_physical[index] & PAGE_LARGE_MASK) + PAGE_LARGE_OFFSET(vaddr);
+        }
+        pte_t *pt = (pte_t *)pd->pd_virtual[index];
+        pte_t pte = pt[vaddr_to_ptindex(vaddr)];
+        return PT_PRESENT & pte ? pte & PAGE_MASK : 0;
+}
+
+int
+pt_test_and_clear_accessed(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(paddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if (pde_is_large(pd->pd_physical[index])) {
+                /* One accessed bit covers every page of a large page. Only
+                 * the first page's check clears it, so the others keep
+                 * seeing the large page as referenced until the clock
+                 * comes around to that one again */
+                pde_t *pde = &pd->pd_physical[index];
+                if ((*pde & PAGE_LARGE_MASK) != (paddr & PAGE_LARGE_MASK)
+                    || PAGE_LARGE_OFFSET(vaddr) != PAGE_LARGE_OFFSET(paddr)
+                    || !(PD_ACCESSED & *pde)) {
+                        return 0;
+                }
+                if (PAGE_LARGE_ALIGNED(vaddr)) {
+                        *pde &= ~PD_ACCESSED;
+                        if (pd == current_pagedir) {
+                                tlb_flush(vaddr);
+                        }
+                }
+                return 1;
+        }
+
+        if (PT_PRESENT & pd->pd_physical[index]) {
+                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+
+                index = vaddr_to_ptindex(vaddr);
+                if ((PT_PRESENT & pt[index]) && (PT_ACCESSED & pt[index])
+                    && paddr == (pt[index] & PAGE_MASK)) {
+                        pt[index] &= ~PT_ACCESSED;
+                        /* The processor only sets the accessed bit when it
+                         * loads the entry into the TLB, so drop any cached
+                         * copy or later accesses would go unnoticed */
+                        if (pd == current_pagedir) {
+                                tlb_flush(vaddr);
+                        }
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* Adds the addresses mapped by entries [from, to) of the page table
+ * mapping the 4mb starting at vbase to the batch. */
+static void
+_pt_collect(tlb_batch_t *tb, pte_t *pt, uint32_t from, uint32_t to, uintptr_t vbase)
+{
+        uint32_t i;
+        for (i = from; i < to && !tlb_batch_full(tb); ++i) {
+                if (PT_PRESENT & pt[i]) {
+                        tlb_batch_add(tb, vbase + i * PAGE_SIZE);
+                }
+        }
+}
+
 void
 pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
 {
-        uint32_t index;
+        pt_unmap_range_batch(pd, vlow, vhigh, NULL);
+}
 
+void
+pt_unmap_range_batch(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, tlb_batch_t *tb)
+{
         KASSERT(vlow < vhigh);
         KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
         KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
 
-        index = vaddr_to_ptindex(vlow);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vlow)];
-                size_t size = (PT_ENTRY_COUNT - index) * sizeof(*pt);
-                memset(&pt[index], 0, size);
-        }
-        vlow += PAGE_SIZE * ((PT_ENTRY_COUNT - index) % PT_ENTRY_COUNT);
+        /* one page directory entry at a time */
+        while (vlow < vhigh) {
+                uint32_t index = vaddr_to_pdindex(vlow);
+                uintptr_t vbase = index * PT_VADDR_SIZE;
+                uintptr_t vend = MIN(vbase + PT_VADDR_SIZE, vhigh);
+                uint32_t from = vaddr_to_ptindex(vlow);
+                uint32_t to = (vend - vbase) / PAGE_SIZE;
+
+                vlow = vend;
+                if (!(PT_PRESENT & pd->pd_physical[index])) {
+                        continue;
+                }
 
-        index = vaddr_to_ptindex(vhigh);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vhigh)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vhigh)];
-                size_t size = index * sizeof(*pt);
-                memset(&pt[0], 0, size);
+                if (0 == from && PT_ENTRY_COUNT == to) {
+                        /* the whole entry goes, along with its page table */
+                        if (pde_is_large(pd->pd_physical[index])) {
+                                if (NULL != tb) {
+                                        tlb_batch_add(tb, vbase);
+                                }
+                        } else {
+                                if (NULL != tb) {
+                                        _pt_collect(tb, (pte_t *)pd->pd_virtual[index], 0, to, vbase);
+                                        /* the CPU may have cached the entry pointing
+                                         * at the page table even with no page mapped
+                                         * through it, and the page is about to be
+                                         * reused */
+                                        tlb_batch_add(tb, vbase);
+                                }
+                                page_free(pd->pd_virtual[index]);
+                        }
+                        pd->pd_virtual[index] = NULL;
+                        pd->pd_physical[index] = 0;
+                        continue;
+                }
+
+                /* large pages only partly covered by the range must be broken up */
+                if (pde_is_large(pd->pd_physical[index]) && 0 > _pt_demote(pd, index)) {
+                        continue;
+                }
+                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+                if (NULL != tb) {
+                        _pt_collect(tb, pt, from, to, vbase);
+                }
+                memset(&pt[from], 0, (to - from) * sizeof(*pt));
         }
-        vhigh -= PAGE_SIZE * index;
+}
 
-        uint32_t i;
-        for (i = vaddr_to_pdindex(vlow); i < vaddr_to_pdindex(vhigh); ++i) {
-                if (PT_PRESENT & pd->pd_physical[i]) {
-                        page_free(pd->pd_virtual[i]);
-                        pd->pd_virtual[i] = NULL;
-                        pd->pd_physical[i] = 0;
+void
+pt_write_protect_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, tlb_batch_t *tb)
+{
+        KASSERT(vlow < vhigh);
+        KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
+        KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
+
+        while (vlow < vhigh) {
+                uint32_t index = vaddr_to_pdindex(vlow);
+                uintptr_t vbase = index * PT_VADDR_SIZE;
+                uintptr_t vend = MIN(vbase + PT_VADDR_SIZE, vhigh);
+                uint32_t from = vaddr_to_ptindex(vlow);
+                uint32_t to = (vend - vbase) / PAGE_SIZE;
+                uint32_t i;
+
+                vlow = vend;
+                if (!(PT_PRESENT & pd->pd_physical[index])) {
+                        continue;
+                }
+
+                if (pde_is_large(pd->pd_physical[index])) {
+                        if (0 == from && PT_ENTRY_COUNT == to) {
+                                /* a large page has a single permission */
+                                if (PD_WRITE & pd->pd_physical[index]) {
+                                        pd->pd_physical[index] &= ~PD_WRITE;
+                                        tlb_batch_add(tb, vbase);
+                                }
+                                continue;
+                        }
+                        if (0 > _pt_demote(pd, index)) {
+                                continue;
+                        }
+                }
+
+                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+                for (i = from; i < to; ++i) {
+                        if ((PT_PRESENT & pt[i]) && (PT_WRITE & pt[i])) {
+                                pt[i] &= ~PT_WRITE;
+                                tlb_batch_add(tb, vbase + i * PAGE_SIZE);
+                        }
                 }
         }
 }
 
+int
+pt_copy_range(pagedir_t *dst, pagedir_t *src, uintptr_t vlow, uintptr_t vhigh)
+{
+        KASSERT(vlow < vhigh);
+        KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
+        KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
+
+        while (vlow < vhigh) {
+                uint32_t index = vaddr_to_pdindex(vlow);
+                uintptr_t vbase = index * PT_VADDR_SIZE;
+                uintptr_t vend = MIN(vbase + PT_VADDR_SIZE, vhigh);
+                uint32_t from = vaddr_to_ptindex(vlow);
+                uint32_t to = (vend - vbase) / PAGE_SIZE;
+                uint32_t i;
+                int ret;
+
+                vlow = vend;
+                if (!(PT_PRESENT & src->pd_physical[index])
+                    || pde_is_large(src->pd_physical[index])) {
+                        continue;
+                }
+
+                pte_t *pt = (pte_t *)src->pd_virtual[index];
+                for (i = from; i < to; ++i) {
+                        if (!(PT_PRESENT & pt[i])) {
+                                continue;
+                        }
+                        if (0 > (ret = pt_map(dst, vbase + i * PAGE_SIZE, pt[i] & PAGE_MASK,
+                                              PD_PRESENT | PD_USER, PT_PRESENT | PT_USER))) {
+                                return ret;
+                        }
+                }
+        }
+        return 0;
+}
 
 pagedir_t *
 pt_create_pagedir()
@@ -215,7 +556,7 @@ pt_destroy_pagedir(pagedir_t *pdir)
 
         uint32_t i;
         for (i = begin; i <= end; ++i) {
-                if (PT_PRESENT & pdir->pd_physical[i]) {
+                if ((PT_PRESENT & pdir->pd_physical[i]) && !pde_is_large(pdir->pd_physical[i])) {
                         page_free(pdir->pd_virtual[i]);
                 }
         }
@@ -351,6 +692,7 @@ pt_template_init()
          * to remove the mapping of the first 4mb and then saved in a
          * seperate page as the template */
         memset(current_pagedir->pd_virtual[0], 0, PAGE_SIZE);
+        _pt_kstack_init();
         tlb_flush_all();
 
         template_pagedir = page_alloc_n(2);
@@ -358,6 +700,24 @@ pt_template_init()
         memcpy(template_pagedir, current_pagedir, sizeof(*template_pagedir));
 
         intr_register(INTR_PAGE_FAULT, _pt_fault_handler);
+
+        /* Turn on page size extensions so user memory can be mapped with
+         * large pages where possible */
+        uint32_t eax, edx, cr4;
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        if (CPUID_FEAT_EDX_PSE & edx) {
+                __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+                cr4 |= CR4_PSE;
+                __asm__ volatile("movl %0, %%cr4" :: "r"(cr4));
+                pt_large_pages = 1;
+        }
+        dbgq(DBG_MM, "Large pages %s\n", pt_large_pages ? "enabled" : "not supported");
+}
+
+int
+pt_large_pages_enabled(void)
+{
+        return pt_large_pages;
 }
 
 /* Debugging information to print human-readable information about
@@ -379,7 +739,11 @@ pt_mapping_info(const void *pt, char *buf, size_t osize)
 
         while (PT_ENTRY_COUNT > pdi) {
                 pte_t *entry = NULL;
-                if (PD_PRESENT & pagedir->pd_physical[pdi]) {
+                pte_t large;
+                if (pde_is_large(pagedir->pd_physical[pdi])) {
+                        large = (pagedir->pd_physical[pdi] & PAGE_LARGE_MASK) + pti * PAGE_SIZE;
+                        entry = &large;
+                } else if (PD_PRESENT & pagedir->pd_physical[pdi]) {
                         if (PT_PRESENT & pagedir->pd_virtual[pdi][pti]) {
                                 entry = &pagedir->pd_virtual[pdi][pti];
                         }
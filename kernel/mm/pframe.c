@@ -7,6 +7,7 @@
 #include "proc/proc.h"
 
 #include "util/debug.h"
+#include "util/radix.h"
 #include "util/string.h"
 
 #include "mm/mmobj.h"
@@ -54,14 +55,14 @@
  * When a page is allocated or pinned:
  *     - pf_link links the page into allocated_list or pinned_list,
  *       respectively
- *     - pf_hlink links the page into the appropriate hash chain of the
- *       resident page hashtable
+ *     - the page is stored in its mmobj's page index (see below) under
+ *       its page number
  *     - pf_olink links the page into the appropriate mmobj's list of
  *       resident pages
  *
  * When a page is free:
  *     - pf_link links the page into free_list
- *     - pf_hlink does not link the page into any list
+ *     - the page is not in any page index
  *     - pf_olink does not link the page into any list
  */
 
@@ -77,21 +78,49 @@ static int npinned;
 static list_t pinned_list;
 
 /*     The ALLOCATED list: */
-/*       Pages on this list contain useful/actual/real data. This list is
- *       maintained in least-recently-requested (via pframe_get or
- *       pframe_get_resident) (and thus, *roughly/approximately* LRU) order.
+/*       Pages on this list contain useful/actual/real data. The list is
+ *       the ring of a CLOCK (second chance) replacement policy and its
+ *       head is the clock hand. Finding a page (via pframe_get or
+ *       pframe_get_resident) only sets PF_REFERENCED on it, so cache hits
+ *       never touch the list. When pageoutd looks at the page under the
+ *       hand it gathers the page's PF_REFERENCED flag and the accessed
+ *       bits of every user PTE mapping it, clearing them as it goes. A
+ *       page that was referenced since the hand last passed is moved to
+ *       the tail (advancing the hand past it); one that was not is
+ *       reclaimed. New and newly unpinned pages enter at the tail.
  */
 static int nallocated;
 static list_t alloc_list;
 
+static pframe_stats_t pframe_stats;
+
 static slab_allocator_t *pframe_allocator;
 
-/* Used to quickly look up pframes. ALL pages "owned by" some
- * mmobj should be in this hash
- * (object, pagenum) --> list of pframes */
-#define hash_page(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
-                                  % PF_HASH_SIZE)
-static list_t pframe_hash[PF_HASH_SIZE];
+/* Used to quickly look up pframes. ALL pages "owned by" some mmobj are in
+ * that mmobj's page index, a radix tree keyed by page number, so a lookup
+ * costs a handful of pointer dereferences no matter how many pages are
+ * resident.
+ *
+ * The index cannot live in the mmobj itself (the layout of mmobj_t is
+ * shared with precompiled code), so it hangs off a small hash keyed by
+ * the object's address instead. An index is created when its object gets
+ * its first resident page and destroyed when it loses its last one, so
+ * the hash only holds objects which actually have pages. Consecutive
+ * lookups almost always hit the same object, so the last index found is
+ * remembered and checked before the hash.
+ * mmobj --> pframe_index --> (pagenum --> pframe) */
+typedef struct pframe_index {
+        mmobj_t            *pi_obj;
+        radix_tree_t        pi_tree;
+        list_link_t         pi_link;     /* link on pframe_index_hash chain */
+} pframe_index_t;
+
+#define PF_OBJ_HASH_SIZE         (1 << PF_OBJ_HASH_BITS)
+#define hash_obj(obj)            ((((uint32_t)(obj)) * 0x9e370001U) \
+                                  >> (32 - PF_OBJ_HASH_BITS))
+static list_t pframe_index_hash[PF_OBJ_HASH_SIZE];
+static pframe_index_t *pframe_index_last = NULL;
+static slab_allocator_t *pframe_index_allocator;
 
 /* Related to the Pageout daemon: */
 
@@ -106,6 +135,9 @@ static ktqueue_t pageoutd_waitq;
 /* threads waiting for pageoutd to run sleep on this queue */
 static ktqueue_t alloc_waitq;
 
+static pframe_index_t *pframe_index_get(mmobj_t *o, int create);
+static void pframe_index_put(pframe_index_t *pi);
+
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
@@ -115,10 +147,28 @@ static void pageoutd_exit(void);
 #define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
 
 
+/*
+ * Slab constructor for pframes: everything that is the same for every free
+ * pframe. pframe_free hands pframes back in this state.
+ */
+void
+pframe_ctor(void *obj)
+{
+        pframe_t *pf = (pframe_t *)obj;
+        pf->pf_obj = NULL;
+        pf->pf_flags = 0;
+        sched_queue_init(&pf->pf_waitq);
+        pf->pf_pincount = 0;
+        pf->pf_lockcount = 0;
+        list_link_init(&pf->pf_link);
+        list_link_init(&pf->pf_hlink);
+        list_link_init(&pf->pf_olink);
+}
+
 /*
  * Initialize the pinned and allocated counts and lists. Then, make a pframe
  * slab allocator. You should also list_init all the lists that make
- * up the pframe_hash. Finally, you need to set things up for pageoutd to
+ * up the pframe_index_hash. Finally, you need to set things up for pageoutd to
  * run by setting nfreepages_min and nfreepages_target.
  */
 void
@@ -130,13 +180,18 @@ pframe_init(void)
         nallocated = 0;
         list_init(&alloc_list);
 
-        pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
+        pframe_allocator = slab_allocator_create_ctor("pframe", sizeof(pframe_t),
+                                                      pframe_ctor, NULL);
         KASSERT(NULL != pframe_allocator);
+        pframe_index_allocator = slab_allocator_create("pframe_index",
+                                 sizeof(pframe_index_t));
+        KASSERT(NULL != pframe_index_allocator);
 
-        /* initialize pframe_hash: */
+        /* initialize pframe_index_hash: */
         int i;
-        for (i = 0; i < PF_HASH_SIZE; ++i)
-                list_init(&pframe_hash[i]);
+        for (i = 0; i < PF_OBJ_HASH_SIZE; ++i)
+                list_init(&pframe_index_hash[i]);
+        pframe_index_last = NULL;
 
         /* initialize pageout parameters: */
         nfreepages_target = page_free_count() >> 1;
@@ -210,50 +265,107 @@ pframe_shutdown()
 pframe_t *
 pframe_get_resident(struct mmobj *o, uint32_t pagenum)
 {
-        list_t *hashchain;
+        pframe_index_t *pi;
         pframe_t *pf;
 
-        hashchain = &pframe_hash[hash_page(o, pagenum)];
-        list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
-                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
-                        /* found a page with the specified identity. It is
-                         * up to the caller to recognize/care if the page
-                         * is busy. */
-                        if (!pframe_is_pinned(pf)) {
-                                /* send to back of alloc_list */
-                                list_remove(&pf->pf_link);
-                                list_insert_tail(&alloc_list, &pf->pf_link);
-                        }
-                        return pf;
+        if (NULL == (pi = pframe_index_get(o, 0)))
+                return NULL;
+        if (NULL == (pf = radix_lookup(&pi->pi_tree, pagenum)))
+                return NULL;
+
+        /* found a page with the specified identity. It is up to the caller
+         * to recognize/care if the page is busy. */
+        KASSERT(o == pf->pf_obj && pagenum == pf->pf_pagenum);
+        if (!pframe_is_referenced(pf)) {
+                /* only store when the flag changes, so repeated hits on a
+                 * hot page leave it untouched */
+                pframe_set_referenced(pf);
+        }
+        return pf;
+}
+
+/*
+ * Finds the page index of o. If o has no index yet and create is set a new,
+ * empty one is made for it; otherwise NULL is returned. Returns NULL if
+ * memory for a new index cannot be allocated.
+ */
+static pframe_index_t *
+pframe_index_get(mmobj_t *o, int create)
+{
+        pframe_index_t *pi;
+        list_t *chain;
+
+        if (NULL != pframe_index_last && o == pframe_index_last->pi_obj)
+                return pframe_index_last;
+
+        chain = &pframe_index_hash[hash_obj(o)];
+        list_iterate_begin(chain, pi, pframe_index_t, pi_link) {
+                if (o == pi->pi_obj) {
+                        pframe_index_last = pi;
+                        return pi;
                 }
         } list_iterate_end();
 
-        return NULL;
+        if (!create)
+                return NULL;
+        if (NULL == (pi = slab_obj_alloc(pframe_index_allocator)))
+                return NULL;
+        pi->pi_obj = o;
+        radix_tree_init(&pi->pi_tree);
+        list_insert_head(chain, &pi->pi_link);
+        pframe_index_last = pi;
+        return pi;
+}
+
+/*
+ * Destroys pi if it no longer holds any pages.
+ */
+static void
+pframe_index_put(pframe_index_t *pi)
+{
+        if (!radix_tree_empty(&pi->pi_tree))
+                return;
+        if (pframe_index_last == pi)
+                pframe_index_last = NULL;
+        list_remove(&pi->pi_link);
+        slab_obj_free(pframe_index_allocator, pi);
 }
 
 /*
  * Allocate a pframe to hold the page identified by the object and page number.
  * The given page should not already be resident.
  *
- * We allocate a page from the free list. We then initialize the newly allocated
- * page's object, pagenum, and flags, pin count, and links. We also update the
- * object's nrespages.
+ * We allocate a page from the free list (unless the caller supplies the page
+ * frame). We then initialize the newly allocated page's object, pagenum, and
+ * flags, pin count, and links. We also update the object's nrespages.
  *
  * @param o the mmobj identifying this page
  * @param pagenum the page number of this page in the object
+ * @param addr the page frame to use, or NULL to allocate one
  *
  * @return a new pframe
  */
 static pframe_t *
-pframe_alloc(mmobj_t *o, uint32_t pagenum)
+pframe_alloc_frame(mmobj_t *o, uint32_t pagenum, void *addr)
 {
+        pframe_index_t *pi;
         pframe_t *pf;
         if (NULL == (pf = slab_obj_alloc(pframe_allocator))) {
                 dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
                 return NULL;
         }
-        if (NULL == (pf->pf_addr = page_alloc())) {
+        if (NULL == (pf->pf_addr = (NULL != addr) ? addr : page_alloc())) {
+                dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
+                slab_obj_free(pframe_allocator, pf);
+                return NULL;
+        }
+        if (NULL == (pi = pframe_index_get(o, 1))
+            || 0 > radix_insert(&pi->pi_tree, pagenum, pf)) {
                 dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
+                if (NULL != pi)
+                        pframe_index_put(pi);
+                if (NULL == addr)
+                        page_free(pf->pf_addr);
                 slab_obj_free(pframe_allocator, pf);
                 return NULL;
         }
@@ -261,13 +373,11 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
         nallocated++;
         list_insert_tail(&alloc_list, &pf->pf_link);
 
+        /* the wait queue, pin count and links were set up by pframe_ctor */
+        KASSERT(sched_queue_empty(&pf->pf_waitq) && 0 == pf->pf_pincount);
         pf->pf_obj = o;
         pf->pf_pagenum = pagenum;
         pf->pf_flags = 0;
-        sched_queue_init(&pf->pf_waitq);
-        pf->pf_pincount = 0;
-
-        list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
 
         o->mmo_ops->ref(o);
         o->mmo_nrespages++;
@@ -276,13 +386,24 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
         return pf;
 }
 
+static pframe_t *
+pframe_alloc(mmobj_t *o, uint32_t pagenum)
+{
+        return pframe_alloc_frame(o, pagenum, NULL);
+}
+
 int
 pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result)
 {
         KASSERT(NULL != o);
         KASSERT(NULL != result);
 
-        return o->mmo_ops->lookuppage(o, pagenum, forwrite, result);
+        int ret = o->mmo_ops->lookuppage(o, pagenum, forwrite, result);
+        if (0 == ret) {
+                /* whatever is looking the page up is still using it */
+                (*result)->pf_flags &= ~PF_FREEABLE;
+        }
+        return ret;
 }
 
 /*
@@ -292,43 +413,61 @@ pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result
  *
  * @param pf page to be migrated
  * @param dest destination vm object
+ * @return 0 on success, -ENOMEM if dest's page index could not be grown, in
+ * which case pf is left where it was
  */
-void
+int
 pframe_migrate(pframe_t *pf, mmobj_t *dest)
 {
+        pframe_index_t *pi;
+        pframe_t *destpf;
+        int ret;
+
         KASSERT(pf != NULL);
-    KASSERT(dest != NULL);
-    KASSERT(!pframe_is_busy(pf));
-
-    /* If dest already has a page for this pagenum, just throw this one away. */
-    if (pframe_get_resident(dest, pf->pf_pagenum) != NULL) {
-        /* Caller should not be using pf after this; and ideally it’s not pinned. */
-       // KASSERT(!pframe_is_pinned(pf));
-	// pframe_unpin(pf); //new 
-        pframe_clean(pf);       /* if needed */
-        pframe_free(pf);
-        return;
-    }
+        KASSERT(dest != NULL);
+        KASSERT(!pframe_is_busy(pf));
 
-    if (pf->pf_obj == dest) return; /* nothing to do */
+        if (pf->pf_obj == dest) return 0; /* nothing to do */
 
-    mmobj_t *src = pf->pf_obj;
+        /* If dest already has a page for this pagenum, just throw this one
+         * away. Whoever locked it now sees dest's page, so the locks move. */
+        if ((destpf = pframe_get_resident(dest, pf->pf_pagenum)) != NULL) {
+                while (pframe_is_locked(pf)) {
+                        pframe_unlock(pf);
+                        pframe_lock(destpf);
+                }
+                if (pframe_is_dirty(pf))
+                        pframe_clean(pf);
+                pframe_free(pf);
+                return 0;
+        }
 
-    /* Remove from old object’s lists */
-    list_remove(&pf->pf_olink);
-    src->mmo_nrespages--;
-	src->mmo_ops->put(src); //new
-    list_remove(&pf->pf_hlink);
+        mmobj_t *src = pf->pf_obj;
 
-    /* Attach to dest */
-    pf->pf_obj = dest;
-    list_insert_head(&dest->mmo_respages, &pf->pf_olink);
-    dest->mmo_nrespages++;
+        /* Attach to dest's index first so that a failure leaves pf untouched */
+        if (NULL == (pi = pframe_index_get(dest, 1)))
+                return -ENOMEM;
+        if (0 > (ret = radix_insert(&pi->pi_tree, pf->pf_pagenum, pf))) {
+                pframe_index_put(pi);
+                return ret;
+        }
+
+        /* Remove from old object's index and lists */
+        pi = pframe_index_get(src, 0);
+        KASSERT(NULL != pi);
+        radix_remove(&pi->pi_tree, pf->pf_pagenum);
+        pframe_index_put(pi);
+        list_remove(&pf->pf_olink);
+        src->mmo_nrespages--;
+        src->mmo_ops->put(src);
 
-    list_insert_head(&pframe_hash[hash_page(dest, pf->pf_pagenum)],
-                     &pf->pf_hlink);
-	dest->mmo_ops->ref(dest); //new
+        /* Attach to dest */
+        pf->pf_obj = dest;
+        list_insert_head(&dest->mmo_respages, &pf->pf_olink);
+        dest->mmo_nrespages++;
+        dest->mmo_ops->ref(dest);
 
+        return 0;
 }
 
 /*
@@ -385,6 +524,7 @@ pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 		while (pframe_is_busy(newP)) {
 		    sched_sleep_on(&newP->pf_waitq);
 		}
+		pframe_stats.ps_hits++;
 		*result = newP;
 		return 0;
 		
@@ -399,6 +539,7 @@ pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 	if(newP == NULL){
 		return -ENOMEM;
 	}
+	pframe_stats.ps_misses++;
 	int ret = pframe_fill(newP);
 	if(ret < 0){
 		pframe_free(newP);
@@ -442,6 +583,103 @@ pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 #endif
 }
 
+/*
+ * Like pframe_get, but finds PAGE_LARGE_NPAGES consecutive pages of o,
+ * starting at pagenum, which all sit in one large page frame, so that
+ * they can be mapped with a single page directory entry. If none of the
+ * pages are resident a large page is allocated and each page is filled
+ * into its own part of it; if all of them already are resident (mapped
+ * large by someone else, for instance) they are used as they are.
+ * Otherwise the pages cannot be made contiguous and the caller should
+ * fall back to mapping them one at a time.
+ *
+ * The pages are marked PF_LARGE, but otherwise they are ordinary pages
+ * which may be cleaned, reclaimed and freed one at a time.
+ *
+ * @param o the object the pages are in
+ * @param pagenum the page number of the first page
+ * @param result used to return the first page
+ * @return 0 on success, -EEXIST if some but not all of the pages are
+ * resident or they are in the wrong frames, -ENOMEM if no large page
+ * frame is free, or an error from filling a page
+ */
+int
+pframe_get_large(struct mmobj *o, uint32_t pagenum, pframe_t **result)
+{
+        pframe_t *pf, *first;
+        char *frame;
+        uint32_t i;
+        int ret = 0;
+
+        KASSERT(NULL != o);
+        KASSERT(NULL != result);
+
+        *result = NULL;
+        if (NULL != (first = pframe_get_resident(o, pagenum))) {
+                for (i = 0; i < PAGE_LARGE_NPAGES; ++i) {
+                        if (NULL == (pf = pframe_get_resident(o, pagenum + i))
+                            || (char *)pf->pf_addr != (char *)first->pf_addr + i * PAGE_SIZE)
+                                return -EEXIST;
+                        while (pframe_is_busy(pf))
+                                sched_sleep_on(&pf->pf_waitq);
+                }
+                if (!pframe_is_large(first))
+                        return -EEXIST;
+                *result = first;
+                return 0;
+        }
+        for (i = 1; i < PAGE_LARGE_NPAGES; ++i) {
+                if (NULL != pframe_get_resident(o, pagenum + i))
+                        return -EEXIST;
+        }
+
+        /* Leave the small pages to those who need them */
+        if (page_free_count() < nfreepages_min + 2 * PAGE_LARGE_NPAGES)
+                return -ENOMEM;
+        if (NULL == (frame = page_alloc_n(PAGE_LARGE_NPAGES)))
+                return -ENOMEM;
+        KASSERT(PAGE_LARGE_ALIGNED(pt_virt_to_phys((uintptr_t)frame)));
+
+        /* Make every page resident (and busy) before filling any of them,
+         * since filling may block */
+        for (i = 0; i < PAGE_LARGE_NPAGES; ++i) {
+                if (NULL == (pf = pframe_alloc_frame(o, pagenum + i, frame + i * PAGE_SIZE))) {
+                        for (; i < PAGE_LARGE_NPAGES; ++i)
+                                page_free(frame + i * PAGE_SIZE);
+                        ret = -ENOMEM;
+                        break;
+                }
+                pf->pf_flags = PF_LARGE | PF_BUSY;
+        }
+        for (i = 0; i < PAGE_LARGE_NPAGES && 0 == ret; ++i) {
+                pf = pframe_get_resident(o, pagenum + i);
+                ret = o->mmo_ops->fillpage(o, pf);
+                KASSERT(pf->pf_addr == frame + i * PAGE_SIZE);
+                pframe_clear_busy(pf);
+                sched_broadcast_on(&pf->pf_waitq);
+        }
+        pframe_stats.ps_misses += PAGE_LARGE_NPAGES;
+
+        if (0 > ret) {
+                /* Throw away whatever was made resident; the frames go
+                 * back to the page allocator one page at a time */
+                for (i = 0; i < PAGE_LARGE_NPAGES; ++i) {
+                        if (NULL == (pf = pframe_get_resident(o, pagenum + i))
+                            || !pframe_is_large(pf))
+                                continue;
+                        pframe_clear_busy(pf);
+                        sched_broadcast_on(&pf->pf_waitq);
+                        while (pframe_is_pinned(pf))
+                                pframe_unpin(pf);
+                        pframe_free(pf);
+                }
+                return ret;
+        }
+
+        *result = pframe_get_resident(o, pagenum);
+        return 0;
+}
+
 /*
  * Increases the pin count on this page. Pages with a pin count > 0 will not be
  * paged out by pageoutd, so this ensures that the page will remain resident
@@ -486,6 +724,9 @@ pframe_unpin(pframe_t *pf)
 	KASSERT(pf != NULL);
 	KASSERT(pf->pf_pincount > 0);
 	pf->pf_pincount--;
+	/* an object being torn down drops every pin, locks included */
+	if (pf->pf_lockcount > pf->pf_pincount)
+		pf->pf_lockcount = pf->pf_pincount;
 	if(pf->pf_pincount == 0){
 		list_remove(&pf->pf_link);
 		list_insert_tail(&alloc_list, &pf->pf_link);
@@ -495,6 +736,28 @@ pframe_unpin(pframe_t *pf)
 	
 }
 
+/*
+ * Pins a page on behalf of a locked mapping (mlock or MAP_LOCKED). A lock
+ * is an ordinary pin which is also counted in pf_lockcount, so that code
+ * which drops the transient pins it finds on a page (the fault handler)
+ * can tell them apart from the ones it must leave alone.
+ */
+void
+pframe_lock(pframe_t *pf)
+{
+        pframe_pin(pf);
+        pf->pf_lockcount++;
+}
+
+/* Drops a pin taken by pframe_lock */
+void
+pframe_unlock(pframe_t *pf)
+{
+        KASSERT(pf->pf_lockcount > 0);
+        pf->pf_lockcount--;
+        pframe_unpin(pf);
+}
+
 /*
  * Indicates that a page is about to be modified. This should be called on a
  * page before any attempt to modify its contents. This marks the page dirty
@@ -553,7 +816,6 @@ pframe_clean(pframe_t *pf)
         pframe_clear_dirty(pf);
 
         /* Make sure a future write to the page will fault (and hence dirty it) */
-        tlb_flush((uintptr_t) pf->pf_addr);
         pframe_remove_from_pts(pf);
 
         pframe_set_busy(pf);
@@ -586,23 +848,25 @@ pframe_free(pframe_t *pf)
         mmobj_t *o = pf->pf_obj;
 
 
-        /* Flush the TLB */
-        tlb_flush((uintptr_t) pf->pf_addr);
         /* Remove from all pagetables that map it */
         pframe_remove_from_pts(pf);
 
-        list_remove(&pf->pf_hlink);
+        pframe_index_t *pi = pframe_index_get(o, 0);
+        KASSERT(NULL != pi);
+        radix_remove(&pi->pi_tree, pf->pf_pagenum);
+        pframe_index_put(pi);
 
         pf->pf_obj = NULL;
         nallocated--;
         list_remove(&pf->pf_link);
 
-        page_free(pf->pf_addr);
-        slab_obj_free(pframe_allocator, pf);
-
         o->mmo_nrespages--;
         list_remove(&pf->pf_olink);
 
+        page_free(pf->pf_addr);
+        KASSERT(sched_queue_empty(&pf->pf_waitq));
+        slab_obj_free(pframe_allocator, pf);
+
         /* Now that pf has effectively been freed, dereference the corresponding
          * object. We don't do this earlier as we are modifying the object's counts
          * and also because this op can block */
@@ -648,7 +912,9 @@ list_start:
 
 /* Remove a page frame from the page tables of all processes that map it
  * To do that, traverse all processes that map the given page frame into
- * their address space, and zero the corresponding address entry.
+ * their address space, and zero the corresponding address entry. Only
+ * the current process's translations can be cached in the TLB, so only
+ * those are invalidated.
  */
 void
 pframe_remove_from_pts(pframe_t *pf)
@@ -661,13 +927,155 @@ pframe_remove_from_pts(pframe_t *pf)
                         uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
                         /* And unmap it from that area's proc */
                         if (NULL != vma->vma_vmmap->vmm_proc) {
-                                pt_unmap(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
+                                pagedir_t *pd = vma->vma_vmmap->vmm_proc->p_pagedir;
+                                pt_unmap(pd, vaddr);
+                                if (pd == pt_get()) {
+                                        tlb_flush(vaddr);
+                                }
                         }
                 }
 
         } list_iterate_end();
 }
 
+/*
+ * Returns whether pf has been referenced since the clock hand last passed
+ * it, either through the page cache (PF_REFERENCED) or through a user
+ * mapping (the PTE accessed bit), and clears all of those indications.
+ * The mappings are found the same way pframe_remove_from_pts finds them.
+ */
+static int
+pframe_harvest_referenced(pframe_t *pf)
+{
+        int referenced = pframe_is_referenced(pf);
+        uintptr_t paddr = pt_virt_to_phys((uintptr_t) pf->pf_addr);
+        vmarea_t *vma;
+
+        pframe_clear_referenced(pf);
+        list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
+                if ((pf->pf_pagenum >= vma->vma_off)
+                    && (pf->pf_pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))
+                    && (NULL != vma->vma_vmmap->vmm_proc)) {
+                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
+                        /* a private mapping may map a shadow copy here
+                         * instead, in which case the physical address
+                         * does not match and the bit is left alone */
+                        referenced |= pt_test_and_clear_accessed(vma->vma_vmmap->vmm_proc->p_pagedir,
+                                                                 vaddr, paddr);
+                }
+        } list_iterate_end();
+
+        return referenced;
+}
+
+/*
+ * Advances the clock hand by one step: examines the page at the head of
+ * alloc_list and either waits for it (busy), discards it (freeable), gives
+ * it a second chance (referenced), writes it back (dirty) or reclaims it.
+ * Returns 1 if a page frame was freed, 0 otherwise. May block.
+ */
+static int
+pframe_clock_step(void)
+{
+        pframe_t *pf;
+
+        KASSERT(!list_empty(&alloc_list));
+        pf = list_head(&alloc_list, pframe_t, pf_link);
+
+        if (pframe_is_busy(pf)) {
+                sched_sleep_on(&pf->pf_waitq);
+        } else if (pframe_is_freeable(pf)) {
+                pframe_free(pf);
+                pframe_stats.ps_lazy_frees++;
+                return 1;
+        } else if (pframe_harvest_referenced(pf)) {
+                list_remove(&pf->pf_link);
+                list_insert_tail(&alloc_list, &pf->pf_link);
+                pframe_stats.ps_second_chances++;
+        } else if (pframe_is_dirty(pf)) {
+                /* the page stays under the hand and is reclaimed on the
+                 * next step unless it gets used in the meantime */
+                pframe_clean(pf);
+        } else {
+                pframe_free(pf);
+                pframe_stats.ps_evictions++;
+                return 1;
+        }
+        return 0;
+}
+
+/*
+ * Runs the clock until npages page frames have been reclaimed or there
+ * is nothing left to reclaim. Returns the number of page frames freed.
+ * This routine may block.
+ */
+int
+pframe_reclaim(uint32_t npages)
+{
+        uint32_t nfreed = 0;
+        while ((nfreed < npages) && (!list_empty(&alloc_list))) {
+                nfreed += pframe_clock_step();
+        }
+        return nfreed;
+}
+
+/*
+ * Moves an unpinned page to the clock hand and forgets that it has been
+ * referenced, so that it is the next page considered for reclaim unless it
+ * is used again before then. Does not block.
+ */
+void
+pframe_deactivate(pframe_t *pf)
+{
+        KASSERT(!pframe_is_free(pf));
+
+        if (pframe_is_pinned(pf) || pframe_is_busy(pf))
+                return;
+        pframe_harvest_referenced(pf);
+        list_remove(&pf->pf_link);
+        list_insert_head(&alloc_list, &pf->pf_link);
+}
+
+/*
+ * Marks a page whose contents its owner no longer needs (madvise
+ * MADV_FREE). The clock frees it without writing it back the next time it
+ * comes around, unless the page is looked up again first, which clears the
+ * mark. The caller must have removed the page's mappings, so that any use
+ * of it goes through pframe_lookup. Does not block.
+ */
+void
+pframe_set_freeable(pframe_t *pf)
+{
+        if (pframe_is_pinned(pf) || pframe_is_busy(pf))
+                return;
+        pf->pf_flags |= PF_FREEABLE;
+        pframe_deactivate(pf);
+}
+
+/*
+ * Frees the resident pages of o numbered [lopage, hipage) without writing
+ * them back, skipping pinned and busy pages. The caller must hold a
+ * reference to o so that it outlives its pages.
+ */
+void
+pframe_free_range(mmobj_t *o, uint32_t lopage, uint32_t hipage)
+{
+        pframe_t *pf;
+
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                if (pf->pf_pagenum >= lopage && pf->pf_pagenum < hipage
+                    && !pframe_is_pinned(pf) && !pframe_is_busy(pf)) {
+                        pframe_free(pf);
+                }
+        } list_iterate_end();
+}
+
+void
+pframe_get_stats(pframe_stats_t *stats)
+{
+        *stats = pframe_stats;
+}
+
 /* ------------------------------------------------------------------ */
 /* ------------------------- PAGEOUT DAEMON ------------------------- */
 /* ------------------------------------------------------------------ */
@@ -708,11 +1116,9 @@ pageoutd_exit()
 }
 
 /*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
- * page is busy before yanking it. If the page you select is dirty, make sure
- * to clean it before yanking it. Finally, go back to sleep after having paged
- * out the appropriate page.
+ * The pageout daemon, when run, sweeps the clock over the list of pages which
+ * are available to be paged out until enough page frames are free. Finally,
+ * go back to sleep after having paged out the appropriate pages.
  * Both arguments unused.
  */
 static void *
@@ -721,20 +1127,7 @@ pageoutd_run(int arg1, void *arg2)
         while (1) {
                 KASSERT(nallocated >= 0);
                 while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
-                        pframe_t *pf;
-
-                        /* obtain least-recently-requested page: */
-                        pf = list_head(&alloc_list, pframe_t, pf_link);
-
-                        if (pframe_is_busy(pf)) {
-                                sched_sleep_on(&pf->pf_waitq);
-                        } else if (pframe_is_dirty(pf)) {
-                                pframe_clean(pf);
-                        } else {
-                                /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
-                                pframe_free(pf);
-                        }
+                        pframe_clock_step();
                 }
 
                 /*   release the thundering herd... */
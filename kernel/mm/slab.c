@@ -20,6 +20,7 @@
 #include "mm/page.h"
 
 #include "util/gdb.h"
+#include "util/list.h"
 #include "util/string.h"
 #include "util/debug.h"
 
@@ -40,19 +41,52 @@
 #endif
 
 struct slab {
-        struct slab             *s_next;       /* link on list of slabs */
+        list_link_t              s_link;       /* link on partial/full/empty list */
         int                      s_inuse;      /* number of allocated objs */
         void                    *s_free;       /* head of obj free list */
         void                    *s_addr;       /* start address */
 };
 
+/*
+ * A magazine is a small stack of constructed objects. Each allocator keeps
+ * two magazines, 'loaded' and 'previous', in front of its slabs; nearly all
+ * allocations and frees are satisfied by popping or pushing a round on one
+ * of them. When both are exhausted whole magazines are exchanged with the
+ * allocator's depot, which holds a list of full and a list of empty
+ * magazines. Only when the depot cannot help either do we fall through to
+ * the slab layer. See Bonwick and Adams, "Magazines and Vmem" (2001).
+ */
+#define SLAB_MAG_ROUNDS         15      /* objects per magazine */
+#define SLAB_DEPOT_MAX_FULL     4       /* full magazines kept in a depot */
+
+/* Objects bigger than this are not worth hoarding in magazines */
+#define SLAB_MAG_MAX_OBJSIZE    PAGE_SIZE
+
+struct slab_magazine {
+        struct slab_magazine    *m_next;        /* link on depot list */
+        int                      m_rounds;      /* number of objects held */
+        void                    *m_objs[SLAB_MAG_ROUNDS];
+};
+
 struct slab_allocator {
         struct slab_allocator   *sa_next;       /* link on list of slab allocators */
         const char              *sa_name;       /* user-provided name */
         size_t                   sa_objsize;    /* object size */
-        struct slab             *sa_slabs;      /* head of slab list */
+        list_t                   sa_partial;    /* slabs with some objects in use */
+        list_t                   sa_full;       /* slabs with all objects in use */
+        list_t                   sa_empty;      /* slabs with no objects in use */
         int                      sa_order;      /* npages = (1 << order) */
         int                      sa_slab_nobjs; /* number of objs per slab */
+
+        slab_ctor_t              sa_ctor;       /* run when an obj leaves a slab */
+        slab_dtor_t              sa_dtor;       /* run when an obj returns to a slab */
+
+        int                      sa_use_mags;   /* whether the magazine layer is on */
+        struct slab_magazine    *sa_loaded;     /* magazine rounds are taken from */
+        struct slab_magazine    *sa_previous;   /* the one used before that */
+        struct slab_magazine    *sa_depot_full; /* depot of full magazines */
+        struct slab_magazine    *sa_depot_empty;/* depot of empty magazines */
+        int                      sa_depot_nfull;
 };
 
 struct slab_bufctl {
@@ -75,6 +109,15 @@ struct slab_bufctl {
         ( (void*) (((uintptr_t)(obj)) + (allocator)->sa_objsize \
                    + sizeof(struct slab_bufctl)) )
 
+/* The pointer handed out to callers for an object and back */
+#ifdef SLAB_REDZONE
+#define obj_user(obj)           ((void *)((uintptr_t)(obj) + sizeof(SLAB_REDZONE)))
+#define user_obj(ptr)           ((void *)((uintptr_t)(ptr) - sizeof(SLAB_REDZONE)))
+#else
+#define obj_user(obj)           (obj)
+#define user_obj(ptr)           (ptr)
+#endif
+
 GDB_DEFINE_HOOK(slab_obj_alloc, void *addr, struct slab_allocator *allocator)
 GDB_DEFINE_HOOK(slab_obj_free, void *addr, struct slab_allocator *allocator)
 
@@ -84,6 +127,9 @@ static struct slab_allocator *slab_allocators = NULL;
 /* Special case - allocator for allocation of slab_allocator objects. */
 static struct slab_allocator slab_allocator_allocator;
 
+/* Special case - allocator for magazines. It has no magazines itself. */
+static struct slab_allocator slab_magazine_allocator;
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -160,8 +206,12 @@ _calc_slab_size(struct slab_allocator *allocator)
 }
 
 static void
-_allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
+_allocator_init(struct slab_allocator *allocator, const char *name, size_t size,
+                slab_ctor_t ctor, slab_dtor_t dtor, int use_mags)
 {
+        if (size > SLAB_MAG_MAX_OBJSIZE)
+                use_mags = 0;
+
 #ifdef SLAB_REDZONE
         /*
          * Add space for the front and rear red-zones.
@@ -174,9 +224,21 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
 
         allocator->sa_name = name;
         allocator->sa_objsize = size;
-        allocator->sa_slabs = NULL;
+        list_init(&allocator->sa_partial);
+        list_init(&allocator->sa_full);
+        list_init(&allocator->sa_empty);
         _calc_slab_size(allocator);
 
+        allocator->sa_ctor = ctor;
+        allocator->sa_dtor = dtor;
+
+        allocator->sa_use_mags = use_mags;
+        allocator->sa_loaded = NULL;
+        allocator->sa_previous = NULL;
+        allocator->sa_depot_full = NULL;
+        allocator->sa_depot_empty = NULL;
+        allocator->sa_depot_nfull = 0;
+
         /* Add cache to global cache list. */
         allocator->sa_next = slab_allocators;
         slab_allocators = allocator;
@@ -186,20 +248,28 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
         dbgq(DBG_MM, "  Object Size:   %d\n", allocator->sa_objsize);
         dbgq(DBG_MM, "  Order:         %d\n", allocator->sa_order);
         dbgq(DBG_MM, "  Slab Capacity: %d\n", allocator->sa_slab_nobjs);
+        dbgq(DBG_MM, "  Magazines:     %s\n", use_mags ? "yes" : "no");
 }
 
 struct slab_allocator *
-slab_allocator_create(const char *name, size_t size) {
+slab_allocator_create_ctor(const char *name, size_t size,
+                           slab_ctor_t ctor, slab_dtor_t dtor)
+{
         struct slab_allocator *allocator;
 
         allocator = (struct slab_allocator *) slab_obj_alloc(&slab_allocator_allocator);
         if (!allocator)
                 return NULL;
 
-        _allocator_init(allocator, name, size);
+        _allocator_init(allocator, name, size, ctor, dtor, 1);
         return allocator;
 }
 
+struct slab_allocator *
+slab_allocator_create(const char *name, size_t size) {
+        return slab_allocator_create_ctor(name, size, NULL, NULL);
+}
+
 
 static int
 _slab_allocator_grow(struct slab_allocator *allocator)
@@ -255,26 +325,55 @@ _slab_allocator_grow(struct slab_allocator *allocator)
             1 << allocator->sa_order);
 
         /* Place this slab into the cache. */
-        slab->s_next = allocator->sa_slabs;
-        allocator->sa_slabs = slab;
+        list_insert_head(&allocator->sa_empty, &slab->s_link);
 
         return 1;
 }
 
-void *
-slab_obj_alloc(struct slab_allocator *allocator)
+/* Moves slab onto the partial, full or empty list according to how many
+ * of its objects are in use. */
+static void
+_slab_relist(struct slab_allocator *allocator, struct slab *slab)
+{
+        list_t *list;
+
+        if (0 == slab->s_inuse)
+                list = &allocator->sa_empty;
+        else if (allocator->sa_slab_nobjs == slab->s_inuse)
+                list = &allocator->sa_full;
+        else
+                list = &allocator->sa_partial;
+
+        list_remove(&slab->s_link);
+        list_insert_head(list, &slab->s_link);
+}
+
+/*
+ * Takes an object out of a slab and constructs it. Partially used slabs
+ * are preferred over empty ones so that empty slabs stay empty and can be
+ * reclaimed. Returns the raw object (including any red-zone).
+ */
+static void *
+_slab_obj_alloc(struct slab_allocator *allocator)
 {
         struct slab *slab;
         void *obj;
 
         /* Find a slab with a free object. */
         for (;;) {
-                slab = allocator->sa_slabs;
-                while (slab && (slab->s_inuse == allocator->sa_slab_nobjs))
-                        slab = slab->s_next;
-                if (slab && (slab->s_inuse < allocator->sa_slab_nobjs))
+                if (!list_empty(&allocator->sa_partial)) {
+                        slab = list_head(&allocator->sa_partial, struct slab, s_link);
+                        break;
+                }
+                if (!list_empty(&allocator->sa_empty)) {
+                        slab = list_head(&allocator->sa_empty, struct slab, s_link);
                         break;
-                if (!_slab_allocator_grow(allocator))
+                }
+                /* Growing may reclaim memory, which may drain our own
+                 * magazines back into our slabs, so look again even if
+                 * the grow fails. */
+                if (!_slab_allocator_grow(allocator)
+                    && list_empty(&allocator->sa_partial))
                         return NULL;
         }
 
@@ -286,24 +385,190 @@ slab_obj_alloc(struct slab_allocator *allocator)
         obj = slab->s_free;
         slab->s_free = obj_bufctl(allocator, obj)->sb_next;
         obj_bufctl(allocator, obj)->sb_slab = slab;
-#ifdef SLAB_CHECK_FREE
-        obj_bufctl(allocator, obj)->sb_free = 0;
-#endif
 
         slab->s_inuse++;
+        if (1 == slab->s_inuse || allocator->sa_slab_nobjs == slab->s_inuse)
+                _slab_relist(allocator, slab);
 
         dbg(DBG_MM, "Allocated object 0x%p from \"%s\" (0x%p), "
             "slab 0x%p, inuse %d\n", obj, allocator->sa_name,
             allocator, allocator, slab->s_inuse);
 
+        if (NULL != allocator->sa_ctor)
+                allocator->sa_ctor(obj_user(obj));
+
+        return obj;
+}
+
+/* Destroys a raw object and puts it back on its slab's free list. */
+static void
+_slab_obj_free(struct slab_allocator *allocator, void *obj)
+{
+        struct slab *slab;
+
+        if (NULL != allocator->sa_dtor)
+                allocator->sa_dtor(obj_user(obj));
+
+        slab = obj_bufctl(allocator, obj)->sb_slab;
+
+        /* Place this object back on the slab's free list. */
+        obj_bufctl(allocator, obj)->sb_next = slab->s_free;
+        slab->s_free = obj;
+
+        slab->s_inuse--;
+        if (0 == slab->s_inuse || allocator->sa_slab_nobjs - 1 == slab->s_inuse)
+                _slab_relist(allocator, slab);
+
+        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
+            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+}
+
+/* Returns every object held by mag to the slab layer. */
+static void
+_mag_drain(struct slab_allocator *allocator, struct slab_magazine *mag)
+{
+        while (mag->m_rounds > 0)
+                _slab_obj_free(allocator, mag->m_objs[--mag->m_rounds]);
+}
+
+/* Takes a constructed object from the magazine layer, or returns NULL if
+ * neither the loaded magazines nor the depot have one. Never blocks. */
+static void *
+_mag_alloc(struct slab_allocator *allocator)
+{
+        struct slab_magazine *mag;
+
+        if (NULL != (mag = allocator->sa_loaded) && mag->m_rounds > 0)
+                return mag->m_objs[--mag->m_rounds];
+
+        if (NULL != (mag = allocator->sa_previous) && mag->m_rounds > 0) {
+                allocator->sa_previous = allocator->sa_loaded;
+                allocator->sa_loaded = mag;
+                return mag->m_objs[--mag->m_rounds];
+        }
+
+        if (NULL != (mag = allocator->sa_depot_full)) {
+                allocator->sa_depot_full = mag->m_next;
+                allocator->sa_depot_nfull--;
+                if (NULL != allocator->sa_previous) {
+                        allocator->sa_previous->m_next = allocator->sa_depot_empty;
+                        allocator->sa_depot_empty = allocator->sa_previous;
+                }
+                allocator->sa_previous = allocator->sa_loaded;
+                allocator->sa_loaded = mag;
+                return mag->m_objs[--mag->m_rounds];
+        }
+
+        return NULL;
+}
+
+/* Stores a constructed object in the magazine layer. Returns 0 if there
+ * was no room and no empty magazine could be allocated, in which case the
+ * caller must return the object to its slab. */
+static int
+_mag_free(struct slab_allocator *allocator, void *obj)
+{
+        struct slab_magazine *mag;
+
+        for (;;) {
+                if (NULL != (mag = allocator->sa_loaded) && mag->m_rounds < SLAB_MAG_ROUNDS) {
+                        mag->m_objs[mag->m_rounds++] = obj;
+                        return 1;
+                }
+
+                if (NULL != (mag = allocator->sa_previous) && mag->m_rounds < SLAB_MAG_ROUNDS) {
+                        allocator->sa_previous = allocator->sa_loaded;
+                        allocator->sa_loaded = mag;
+                        continue;
+                }
+
+                if (NULL == allocator->sa_depot_empty) {
+                        /* Allocating may reclaim memory, which empties
+                         * all magazines, so start over afterwards */
+                        if (NULL == (mag = slab_obj_alloc(&slab_magazine_allocator)))
+                                return 0;
+                        mag->m_rounds = 0;
+                        mag->m_next = allocator->sa_depot_empty;
+                        allocator->sa_depot_empty = mag;
+                        continue;
+                }
+
+                /* Retire previous to the depot and load an empty magazine */
+                mag = allocator->sa_depot_empty;
+                allocator->sa_depot_empty = mag->m_next;
+                if (NULL != allocator->sa_previous) {
+                        struct slab_magazine *prev = allocator->sa_previous;
+                        if (allocator->sa_depot_nfull >= SLAB_DEPOT_MAX_FULL) {
+                                _mag_drain(allocator, prev);
+                                prev->m_next = allocator->sa_depot_empty;
+                                allocator->sa_depot_empty = prev;
+                        } else {
+                                prev->m_next = allocator->sa_depot_full;
+                                allocator->sa_depot_full = prev;
+                                allocator->sa_depot_nfull++;
+                        }
+                }
+                allocator->sa_previous = allocator->sa_loaded;
+                allocator->sa_loaded = mag;
+        }
+}
+
+/* Empties and frees every magazine of the allocator. */
+static void
+_mag_reap(struct slab_allocator *allocator)
+{
+        struct slab_magazine *mag, *next;
+        struct slab_magazine *loaded[2];
+        int ii;
+
+        loaded[0] = allocator->sa_loaded;
+        loaded[1] = allocator->sa_previous;
+        allocator->sa_loaded = NULL;
+        allocator->sa_previous = NULL;
+        for (ii = 0; ii < 2; ii++) {
+                if (NULL != loaded[ii]) {
+                        _mag_drain(allocator, loaded[ii]);
+                        slab_obj_free(&slab_magazine_allocator, loaded[ii]);
+                }
+        }
+
+        for (mag = allocator->sa_depot_full; NULL != mag; mag = next) {
+                next = mag->m_next;
+                _mag_drain(allocator, mag);
+                slab_obj_free(&slab_magazine_allocator, mag);
+        }
+        allocator->sa_depot_full = NULL;
+        allocator->sa_depot_nfull = 0;
+
+        for (mag = allocator->sa_depot_empty; NULL != mag; mag = next) {
+                next = mag->m_next;
+                slab_obj_free(&slab_magazine_allocator, mag);
+        }
+        allocator->sa_depot_empty = NULL;
+}
+
+void *
+slab_obj_alloc(struct slab_allocator *allocator)
+{
+        void *obj = NULL;
+
+        if (allocator->sa_use_mags)
+                obj = _mag_alloc(allocator);
+        if (NULL == obj && NULL == (obj = _slab_obj_alloc(allocator)))
+                return NULL;
+
+#ifdef SLAB_CHECK_FREE
+        obj_bufctl(allocator, obj)->sb_free = 0;
+#endif
+
 #ifdef SLAB_REDZONE
         VERIFY_REDZONES(allocator, obj);
+#endif
 
         /*
          * Make object pointer point past the first red-zone.
          */
-        obj = (void *)((uintptr_t)obj + sizeof(SLAB_REDZONE));
-#endif
+        obj = obj_user(obj);
 
         GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
         return obj;
@@ -312,39 +577,31 @@ slab_obj_alloc(struct slab_allocator *allocator)
 void
 slab_obj_free(struct slab_allocator *allocator, void *obj)
 {
-        struct slab *slab;
         GDB_CALL_HOOK(slab_obj_free, obj, allocator);
 
-#ifdef SLAB_REDZONE
-        /* Move pointer back.  See the end of kmem_cache_alloc. */
-        obj = (void *)((uintptr_t)obj - sizeof(SLAB_REDZONE));
+        /* Move pointer back.  See the end of slab_obj_alloc. */
+        obj = user_obj(obj);
 
+#ifdef SLAB_REDZONE
         VERIFY_REDZONES(allocator, obj);
 #endif
 
 #ifdef SLAB_CHECK_FREE
-	        if (obj_bufctl(allocator, obj)->sb_free) {
-            panic("INVALID FREE! Allocator: %s, Obj: 0x%p\n", allocator->sa_name, obj);
+        if (obj_bufctl(allocator, obj)->sb_free) {
+                panic("INVALID FREE! Allocator: %s, Obj: 0x%p\n", allocator->sa_name, obj);
         }
-        KASSERT(!obj_bufctl(allocator, obj)->sb_free && "INVALID FREE!");
         obj_bufctl(allocator, obj)->sb_free = 1;
 #endif
 
-        slab = obj_bufctl(allocator, obj)->sb_slab;
-
-        /* Place this object back on the slab's free list. */
-        obj_bufctl(allocator, obj)->sb_next = slab->s_free;
-        slab->s_free = obj;
-
-        slab->s_inuse--;
-
-        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
-            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+        if (allocator->sa_use_mags && _mag_free(allocator, obj))
+                return;
+        _slab_obj_free(allocator, obj);
 }
 
 /*
  * Reclaims as much memory (up to a target) from
- * unused slabs as possible
+ * unused slabs as possible. Objects cached in magazines are
+ * returned to their slabs first.
  * @param target - target number of pages to reclaim. If negative,
  * try to reclaim as many pages as possible
  * @return number of pages freed
@@ -355,29 +612,29 @@ slab_allocators_reclaim(int target)
         int npages_freed = 0, npages;
 
         struct slab_allocator *a;
-        struct slab *s, **prev;
+        struct slab *s;
+
+        /* Empty all magazines first; the magazines themselves go back to
+         * slab_magazine_allocator, whose slabs are then reclaimed below */
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                _mag_reap(a);
+        }
 
         /* Go through all caches */
         for (a = slab_allocators; NULL != a; a = a->sa_next) {
-                prev = &(a->sa_slabs);
-                s = a->sa_slabs;
-                while (NULL != s) {
-                        struct slab *next = s->s_next;
-                        if (0 == s->s_inuse) {
-                                /* Free Slab */
-                                (*prev) = next;
-                                npages = 1 << a->sa_order;
-
-                                page_free_n(s->s_addr, npages);
-                                npages_freed += npages;
-                        } else {
-                                prev = &(s->s_next);
-                        }
+                npages = 1 << a->sa_order;
+                while (!list_empty(&a->sa_empty)) {
+                        s = list_head(&a->sa_empty, struct slab, s_link);
+                        list_remove(&s->s_link);
+
+                        /* Free Slab */
+                        page_free_n(s->s_addr, npages);
+                        npages_freed += npages;
+
                         /* Check if target was met */
                         if ((target > 0) && (npages_freed >= target)) {
                                 return npages_freed;
                         }
-                        s = next;
                 }
         }
         return npages_freed;
@@ -486,7 +743,10 @@ slab_init()
         struct slab_allocator **cs;
 
         /* Special case initialization of the kmem_cache_t cache. */
-        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator));
+        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator),
+                        NULL, NULL, 0);
+        _allocator_init(&slab_magazine_allocator, "slab_magazines", sizeof(struct slab_magazine),
+                        NULL, NULL, 0);
 
         /*
          * Allocate the power of two buckets for generic
@@ -8,6 +8,7 @@
 
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/sched.h"
 
 #include "mm/mm.h"
 #include "mm/mman.h"
@@ -18,26 +19,32 @@
 #include "mm/tlb.h"
 
 #include "fs/file.h"
+#include "fs/open.h"
+#include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
 #include "vm/shadow.h"
 #include "vm/vmmap.h"
 
+#include "api/binfmt.h"
 #include "api/exec.h"
+#include "api/syscall.h"
 
+#include "main/fpu.h"
 #include "main/interrupt.h"
 
 /* Pushes the appropriate things onto the kernel stack of a newly forked thread
  * so that it can begin execution in userland_entry.
  * regs: registers the new thread should have on execution
  * kstack: location of the new thread's kernel stack
+ * kstacksz: size of the new thread's kernel stack
  * Returns the new stack pointer on success. */
 static uint32_t
-fork_setup_stack(const regs_t *regs, void *kstack)
+fork_setup_stack(const regs_t *regs, void *kstack, size_t kstacksz)
 {
         /* Pointer argument and dummy return address, and userland dummy return
          * address */
-        uint32_t esp = ((uint32_t) kstack) + DEFAULT_STACK_SIZE - (sizeof(regs_t) + 12);
+        uint32_t esp = ((uint32_t) kstack) + kstacksz - (sizeof(regs_t) + 12);
         *(void **)(esp + 4) = (void *)(esp + 8); /* Set the argument to point to location of struct on stack */
         memcpy((void *)(esp + 8), regs, sizeof(regs_t)); /* Copy over struct */
         return esp;
@@ -76,8 +83,7 @@ static void assert_vmas_equivalent(vmarea_t *oldvma, vmarea_t *newvma){
     KASSERT(oldvma->vma_vmmap == curproc->p_vmmap && newvma->vma_vmmap != NULL &&
             newvma->vma_vmmap != curproc->p_vmmap);
 
-    int map_type = oldvma->vma_flags & MAP_TYPE;
-    if (map_type == MAP_PRIVATE){
+    if (vmarea_is_cow(oldvma)){
         KASSERT(oldvma->vma_obj->mmo_shadowed != NULL
                 && oldvma->vma_obj->mmo_shadowed == newvma->vma_obj->mmo_shadowed);
         KASSERT(oldvma->vma_obj->mmo_nrespages == 0
@@ -163,8 +169,8 @@ static void vmmap_revert(list_t *old_vma_list, list_t *new_vma_list){
         
         assert_vmas_equivalent(oldvma, newvma);
         
-        if ((oldvma->vma_flags & MAP_TYPE) == MAP_PRIVATE){
-            KASSERT((newvma->vma_flags & MAP_TYPE) == MAP_PRIVATE);
+        if (vmarea_is_cow(oldvma)){
+            KASSERT(vmarea_is_cow(newvma));
             KASSERT(newvma->vma_obj->mmo_shadowed != NULL);
             KASSERT(oldvma->vma_obj->mmo_shadowed != NULL);
             
@@ -210,7 +216,8 @@ int copy_vmmap(proc_t *p) {
         int map_type = oldvma->vma_flags & MAP_TYPE;
         KASSERT(map_type == MAP_PRIVATE || map_type == MAP_SHARED);
 
-        if (map_type == MAP_PRIVATE) {
+        /* only areas which can be written need copy-on-write */
+        if (vmarea_is_cow(oldvma)) {
 	    err = setup_shadow_objects(oldvma, newvma);
 		 dbg(DBG_TEST, "copy_vmmap: oldvma=%p obj=%p, newvma=%p obj=%p\n", oldvma, oldvma->vma_obj, newvma, newvma->vma_obj);
 	    if (err < 0) {
@@ -218,7 +225,7 @@ int copy_vmmap(proc_t *p) {
 		break;
 	    }
 	}else {
-        /* MAP_SHARED: ref the object and link newvma */
+        /* MAP_SHARED or read-only: ref the object and link newvma */
 		newvma->vma_obj->mmo_ops->ref(newvma->vma_obj);
 		list_insert_tail(mmobj_bottom_vmas(newvma->vma_obj), &newvma->vma_olink);
 	    }
@@ -273,7 +280,7 @@ static kthread_t *setup_thread(proc_t *p, struct regs *regs){
     dbg(DBG_TEST, "setup_thread: Child's trap frame: r_eip = 0x%08x, r_eax = %d, r_ebp = 0x%08x, r_esp = 0x%08x\n",
         regs->r_eip, regs->r_eax, regs->r_ebp, regs->r_useresp);
 
-    uint32_t stack_setup_res = fork_setup_stack(regs, newthr->kt_kstack);
+    uint32_t stack_setup_res = fork_setup_stack(regs, newthr->kt_kstack, newthr->kt_kstacksz);
 
     /* Read back the child's trap frame to verify */
     regs_t *child_regs = (regs_t *)(stack_setup_res + 8);
@@ -284,7 +291,7 @@ static kthread_t *setup_thread(proc_t *p, struct regs *regs){
     newthr->kt_ctx.c_eip = (uint32_t) userland_entry;
     newthr->kt_ctx.c_esp = stack_setup_res;
     newthr->kt_ctx.c_kstack = (uintptr_t) newthr->kt_kstack;
-    newthr->kt_ctx.c_kstacksz = DEFAULT_STACK_SIZE;
+    newthr->kt_ctx.c_kstacksz = newthr->kt_kstacksz;
 
     return newthr;
 }
@@ -302,9 +309,27 @@ static void copy_filetable(proc_t *p){
     }
 }
 
-static void unmap_pagetable(){
-    tlb_flush_all();
-    pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+/* The parent keeps its mappings, but every page of a copy-on-write area
+ * has to become read-only so that neither side's writes reach the other.
+ * Areas which share their object with the child are mapped the same way
+ * in the child straight away, read-only so that a write to a shared page
+ * still faults and dirties it. */
+static void protect_pagetable(proc_t *p){
+    vmarea_t *vma;
+    tlb_batch_t tb;
+    tlb_batch_init(&tb);
+    list_iterate_begin(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+        uintptr_t lo = (uintptr_t)PN_TO_ADDR(vma->vma_start);
+        uintptr_t hi = (uintptr_t)PN_TO_ADDR(vma->vma_end);
+
+        if (vmarea_is_cow(vma)) {
+            pt_write_protect_range(curproc->p_pagedir, lo, hi, &tb);
+        } else {
+            /* without the page tables the child just faults them in */
+            pt_copy_range(p->p_pagedir, curproc->p_pagedir, lo, hi);
+        }
+    } list_iterate_end();
+    tlb_batch_flush(&tb);
 }
 
 static void set_brk_vals(proc_t *p){
@@ -313,8 +338,7 @@ static void set_brk_vals(proc_t *p){
 }
 
 static void cleanup_proc(proc_t *p){
-    if (list_link_is_linked(&p->p_list_link))
-        list_remove(&p->p_list_link);
+    proc_remove(p);
     if (p->p_pagedir)
         pt_destroy_pagedir(p->p_pagedir);
     if (list_link_is_linked(&p->p_child_link))
@@ -377,7 +401,7 @@ dbg(DBG_TEST, "NOOOOOOOOOOOOO\n");
   //  pt_unmap_range(curproc->p_pagedir,  USER_MEM_LOW, USER_MEM_HIGH);
   //  pt_unmap_range(childproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
   //  tlb_flush_all();     /* flush current CPU TLB entries for parent */
-	unmap_pagetable();
+    protect_pagetable(childproc);
     sched_make_runnable(newthr);
 
     /* set eax to the child's pid, now that we've copied it over into the
@@ -386,4 +410,121 @@ dbg(DBG_TEST, "NOOOOOOOOOOOOO\n");
 	dbg(DBG_TEST, "do_fork: regs->r_eip = 0x%08x\n", regs->r_eip);
     dbg(DBG_TEST, "Proc %d forked child process with pid : %d\n", (int)curproc->p_pid, (int)childproc->p_pid);
     return (int)childproc->p_pid;
-}
\ No newline at end of file
+}
+
+/* What a spawning parent hands to its child, and the child's answer */
+typedef struct spawn_req {
+    const char            *sr_filename;
+    char *const           *sr_argv;
+    char *const           *sr_envp;
+    const spawn_action_t  *sr_actions;
+    int                    sr_nactions;
+    int                    sr_err;
+    int                    sr_done;
+    ktqueue_t              sr_waitq;
+} spawn_req_t;
+
+/* Applies the file actions of a spawn to the current process */
+static int spawn_file_actions(const spawn_action_t *sa, int n){
+    int i, fd, err;
+
+    for (i = 0; i < n; i++, sa++){
+        switch (sa->sa_op){
+            case SPAWN_CLOSE:
+                err = do_close(sa->sa_fd);
+                break;
+            case SPAWN_DUP2:
+                err = do_dup2(sa->sa_fd, sa->sa_newfd);
+                break;
+            case SPAWN_OPEN:
+                if (0 > (err = fd = do_open(sa->sa_path.as_str, sa->sa_flags)))
+                    break;
+                if (fd != sa->sa_fd){
+                    err = do_dup2(fd, sa->sa_fd);
+                    do_close(fd);
+                }
+                break;
+            default:
+                err = -EINVAL;
+                break;
+        }
+        if (err < 0)
+            return err;
+    }
+    return 0;
+}
+
+/* The first thing a spawned child runs. Its address space is still the
+ * empty one proc_create gave it, so there is nothing to throw away
+ * before the program is loaded. */
+static void *spawn_start(int arg1, void *arg2){
+    spawn_req_t *req = (spawn_req_t *)arg2;
+    uint32_t eip, esp;
+    int err;
+
+    if (0 == (err = spawn_file_actions(req->sr_actions, req->sr_nactions)))
+        err = binfmt_load(req->sr_filename, req->sr_argv, req->sr_envp, &eip, &esp);
+
+    /* the request lives on the parent's stack, so it is not touched
+     * again once the parent has been told */
+    req->sr_err = err;
+    req->sr_done = 1;
+    sched_broadcast_on(&req->sr_waitq);
+
+    if (err < 0)
+        do_exit(127);
+
+    fpu_reset(curthr);
+    userland_start(eip, esp);
+    panic("returned from userland_start\n");
+    return NULL;
+}
+
+/*
+ * The implementation of spawn: fork and exec in one go without ever
+ * copying the caller's vmmap, shadowing its objects or touching its page
+ * tables. Like vfork, the caller does not return until the child has
+ * loaded its program (or failed to), so that the program's arguments
+ * can be read straight out of the caller's kernel buffers and a failure
+ * can be reported as one.
+ */
+int
+do_spawn(const char *filename, char *const *argv, char *const *envp,
+         const spawn_action_t *actions, int nactions)
+{
+    spawn_req_t req;
+    kthread_t *newthr;
+    proc_t *childproc;
+    int status;
+
+    KASSERT(filename != NULL);
+    KASSERT(nactions == 0 || actions != NULL);
+
+    if (NULL == (childproc = proc_create((char *)filename)))
+        return -ENOMEM;
+    if (NULL == (newthr = kthread_create_class(childproc, spawn_start, 0, &req, KSTACK_USER))){
+        cleanup_proc(childproc);
+        return -ENOMEM;
+    }
+
+    req.sr_filename = filename;
+    req.sr_argv = argv;
+    req.sr_envp = envp;
+    req.sr_actions = actions;
+    req.sr_nactions = nactions;
+    req.sr_err = 0;
+    req.sr_done = 0;
+    sched_queue_init(&req.sr_waitq);
+
+    copy_filetable(childproc);
+    sched_make_runnable(newthr);
+    while (!req.sr_done)
+        sched_sleep_on(&req.sr_waitq);
+
+    if (req.sr_err < 0){
+        do_waitpid(childproc->p_pid, 0, &status);
+        return req.sr_err;
+    }
+    dbg(DBG_TEST, "Proc %d spawned child process with pid : %d\n", (int)curproc->p_pid, (int)childproc->p_pid);
+    return (int)childproc->p_pid;
+}
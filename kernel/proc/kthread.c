@@ -16,6 +16,9 @@
 
 #include "mm/slab.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
+
+#include "main/fpu.h"
 
 kthread_t *curthr; /* global */
 static slab_allocator_t *kthread_allocator = NULL;
@@ -30,46 +33,181 @@ static list_t kthread_reapd_deadlist; /* Threads to be cleaned */
 static void *kthread_reapd_run(int arg1, void *arg2);
 #endif
 
+/*
+ * Kernel stacks. Every stack gets its own slot of 1 << KSTACK_SLOT_SHIFT
+ * bytes in the kernel stack window and its pages are mapped one at a time
+ * at the top of the slot, so a stack needs no physically contiguous
+ * memory and the page below it, left unmapped, catches an overflow
+ * instead of letting it run into another stack. The page fault then
+ * cannot push its frame and becomes a double fault, which the double
+ * fault task in gdt.c reports from a stack of its own. A freed stack
+ * stays mapped on a list for its class, up to KSTACK_CACHE_MAX of them,
+ * so creating a thread usually just takes one off the list.
+ */
+#define KSTACK_SLOT_SIZE        (1U << KSTACK_SLOT_SHIFT)
+#define KSTACK_NSLOTS           (KSTACK_AREA_SIZE >> KSTACK_SLOT_SHIFT)
+
+typedef struct kstack_cache {
+        size_t          kc_size;        /* bytes of stack, page aligned */
+        list_t          kc_free;        /* free stacks, still mapped */
+        uint32_t        kc_nfree;
+} kstack_cache_t;
+
+/* A free stack holds its link on kc_free at its lowest address */
+typedef struct kstack_free {
+        list_link_t     kf_link;
+} kstack_free_t;
+
+static kstack_cache_t kstack_caches[KSTACK_NCLASSES];
+static uint32_t kstack_slots[KSTACK_NSLOTS]; /* free slot numbers, a stack */
+static uint32_t kstack_nslots;
+static kstack_stats_t kstack_stats;
+
 void
 kthread_init()
 {
+        uint32_t i;
+
         kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t));
         KASSERT(NULL != kthread_allocator);
+
+        kstack_caches[KSTACK_USER].kc_size = (size_t)PAGE_ALIGN_UP(KSTACK_SIZE_USER);
+        kstack_caches[KSTACK_KERNEL].kc_size = (size_t)PAGE_ALIGN_UP(KSTACK_SIZE_KERNEL);
+        for (i = 0; i < KSTACK_NCLASSES; ++i) {
+                KASSERT(0 < kstack_caches[i].kc_size);
+                KASSERT(kstack_caches[i].kc_size + PAGE_SIZE <= KSTACK_SLOT_SIZE
+                        && "kernel stack does not leave room for a guard page");
+                list_init(&kstack_caches[i].kc_free);
+                kstack_caches[i].kc_nfree = 0;
+        }
+
+        /* hand out the lowest slots first */
+        for (i = 0; i < KSTACK_NSLOTS; ++i) {
+                kstack_slots[i] = KSTACK_NSLOTS - 1 - i;
+        }
+        kstack_nslots = KSTACK_NSLOTS;
 }
 
-/**
- * Allocates a new kernel stack.
- *
- * @return a newly allocated stack, or NULL if there is not enough
- * memory available
- */
-static char *
-alloc_stack(void)
+/* Unmaps and frees the size bytes of stack starting at stack, which are
+ * at the top of their slot, and gives the slot back */
+static void
+kstack_release(char *stack, size_t size)
 {
-        /* extra page for "magic" data */
-        char *kstack;
-        int npages = 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT);
-        kstack = (char *)page_alloc_n(npages);
+        uintptr_t va;
 
-        return kstack;
+        for (va = (uintptr_t)stack; va < (uintptr_t)stack + size; va += PAGE_SIZE) {
+                page_free(pt_kstack_unmap(va));
+        }
+        kstack_slots[kstack_nslots++] = ((uintptr_t)stack - KSTACK_AREA_LOW) >> KSTACK_SLOT_SHIFT;
 }
 
-/**
- * Frees a stack allocated with alloc_stack.
- *
- * @param stack the stack to free
- */
-static void
-free_stack(char *stack)
+/* Frees one cached stack of any class, returning 0 if there were none */
+static int
+kstack_reclaim(void)
 {
-        page_free_n(stack, 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT));
+        kstack_cache_t *kc;
+        kstack_free_t *kf;
+
+        for (kc = kstack_caches; kc < kstack_caches + KSTACK_NCLASSES; ++kc) {
+                if (!list_empty(&kc->kc_free)) {
+                        kf = list_head(&kc->kc_free, kstack_free_t, kf_link);
+                        list_remove(&kf->kf_link);
+                        kc->kc_nfree--;
+                        kstack_release((char *)kf, kc->kc_size);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+char *
+kstack_alloc(kstack_class_t kclass)
+{
+        kstack_cache_t *kc = &kstack_caches[kclass];
+        kstack_free_t *kf;
+        uintptr_t top, va;
+        char *stack;
+        void *page;
+
+        KASSERT(KSTACK_NCLASSES > kclass);
+
+        if (!list_empty(&kc->kc_free)) {
+                kf = list_head(&kc->kc_free, kstack_free_t, kf_link);
+                list_remove(&kf->kf_link);
+                kc->kc_nfree--;
+                kstack_stats.kss_hits++;
+                kstack_stats.kss_inuse++;
+                return (char *)kf;
+        }
+
+        if (0 == kstack_nslots && !kstack_reclaim()) {
+                kstack_stats.kss_failed++;
+                return NULL;
+        }
+        top = KSTACK_AREA_LOW + ((uintptr_t)kstack_slots[--kstack_nslots] << KSTACK_SLOT_SHIFT)
+              + KSTACK_SLOT_SIZE;
+        stack = (char *)(top - kc->kc_size);
+        for (va = (uintptr_t)stack; va < top; va += PAGE_SIZE) {
+                /* stacks kept for other classes are the first to go */
+                while (NULL == (page = page_alloc())) {
+                        if (!kstack_reclaim()) {
+                                kstack_release(stack, va - (uintptr_t)stack);
+                                kstack_stats.kss_failed++;
+                                return NULL;
+                        }
+                }
+                pt_kstack_map(va, page);
+        }
+        kstack_stats.kss_misses++;
+        kstack_stats.kss_inuse++;
+        return stack;
+}
+
+void
+kstack_free(char *stack, kstack_class_t kclass)
+{
+        kstack_cache_t *kc = &kstack_caches[kclass];
+        kstack_free_t *kf = (kstack_free_t *)stack;
+
+        KASSERT(KSTACK_NCLASSES > kclass);
+        KASSERT(KSTACK_AREA_LOW <= (uintptr_t)stack && KSTACK_AREA_HIGH > (uintptr_t)stack);
+        KASSERT(0 == ((uintptr_t)stack + kc->kc_size) % KSTACK_SLOT_SIZE);
+
+        kstack_stats.kss_inuse--;
+        if (kc->kc_nfree < KSTACK_CACHE_MAX) {
+                list_link_init(&kf->kf_link);
+                list_insert_head(&kc->kc_free, &kf->kf_link);
+                kc->kc_nfree++;
+        } else {
+                kstack_release(stack, kc->kc_size);
+        }
+}
+
+size_t
+kstack_size(kstack_class_t kclass)
+{
+        KASSERT(KSTACK_NCLASSES > kclass);
+        return kstack_caches[kclass].kc_size;
+}
+
+void
+kstack_get_stats(kstack_stats_t *stats)
+{
+        uint32_t i;
+
+        *stats = kstack_stats;
+        stats->kss_cached = 0;
+        for (i = 0; i < KSTACK_NCLASSES; ++i) {
+                stats->kss_cached += kstack_caches[i].kc_nfree;
+        }
 }
 
 void
 kthread_destroy(kthread_t *t)
 {
         KASSERT(t && t->kt_kstack);
-        free_stack(t->kt_kstack);
+        fpu_release(t);
+        kstack_free(t->kt_kstack, t->kt_kstack_class);
         if (list_link_is_linked(&t->kt_plink))
                 list_remove(&t->kt_plink);
 
@@ -77,8 +215,8 @@ kthread_destroy(kthread_t *t)
 }
 
 /*
- * Allocate a new stack with the alloc_stack function. The size of the
- * stack is DEFAULT_STACK_SIZE.
+ * Allocate a new stack with the kstack_alloc function. The size of the
+ * stack is that of its class, KSTACK_KERNEL.
  *
  * Don't forget to initialize the thread context with the
  * context_setup function. The context should have the same pagetable
@@ -86,6 +224,13 @@ kthread_destroy(kthread_t *t)
  */
 kthread_t *
 kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
+{
+        return kthread_create_class(p, func, arg1, arg2, KSTACK_KERNEL);
+}
+
+kthread_t *
+kthread_create_class(struct proc *p, kthread_func_t func, long arg1, void *arg2,
+                     kstack_class_t kclass)
 {
 	KASSERT(NULL != p);
 	//dbg(DBG_PRINT, "(GRADING1A 3.a)\n");
@@ -94,8 +239,13 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
 
 	memset(t, 0, sizeof(*t)); //set memory to 0
 
-	t->kt_kstack = alloc_stack();
-	if(!t->kt_kstack) return NULL;
+	t->kt_kstack = kstack_alloc(kclass);
+	if(!t->kt_kstack) {
+		slab_obj_free(kthread_allocator, t);
+		return NULL;
+	}
+	t->kt_kstacksz = kstack_size(kclass);
+	t->kt_kstack_class = kclass;
 
 	t->kt_retval = 0;
 	t->kt_errno = 0;
@@ -103,6 +253,7 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
 	t->kt_cancelled = 0;
 	t->kt_state = KT_RUN;
 	t->kt_wchan = NULL;
+	t->kt_prio = sched_nice_level(p->p_nice);
 
 	list_link_init(&t->kt_qlink);   // set all queues to empty
 	list_link_init(&t->kt_plink);
@@ -110,7 +261,7 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
 	list_insert_tail(&p->p_threads, &t->kt_plink);
 	//setting up context for the thread
 	context_setup(&t->kt_ctx, func, (int)arg1, arg2,
-                  t->kt_kstack, DEFAULT_STACK_SIZE, p->p_pagedir); 
+                  t->kt_kstack, t->kt_kstacksz, p->p_pagedir); 
 
         //dbg(DBG_PRINT, "(GRADING1E)\n");
           return t;
@@ -168,6 +319,8 @@ void
 kthread_exit(void *retval)
 {
 	curthr->kt_retval = retval;
+	/* give back what it reserved in the deadline class */
+	sched_setdeadline(curthr, 0, 0, 0);
 	curthr->kt_state = KT_EXITED;  
 	proc_thread_exited(retval); 
 
@@ -202,7 +355,9 @@ kthread_clone(kthread_t *thr)
 	kthread_t *newthr = slab_obj_alloc(kthread_allocator);
 	if (newthr == NULL) return NULL;
 
-	void *kstack = alloc_stack();
+	/* the copy runs the same kind of thread, so it gets the same kind
+	 * of stack */
+	char *kstack = kstack_alloc(thr->kt_kstack_class);
 	if (kstack == NULL) {
 		slab_obj_free(kthread_allocator, newthr);
 		return NULL;
@@ -223,8 +378,19 @@ kthread_clone(kthread_t *thr)
 	list_link_init(&newthr->kt_plink);
 	list_link_init(&newthr->kt_qlink);
 
+	/* a reservation in the deadline class is not inherited, the copy
+	 * would have to be admitted on its own */
+	newthr->kt_dl_runtime = newthr->kt_dl_deadline = newthr->kt_dl_period = 0;
+	newthr->kt_dl_budget = 0;
+	newthr->kt_dl_overruns = 0;
+	list_link_init(&newthr->kt_dl_link);
+
 	newthr->kt_ctx = thr->kt_ctx;
 
+	/* The struct copy above duplicated whatever was last saved to
+	 * memory; flush live registers first and re-align the area */
+	fpu_clone(thr, newthr);
+
 	uintptr_t old_base = (uintptr_t)thr->kt_kstack;
 	uintptr_t new_base = (uintptr_t)newthr->kt_kstack;
 	uintptr_t old_sp   = (uintptr_t)newthr->kt_ctx.c_esp;
@@ -3,20 +3,76 @@
 #include "globals.h"
 #include "errno.h"
 
+#include "main/apic.h"
+#include "main/cpuid.h"
 #include "main/interrupt.h"
+#include "main/fpu.h"
+
+#include "mm/page.h"
 
 #include "proc/sched.h"
 #include "proc/kthread.h"
+#include "proc/proc.h"
 
 #include "util/init.h"
 #include "util/debug.h"
+#include "util/timer.h"
+
+/*
+ * The run queue is a multi-level feedback queue: one queue per level,
+ * and a bitmap of the levels which have threads waiting, so the next
+ * thread to run is found by looking for the lowest set bit. A thread
+ * starts at the level of its process' nice value. Each time it has run
+ * for a whole slice at its level it drops a level, and each time it
+ * wakes from a sleep it moves back up SCHED_WAKE_BOOST levels, so
+ * threads which mostly wait for I/O stay above those which compute.
+ * Lower levels get longer slices, starting from SCHED_SLICE_TICKS clock
+ * ticks at the top so that every slice outlasts a tick. A thread is
+ * charged when it gives up the CPU and on every clock tick, and one
+ * running in user mode is preempted once its slice is used up. Every
+ * SCHED_BOOST_CYCLES all the waiting threads are put back at their
+ * starting levels so that the ones at the bottom cannot be starved
+ * forever.
+ *
+ * Above all of that is the deadline class. A thread which has joined it
+ * with sched_setdeadline is given a budget of kt_dl_runtime cycles every
+ * kt_dl_period, to be used by kt_dl_deadline cycles into the period.
+ * While it has budget left it waits on kt_dlq, which is kept in order
+ * of deadline, and runs ahead of every normal thread. A thread which
+ * runs out of budget has overrun: it is demoted to the normal class for
+ * the rest of the period. One which yields is done for the period and
+ * waits on kt_dlthrottleq until the next one starts. Periods are
+ * started by the clock tick, or when a sleeping thread wakes. Threads
+ * are only admitted while the deadline class as a whole reserves no
+ * more than SCHED_DL_UTIL_MAX of the CPU, so that every deadline can
+ * be met.
+ */
+static ktqueue_t kt_runq[SCHED_NLEVELS];
+static uint32_t kt_runq_levels;         /* bit n set if kt_runq[n] is not empty */
+static uint64_t kt_runq_boosted;        /* when every thread was last boosted */
+static int kt_runq_preempt;             /* curthr should give up the CPU */
 
-static ktqueue_t kt_runq;
+static ktqueue_t kt_dlq;                /* deadline threads with budget, earliest at the tail */
+static ktqueue_t kt_dlthrottleq;        /* deadline threads waiting for their next period */
+static list_t kt_dl_threads;            /* all threads in the deadline class */
+static uint32_t kt_dl_util;             /* the CPU they reserve, per mille */
 
 static __attribute__((unused)) void
 sched_init(void)
 {
-        sched_queue_init(&kt_runq);
+        int level;
+
+        KASSERT(SCHED_NLEVELS <= 32 && "one bit per level in kt_runq_levels");
+        KASSERT(sched_nice_level(PRIO_MAX) < SCHED_NLEVELS);
+        for (level = 0; level < SCHED_NLEVELS; ++level)
+                sched_queue_init(&kt_runq[level]);
+        kt_runq_levels = 0;
+        kt_runq_boosted = rdtsc();
+
+        sched_queue_init(&kt_dlq);
+        sched_queue_init(&kt_dlthrottleq);
+        list_init(&kt_dl_threads);
+        kt_dl_util = 0;
 }
 init_func(sched_init);
 
@@ -78,6 +134,193 @@ ktqueue_remove(ktqueue_t *q, kthread_t *thr)
         q->tq_size--;
 }
 
+/*** PRIVATE RUN QUEUE MANIPULATION FUNCTIONS ***/
+/* In the deadline class with budget left this period */
+static inline int
+dl_active(kthread_t *thr)
+{
+        return 0 != thr->kt_dl_runtime && 0 != thr->kt_dl_budget;
+}
+
+/* Per mille of the CPU a thread in the deadline class reserves */
+static inline uint32_t
+dl_util(uint64_t runtime, uint64_t deadline)
+{
+        return (uint32_t)((runtime * 1000 + deadline - 1) / deadline);
+}
+
+/* Queues a thread behind those with the same or an earlier deadline */
+static void
+dlq_enqueue(kthread_t *thr)
+{
+        list_link_t *link;
+
+        KASSERT(!thr->kt_wchan);
+        for (link = kt_dlq.tq_list.l_next; link != &kt_dlq.tq_list; link = link->l_next) {
+                if ((list_item(link, kthread_t, kt_qlink))->kt_dl_abs <= thr->kt_dl_abs)
+                        break;
+        }
+        list_insert_before(link, &thr->kt_qlink);
+        thr->kt_wchan = &kt_dlq;
+        kt_dlq.tq_size++;
+}
+
+/*
+ * Starts a new period for a deadline thread if the last one is over. A
+ * thread which has slept through whole periods starts a fresh one now.
+ * Returns true if a period was started.
+ */
+static int
+dl_replenish(kthread_t *thr, uint64_t now)
+{
+        uint64_t start;
+
+        if (0 == thr->kt_dl_runtime || now < thr->kt_dl_next)
+                return 0;
+        start = (now - thr->kt_dl_next < thr->kt_dl_period) ? thr->kt_dl_next : now;
+        thr->kt_dl_abs = start + thr->kt_dl_deadline;
+        thr->kt_dl_next = start + thr->kt_dl_period;
+        thr->kt_dl_budget = thr->kt_dl_runtime;
+        return 1;
+}
+
+static inline int
+runq_contains(kthread_t *thr)
+{
+        return (thr->kt_wchan >= &kt_runq[0] && thr->kt_wchan < &kt_runq[SCHED_NLEVELS])
+               || &kt_dlq == thr->kt_wchan;
+}
+
+static inline int
+runq_ready(void)
+{
+        return 0 != kt_runq_levels || !sched_queue_empty(&kt_dlq);
+}
+
+static void
+runq_enqueue(kthread_t *thr)
+{
+        if (dl_active(thr)) {
+                dlq_enqueue(thr);
+                return;
+        }
+        ktqueue_enqueue(&kt_runq[thr->kt_prio], thr);
+        kt_runq_levels |= 1U << thr->kt_prio;
+}
+
+static void
+runq_remove(kthread_t *thr)
+{
+        KASSERT(runq_contains(thr));
+        if (&kt_dlq == thr->kt_wchan) {
+                ktqueue_remove(&kt_dlq, thr);
+                return;
+        }
+        ktqueue_remove(&kt_runq[thr->kt_prio], thr);
+        if (sched_queue_empty(&kt_runq[thr->kt_prio]))
+                kt_runq_levels &= ~(1U << thr->kt_prio);
+}
+
+/*
+ * Takes the deadline thread with the earliest deadline, or else the
+ * thread which has waited longest at the highest level
+ */
+static kthread_t *
+runq_dequeue(void)
+{
+        int level;
+        kthread_t *thr;
+
+        if (!sched_queue_empty(&kt_dlq))
+                return ktqueue_dequeue(&kt_dlq);
+        KASSERT(0 != kt_runq_levels);
+        level = __builtin_ctz(kt_runq_levels);
+        thr = ktqueue_dequeue(&kt_runq[level]);
+        if (sched_queue_empty(&kt_runq[level]))
+                kt_runq_levels &= ~(1U << level);
+        return thr;
+}
+
+static inline int
+sched_base_level(kthread_t *thr)
+{
+        return sched_nice_level(thr->kt_proc->p_nice);
+}
+
+/* Slices are measured in TSC cycles, so that the time a thread runs
+ * between ticks counts too. Until the TSC has been calibrated against
+ * the clock there are no ticks, and no slice can run out. */
+static inline uint64_t
+sched_slice(int level)
+{
+        uint64_t tick = (uint64_t)TICK_MSECS * apic_tsc_khz();
+
+        if (0 == tick)
+                return (uint64_t)-1;
+        return (tick * SCHED_SLICE_TICKS) << (level >> 3);
+}
+
+/*
+ * Charges a thread for the time it has been running since it was last
+ * charged, and drops it a level if that uses up its slice. A deadline
+ * thread is charged against its budget instead while it has some, and
+ * demoted if that runs out. Returns true if the thread was dropped or
+ * demoted.
+ */
+static int
+sched_charge(kthread_t *thr, uint64_t now)
+{
+        uint64_t ran = now - thr->kt_oncpu;
+
+        thr->kt_oncpu = now;
+        if (dl_active(thr)) {
+                if (ran < thr->kt_dl_budget) {
+                        thr->kt_dl_budget -= ran;
+                        return 0;
+                }
+                thr->kt_dl_budget = 0;
+                thr->kt_dl_overruns++;
+                return 1;
+        }
+        thr->kt_slice_used += ran;
+        if (thr->kt_slice_used < sched_slice(thr->kt_prio))
+                return 0;
+        thr->kt_slice_used = 0;
+        if (thr->kt_prio < SCHED_NLEVELS - 1)
+                thr->kt_prio++;
+        return 1;
+}
+
+/* Whether a waiting thread should be running instead of thr */
+static int
+sched_outranked(kthread_t *thr)
+{
+        if (!sched_queue_empty(&kt_dlq)) {
+                return !dl_active(thr)
+                       || (list_tail(&kt_dlq.tq_list, kthread_t, kt_qlink))->kt_dl_abs < thr->kt_dl_abs;
+        }
+        return !dl_active(thr) && (kt_runq_levels & ((1U << thr->kt_prio) - 1));
+}
+
+/* Puts every waiting thread back at the level it started at */
+static void
+sched_boost_all(void)
+{
+        kthread_t *thr;
+        int level;
+
+        for (level = 1; level < SCHED_NLEVELS; ++level) {
+                list_iterate_begin(&kt_runq[level].tq_list, thr, kthread_t, kt_qlink) {
+                        if (sched_base_level(thr) != level) {
+                                runq_remove(thr);
+                                thr->kt_prio = sched_base_level(thr);
+                                thr->kt_slice_used = 0;
+                                runq_enqueue(thr);
+                        }
+                } list_iterate_end();
+        }
+}
+
 /*** PUBLIC KTQUEUE MANIPULATION FUNCTIONS ***/
 void
 sched_queue_init(ktqueue_t *q)
@@ -148,6 +391,76 @@ sched_cancel(struct kthread *kthr)
         return;
 }
 
+/*
+ * A timed sleep arms a timer on the sleeper's stack before it switches
+ * away. If the timer runs while the thread is still on the queue it
+ * takes it off and makes it runnable; if the thread has been woken
+ * already the timer finds it on the run queue and leaves it there. Either way
+ * the thread cancels the timer as soon as it runs again, before it can
+ * go to sleep anywhere else.
+ */
+typedef struct sched_timeout {
+        timer_t         st_timer;
+        kthread_t      *st_thr;
+        ktqueue_t      *st_q;
+        int             st_expired;
+} sched_timeout_t;
+
+static void
+sched_timeout_expire(timer_t *t)
+{
+        sched_timeout_t *st = t->t_data;
+
+        /* once woken the thread is on the run queue instead */
+        if (st->st_q == st->st_thr->kt_wchan) {
+                st->st_expired = 1;
+                sched_make_runnable(st->st_thr);
+        }
+}
+
+static int
+sched_timed_sleep(ktqueue_t *q, uint32_t ticks, kthread_state_t state)
+{
+        sched_timeout_t st;
+        uint8_t oIPL;
+
+        if (0 == ticks)
+                return -ETIMEDOUT;
+
+        timer_init(&st.st_timer, sched_timeout_expire, &st);
+        st.st_thr = curthr;
+        st.st_q = q;
+        st.st_expired = 0;
+
+        oIPL = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        curthr->kt_state = state;
+        ktqueue_enqueue(q, curthr);
+        timer_set(&st.st_timer, ticks);
+        intr_setipl(oIPL);
+
+        sched_switch();
+        timer_cancel(&st.st_timer);
+        return st.st_expired ? -ETIMEDOUT : 0;
+}
+
+int
+sched_sleep_on_timeout(ktqueue_t *q, uint32_t ticks)
+{
+        return sched_timed_sleep(q, ticks, KT_SLEEP);
+}
+
+int
+sched_cancellable_sleep_on_timeout(ktqueue_t *q, uint32_t ticks)
+{
+        int ret;
+
+        if (curthr->kt_cancelled)
+                return -EINTR;
+        ret = sched_timed_sleep(q, ticks, KT_SLEEP_CANCELLABLE);
+        return curthr->kt_cancelled ? -EINTR : ret;
+}
+
 /*
  * In this function, you will be modifying the run queue, which can
  * also be modified from an interrupt context. In order for thread
@@ -188,10 +501,28 @@ void
 sched_switch(void)
 {
     uint8_t orig_ipl = intr_getipl();
+    uint64_t now;
 
     intr_setipl(IPL_HIGH);
 
-    while (sched_queue_empty(&kt_runq)) {
+    /* a thread putting itself back on the run queue was charged then */
+    now = rdtsc();
+    if (!runq_contains(curthr))
+	sched_charge(curthr, now);
+    if (now - kt_runq_boosted >= SCHED_BOOST_CYCLES) {
+	sched_boost_all();
+	kt_runq_boosted = now;
+    }
+
+    while (!runq_ready()) {
+	/* Nothing to run: zero a page for the anonymous fault path, then
+	 * let any pending interrupts in before looking at the run queue
+	 * again. Only halt once the pool is full. */
+	if (page_zero_refill(1)) {
+		intr_setipl(IPL_LOW);
+		intr_setipl(IPL_HIGH);
+		continue;
+	}
       //    /* allow device interrupts */
 	intr_disable();
 	intr_setipl(IPL_LOW); 
@@ -200,12 +531,13 @@ sched_switch(void)
         intr_setipl(IPL_HIGH);/* protect runqueue again */
     } 
 	
-    KASSERT(!sched_queue_empty(&kt_runq));
-
     context_t *old_ctx = &curthr->kt_ctx;
-    curthr  = ktqueue_dequeue(&kt_runq);
+    curthr  = runq_dequeue();
     curproc = curthr->kt_proc;
+    curthr->kt_oncpu = rdtsc();
+    kt_runq_preempt = 0;
 
+    fpu_switch(curthr);
     context_switch(old_ctx, &curthr->kt_ctx);
 
     intr_setipl(orig_ipl);
@@ -232,7 +564,7 @@ sched_make_runnable(kthread_t *thr)
 
 	intr_setipl(IPL_HIGH);
 
-	KASSERT(&kt_runq != thr->kt_wchan);
+	KASSERT(!runq_contains(thr));
 	//dbg(DBG_PRINT, "(GRADING1A 5.a)\n");
 
 	// remove thread from whichever queue its blocked on	
@@ -242,11 +574,168 @@ sched_make_runnable(kthread_t *thr)
 	if(curproc->p_comm[0] == 'f'){
 		// dbg(DBG_PRINT,"(GRADING1C 7)\n");
 	}
+	if (KT_SLEEP == thr->kt_state || KT_SLEEP_CANCELLABLE == thr->kt_state) {
+		/* woken up: it has been waiting rather than computing */
+		thr->kt_prio = MAX(sched_base_level(thr), thr->kt_prio - SCHED_WAKE_BOOST);
+	} else if (thr == curthr) {
+		/* yielding: charge it before it goes back on */
+		sched_charge(thr, rdtsc());
+	}
+	dl_replenish(thr, rdtsc());
 	thr->kt_state = KT_RUN;
-	ktqueue_enqueue(&kt_runq, thr); //enqueue the thread
+	runq_enqueue(thr); //enqueue the thread
+
+	/* have the running thread make way on its way back to user mode */
+	if (thr != curthr && KT_RUN == curthr->kt_state && sched_outranked(curthr))
+		kt_runq_preempt = 1;
 
 	intr_setipl(oIPL);
         
 	return;
 }
 
+
+int
+sched_nice_level(int nice)
+{
+        nice = MAX(PRIO_MIN, MIN(PRIO_MAX, nice));
+        return (nice - PRIO_MIN) >> 1;
+}
+
+void
+sched_renice(proc_t *p, int nice)
+{
+        uint8_t oIPL = intr_getipl();
+        kthread_t *thr;
+
+        intr_setipl(IPL_HIGH);
+        p->p_nice = nice;
+        list_iterate_begin(&p->p_threads, thr, kthread_t, kt_plink) {
+                if (runq_contains(thr)) {
+                        runq_remove(thr);
+                        thr->kt_prio = sched_nice_level(nice);
+                        runq_enqueue(thr);
+                } else {
+                        thr->kt_prio = sched_nice_level(nice);
+                }
+                thr->kt_slice_used = 0;
+        } list_iterate_end();
+        intr_setipl(oIPL);
+}
+
+/*
+ * Called from the clock interrupt. The running thread is charged for
+ * the time since it was last charged, and asked to give up the CPU if
+ * that used up its slice or if a thread at a higher level is waiting.
+ * Time spent waiting for an interrupt in sched_switch is charged to no
+ * one.
+ */
+void
+sched_tick(void)
+{
+        uint64_t now = rdtsc();
+        int running = KT_RUN == curthr->kt_state && !runq_contains(curthr);
+        kthread_t *thr;
+
+        if (running && sched_charge(curthr, now))
+                kt_runq_preempt = 1;
+
+        /* start new periods for the deadline threads whose last one is
+         * over, releasing those which were done with it */
+        list_iterate_begin(&kt_dl_threads, thr, kthread_t, kt_dl_link) {
+                if (now < thr->kt_dl_next) {
+                        continue;
+                }
+                if (&kt_dlthrottleq == thr->kt_wchan) {
+                        sched_make_runnable(thr);
+                } else if (runq_contains(thr)) {
+                        runq_remove(thr);
+                        dl_replenish(thr, now);
+                        runq_enqueue(thr);
+                } else if (thr == curthr && running) {
+                        dl_replenish(thr, now);
+                }
+        } list_iterate_end();
+
+        if (running && sched_outranked(curthr))
+                kt_runq_preempt = 1;
+}
+
+void
+sched_preempt(void)
+{
+        if (kt_runq_preempt && KT_RUN == curthr->kt_state) {
+                sched_make_runnable(curthr);
+                sched_switch();
+        }
+}
+
+/*
+ * A deadline thread which yields is done with this period. It gives up
+ * what is left of its budget and does not run again until the next
+ * period starts.
+ */
+void
+sched_yield(void)
+{
+        uint8_t oIPL;
+
+        if (0 == curthr->kt_dl_runtime) {
+                sched_make_runnable(curthr);
+                sched_switch();
+                return;
+        }
+
+        oIPL = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        curthr->kt_dl_budget = 0;
+        curthr->kt_state = KT_SLEEP;
+        ktqueue_enqueue(&kt_dlthrottleq, curthr);
+        intr_setipl(oIPL);
+        sched_switch();
+}
+
+int
+sched_setdeadline(kthread_t *thr, uint64_t runtime, uint64_t deadline, uint64_t period)
+{
+        uint8_t oIPL;
+        uint32_t util = 0, old = 0;
+        int queued;
+
+        if (0 == deadline)
+                deadline = period;
+        if (0 != runtime || 0 != period) {
+                if (0 == runtime || runtime > deadline || deadline > period)
+                        return -EINVAL;
+                util = dl_util(runtime, deadline);
+        }
+
+        oIPL = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        if (0 != thr->kt_dl_runtime)
+                old = dl_util(thr->kt_dl_runtime, thr->kt_dl_deadline);
+        if (kt_dl_util - old + util > SCHED_DL_UTIL_MAX) {
+                intr_setipl(oIPL);
+                return -EBUSY;
+        }
+        kt_dl_util = kt_dl_util - old + util;
+
+        if (0 == thr->kt_dl_runtime && 0 != runtime)
+                list_insert_tail(&kt_dl_threads, &thr->kt_dl_link);
+        else if (0 != thr->kt_dl_runtime && 0 == runtime)
+                list_remove(&thr->kt_dl_link);
+
+        if ((queued = runq_contains(thr)))
+                runq_remove(thr);
+        thr->kt_dl_runtime = runtime;
+        thr->kt_dl_deadline = (0 != runtime) ? deadline : 0;
+        thr->kt_dl_period = (0 != runtime) ? period : 0;
+        thr->kt_dl_budget = runtime;
+        thr->kt_dl_next = rdtsc();
+        thr->kt_dl_overruns = 0;
+        dl_replenish(thr, thr->kt_dl_next);
+        if (queued)
+                runq_enqueue(thr);
+        intr_setipl(oIPL);
+        return 0;
+}
@@ -0,0 +1,18 @@
+#include "types.h"
+
+#include "test/bench.h"
+
+static uint32_t bench_seed;
+
+void
+bench_srand(uint32_t seed)
+{
+        bench_seed = seed;
+}
+
+uint32_t
+bench_rand(void)
+{
+        bench_seed = bench_seed * 1103515245 + 12345;
+        return bench_seed >> 8;
+}
@@ -0,0 +1,155 @@
+/*
+ * Evaluates page replacement: streams repeatedly through a large file while
+ * touching a small hot file at regular intervals, and keeps the combined
+ * resident size of the two files under a fixed budget by running the
+ * reclaim clock by hand. A good policy keeps the hot set resident and lets
+ * the stream pages go; a FIFO or poor LRU approximation evicts hot pages
+ * as the stream washes over them.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "fs/fcntl.h"
+#include "fs/file.h"
+#include "fs/lseek.h"
+#include "fs/open.h"
+#include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+#define CLOCK_HOT_PAGES         16
+#define CLOCK_STREAM_PAGES      512
+#define CLOCK_BUDGET            96      /* resident pages allowed to both files */
+#define CLOCK_PASSES            4
+#define CLOCK_HOT_INTERVAL      4       /* stream pages read per hot page read */
+
+#define CLOCK_HOT_PATH          "/clock_hot"
+#define CLOCK_STREAM_PATH       "/clock_stream"
+
+static int
+clock_bench_mkfile(const char *path, uint32_t npages, char *buf)
+{
+        uint32_t i;
+        int fd, ret = 0;
+
+        if (0 > (fd = do_open(path, O_RDWR | O_CREAT)))
+                return fd;
+        for (i = 0; i < npages; ++i) {
+                memset(buf, (int)i, PAGE_SIZE);
+                if (0 > (ret = do_write(fd, buf, PAGE_SIZE)))
+                        break;
+        }
+        do_close(fd);
+        return (0 > ret) ? ret : 0;
+}
+
+static int
+clock_bench_read(int fd, uint32_t pagenum, char *buf)
+{
+        int ret;
+        if (0 > (ret = do_lseek(fd, pagenum * PAGE_SIZE, SEEK_SET)))
+                return ret;
+        return do_read(fd, buf, PAGE_SIZE);
+}
+
+static uint32_t
+clock_bench_resident(int fd)
+{
+        file_t *f = fget(fd);
+        uint32_t nres;
+
+        KASSERT(NULL != f);
+        nres = f->f_vnode->vn_nrespages;
+        fput(f);
+        return nres;
+}
+
+static int
+clock_bench(kshell_t *ksh, int argc, char **argv)
+{
+        pframe_stats_t before, after, hot_before, hot_after;
+        uint32_t pass, i, hot_reads = 0, hot_misses = 0;
+        int hotfd = -1, streamfd = -1, ret;
+        char *buf;
+
+        if (NULL == (buf = kmalloc(PAGE_SIZE)))
+                return -ENOMEM;
+
+        if (0 > (ret = clock_bench_mkfile(CLOCK_HOT_PATH, CLOCK_HOT_PAGES, buf))
+            || 0 > (ret = clock_bench_mkfile(CLOCK_STREAM_PATH, CLOCK_STREAM_PAGES, buf))) {
+                kprintf(ksh, "clock_bench: could not create files: %d\n", ret);
+                goto out;
+        }
+        if (0 > (ret = hotfd = do_open(CLOCK_HOT_PATH, O_RDONLY))
+            || 0 > (ret = streamfd = do_open(CLOCK_STREAM_PATH, O_RDONLY))) {
+                goto out;
+        }
+
+        pframe_get_stats(&before);
+        for (pass = 0; pass < CLOCK_PASSES; ++pass) {
+                for (i = 0; i < CLOCK_STREAM_PAGES; ++i) {
+                        if (0 > (ret = clock_bench_read(streamfd, i, buf)))
+                                goto out;
+
+                        if (0 == i % CLOCK_HOT_INTERVAL) {
+                                pframe_get_stats(&hot_before);
+                                ret = clock_bench_read(hotfd, hot_reads % CLOCK_HOT_PAGES, buf);
+                                if (0 > ret)
+                                        goto out;
+                                pframe_get_stats(&hot_after);
+                                hot_reads++;
+                                if (hot_after.ps_misses != hot_before.ps_misses)
+                                        hot_misses++;
+                        }
+
+                        while (clock_bench_resident(hotfd) + clock_bench_resident(streamfd)
+                               > CLOCK_BUDGET) {
+                                if (0 == pframe_reclaim(1))
+                                        break;
+                        }
+                }
+        }
+        pframe_get_stats(&after);
+
+        /* The first touch of each hot page always misses */
+        kprintf(ksh, "hot set: %u reads, %u misses (%u compulsory)\n",
+                hot_reads, hot_misses, CLOCK_HOT_PAGES);
+        kprintf(ksh, "page cache: %u hits, %u misses, hit rate %u%%\n",
+                after.ps_hits - before.ps_hits, after.ps_misses - before.ps_misses,
+                (100 * (after.ps_hits - before.ps_hits))
+                / MAX(1, (after.ps_hits - before.ps_hits) + (after.ps_misses - before.ps_misses)));
+        kprintf(ksh, "clock: %u evictions, %u second chances\n",
+                after.ps_evictions - before.ps_evictions,
+                after.ps_second_chances - before.ps_second_chances);
+        ret = 0;
+
+out:
+        if (0 <= hotfd)
+                do_close(hotfd);
+        if (0 <= streamfd)
+                do_close(streamfd);
+        do_unlink(CLOCK_HOT_PATH);
+        do_unlink(CLOCK_STREAM_PATH);
+        kfree(buf);
+        return ret;
+}
+
+static __attribute__((unused)) void
+clock_bench_init(void)
+{
+        kshell_add_command("clock_bench", clock_bench,
+                           "measure hot-set retention while streaming a file");
+}
+init_func(clock_bench_init);
+init_depends(kshell_init);
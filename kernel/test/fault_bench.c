@@ -0,0 +1,145 @@
+/*
+ * Counts the page faults taken by a sequential read of a mapped file whose
+ * pages are all in the page cache, for several fault-around windows. The
+ * file is mapped into the shell's own address space and read from here;
+ * like the processor, the loop only enters the fault handler for pages
+ * which are not mapped yet, so the number of calls is the number of traps
+ * a user program reading the same mapping would take.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "config.h"
+
+#include "fs/fcntl.h"
+#include "fs/open.h"
+#include "fs/vfs_syscall.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mman.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+#include "vm/mmap.h"
+#include "vm/pagefault.h"
+
+#define FAULT_BENCH_PAGES       256     /* 1MB */
+#define FAULT_BENCH_PATH        "/fault_bench"
+
+static const uint32_t fault_bench_windows[] = { 1, 4, 16, 64 };
+
+/* Creates the file, with the page number in every word, and reads it
+ * back so that all of it is resident. */
+static int
+fault_bench_mkfile(char *buf)
+{
+        uint32_t i, j;
+        int fd, ret = 0;
+
+        if (0 > (fd = do_open(FAULT_BENCH_PATH, O_RDWR | O_CREAT)))
+                return fd;
+        for (i = 0; i < FAULT_BENCH_PAGES && 0 <= ret; ++i) {
+                for (j = 0; j < PAGE_SIZE / sizeof(uint32_t); ++j)
+                        ((uint32_t *)buf)[j] = i;
+                ret = do_write(fd, buf, PAGE_SIZE);
+        }
+        do_close(fd);
+        if (0 > ret)
+                return ret;
+
+        if (0 > (fd = do_open(FAULT_BENCH_PATH, O_RDONLY)))
+                return fd;
+        while (0 < (ret = do_read(fd, buf, PAGE_SIZE)))
+                ;
+        do_close(fd);
+        return ret;
+}
+
+static int
+fault_bench_run(kshell_t *ksh, uint32_t window)
+{
+        pagefault_stats_t before, after;
+        uint64_t start, cycles;
+        uintptr_t base, vaddr;
+        void *addr;
+        uint32_t i;
+        int fd, ret;
+
+        if (0 > (fd = do_open(FAULT_BENCH_PATH, O_RDONLY)))
+                return fd;
+        ret = do_mmap(NULL, FAULT_BENCH_PAGES * PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0, &addr);
+        do_close(fd);
+        if (0 > ret)
+                return ret;
+        base = (uintptr_t)addr;
+
+        pagefault_set_around(window);
+        pagefault_get_stats(&before);
+        start = rdtsc();
+        for (i = 0; i < FAULT_BENCH_PAGES; ++i) {
+                vaddr = base + i * PAGE_SIZE;
+                if (!pt_is_mapped(curproc->p_pagedir, vaddr))
+                        handle_pagefault(vaddr, FAULT_USER);
+                if (i != *(volatile uint32_t *)vaddr)
+                        panic("fault_bench: page %u of the mapping holds %u\n",
+                              i, *(uint32_t *)vaddr);
+        }
+        cycles = rdtsc() - start;
+        pagefault_get_stats(&after);
+
+        kprintf(ksh, "window %2u: %4u faults, %4u pages mapped around, %6u cycles/page\n",
+                window, after.pfs_faults - before.pfs_faults,
+                after.pfs_around - before.pfs_around,
+                (uint32_t)(cycles / FAULT_BENCH_PAGES));
+
+        return do_munmap(addr, FAULT_BENCH_PAGES * PAGE_SIZE);
+}
+
+static int
+fault_bench(kshell_t *ksh, int argc, char **argv)
+{
+        uint32_t saved, i;
+        char *buf;
+        int ret;
+
+        if (NULL == (buf = kmalloc(PAGE_SIZE)))
+                return -ENOMEM;
+        if (0 > (ret = fault_bench_mkfile(buf))) {
+                kprintf(ksh, "fault_bench: could not create file: %d\n", ret);
+                goto out;
+        }
+
+        kprintf(ksh, "sequential read of %u cached pages through a private mapping\n",
+                FAULT_BENCH_PAGES);
+        saved = pagefault_set_around(PAGEFAULT_AROUND_PAGES);
+        for (i = 0; i < sizeof(fault_bench_windows) / sizeof(fault_bench_windows[0]); ++i) {
+                if (0 > (ret = fault_bench_run(ksh, fault_bench_windows[i]))) {
+                        kprintf(ksh, "fault_bench: mapping failed: %d\n", ret);
+                        break;
+                }
+        }
+        pagefault_set_around(saved);
+
+out:
+        do_unlink(FAULT_BENCH_PATH);
+        kfree(buf);
+        return ret;
+}
+
+static __attribute__((unused)) void
+fault_bench_init(void)
+{
+        kshell_add_command("fault_bench", fault_bench,
+                           "count faults reading a cached file mapping with fault-around");
+}
+init_func(fault_bench_init);
+init_depends(kshell_init);
@@ -0,0 +1,167 @@
+/*
+ * Times kernel stack allocation the way fork does it, against the single
+ * physically contiguous block alloc_stack used to take from the page
+ * allocator. Each round allocates a stack together with a few single
+ * pages, as a forked process also takes page tables and pages of its
+ * own, and keeps half of those pages when the stacks are freed in
+ * batches, as a chain of forking processes would leave them. What is
+ * left afterwards is counted in runs of 16 free pages, the block a
+ * contiguous stack needs. Creating and reaping whole processes with
+ * kernel threads is timed as well.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+#define KSTACK_BENCH_STACKS     256
+#define KSTACK_BENCH_BATCH      16      /* stacks freed together */
+#define KSTACK_BENCH_PAGES      4       /* single pages taken per stack */
+#define KSTACK_BENCH_THREADS    200
+#define KSTACK_BENCH_RUN_ORDER  4       /* 16 pages, room for a 15 page stack */
+
+/* The stack alloc_stack used to allocate */
+#define KSTACK_BENCH_OLD_PAGES  (1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT))
+
+/* Free runs of 1 << KSTACK_BENCH_RUN_ORDER pages */
+static uint32_t
+kstack_bench_runs(void)
+{
+        uint32_t order, runs = 0;
+
+        for (order = KSTACK_BENCH_RUN_ORDER; order < PAGE_NSIZES; ++order)
+                runs += page_free_blocks(order) << (order - KSTACK_BENCH_RUN_ORDER);
+        return runs;
+}
+
+static int
+kstack_bench_churn(kshell_t *ksh, int pooled)
+{
+        char *stacks[KSTACK_BENCH_BATCH];
+        void **held;
+        uint64_t start, acycles = 0, fcycles = 0;
+        uint32_t runs_before = kstack_bench_runs(), runs_after;
+        int i, j, n, nheld = 0, failed = 0;
+        void *page;
+
+        if (NULL == (held = kmalloc(KSTACK_BENCH_STACKS * KSTACK_BENCH_PAGES * sizeof(*held))))
+                return -ENOMEM;
+
+        for (i = 0; i < KSTACK_BENCH_STACKS; i += KSTACK_BENCH_BATCH) {
+                for (n = 0; n < KSTACK_BENCH_BATCH; ++n) {
+                        start = rdtsc();
+                        stacks[n] = pooled ? kstack_alloc(KSTACK_USER)
+                                    : page_alloc_n(KSTACK_BENCH_OLD_PAGES);
+                        acycles += rdtsc() - start;
+                        if (NULL == stacks[n]) {
+                                failed++;
+                                break;
+                        }
+                        for (j = 0; j < KSTACK_BENCH_PAGES; ++j) {
+                                if (NULL == (page = page_alloc()))
+                                        break;
+                                /* every other page outlives the process */
+                                if (j & 1)
+                                        held[nheld++] = page;
+                                else
+                                        page_free(page);
+                        }
+                }
+                while (n-- > 0) {
+                        start = rdtsc();
+                        if (pooled)
+                                kstack_free(stacks[n], KSTACK_USER);
+                        else
+                                page_free_n(stacks[n], KSTACK_BENCH_OLD_PAGES);
+                        fcycles += rdtsc() - start;
+                }
+        }
+        runs_after = kstack_bench_runs();
+
+        while (nheld > 0)
+                page_free(held[--nheld]);
+        kfree(held);
+
+        kprintf(ksh, "%-10s alloc %6u cycles, free %6u cycles, %u failed, "
+                "16 page runs %u -> %u\n", pooled ? "pool" : "contiguous",
+                (uint32_t)(acycles / KSTACK_BENCH_STACKS), (uint32_t)(fcycles / KSTACK_BENCH_STACKS),
+                failed, runs_before, runs_after);
+        return 0;
+}
+
+static void *
+kstack_bench_thread(int arg1, void *arg2)
+{
+        return NULL;
+}
+
+static int
+kstack_bench_threads(kshell_t *ksh)
+{
+        kstack_stats_t before, after;
+        uint64_t start, cycles;
+        kthread_t *thr;
+        proc_t *p;
+        int i, status;
+
+        kstack_get_stats(&before);
+        start = rdtsc();
+        for (i = 0; i < KSTACK_BENCH_THREADS; ++i) {
+                if (NULL == (p = proc_create("kstack_bench")))
+                        return -ENOMEM;
+                if (NULL == (thr = kthread_create_class(p, kstack_bench_thread, 0, NULL,
+                                                        KSTACK_USER)))
+                        panic("kstack_bench: no stack for a thread\n");
+                sched_make_runnable(thr);
+                do_waitpid(p->p_pid, 0, &status);
+        }
+        cycles = rdtsc() - start;
+        kstack_get_stats(&after);
+
+        kprintf(ksh, "process create+reap %u cycles, stacks from cache %u, newly mapped %u\n",
+                (uint32_t)(cycles / KSTACK_BENCH_THREADS), after.kss_hits - before.kss_hits,
+                after.kss_misses - before.kss_misses);
+        return 0;
+}
+
+static int
+kstack_bench(kshell_t *ksh, int argc, char **argv)
+{
+        kstack_stats_t stats;
+        int ret;
+
+        if (0 > (ret = kstack_bench_churn(ksh, 0))
+            || 0 > (ret = kstack_bench_churn(ksh, 1))
+            || 0 > (ret = kstack_bench_threads(ksh))) {
+                kprintf(ksh, "kstack_bench: out of memory\n");
+                return ret;
+        }
+
+        kstack_get_stats(&stats);
+        kprintf(ksh, "stacks in use %u, cached %u, failed allocations %u\n",
+                stats.kss_inuse, stats.kss_cached, stats.kss_failed);
+        return 0;
+}
+
+static __attribute__((unused)) void
+kstack_bench_init(void)
+{
+        kshell_add_command("kstack_bench", kstack_bench,
+                           "time kernel stack allocation and count the free runs it leaves");
+}
+init_func(kstack_bench_init);
+init_depends(kshell_init);
@@ -0,0 +1,133 @@
+/*
+ * Stress test and benchmark for the page allocator. Keeps a pool of up to
+ * PAGE_BENCH_LIVE live blocks and randomly allocates or frees one at a
+ * time; most requests are single pages (through page_alloc/page_free, as
+ * pframes and page tables use them) and the rest are blocks of 2 to 32
+ * pages (through page_alloc_n, as slabs use them). Every block is checked
+ * for overlap with the others when it is allocated, and the free page
+ * count must come back to where it started once everything is freed.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+#include "test/bench.h"
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+#define PAGE_BENCH_OPS          200000
+#define PAGE_BENCH_LIVE         1024
+#define PAGE_BENCH_MAX_ORDER    5
+#define PAGE_BENCH_HIGH_PCT     20      /* percent of requests above order 0 */
+
+typedef struct page_bench_block {
+        uintptr_t       pbb_addr;
+        uint32_t        pbb_npages;
+} page_bench_block_t;
+
+/* Panics if [addr, addr + npages pages) overlaps any of the live blocks */
+static void
+page_bench_check(page_bench_block_t *live, int nlive, uintptr_t addr, uint32_t npages)
+{
+        uintptr_t end = addr + npages * PAGE_SIZE;
+        int i;
+
+        KASSERT(0 == (addr & ((npages * PAGE_SIZE) - 1)) && "misaligned block");
+        for (i = 0; i < nlive; ++i) {
+                uintptr_t lend = live[i].pbb_addr + live[i].pbb_npages * PAGE_SIZE;
+                if (addr < lend && live[i].pbb_addr < end)
+                        panic("page_bench: block 0x%p (%u pages) overlaps 0x%p (%u pages)\n",
+                              (void *)addr, npages, (void *)live[i].pbb_addr, live[i].pbb_npages);
+        }
+}
+
+static int
+page_bench(kshell_t *ksh, int argc, char **argv)
+{
+        page_bench_block_t *live;
+        uint32_t nfree_before = page_free_count();
+        uint32_t allocs[2] = { 0, 0 }, failures = 0;
+        uint64_t cycles[2] = { 0, 0 }, frees_cycles = 0, start;
+        uint32_t frees = 0;
+        int nlive = 0, i;
+
+        if (NULL == (live = kmalloc(PAGE_BENCH_LIVE * sizeof(*live))))
+                return -ENOMEM;
+        /* kmalloc may have taken pages itself */
+        nfree_before = page_free_count();
+
+        bench_srand(1);
+        for (i = 0; i < PAGE_BENCH_OPS; ++i) {
+                if (nlive == PAGE_BENCH_LIVE || (nlive > 0 && (bench_rand() & 1))) {
+                        int victim = bench_rand() % nlive;
+                        page_bench_block_t b = live[victim];
+                        live[victim] = live[--nlive];
+
+                        start = rdtsc();
+                        if (1 == b.pbb_npages)
+                                page_free((void *)b.pbb_addr);
+                        else
+                                page_free_n((void *)b.pbb_addr, b.pbb_npages);
+                        frees_cycles += rdtsc() - start;
+                        frees++;
+                } else {
+                        int high = (bench_rand() % 100) < PAGE_BENCH_HIGH_PCT;
+                        uint32_t npages = high ? 1 << (1 + bench_rand() % PAGE_BENCH_MAX_ORDER) : 1;
+                        void *addr;
+
+                        start = rdtsc();
+                        addr = high ? page_alloc_n(npages) : page_alloc();
+                        cycles[high] += rdtsc() - start;
+                        if (NULL == addr) {
+                                failures++;
+                                continue;
+                        }
+                        allocs[high]++;
+
+                        page_bench_check(live, nlive, (uintptr_t)addr, npages);
+                        live[nlive].pbb_addr = (uintptr_t)addr;
+                        live[nlive].pbb_npages = npages;
+                        nlive++;
+                }
+        }
+
+        while (nlive > 0) {
+                --nlive;
+                if (1 == live[nlive].pbb_npages)
+                        page_free((void *)live[nlive].pbb_addr);
+                else
+                        page_free_n((void *)live[nlive].pbb_addr, live[nlive].pbb_npages);
+        }
+        kfree(live);
+
+        kprintf(ksh, "order 0:    %u allocs, %u cycles/alloc\n", allocs[0],
+                (uint32_t)(cycles[0] / MAX(1, allocs[0])));
+        kprintf(ksh, "order 1-%d:  %u allocs, %u cycles/alloc\n", PAGE_BENCH_MAX_ORDER,
+                allocs[1], (uint32_t)(cycles[1] / MAX(1, allocs[1])));
+        kprintf(ksh, "frees:      %u, %u cycles/free\n", frees,
+                (uint32_t)(frees_cycles / MAX(1, frees)));
+        kprintf(ksh, "failed allocs: %u\n", failures);
+
+        if (page_free_count() < nfree_before) {
+                kprintf(ksh, "page_bench: leaked %u pages\n", nfree_before - page_free_count());
+                return -EFAULT;
+        }
+        return 0;
+}
+
+static __attribute__((unused)) void
+page_bench_init(void)
+{
+        kshell_add_command("page_bench", page_bench,
+                           "stress the page allocator with mixed-order requests");
+}
+init_func(page_bench_init);
+init_depends(kshell_init);
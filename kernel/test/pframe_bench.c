@@ -0,0 +1,139 @@
+/*
+ * Measures the cost of looking up a resident page by (object, page number)
+ * with the per-object radix tree used by pframe_get_resident() and with the
+ * fixed-size global hash it replaced. Each run populates one object with
+ * N pages and performs random lookups against it.
+ *
+ * The pframes used here are dummies: they are never given page frames or
+ * put on any paging list, so the benchmark can be run with far more
+ * "resident" pages than there is physical memory.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "test/bench.h"
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/radix.h"
+
+#define BENCH_LOOKUPS           100000
+#define BENCH_OLD_HASH_SIZE     17      /* the old PF_HASH_SIZE */
+
+#define old_hash_page(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
+                                      % BENCH_OLD_HASH_SIZE)
+
+static slab_allocator_t *bench_pframe_allocator = NULL;
+
+static pframe_t *
+old_hash_lookup(list_t *hash, mmobj_t *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+        list_iterate_begin(&hash[old_hash_page(o, pagenum)], pf, pframe_t, pf_hlink) {
+                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum))
+                        return pf;
+        } list_iterate_end();
+        return NULL;
+}
+
+static int
+pframe_bench_run(kshell_t *ksh, uint32_t npages)
+{
+        static list_t hash[BENCH_OLD_HASH_SIZE];
+        mmobj_t *o = (mmobj_t *)&hash;  /* any unique address will do */
+        radix_tree_t tree;
+        pframe_t **pages;
+        uint64_t start, radix_cycles, hash_cycles;
+        uint32_t i, n, found = 0;
+        int ret = 0;
+
+        if (NULL == (pages = kmalloc(npages * sizeof(*pages))))
+                return -ENOMEM;
+
+        for (i = 0; i < BENCH_OLD_HASH_SIZE; ++i)
+                list_init(&hash[i]);
+        radix_tree_init(&tree);
+
+        for (i = 0; i < npages; ++i) {
+                if (NULL == (pages[i] = slab_obj_alloc(bench_pframe_allocator))) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+                pages[i]->pf_obj = o;
+                pages[i]->pf_pagenum = i;
+                list_insert_head(&hash[old_hash_page(o, i)], &pages[i]->pf_hlink);
+                if (0 > (ret = radix_insert(&tree, i, pages[i]))) {
+                        list_remove(&pages[i]->pf_hlink);
+                        slab_obj_free(bench_pframe_allocator, pages[i]);
+                        goto out;
+                }
+        }
+
+        bench_srand(npages);
+        start = rdtsc();
+        for (n = 0; n < BENCH_LOOKUPS; ++n)
+                found += (NULL != radix_lookup(&tree, bench_rand() % npages));
+        radix_cycles = rdtsc() - start;
+
+        bench_srand(npages);
+        start = rdtsc();
+        for (n = 0; n < BENCH_LOOKUPS; ++n)
+                found += (NULL != old_hash_lookup(hash, o, bench_rand() % npages));
+        hash_cycles = rdtsc() - start;
+
+        KASSERT(2 * BENCH_LOOKUPS == found);
+        kprintf(ksh, "%6u pages: radix %6u cycles/lookup, hash(%d) %8u cycles/lookup\n",
+                npages, (uint32_t)(radix_cycles / BENCH_LOOKUPS),
+                BENCH_OLD_HASH_SIZE, (uint32_t)(hash_cycles / BENCH_LOOKUPS));
+
+out:
+        while (i-- > 0) {
+                radix_remove(&tree, i);
+                list_remove(&pages[i]->pf_hlink);
+                slab_obj_free(bench_pframe_allocator, pages[i]);
+        }
+        KASSERT(radix_tree_empty(&tree));
+        kfree(pages);
+        return ret;
+}
+
+static int
+pframe_bench(kshell_t *ksh, int argc, char **argv)
+{
+        static const uint32_t sizes[] = { 1000, 10000, 50000 };
+        unsigned int i;
+        int ret;
+
+        if (NULL == bench_pframe_allocator) {
+                bench_pframe_allocator = slab_allocator_create("pframe_bench",
+                                         sizeof(pframe_t));
+                KASSERT(NULL != bench_pframe_allocator);
+        }
+
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+                if (0 > (ret = pframe_bench_run(ksh, sizes[i]))) {
+                        kprintf(ksh, "%u pages: out of memory\n", sizes[i]);
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+static __attribute__((unused)) void
+pframe_bench_init(void)
+{
+        kshell_add_command("pframe_bench", pframe_bench,
+                           "time resident page lookups at 1K/10K/50K pages");
+}
+init_func(pframe_bench_init);
+init_depends(kshell_init);
@@ -0,0 +1,171 @@
+/*
+ * Times creating, running and reaping a short-lived process with 100,
+ * 1000 and 5000 other processes alive, reaping it both by pid and with
+ * a wait for any child, and times proc_lookup against a walk over the
+ * process list like the one it used to do. The other processes are
+ * children of the shell which never get a thread; they only hold pids,
+ * take up room in the process list and hash, and sit on the shell's
+ * list of children alongside the one being reaped.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "fs/vnode.h"
+
+#include "test/bench.h"
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+#include "vm/vmmap.h"
+
+#define PID_BENCH_ROUNDS        200
+#define PID_BENCH_LOOKUPS       4096
+
+static const uint32_t pid_bench_sizes[] = { 100, 1000, 5000 };
+
+/* The list walk proc_lookup used to do */
+static proc_t *
+linear_lookup(pid_t pid)
+{
+        proc_t *p;
+
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (p->p_pid == pid)
+                        return p;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void *
+pid_bench_exit(int arg1, void *arg2)
+{
+        return NULL;
+}
+
+/* Creates, runs and reaps one process, by its pid or as any child */
+static int
+pid_bench_round(int by_pid)
+{
+        kthread_t *thr;
+        proc_t *p;
+        pid_t pid;
+        int status;
+
+        if (NULL == (p = proc_create("pid_bench")))
+                return -ENOMEM;
+        if (NULL == (thr = kthread_create(p, pid_bench_exit, 0, NULL)))
+                panic("pid_bench: no thread for a process\n");
+        pid = p->p_pid;
+        sched_make_runnable(thr);
+        if (pid != do_waitpid(by_pid ? pid : -1, 0, &status))
+                panic("pid_bench: reaped the wrong process\n");
+        return 0;
+}
+
+/* Gets rid of a process which never had a thread */
+static void
+pid_bench_discard(proc_t *p)
+{
+        int status;
+
+        p->p_state = PROC_DEAD;
+        vmmap_destroy(p->p_vmmap);
+        p->p_vmmap = NULL;
+        if (NULL != p->p_cwd) {
+                vput(p->p_cwd);
+                p->p_cwd = NULL;
+        }
+        do_waitpid(p->p_pid, 0, &status);
+}
+
+static int
+pid_bench_run(kshell_t *ksh, uint32_t n)
+{
+        uint64_t start, bypid = 0, any = 0, hashed = 0, linear = 0;
+        proc_t **idle;
+        uint32_t i, live = 0;
+        pid_t pid;
+        int ret = 0;
+
+        if (NULL == (idle = kmalloc(n * sizeof(*idle))))
+                return -ENOMEM;
+        for (live = 0; live < n; ++live) {
+                if (NULL == (idle[live] = proc_create("pid_bench_idle"))) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+        }
+
+        for (i = 0; i < PID_BENCH_ROUNDS; ++i) {
+                start = rdtsc();
+                if (0 > (ret = pid_bench_round(1)))
+                        goto out;
+                bypid += rdtsc() - start;
+
+                start = rdtsc();
+                if (0 > (ret = pid_bench_round(0)))
+                        goto out;
+                any += rdtsc() - start;
+        }
+
+        bench_srand(n);
+        for (i = 0; i < PID_BENCH_LOOKUPS; ++i) {
+                pid = idle[bench_rand() % n]->p_pid;
+                start = rdtsc();
+                if (NULL == proc_lookup(pid))
+                        panic("pid_bench: lost pid %d\n", pid);
+                hashed += rdtsc() - start;
+                start = rdtsc();
+                if (NULL == linear_lookup(pid))
+                        panic("pid_bench: lost pid %d\n", pid);
+                linear += rdtsc() - start;
+        }
+
+        kprintf(ksh, "%4u live: create+exit+waitpid %7u cycles, +wait %7u, "
+                "lookup %4u (list walk %6u)\n", n,
+                (uint32_t)(bypid / PID_BENCH_ROUNDS), (uint32_t)(any / PID_BENCH_ROUNDS),
+                (uint32_t)(hashed / PID_BENCH_LOOKUPS), (uint32_t)(linear / PID_BENCH_LOOKUPS));
+
+out:
+        while (live > 0)
+                pid_bench_discard(idle[--live]);
+        kfree(idle);
+        return ret;
+}
+
+static int
+pid_bench(kshell_t *ksh, int argc, char **argv)
+{
+        uint32_t i;
+        int ret;
+
+        for (i = 0; i < sizeof(pid_bench_sizes) / sizeof(pid_bench_sizes[0]); ++i) {
+                if (0 > (ret = pid_bench_run(ksh, pid_bench_sizes[i]))) {
+                        kprintf(ksh, "pid_bench: out of memory with %u processes\n",
+                                pid_bench_sizes[i]);
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+static __attribute__((unused)) void
+pid_bench_init(void)
+{
+        kshell_add_command("pid_bench", pid_bench,
+                           "time process creation and reaping among many live processes");
+}
+init_func(pid_bench_init);
+init_depends(kshell_init);
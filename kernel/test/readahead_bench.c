@@ -0,0 +1,146 @@
+/*
+ * Reads a file on disk0 a page at a time, sequentially and at random, with
+ * readahead turned off and on. The file's pages are evicted from the page
+ * cache before every run so that each one starts from the disk. A page
+ * cache miss means read(2) had to wait for the disk itself; with readahead
+ * a sequential reader should find nearly every page already read in (or
+ * on its way in), while a random reader should see readahead back off and
+ * read nothing it does not use.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "fs/fcntl.h"
+#include "fs/file.h"
+#include "fs/lseek.h"
+#include "fs/open.h"
+#include "fs/readahead.h"
+#include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "proc/sched.h"
+
+#include "test/bench.h"
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+#define RA_BENCH_PAGES          512     /* 2MB */
+#define RA_BENCH_PATH           "/readahead_bench"
+
+/* Writes back and frees every resident page of the file */
+static void
+ra_bench_evict(int fd)
+{
+        file_t *f = fget(fd);
+        mmobj_t *o = &f->f_vnode->vn_mmobj;
+        pframe_t *pf;
+
+        while (!list_empty(&o->mmo_respages)) {
+                pf = list_head(&o->mmo_respages, pframe_t, pf_olink);
+                if (pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                } else if (pframe_is_pinned(pf)) {
+                        break;
+                } else if (pframe_is_dirty(pf)) {
+                        pframe_clean(pf);
+                } else {
+                        pframe_free(pf);
+                }
+        }
+        fput(f);
+}
+
+static int
+ra_bench_run(kshell_t *ksh, int fd, char *buf, int random, int enabled)
+{
+        pframe_stats_t before, after;
+        readahead_stats_t rbefore, rafter;
+        uint64_t start, cycles = 0;
+        uint32_t i, pagenum;
+        int ret;
+
+        ra_bench_evict(fd);
+        readahead_set_enabled(enabled);
+        bench_srand(1);
+
+        pframe_get_stats(&before);
+        readahead_get_stats(&rbefore);
+        for (i = 0; i < RA_BENCH_PAGES; ++i) {
+                pagenum = random ? bench_rand() % RA_BENCH_PAGES : i;
+                start = rdtsc();
+                if (0 > (ret = do_lseek(fd, pagenum * PAGE_SIZE, SEEK_SET))
+                    || 0 > (ret = do_read(fd, buf, PAGE_SIZE))) {
+                        readahead_set_enabled(1);
+                        return ret;
+                }
+                cycles += rdtsc() - start;
+        }
+        pframe_get_stats(&after);
+        readahead_get_stats(&rafter);
+        readahead_set_enabled(1);
+
+        kprintf(ksh, "%-10s readahead %-3s %8u cycles/page, %4u cache misses, "
+                "%4u pages read ahead\n", random ? "random" : "sequential",
+                enabled ? "on" : "off", (uint32_t)(cycles / RA_BENCH_PAGES),
+                after.ps_misses - before.ps_misses, rafter.ras_pages - rbefore.ras_pages);
+        return 0;
+}
+
+static int
+readahead_bench(kshell_t *ksh, int argc, char **argv)
+{
+        int fd = -1, ret = 0, random, enabled;
+        uint32_t i;
+        char *buf;
+
+        if (NULL == (buf = kmalloc(PAGE_SIZE)))
+                return -ENOMEM;
+
+        if (0 > (ret = fd = do_open(RA_BENCH_PATH, O_RDWR | O_CREAT)))
+                goto out;
+        for (i = 0; i < RA_BENCH_PAGES; ++i) {
+                memset(buf, (int)i, PAGE_SIZE);
+                if (0 > (ret = do_write(fd, buf, PAGE_SIZE))) {
+                        kprintf(ksh, "readahead_bench: could not write file: %d\n", ret);
+                        goto out;
+                }
+        }
+
+        kprintf(ksh, "%u pages read from disk a page at a time\n", RA_BENCH_PAGES);
+        for (random = 0; random <= 1; ++random) {
+                for (enabled = 0; enabled <= 1; ++enabled) {
+                        if (0 > (ret = ra_bench_run(ksh, fd, buf, random, enabled))) {
+                                kprintf(ksh, "readahead_bench: read failed: %d\n", ret);
+                                goto out;
+                        }
+                }
+        }
+        ret = 0;
+
+out:
+        if (0 <= fd)
+                do_close(fd);
+        do_unlink(RA_BENCH_PATH);
+        kfree(buf);
+        return ret;
+}
+
+static __attribute__((unused)) void
+readahead_bench_init(void)
+{
+        kshell_add_command("readahead_bench", readahead_bench,
+                           "time sequential and random file reads with and without readahead");
+}
+init_func(readahead_bench_init);
+init_depends(kshell_init);
@@ -0,0 +1,163 @@
+/*
+ * Times slab allocator churn for the objects the VM and VFS layers
+ * allocate most: pframes, vnodes and vmareas. Each object type is run
+ * through three patterns:
+ *
+ *     pairs   - allocate one object and free it right away, which the
+ *               loaded magazine should absorb entirely
+ *     batch   - allocate and free SLAB_BENCH_BATCH objects at a time,
+ *               which exchanges magazines with the depot
+ *     bulk    - allocate and free SLAB_BENCH_BULK objects at a time,
+ *               which goes through the partial/full slab lists
+ *
+ * vmareas come from the real vmarea allocator. The pframe and vnode
+ * allocators are private to their modules, so equivalent caches are made
+ * here with those modules' own constructors.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "fs/vnode.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+#include "vm/vmmap.h"
+
+#define SLAB_BENCH_OPS          100000
+#define SLAB_BENCH_BATCH        64
+#define SLAB_BENCH_BULK         4096
+
+typedef struct slab_bench_type {
+        const char        *sbt_name;
+        void            *(*sbt_alloc)(void);
+        void             (*sbt_free)(void *obj);
+} slab_bench_type_t;
+
+static slab_allocator_t *bench_pframe_allocator = NULL;
+static slab_allocator_t *bench_vnode_allocator = NULL;
+
+static void *
+bench_pframe_alloc(void)
+{
+        return slab_obj_alloc(bench_pframe_allocator);
+}
+
+static void
+bench_pframe_free(void *obj)
+{
+        slab_obj_free(bench_pframe_allocator, obj);
+}
+
+static void *
+bench_vnode_alloc(void)
+{
+        return slab_obj_alloc(bench_vnode_allocator);
+}
+
+static void
+bench_vnode_free(void *obj)
+{
+        slab_obj_free(bench_vnode_allocator, obj);
+}
+
+static void *
+bench_vmarea_alloc(void)
+{
+        return vmarea_alloc();
+}
+
+static void
+bench_vmarea_free(void *obj)
+{
+        vmarea_free((vmarea_t *)obj);
+}
+
+static const slab_bench_type_t slab_bench_types[] = {
+        { "pframe", bench_pframe_alloc, bench_pframe_free },
+        { "vnode",  bench_vnode_alloc,  bench_vnode_free },
+        { "vmarea", bench_vmarea_alloc, bench_vmarea_free },
+};
+
+/* Allocates and frees objects batch at a time until SLAB_BENCH_OPS of
+ * each have been done. Returns the cycles taken per alloc/free pair, or
+ * -ENOMEM. */
+static int
+slab_bench_run(const slab_bench_type_t *type, void **objs, int batch)
+{
+        uint64_t start, cycles;
+        int done, i;
+
+        start = rdtsc();
+        for (done = 0; done < SLAB_BENCH_OPS; done += batch) {
+                for (i = 0; i < batch; ++i) {
+                        if (NULL == (objs[i] = type->sbt_alloc())) {
+                                while (i-- > 0)
+                                        type->sbt_free(objs[i]);
+                                return -ENOMEM;
+                        }
+                }
+                for (i = batch - 1; i >= 0; --i)
+                        type->sbt_free(objs[i]);
+        }
+        cycles = rdtsc() - start;
+
+        return (int)(cycles / done);
+}
+
+static int
+slab_bench(kshell_t *ksh, int argc, char **argv)
+{
+        static const int batches[] = { 1, SLAB_BENCH_BATCH, SLAB_BENCH_BULK };
+        void **objs;
+        unsigned int t, b;
+        int cycles[3];
+
+        if (NULL == bench_pframe_allocator) {
+                bench_pframe_allocator = slab_allocator_create_ctor("bench_pframe",
+                                         sizeof(pframe_t), pframe_ctor, NULL);
+                bench_vnode_allocator = slab_allocator_create_ctor("bench_vnode",
+                                        sizeof(vnode_t), vnode_ctor, NULL);
+                KASSERT(NULL != bench_pframe_allocator && NULL != bench_vnode_allocator);
+        }
+
+        if (NULL == (objs = kmalloc(SLAB_BENCH_BULK * sizeof(*objs))))
+                return -ENOMEM;
+
+        kprintf(ksh, "cycles per alloc+free   pairs   batch(%d)   bulk(%d)\n",
+                SLAB_BENCH_BATCH, SLAB_BENCH_BULK);
+        for (t = 0; t < sizeof(slab_bench_types) / sizeof(slab_bench_types[0]); ++t) {
+                for (b = 0; b < sizeof(batches) / sizeof(batches[0]); ++b) {
+                        cycles[b] = slab_bench_run(&slab_bench_types[t], objs, batches[b]);
+                        if (0 > cycles[b]) {
+                                kprintf(ksh, "%s: out of memory\n", slab_bench_types[t].sbt_name);
+                                kfree(objs);
+                                return cycles[b];
+                        }
+                }
+                kprintf(ksh, "%-20s %8d %11d %10d\n", slab_bench_types[t].sbt_name,
+                        cycles[0], cycles[1], cycles[2]);
+        }
+
+        kfree(objs);
+        return 0;
+}
+
+static __attribute__((unused)) void
+slab_bench_init(void)
+{
+        kshell_add_command("slab_bench", slab_bench,
+                           "time slab alloc/free churn for pframes, vnodes and vmareas");
+}
+init_func(slab_bench_init);
+init_depends(kshell_init);
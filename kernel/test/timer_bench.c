@@ -0,0 +1,193 @@
+/*
+ * Times setting and cancelling a timer with 0, 1000 and 10000 others
+ * pending, both for timers due within the root of the wheel and for
+ * ones further out, against inserting into a list kept sorted by expiry,
+ * which is what a simple timer queue would do. Then measures how late
+ * timed sleeps of 1 to 10 ticks wake up: each sleep starts just after a
+ * tick, so it should last exactly its number of ticks, and anything
+ * more is the time taken to run the timer and switch back to the
+ * sleeper.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "main/apic.h"
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/sched.h"
+
+#include "test/bench.h"
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/timer.h"
+
+#define TIMER_BENCH_PROBES      1024
+#define TIMER_BENCH_ROUNDS      16
+#define TIMER_BENCH_NEAR        255             /* ticks, within the root */
+#define TIMER_BENCH_FAR         (1 << 20)       /* ticks, about 3 hours */
+#define TIMER_BENCH_SLEEPS      20
+
+static const uint32_t timer_bench_sizes[] = { 0, 1000, 10000 };
+static const uint32_t timer_bench_ticks[] = { 1, 2, 5, 10 };
+
+static void
+timer_bench_nop(timer_t *t)
+{
+}
+
+/* Inserts a timer into a list kept in order of expiry */
+static void
+sorted_insert(list_t *list, timer_t *t, uint32_t ticks)
+{
+        list_link_t *link;
+
+        t->t_expires = timer_now() + ticks;
+        for (link = list->l_next; link != list; link = link->l_next) {
+                if (timer_after((list_item(link, timer_t, t_link))->t_expires, t->t_expires))
+                        break;
+        }
+        list_insert_before(link, &t->t_link);
+}
+
+/* Cycles per set and per cancel of the probes, at distances up to max */
+static void
+timer_bench_probes(timer_t *probes, uint32_t max, uint64_t *set, uint64_t *cancel)
+{
+        uint32_t ticks[TIMER_BENCH_PROBES];
+        uint64_t start;
+        int i, round;
+
+        for (round = 0; round < TIMER_BENCH_ROUNDS; ++round) {
+                for (i = 0; i < TIMER_BENCH_PROBES; ++i)
+                        ticks[i] = 1 + bench_rand() % max;
+                start = rdtsc();
+                for (i = 0; i < TIMER_BENCH_PROBES; ++i)
+                        timer_set(&probes[i], ticks[i]);
+                *set += rdtsc() - start;
+                start = rdtsc();
+                for (i = 0; i < TIMER_BENCH_PROBES; ++i)
+                        timer_cancel(&probes[i]);
+                *cancel += rdtsc() - start;
+        }
+}
+
+/* Cycles per insert into the sorted list holding the others */
+static uint64_t
+timer_bench_sorted(list_t *list, timer_t *probes, uint32_t max)
+{
+        uint64_t start, cycles = 0;
+        int i, round;
+
+        for (round = 0; round < TIMER_BENCH_ROUNDS; ++round) {
+                for (i = 0; i < TIMER_BENCH_PROBES; ++i) {
+                        uint32_t ticks = 1 + bench_rand() % max;
+
+                        start = rdtsc();
+                        sorted_insert(list, &probes[i], ticks);
+                        cycles += rdtsc() - start;
+                        list_remove(&probes[i].t_link);
+                }
+        }
+        return cycles;
+}
+
+static int
+timer_bench_run(kshell_t *ksh, uint32_t n)
+{
+        uint64_t nset = 0, ncancel = 0, fset = 0, fcancel = 0, nsorted, fsorted;
+        uint32_t ops = TIMER_BENCH_PROBES * TIMER_BENCH_ROUNDS, i;
+        timer_t *others, *probes;
+        list_t sorted;
+
+        others = kmalloc((n + TIMER_BENCH_PROBES) * sizeof(timer_t));
+        if (NULL == others)
+                return -ENOMEM;
+        probes = others + n;
+
+        bench_srand(n);
+        for (i = 0; i < n + TIMER_BENCH_PROBES; ++i)
+                timer_init(&others[i], timer_bench_nop, NULL);
+        for (i = 0; i < n; ++i)
+                timer_set(&others[i], 1 + bench_rand() % TIMER_BENCH_FAR);
+
+        timer_bench_probes(probes, TIMER_BENCH_NEAR, &nset, &ncancel);
+        timer_bench_probes(probes, TIMER_BENCH_FAR, &fset, &fcancel);
+
+        /* the same population, in a sorted list instead of the wheel */
+        list_init(&sorted);
+        for (i = 0; i < n; ++i) {
+                timer_cancel(&others[i]);
+                sorted_insert(&sorted, &others[i], 1 + bench_rand() % TIMER_BENCH_FAR);
+        }
+        nsorted = timer_bench_sorted(&sorted, probes, TIMER_BENCH_NEAR);
+        fsorted = timer_bench_sorted(&sorted, probes, TIMER_BENCH_FAR);
+        while (!list_empty(&sorted))
+                list_remove_head(&sorted);
+
+        kprintf(ksh, "%5u pending: near set %4u cancel %4u (sorted list %7u), "
+                "far set %4u cancel %4u (sorted list %7u) cycles\n", n,
+                (uint32_t)(nset / ops), (uint32_t)(ncancel / ops), (uint32_t)(nsorted / ops),
+                (uint32_t)(fset / ops), (uint32_t)(fcancel / ops), (uint32_t)(fsorted / ops));
+
+        kfree(others);
+        return 0;
+}
+
+/* How late timed sleeps of the given number of ticks wake up */
+static void
+timer_bench_jitter(kshell_t *ksh, uint32_t ticks)
+{
+        uint64_t expected = (uint64_t)ticks * TICK_MSECS * apic_tsc_khz();
+        uint64_t start, late, total = 0, worst = 0;
+        ktqueue_t q;
+        int i;
+
+        sched_queue_init(&q);
+        for (i = 0; i < TIMER_BENCH_SLEEPS; ++i) {
+                /* start just after a tick */
+                sched_sleep_on_timeout(&q, 1);
+                start = rdtsc();
+                if (-ETIMEDOUT != sched_sleep_on_timeout(&q, ticks))
+                        panic("timer_bench: woken from an empty queue\n");
+                late = rdtsc() - start;
+                late = late > expected ? late - expected : 0;
+                total += late;
+                worst = MAX(worst, late);
+        }
+        kprintf(ksh, "%2u tick sleeps: %6u usecs late on average, %6u at worst\n", ticks,
+                (uint32_t)(total * 1000 / apic_tsc_khz() / TIMER_BENCH_SLEEPS),
+                (uint32_t)(worst * 1000 / apic_tsc_khz()));
+}
+
+static int
+timer_bench(kshell_t *ksh, int argc, char **argv)
+{
+        uint32_t i;
+        int ret;
+
+        for (i = 0; i < sizeof(timer_bench_sizes) / sizeof(timer_bench_sizes[0]); ++i) {
+                if (0 > (ret = timer_bench_run(ksh, timer_bench_sizes[i]))) {
+                        kprintf(ksh, "timer_bench: out of memory with %u timers\n",
+                                timer_bench_sizes[i]);
+                        return ret;
+                }
+        }
+        for (i = 0; i < sizeof(timer_bench_ticks) / sizeof(timer_bench_ticks[0]); ++i)
+                timer_bench_jitter(ksh, timer_bench_ticks[i]);
+        return 0;
+}
+
+static __attribute__((unused)) void
+timer_bench_init(void)
+{
+        kshell_add_command("timer_bench", timer_bench,
+                           "time timer set and cancel, and how late timed sleeps wake");
+}
+init_func(timer_bench_init);
+init_depends(kshell_init);
@@ -0,0 +1,170 @@
+/*
+ * Times vmmap_lookup, vmmap_find_range and an mmap/munmap pair in address
+ * spaces of 1, 100 and 2000 areas, against a walk over vmm_list like the
+ * one they used to do. The areas are one page each with a one page hole
+ * between neighbours, except for a single two page hole in the middle.
+ * The rest of the user address space is taken by one area below them and
+ * one above, a page away, so a two page search has to get past half the
+ * areas in either direction before it finds the hole. Every result is
+ * checked against the list walk.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
+
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "mm/page.h"
+
+#include "test/bench.h"
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+#include "vm/vmmap.h"
+
+#define VMMAP_BENCH_LOOKUPS     4096
+#define VMMAP_BENCH_SEARCHES    1024
+#define VMMAP_BENCH_MAPS        256
+
+static const uint32_t vmmap_bench_sizes[] = { 1, 100, 2000 };
+
+/* The list walk vmmap_lookup used to do */
+static vmarea_t *
+linear_lookup(vmmap_t *map, uint32_t vfn)
+{
+        vmarea_t *vma;
+
+        list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+                if (vma->vma_start <= vfn && vfn < vma->vma_end)
+                        return vma;
+        } list_iterate_end();
+        return NULL;
+}
+
+/* The list walk vmmap_find_range used to do for VMMAP_DIR_LOHI */
+static int
+linear_find_lohi(vmmap_t *map, uint32_t npages)
+{
+        uint32_t start = ADDR_TO_PN(USER_MEM_LOW);
+        vmarea_t *vma;
+
+        list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+                if (start < vma->vma_start && vma->vma_start - start >= npages)
+                        return start;
+                if (vma->vma_end > start)
+                        start = vma->vma_end;
+        } list_iterate_end();
+        if (ADDR_TO_PN(USER_MEM_HIGH) - start >= npages)
+                return start;
+        return -1;
+}
+
+/* Returns the first page of area i */
+static inline uint32_t
+bench_area(uint32_t base, uint32_t n, uint32_t i)
+{
+        return base + 2 * i + (i >= n / 2 ? 1 : 0);
+}
+
+static int
+vmmap_bench_run(kshell_t *ksh, uint32_t n)
+{
+        uint32_t lo = ADDR_TO_PN(USER_MEM_LOW), hi = ADDR_TO_PN(USER_MEM_HIGH);
+        uint32_t base = lo + (hi - lo) / 2;
+        uint32_t top = bench_area(base, n, n - 1) + 2;
+        uint32_t hole = bench_area(base, n, n / 2) - 2;
+        uint64_t start, tree = 0, linear = 0, lohi = 0, hilo = 0, maps = 0;
+        vmarea_t *vma;
+        vmmap_t *map;
+        uint32_t i, vfn;
+        int ret = 0;
+
+        if (NULL == (map = vmmap_create()))
+                return -ENOMEM;
+        if (0 > (ret = vmmap_map(map, NULL, lo, base - 1 - lo, PROT_READ, MAP_SHARED, 0,
+                                 VMMAP_DIR_HILO, NULL))
+            || 0 > (ret = vmmap_map(map, NULL, top, hi - top, PROT_READ, MAP_SHARED, 0,
+                                    VMMAP_DIR_HILO, NULL)))
+                goto out;
+        for (i = 0; i < n; ++i) {
+                if (0 > (ret = vmmap_map(map, NULL, bench_area(base, n, i), 1, PROT_READ,
+                                         MAP_SHARED, 0, VMMAP_DIR_HILO, NULL)))
+                        goto out;
+        }
+
+        bench_srand(n);
+        for (i = 0; i < VMMAP_BENCH_LOOKUPS; ++i) {
+                vfn = base + bench_rand() % (top - base);
+                start = rdtsc();
+                vma = vmmap_lookup(map, vfn);
+                tree += rdtsc() - start;
+                start = rdtsc();
+                if (vma != linear_lookup(map, vfn))
+                        panic("vmmap_bench: lookup of %#x found %p\n", vfn, vma);
+                linear += rdtsc() - start;
+        }
+
+        for (i = 0; i < VMMAP_BENCH_SEARCHES; ++i) {
+                start = rdtsc();
+                ret = vmmap_find_range(map, 2, VMMAP_DIR_LOHI);
+                lohi += rdtsc() - start;
+                if ((uint32_t)ret != hole || ret != linear_find_lohi(map, 2))
+                        panic("vmmap_bench: found %#x, not %#x\n", ret, hole);
+
+                start = rdtsc();
+                ret = vmmap_find_range(map, 2, VMMAP_DIR_HILO);
+                hilo += rdtsc() - start;
+                if ((uint32_t)ret != hole)
+                        panic("vmmap_bench: found %#x, not %#x\n", ret, hole);
+        }
+
+        /* each mapping lands in the hole and is then unmapped again */
+        for (i = 0; i < VMMAP_BENCH_MAPS; ++i) {
+                start = rdtsc();
+                if (0 > (ret = vmmap_map(map, NULL, 0, 2, PROT_READ, MAP_SHARED, 0,
+                                         VMMAP_DIR_LOHI, &vma))
+                    || 0 > (ret = vmmap_remove(map, vma->vma_start, 2)))
+                        goto out;
+                maps += rdtsc() - start;
+        }
+        ret = 0;
+
+        kprintf(ksh, "%4u areas: lookup %5u cycles (list walk %6u), find_range lohi %5u "
+                "hilo %5u, mmap+munmap %6u\n", n,
+                (uint32_t)(tree / VMMAP_BENCH_LOOKUPS), (uint32_t)(linear / VMMAP_BENCH_LOOKUPS),
+                (uint32_t)(lohi / VMMAP_BENCH_SEARCHES), (uint32_t)(hilo / VMMAP_BENCH_SEARCHES),
+                (uint32_t)(maps / VMMAP_BENCH_MAPS));
+
+out:
+        vmmap_destroy(map);
+        return ret;
+}
+
+static int
+vmmap_bench(kshell_t *ksh, int argc, char **argv)
+{
+        uint32_t i;
+        int ret;
+
+        for (i = 0; i < sizeof(vmmap_bench_sizes) / sizeof(vmmap_bench_sizes[0]); ++i) {
+                if (0 > (ret = vmmap_bench_run(ksh, vmmap_bench_sizes[i]))) {
+                        kprintf(ksh, "vmmap_bench: mapping failed: %d\n", ret);
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+static __attribute__((unused)) void
+vmmap_bench_init(void)
+{
+        kshell_add_command("vmmap_bench", vmmap_bench,
+                           "time area lookups and free range searches in large address spaces");
+}
+init_func(vmmap_bench_init);
+init_depends(kshell_init);
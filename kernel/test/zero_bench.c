@@ -0,0 +1,96 @@
+/*
+ * Measures first-touch fault throughput on anonymous memory with and
+ * without the pre-zeroed page pool. Each run creates a fresh anonymous
+ * object of ZERO_BENCH_PAGES pages (what an anonymous mmap or a BSS
+ * segment is backed by) and looks up every page for writing, as the page
+ * fault handler does on a first write. Pages are touched in bursts the
+ * size of the pool; between bursts the pool is refilled by hand, standing
+ * in for the idle time a real program leaves the scheduler between bursts
+ * of faults. Refill time is not counted.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "config.h"
+
+#include "main/cpuid.h"
+
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+#include "vm/anon.h"
+
+#define ZERO_BENCH_PAGES        2048    /* 8MB */
+
+/* Returns the cycles spent faulting in every page, or -errno */
+static int64_t
+zero_bench_run(page_zero_stats_t *stats)
+{
+        page_zero_stats_t before;
+        uint64_t start, cycles = 0;
+        mmobj_t *o;
+        pframe_t *pf;
+        uint32_t i;
+        int ret = 0;
+
+        if (NULL == (o = anon_create()))
+                return -ENOMEM;
+
+        page_zero_get_stats(&before);
+        for (i = 0; i < ZERO_BENCH_PAGES; ++i) {
+                if (0 == i % PAGE_ZERO_POOL_SIZE)
+                        page_zero_refill(PAGE_ZERO_POOL_SIZE);
+
+                start = rdtsc();
+                ret = pframe_lookup(o, i, 1, &pf);
+                cycles += rdtsc() - start;
+                if (0 > ret)
+                        break;
+                KASSERT(0 == ((uint32_t *)pf->pf_addr)[PAGE_SIZE / sizeof(uint32_t) - 1]);
+        }
+        page_zero_get_stats(stats);
+        stats->pzs_hits -= before.pzs_hits;
+        stats->pzs_misses -= before.pzs_misses;
+
+        o->mmo_ops->put(o);
+        return (0 > ret) ? ret : (int64_t)cycles;
+}
+
+static int
+zero_bench(kshell_t *ksh, int argc, char **argv)
+{
+        page_zero_stats_t stats;
+        int64_t cycles;
+        int pool;
+
+        kprintf(ksh, "first touch of %u anonymous pages (%u KB)\n",
+                ZERO_BENCH_PAGES, ZERO_BENCH_PAGES * (PAGE_SIZE / 1024));
+        for (pool = 0; pool <= 1; ++pool) {
+                page_zero_set_enabled(pool);
+                if (0 > (cycles = zero_bench_run(&stats))) {
+                        kprintf(ksh, "zero_bench: fault failed: %d\n", (int)cycles);
+                        page_zero_set_enabled(1);
+                        return (int)cycles;
+                }
+                kprintf(ksh, "%-14s %8u cycles/fault, %u from pool, %u zeroed in place\n",
+                        pool ? "with pool:" : "without pool:",
+                        (uint32_t)(cycles / ZERO_BENCH_PAGES), stats.pzs_hits, stats.pzs_misses);
+        }
+        return 0;
+}
+
+static __attribute__((unused)) void
+zero_bench_init(void)
+{
+        kshell_add_command("zero_bench", zero_bench,
+                           "time anonymous first-touch faults with and without the zeroed page pool");
+}
+init_func(zero_bench_init);
+init_depends(kshell_init);
@@ -0,0 +1,193 @@
+#include "types.h"
+#include "errno.h"
+
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/radix.h"
+#include "util/string.h"
+
+typedef struct radix_node {
+        void    *rn_slots[RADIX_FANOUT];
+        int      rn_count;      /* number of non-NULL slots */
+} radix_node_t;
+
+static slab_allocator_t *radix_node_allocator = NULL;
+
+/* Largest key representable by a tree of the given height */
+static inline uint32_t
+radix_maxkey(int height)
+{
+        if (height * RADIX_SHIFT >= 32)
+                return 0xffffffff;
+        return (1U << (height * RADIX_SHIFT)) - 1;
+}
+
+static inline int
+radix_index(uint32_t key, int level)
+{
+        return (key >> (level * RADIX_SHIFT)) & RADIX_MASK;
+}
+
+static radix_node_t *
+radix_node_alloc(void)
+{
+        radix_node_t *n = slab_obj_alloc(radix_node_allocator);
+        if (NULL != n)
+                memset(n, 0, sizeof(*n));
+        return n;
+}
+
+void
+radix_init(void)
+{
+        radix_node_allocator = slab_allocator_create("radix_node", sizeof(radix_node_t));
+        KASSERT(NULL != radix_node_allocator);
+}
+
+void *
+radix_lookup(radix_tree_t *t, uint32_t key)
+{
+        radix_node_t *n = t->rt_root;
+        int level = t->rt_height - 1;
+
+        if (key > radix_maxkey(t->rt_height))
+                return NULL;
+
+        while (NULL != n && level > 0) {
+                n = n->rn_slots[radix_index(key, level)];
+                --level;
+        }
+        return (NULL == n) ? NULL : n->rn_slots[radix_index(key, 0)];
+}
+
+/* Drops root nodes which only have a single child in slot 0 and frees the
+ * root entirely once the tree is empty. */
+static void
+radix_shrink(radix_tree_t *t)
+{
+        while (NULL != t->rt_root) {
+                radix_node_t *root = t->rt_root;
+                if (0 == root->rn_count) {
+                        slab_obj_free(radix_node_allocator, root);
+                        t->rt_root = NULL;
+                        t->rt_height = 0;
+                } else if (t->rt_height > 1 && 1 == root->rn_count
+                           && NULL != root->rn_slots[0]) {
+                        t->rt_root = root->rn_slots[0];
+                        t->rt_height--;
+                        slab_obj_free(radix_node_allocator, root);
+                } else {
+                        break;
+                }
+        }
+}
+
+/* Frees the now-empty interior nodes recorded in path[0..depth), deepest
+ * first, unlinking each from its parent. */
+static void
+radix_prune(radix_tree_t *t, radix_node_t **path, int *slots, int depth)
+{
+        int i;
+        for (i = depth - 1; i > 0; --i) {
+                if (0 != path[i]->rn_count)
+                        break;
+                slab_obj_free(radix_node_allocator, path[i]);
+                path[i - 1]->rn_slots[slots[i - 1]] = NULL;
+                path[i - 1]->rn_count--;
+        }
+        radix_shrink(t);
+}
+
+int
+radix_insert(radix_tree_t *t, uint32_t key, void *item)
+{
+        radix_node_t *path[RADIX_MAX_HEIGHT];
+        int slots[RADIX_MAX_HEIGHT];
+        radix_node_t *n;
+        int level, depth;
+
+        KASSERT(NULL != item);
+
+        /* Grow the tree upward until key fits */
+        if (NULL == t->rt_root) {
+                if (NULL == (t->rt_root = radix_node_alloc()))
+                        return -ENOMEM;
+                t->rt_height = 1;
+        }
+        while (key > radix_maxkey(t->rt_height)) {
+                radix_node_t *root = radix_node_alloc();
+                if (NULL == root) {
+                        radix_shrink(t);
+                        return -ENOMEM;
+                }
+                root->rn_slots[0] = t->rt_root;
+                root->rn_count = 1;
+                t->rt_root = root;
+                t->rt_height++;
+        }
+
+        /* Walk down, creating interior nodes as needed */
+        n = t->rt_root;
+        depth = 0;
+        for (level = t->rt_height - 1; level > 0; --level) {
+                int i = radix_index(key, level);
+                path[depth] = n;
+                slots[depth] = i;
+                depth++;
+                if (NULL == n->rn_slots[i]) {
+                        radix_node_t *child = radix_node_alloc();
+                        if (NULL == child) {
+                                radix_prune(t, path, slots, depth);
+                                return -ENOMEM;
+                        }
+                        n->rn_slots[i] = child;
+                        n->rn_count++;
+                }
+                n = n->rn_slots[i];
+        }
+
+        level = radix_index(key, 0);
+        if (NULL != n->rn_slots[level]) {
+                path[depth] = n;
+                radix_prune(t, path, slots, depth + 1);
+                return -EEXIST;
+        }
+        n->rn_slots[level] = item;
+        n->rn_count++;
+        t->rt_count++;
+        return 0;
+}
+
+void *
+radix_remove(radix_tree_t *t, uint32_t key)
+{
+        radix_node_t *path[RADIX_MAX_HEIGHT];
+        int slots[RADIX_MAX_HEIGHT];
+        radix_node_t *n = t->rt_root;
+        int level, depth = 0;
+        void *item;
+
+        if (NULL == n || key > radix_maxkey(t->rt_height))
+                return NULL;
+
+        for (level = t->rt_height - 1; level > 0; --level) {
+                int i = radix_index(key, level);
+                path[depth] = n;
+                slots[depth] = i;
+                depth++;
+                if (NULL == (n = n->rn_slots[i]))
+                        return NULL;
+        }
+
+        level = radix_index(key, 0);
+        if (NULL == (item = n->rn_slots[level]))
+                return NULL;
+        n->rn_slots[level] = NULL;
+        n->rn_count--;
+        t->rt_count--;
+
+        path[depth] = n;
+        radix_prune(t, path, slots, depth + 1);
+        return item;
+}
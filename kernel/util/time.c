@@ -1,5 +1,3 @@
-
-
 #include "globals.h"
 
 #include "main/interrupt.h"
@@ -8,31 +6,30 @@
 
 #include "util/debug.h"
 #include "util/init.h"
+#include "util/timer.h"
 
 #include "proc/sched.h"
 #include "proc/kthread.h"
 
 #define APIC_TIMER_IRQ 32 /* Map interrupt 32 */
 
-#ifdef __UPREEMPT__
-static unsigned int ms = 0;
-
-static void pit_handler(regs_t *regs)
+/* The local APIC timer is not an I/O APIC irq, so it is not mapped with
+ * intr_map and has to be acknowledged here */
+static void time_tick(regs_t *regs)
 {
-  dbg(DBG_CORE, "PIT HANDLER FIRED\n");
+  apic_eoi();
+  timer_tick();
+  sched_tick();
 }
 
-/* Uncomment this to enable the apic timer to
- * call the pit_handler for userland preemption
- */
-
+/* The tick runs the timers which are due and charges the running
+ * thread's slice; with __UPREEMPT__, __intr_handler preempts it on its
+ * way back to user mode once the slice is used up. Timers need the tick
+ * either way. */
 static __attribute__((unused)) void time_init(void)
 {
-  intr_map(APIC_TIMER_IRQ, APIC_TIMER_IRQ);
-  intr_register(APIC_TIMER_IRQ, pit_handler);
-  /* TODO: figure out how this argument converts to hertz */
-  apic_enable_periodic_timer(8);
+  intr_register(APIC_TIMER_IRQ, time_tick);
+  apic_enable_periodic_timer(1000 / TICK_MSECS);
 }
 init_func(time_init);
-
-#endif
+init_depends(timer_wheel_init);
@@ -0,0 +1,157 @@
+#include "types.h"
+#include "kernel.h"
+
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/timer.h"
+
+/*
+ * The wheel is the one from Linux: a root of 256 slots, one per tick,
+ * for timers due within the next 256 ticks, and four levels of 64 slots
+ * above it, each slot of a level covering as many ticks as the whole of
+ * the level below. A timer goes in the slot of the lowest level whose
+ * range reaches its expiry, so setting it is a matter of finding the
+ * level from the distance and linking it in. Every 256 ticks, when the
+ * root comes round to its first slot again, the timers in the next slot
+ * of the first level are put back in at the levels they are now close
+ * enough for, and the same goes for each level above once the one below
+ * it has come round. Most timers are cancelled before they get that far;
+ * one which runs is moved at most once per level.
+ */
+#define TIMER_ROOT_BITS         8
+#define TIMER_ROOT_SIZE         (1 << TIMER_ROOT_BITS)
+#define TIMER_ROOT_MASK         (TIMER_ROOT_SIZE - 1)
+#define TIMER_LEVEL_BITS        6
+#define TIMER_LEVEL_SIZE        (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK        (TIMER_LEVEL_SIZE - 1)
+#define TIMER_LEVELS            4
+
+/* Shift of the ticks one slot of the given level covers */
+#define TIMER_LEVEL_SHIFT(level) (TIMER_ROOT_BITS + (level) * TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_INDEX(ticks, level) \
+        (((ticks) >> TIMER_LEVEL_SHIFT(level)) & TIMER_LEVEL_MASK)
+
+static list_t timer_root[TIMER_ROOT_SIZE];
+static list_t timer_levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static uint32_t timer_ticks;            /* ticks run so far */
+
+static __attribute__((unused)) void
+timer_wheel_init(void)
+{
+        int i, level;
+
+        for (i = 0; i < TIMER_ROOT_SIZE; ++i)
+                list_init(&timer_root[i]);
+        for (level = 0; level < TIMER_LEVELS; ++level) {
+                for (i = 0; i < TIMER_LEVEL_SIZE; ++i)
+                        list_init(&timer_levels[level][i]);
+        }
+}
+init_func(timer_wheel_init);
+
+uint32_t
+timer_now(void)
+{
+        return timer_ticks;
+}
+
+/* Links a timer into the slot for its expiry, which must not be before
+ * the tick being run */
+static void
+timer_add(timer_t *t)
+{
+        uint32_t distance = t->t_expires - timer_ticks;
+        int level;
+
+        KASSERT((int32_t)distance >= 0);
+        if (distance < TIMER_ROOT_SIZE) {
+                list_insert_tail(&timer_root[t->t_expires & TIMER_ROOT_MASK], &t->t_link);
+                return;
+        }
+        for (level = 0; level < TIMER_LEVELS - 1; ++level) {
+                if (distance < 1U << TIMER_LEVEL_SHIFT(level + 1))
+                        break;
+        }
+        list_insert_tail(&timer_levels[level][TIMER_LEVEL_INDEX(t->t_expires, level)],
+                         &t->t_link);
+}
+
+/* Puts the timers in the current slot of a level back in lower down.
+ * Returns the slot, which is 0 when the level above is due as well. */
+static int
+timer_cascade(int level)
+{
+        int index = TIMER_LEVEL_INDEX(timer_ticks, level);
+        list_t *slot = &timer_levels[level][index];
+        list_t moving;
+        timer_t *t;
+
+        if (list_empty(slot))
+                return index;
+
+        /* take the whole slot first, as timers may go back into it */
+        moving.l_next = slot->l_next;
+        moving.l_prev = slot->l_prev;
+        moving.l_next->l_prev = &moving;
+        moving.l_prev->l_next = &moving;
+        list_init(slot);
+
+        while (!list_empty(&moving)) {
+                t = list_head(&moving, timer_t, t_link);
+                list_remove(&t->t_link);
+                timer_add(t);
+        }
+        return index;
+}
+
+void
+timer_set(timer_t *t, uint32_t ticks)
+{
+        uint8_t oIPL = intr_getipl();
+
+        KASSERT(ticks < 0x80000000U);
+        intr_setipl(IPL_HIGH);
+        if (timer_pending(t))
+                list_remove(&t->t_link);
+        /* the current tick has been run already */
+        t->t_expires = timer_ticks + MAX(ticks, 1U);
+        timer_add(t);
+        intr_setipl(oIPL);
+}
+
+int
+timer_cancel(timer_t *t)
+{
+        uint8_t oIPL = intr_getipl();
+        int pending;
+
+        intr_setipl(IPL_HIGH);
+        if ((pending = timer_pending(t)))
+                list_remove(&t->t_link);
+        intr_setipl(oIPL);
+        return pending;
+}
+
+void
+timer_tick(void)
+{
+        uint8_t oIPL = intr_getipl();
+        list_t *slot;
+        timer_t *t;
+        int index, level;
+
+        intr_setipl(IPL_HIGH);
+        index = ++timer_ticks & TIMER_ROOT_MASK;
+        for (level = 0; 0 == index && level < TIMER_LEVELS; ++level)
+                index = timer_cascade(level);
+
+        slot = &timer_root[timer_ticks & TIMER_ROOT_MASK];
+        while (!list_empty(slot)) {
+                t = list_head(slot, timer_t, t_link);
+                list_remove(&t->t_link);
+                t->t_func(t);
+        }
+        intr_setipl(oIPL);
+}
@@ -16,6 +16,10 @@ int anon_count = 0; /* for debugging/verification purposes */
 
 static slab_allocator_t *anon_allocator;
 
+/* Mapped read-only wherever a private anonymous page is read before it
+ * is ever written; never freed, and not part of any object */
+static void *anon_zero_frame;
+
 static void anon_ref(mmobj_t *o);
 static void anon_put(mmobj_t *o);
 static int  anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
@@ -43,6 +47,27 @@ anon_init()
         anon_allocator = slab_allocator_create("anon", sizeof(mmobj_t));
 	dbg(DBG_TEST, "anon_mmobj_ops at %p\n", &anon_mmobj_ops);
         KASSERT(NULL != anon_allocator);
+
+        anon_zero_frame = page_alloc();
+        KASSERT(NULL != anon_zero_frame);
+        memset(anon_zero_frame, 0, PAGE_SIZE);
+}
+
+/*
+ * Returns the shared zero page. Nothing may ever write to it, so it
+ * must only be mapped without PD_WRITE.
+ */
+void *
+anon_zero_page(void)
+{
+        return anon_zero_frame;
+}
+
+/* Returns whether o is an anonymous object made by anon_create */
+int
+mmobj_is_anon(mmobj_t *o)
+{
+        return &anon_mmobj_ops == o->mmo_ops;
 }
 
 /*
@@ -164,7 +189,20 @@ anon_fillpage(mmobj_t *o, pframe_t *pf)
 	KASSERT(pf != NULL);
 	KASSERT(pf->pf_obj == o);
   //  pframe_pin(pf);
-	memset(pf->pf_addr, 0, PAGE_SIZE);
+	/* Swap in an already zeroed frame if the idle loop has made one,
+	 * unless the frame is part of a large page and has to stay put */
+	void *zeroed = pframe_is_large(pf) ? NULL : page_zero_take();
+	if (NULL != zeroed) {
+		page_free(pf->pf_addr);
+		pf->pf_addr = zeroed;
+	} else {
+		memset(pf->pf_addr, 0, PAGE_SIZE);
+	}
+	/* Writes through a large page mapping never reach pframe_dirty,
+	 * and there is nowhere to clean anonymous memory to anyway, so
+	 * large pages stay resident until the object goes away */
+	if (pframe_is_large(pf))
+		pframe_pin(pf);
 	
         return 0;
 }
@@ -2,6 +2,7 @@
 
 #include "globals.h"
 #include "errno.h"
+#include "config.h"
 #include "util/debug.h"
 
 #include "mm/mm.h"
@@ -10,6 +11,7 @@
 
 #include "vm/mmap.h"
 #include "vm/vmmap.h"
+#include "vm/pagefault.h"
 #include "mm/tlb.h"
 #include "proc/proc.h"
 
@@ -124,9 +126,27 @@ do_brk(void *addr, void **ret)
                                 return ret;
                         }
                         dbg(DBG_TEST, "do_brk: created heap vmarea [%#x-%#x)\n", start_vfn, new_end_vfn);
+                } else if (vma->vma_flags & MAP_LOCKED) {
+                        /* A locked heap stays locked as it grows */
+                        if (map->vmm_nlocked + (new_end_vfn - old_end_vfn) > VMMAP_MAX_LOCKED_PAGES) {
+                                return -ENOMEM;
+                        }
+                        vmmap_resize(vma, vma->vma_start, new_end_vfn);
+                        int nlocked = pagefault_populate(vma, old_end_vfn, new_end_vfn, 1);
+                        if (nlocked < 0) {
+                                tlb_batch_t tb;
+                                vmmap_resize(vma, vma->vma_start, old_end_vfn);
+                                tlb_batch_init(&tb);
+                                pt_unmap_range_batch(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(old_end_vfn),
+                                                     (uintptr_t)PN_TO_ADDR(new_end_vfn), &tb);
+                                tlb_batch_flush(&tb);
+                                return nlocked;
+                        }
+                        map->vmm_nlocked += nlocked;
+                        dbg(DBG_TEST, "do_brk: extended locked heap vmarea to %#x\n", new_end_vfn);
                 } else {
                         /* Extend the existing vmarea */
-                        vma->vma_end = new_end_vfn;
+                        vmmap_resize(vma, vma->vma_start, new_end_vfn);
                         dbg(DBG_TEST, "do_brk: extended heap vmarea to %#x\n", new_end_vfn);
                 }
                 
@@ -147,7 +167,10 @@ do_brk(void *addr, void **ret)
                 }
 
                 /* Shrink the vmarea */
-                vma->vma_end = new_end_vfn;
+                if (vma->vma_flags & MAP_LOCKED) {
+                        map->vmm_nlocked -= pagefault_unlock(vma, new_end_vfn, old_end_vfn);
+                }
+                vmmap_resize(vma, vma->vma_start, new_end_vfn);
 
                 /* Unmap pages in the shrunk range */
                 /* Note: vmmap_remove is not needed because we just shrunk the vma. 
@@ -169,8 +192,10 @@ do_brk(void *addr, void **ret)
                  
                  uintptr_t start = (uintptr_t)PN_TO_ADDR(new_end_vfn);
                  uintptr_t end   = (uintptr_t)PN_TO_ADDR(old_end_vfn);
-                 pt_unmap_range(curproc->p_pagedir, start, end);
-                 tlb_flush_range(start, (end - start) / PAGE_SIZE);
+                 tlb_batch_t tb;
+                 tlb_batch_init(&tb);
+                 pt_unmap_range_batch(curproc->p_pagedir, start, end, &tb);
+                 tlb_batch_flush(&tb);
         }
 
         curproc->p_brk = (void *)newbrk;
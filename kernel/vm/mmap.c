@@ -3,6 +3,7 @@
 #include "globals.h"
 #include "errno.h"
 #include "types.h"
+#include "config.h"
 
 #include "mm/mm.h"
 #include "mm/tlb.h"
@@ -20,6 +21,7 @@
 
 #include "vm/vmmap.h"
 #include "vm/mmap.h"
+#include "vm/pagefault.h"
 #include "mm/mmobj.h" 
 static int
 valid_map_type(int flags)
@@ -29,7 +31,8 @@ valid_map_type(int flags)
         return 0;
     }
 
-    if (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) {
+    if (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON | MAP_LARGEPAGE
+                  | MAP_POPULATE | MAP_LOCKED)) {
         return 0;
     }
 
@@ -45,7 +48,12 @@ valid_fd(int fd)
 /*
  * This function implements the mmap(2) syscall, but only
  * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, and
- * MAP_ANON flags.
+ * MAP_ANON flags, plus the MAP_LARGEPAGE hint, which asks for
+ * the mapping to be placed and faulted in with large pages
+ * where that is possible, MAP_POPULATE, which faults in up to
+ * VMMAP_MAX_LOCKED_PAGES pages of the mapping before returning
+ * so that its first use does not wait on faults, and MAP_LOCKED,
+ * which faults in and locks all of it as mlock(2) would.
  *
  * Add a mapping to the current process's address space.
  * You need to do some error checking; see the ERRORS section
@@ -125,8 +133,8 @@ if (f != NULL) {
     uint32_t npages = (uint32_t)PAGE_ALIGN_UP(len) / PAGE_SIZE;
     uint32_t lopage = (addr != NULL) ? ADDR_TO_PN(addr) : 0;
 
-    int retval = vmmap_map(curproc->p_vmmap, vnode, lopage, npages,
-                           prot, flags, off, VMMAP_DIR_HILO, &vma);
+    int retval = vmmap_map(curproc->p_vmmap, vnode, lopage, npages, prot,
+                           flags & ~(MAP_POPULATE | MAP_LOCKED), off, VMMAP_DIR_HILO, &vma);
 
     KASSERT(retval == 0 || retval == -ENOMEM);
 
@@ -152,9 +160,23 @@ if (f != NULL) {
 
     uintptr_t start = (uintptr_t)PN_TO_ADDR(vma->vma_start);
     uintptr_t end   = start + npages * PAGE_SIZE;
+    tlb_batch_t tb;
 
-    pt_unmap_range(curproc->p_pagedir, start, end);
-    tlb_flush_range(start, npages);
+    /* only pages which were actually mapped need invalidating */
+    tlb_batch_init(&tb);
+    pt_unmap_range_batch(curproc->p_pagedir, start, end, &tb);
+    tlb_batch_flush(&tb);
+
+    if (flags & MAP_LOCKED) {
+        if ((retval = vmmap_lock(curproc->p_vmmap, vma->vma_start, npages)) < 0) {
+            do_munmap(PN_TO_ADDR(vma->vma_start), npages * PAGE_SIZE);
+            return retval;
+        }
+    } else if (flags & MAP_POPULATE) {
+        /* only a hint: whatever is not faulted in now is on first use */
+        pagefault_populate(vma, vma->vma_start,
+                           vma->vma_start + MIN(npages, VMMAP_MAX_LOCKED_PAGES), 0);
+    }
 
     return 0;
 }
@@ -199,10 +221,83 @@ do_munmap(void *addr, size_t len)
 
     uintptr_t start = (uintptr_t)PN_TO_ADDR(lopage);
     uintptr_t end   = start + npages * PAGE_SIZE;
+    tlb_batch_t tb;
 
-    pt_unmap_range(curproc->p_pagedir, start, end);
-    tlb_flush_range(start, npages);
+    tlb_batch_init(&tb);
+    pt_unmap_range_batch(curproc->p_pagedir, start, end, &tb);
+    tlb_batch_flush(&tb);
 
     return 0;
 }
 
+/*
+ * This function implements the madvise(2) syscall. The range must be
+ * page aligned and entirely mapped; vmmap_advise() does the work.
+ */
+int
+do_madvise(void *addr, size_t len, int advice)
+{
+    if (len == 0 || !PAGE_ALIGNED(addr)) {
+        return -EINVAL;
+    }
+
+    uintptr_t a = (uintptr_t)addr;
+
+    if (a < USER_MEM_LOW || a >= USER_MEM_HIGH || len > USER_MEM_HIGH - a) {
+        return -ENOMEM;
+    }
+
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+    case MADV_FREE:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    return vmmap_advise(curproc->p_vmmap, ADDR_TO_PN(addr),
+                        (uint32_t)PAGE_ALIGN_UP(len) / PAGE_SIZE, advice);
+}
+
+/*
+ * These functions implement the mlock(2) and munlock(2) syscalls. addr
+ * is rounded down to a page boundary, and the range must be entirely
+ * mapped; vmmap_lock() and vmmap_unlock() do the work.
+ */
+int
+do_mlock(const void *addr, size_t len)
+{
+    uintptr_t a = (uintptr_t)PAGE_ALIGN_DOWN(addr);
+
+    if (a < USER_MEM_LOW || a >= USER_MEM_HIGH
+        || len > USER_MEM_HIGH - (uintptr_t)addr) {
+        return -ENOMEM;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    return vmmap_lock(curproc->p_vmmap, ADDR_TO_PN(a),
+                      ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)addr + len)) - ADDR_TO_PN(a));
+}
+
+int
+do_munlock(const void *addr, size_t len)
+{
+    uintptr_t a = (uintptr_t)PAGE_ALIGN_DOWN(addr);
+
+    if (a < USER_MEM_LOW || a >= USER_MEM_HIGH
+        || len > USER_MEM_HIGH - (uintptr_t)addr) {
+        return -ENOMEM;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    return vmmap_unlock(curproc->p_vmmap, ADDR_TO_PN(a),
+                        ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)addr + len)) - ADDR_TO_PN(a));
+}
@@ -4,6 +4,7 @@
 #include "globals.h"
 #include "kernel.h"
 #include "errno.h"
+#include "config.h"
 
 #include "util/debug.h"
 
@@ -16,9 +17,36 @@
 #include "mm/pframe.h"
 #include "mm/pagetable.h"
 
+#include "fs/readahead.h"
+#include "fs/vnode.h"
+
+#include "vm/anon.h"
 #include "vm/pagefault.h"
+#include "vm/shadow.h"
 #include "vm/vmmap.h"
 #include "mm/tlb.h"
+
+static uint32_t pagefault_around_pages = PAGEFAULT_AROUND_PAGES;
+static pagefault_stats_t pagefault_stats;
+
+uint32_t
+pagefault_set_around(uint32_t npages)
+{
+    uint32_t old = pagefault_around_pages;
+    uint32_t window = 1;
+
+    while (window * 2 <= npages && window * 2 <= PAGE_SIZE / sizeof(pte_t))
+        window *= 2;
+    pagefault_around_pages = window;
+    return old;
+}
+
+void
+pagefault_get_stats(pagefault_stats_t *stats)
+{
+    *stats = pagefault_stats;
+}
+
 /*
  * This gets called by _pt_fault_handler in mm/pagetable.c The
  * calling function has already done a lot of error checking for
@@ -50,6 +78,204 @@
  *              address which caused the fault, possible values
  *              can be found in pagefault.h
  */
+/*
+ * Tries to map the whole large page around vaddr at once. This is only
+ * done for areas mapped with MAP_LARGEPAGE which cover the entire large
+ * page, and only where no copy-on-write can happen: the area's object is
+ * written directly, or the area is read-only and every shadow object in
+ * between is still empty. Returns 0 if the large page was mapped; on
+ * failure the fault is handled a page at a time as usual.
+ */
+static int
+handle_pagefault_large(vmarea_t *vma, uintptr_t vaddr)
+{
+    uint32_t base = ADDR_TO_PN(vaddr) & ~(PAGE_LARGE_NPAGES - 1);
+    mmobj_t *o = vma->vma_obj;
+    pframe_t *pf;
+    int ret;
+
+    if (!(vma->vma_flags & MAP_LARGEPAGE) || !pt_large_pages_enabled())
+        return -ENOTSUP;
+    if (base < vma->vma_start || base + PAGE_LARGE_NPAGES > vma->vma_end)
+        return -ENOTSUP;
+    if (NULL != o->mmo_shadowed) {
+        if (vma->vma_prot & PROT_WRITE)
+            return -ENOTSUP;
+        for (; NULL != o->mmo_shadowed; o = o->mmo_shadowed) {
+            if (0 < o->mmo_nrespages)
+                return -ENOTSUP;
+        }
+    }
+
+    ret = pframe_get_large(o, vma->vma_off + (base - vma->vma_start), &pf);
+    if (ret < 0) {
+        dbg(DBG_VM, "no large page at 0x%08x: %d\n", vaddr, ret);
+        return ret;
+    }
+
+    uint32_t pdflags = PD_PRESENT | PD_USER;
+    if (vma->vma_prot & PROT_WRITE)
+        pdflags |= PD_WRITE;
+    return pt_map_large(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(base),
+                        pt_virt_to_phys((uintptr_t)pf->pf_addr), pdflags);
+}
+
+/*
+ * Returns the page a read of objpage through the area would find, but only
+ * if it is already resident and not busy, so that nothing here can block.
+ * Pages given up with MADV_FREE are left alone, since mapping one would
+ * keep it from being discarded without anything having used it.
+ * Shadow objects only ever hold pages which were copied into them, so a
+ * page missing from one is looked for further down the chain; a page
+ * missing from the bottom object would have to be read in and is skipped.
+ */
+static pframe_t *
+fault_around_lookup(vmarea_t *vma, uint32_t objpage)
+{
+    mmobj_t *o;
+    pframe_t *pf;
+
+    for (o = vma->vma_obj; NULL != o; o = o->mmo_shadowed) {
+        if (NULL != (pf = pframe_get_resident(o, objpage)))
+            return (pframe_is_busy(pf) || pframe_is_freeable(pf)) ? NULL : pf;
+    }
+    return NULL;
+}
+
+/*
+ * Maps the resident pages in the aligned window of pagefault_around_pages
+ * pages around pagenum, so that touching them later does not trap. Pages
+ * are only made writable if the fault handler would have: the area is
+ * writable, writes go to the page's own object (shared, or already copied
+ * into the top shadow object) and the page is already dirty, so that the
+ * first write to a clean page still faults and dirties it. Nothing is
+ * mapped over an existing entry, so there is nothing to invalidate.
+ */
+static void
+handle_fault_around(vmarea_t *vma, uint32_t pagenum)
+{
+    uint32_t window = pagefault_around_pages;
+    uint32_t lo, hi, pn;
+    pframe_t *pf;
+
+    if (window <= 1)
+        return;
+    lo = MAX(pagenum & ~(window - 1), vma->vma_start);
+    hi = MIN((pagenum & ~(window - 1)) + window, vma->vma_end);
+
+    for (pn = lo; pn < hi; ++pn) {
+        uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(pn);
+        uint32_t pdflags = PD_PRESENT | PD_USER;
+
+        if (pn == pagenum || pt_is_mapped(curproc->p_pagedir, vaddr))
+            continue;
+        if (NULL == (pf = fault_around_lookup(vma, vma->vma_off + pn - vma->vma_start)))
+            continue;
+
+        if ((vma->vma_prot & PROT_WRITE) && pframe_is_dirty(pf)
+            && ((vma->vma_flags & MAP_SHARED) || pf->pf_obj == vma->vma_obj))
+            pdflags |= PD_WRITE;
+        if (0 > pt_map(curproc->p_pagedir, vaddr,
+                       pt_virt_to_phys((uintptr_t)pf->pf_addr), pdflags, pdflags))
+            return;
+        pagefault_stats.pfs_around++;
+    }
+}
+
+/*
+ * Maps the shared zero page read-only at pagenum if a read there would
+ * only find a page of zeroes that does not exist yet: the area is private
+ * anonymous memory and no object in its chain has the page. Nothing is
+ * allocated, and the first write faults again and gets a private page in
+ * the usual way. Shared areas are left alone, since a write through
+ * another mapping of the object would never be seen through this one.
+ * Returns 0 if the zero page was mapped.
+ */
+static int
+pagefault_map_zero(vmarea_t *vma, uint32_t pagenum)
+{
+    uint32_t objpage = vma->vma_off + (pagenum - vma->vma_start);
+    uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(pagenum);
+    mmobj_t *o;
+    int ret;
+
+    if (!(vma->vma_flags & MAP_PRIVATE) || !mmobj_is_anon(mmobj_bottom_obj(vma->vma_obj)))
+        return -ENOTSUP;
+    for (o = vma->vma_obj; NULL != o; o = o->mmo_shadowed) {
+        if (NULL != pframe_get_resident(o, objpage))
+            return -EEXIST;
+    }
+
+    if ((ret = pt_map(curproc->p_pagedir, vaddr,
+                      pt_virt_to_phys((uintptr_t)anon_zero_page()),
+                      PD_PRESENT | PD_USER, PD_PRESENT | PD_USER)) < 0)
+        return ret;
+    tlb_flush(vaddr);
+    pagefault_stats.pfs_zero++;
+    return 0;
+}
+
+/*
+ * Finds the page a fault of the given kind on pagenum of vma would find,
+ * doing any copy-on-write a write needs, and maps it into the current
+ * address space. Pages are made writable only once writes go to their own
+ * object: a private mapping still reading the page below keeps it
+ * read-only, so that the first write faults and copies it. On success the
+ * page mapped is returned in *result.
+ */
+static int
+pagefault_map(vmarea_t *vma, uint32_t pagenum, int write_fault, pframe_t **result)
+{
+    uint32_t objpage = vma->vma_off + (pagenum - vma->vma_start);
+    uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(pagenum);
+    pframe_t *pf;
+
+    /* Only private mappings should trigger COW on write faults */
+    int forwrite = write_fault && (vma->vma_flags & MAP_PRIVATE);
+    int ret = pframe_lookup(vma->vma_obj, objpage, forwrite, &pf);
+    if (ret < 0) {
+        return ret;
+    }
+    if (write_fault) {
+        pframe_pin(pf);
+        int dirty_res = pframe_dirty(pf);
+        pframe_unpin(pf);
+
+        if (dirty_res < 0) {
+            return dirty_res;
+        }
+    }
+    uintptr_t paddr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+    uint32_t pdflags = PD_PRESENT | PD_USER;
+
+    if (vma->vma_prot & PROT_WRITE) {
+        if (vma->vma_flags & MAP_SHARED) {
+            /* shared writable mapping: writes go straight to the object */
+            pdflags |= PD_WRITE;
+        } else if ((vma->vma_flags & MAP_PRIVATE) &&
+                   pf->pf_obj == vma->vma_obj) {
+            /* private mapping, and we've already done COW into top shadow */
+            pdflags |= PD_WRITE;
+        }
+        /* else: private mapping still using bottom page -> keep read-only
+           so the first write will fault and we can COW */
+    }
+
+    if ((ret = pt_map(curproc->p_pagedir, vaddr, paddr, pdflags, pdflags)) < 0) {
+        return ret;
+    }
+    /* drop the pin a fresh copy-on-write page comes with, but not the
+     * ones holding a locked mapping's pages in memory */
+    if (pf->pf_pincount > pf->pf_lockcount) {
+        pframe_unpin(pf);
+    }
+    /* only this page's translation can be stale */
+    tlb_flush(vaddr);
+
+    *result = pf;
+    return 0;
+}
+
 #if 0
 void
 handle_pagefault(uintptr_t vaddr, uint32_t cause)
@@ -133,6 +359,8 @@ void
 handle_pagefault(uintptr_t vaddr, uint32_t cause)
 {
     uint32_t pagenum = ADDR_TO_PN(vaddr);
+
+    pagefault_stats.pfs_faults++;
     
     // 2. Find the vmarea that contains this address
     vmarea_t *vma = vmmap_lookup(curproc->p_vmmap, pagenum);
@@ -161,6 +389,11 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
         return;
     }
     
+    /* keep the chain this fault has to search short */
+    if (NULL != vma->vma_obj->mmo_shadowed) {
+        shadow_collapse(vma->vma_obj, SHADOW_COLLAPSE_WALK);
+    }
+
     // 4. Calculate offset within the memory object
     uint32_t pageoff = pagenum - vma->vma_start;
     uint32_t objpage = vma->vma_off + pageoff;
@@ -178,48 +411,117 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
         vma->vma_obj ? vma->vma_obj->mmo_shadowed : NULL,
         vma->vma_obj ? mmobj_bottom_obj(vma->vma_obj) : NULL);
 	dbg(DBG_TEST, "PF DEBUG: vma_ptr=%p prot=0x%x\n", vma, vma->vma_prot);
-    // 5. Get the page from the memory object (this loads it)
+    if (0 == handle_pagefault_large(vma, vaddr)) {
+        tlb_flush((uintptr_t)PAGE_ALIGN_DOWN(vaddr));
+        return;
+    }
+    /* let a sequential scan of a file read ahead of the faults, and drop
+     * the pages an area advised to be sequential has left behind */
+    vnode_t *vn = vnode_from_mmobj(mmobj_bottom_obj(vma->vma_obj));
+    if (NULL != vn) {
+        readahead_access(&vma->vma_ra, vn, objpage, 1);
+        if (READAHEAD_SEQUENTIAL == vma->vma_ra.ra_mode && objpage >= READAHEAD_MAX_PAGES) {
+            pframe_t *behind = pframe_get_resident(&vn->vn_mmobj, objpage - READAHEAD_MAX_PAGES);
+            if (NULL != behind)
+                pframe_deactivate(behind);
+        }
+    }
+
+    /* reading untouched anonymous memory needs no page of its own */
+    if (!write_fault && 0 == pagefault_map_zero(vma, pagenum)) {
+        handle_fault_around(vma, pagenum);
+        return;
+    }
+
+    // 5. Get the page from the memory object (this loads it) and map it
     pframe_t *pf;
-	/* Only private mappings should trigger COW on write faults */
-	int forwrite = write_fault && (vma->vma_flags & MAP_PRIVATE);
-    int ret = pframe_lookup(vma->vma_obj, objpage, forwrite, &pf);
+    int ret = pagefault_map(vma, pagenum, write_fault, &pf);
     if (ret < 0) {
         dbg(DBG_TEST, "Page fault at 0x%08x - pframe_lookup failed: %d\n", vaddr, ret);
         do_exit(EFAULT);
         return;
     }
-    if (cause & FAULT_WRITE){
-        pframe_pin(pf);
-        int dirty_res = pframe_dirty(pf);
-        pframe_unpin(pf);
 
-        if (dirty_res < 0){
-            do_exit(EFAULT);
-            panic("returned from do_exit");
-        }
+    handle_fault_around(vma, pagenum);
+}
+
+/*
+ * Faults in pages [lopage, hipage) of vma, which must belong to the
+ * current address space, ahead of their first use (MAP_POPULATE, mlock).
+ * Writable private pages are faulted in for writing, so that their
+ * copy-on-write happens here rather than on the first store. With lock
+ * set every page is also locked in memory with pframe_lock; if one of them
+ * cannot be had, the pages locked so far are unlocked again. Areas which
+ * can be neither read nor written are left alone. Returns the number of
+ * pages faulted in, or -errno.
+ */
+int
+pagefault_populate(vmarea_t *vma, uint32_t lopage, uint32_t hipage, int lock)
+{
+    int write = (vma->vma_prot & PROT_WRITE) && (vma->vma_flags & MAP_PRIVATE);
+    uint32_t pn;
+    pframe_t *pf;
+    int ret;
+
+    KASSERT(vma->vma_vmmap == curproc->p_vmmap);
+    KASSERT(vma->vma_start <= lopage && lopage <= hipage && hipage <= vma->vma_end);
+
+    if (!(vma->vma_prot & (PROT_READ | PROT_WRITE))) {
+        return 0;
     }
-    // 5. Map the page into the page table
-    uintptr_t paddr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
-    uint32_t pdflags = PD_PRESENT | PD_USER;
 
-if (vma->vma_prot & PROT_WRITE) {
-    if (vma->vma_flags & MAP_SHARED) {
-        /* shared writable mapping: writes go straight to the object */
-        pdflags |= PD_WRITE;
-    } else if ((vma->vma_flags & MAP_PRIVATE) &&
-               pf->pf_obj == vma->vma_obj) {
-        /* private mapping, and we've already done COW into top shadow */
-        pdflags |= PD_WRITE;
+    for (pn = lopage; pn < hipage; ++pn) {
+        /* a large page is never copied, so it cannot be locked page by
+         * page, but it needs no fault of its own either */
+        if (!lock && 0 == (pn & (PAGE_LARGE_NPAGES - 1))
+            && 0 == handle_pagefault_large(vma, (uintptr_t)PN_TO_ADDR(pn))) {
+            tlb_flush((uintptr_t)PN_TO_ADDR(pn));
+            pn += PAGE_LARGE_NPAGES - 1;
+            continue;
+        }
+        if ((ret = pagefault_map(vma, pn, write, &pf)) < 0) {
+            if (lock) {
+                pagefault_unlock(vma, lopage, pn);
+            }
+            return ret;
+        }
+        if (lock) {
+            pframe_lock(pf);
+        }
     }
-    /* else: private mapping still using bottom page -> keep read-only
-       so the first write will fault and we can COW */
+    return MIN(pn, hipage) - lopage;
 }
-    
-    pt_map(curproc->p_pagedir, 
-           (uintptr_t)PAGE_ALIGN_DOWN(vaddr),
-           paddr,
-           pdflags,
-           pdflags);
-    if(pf->pf_pincount > 0) pframe_unpin(pf); 
-    tlb_flush_all();
+
+/*
+ * Drops the locks pagefault_populate took on pages [lopage, hipage) of
+ * vma. The page a lock is on is not necessarily the one mapped now: after
+ * a fork, a write copies a locked page into the new top shadow object and
+ * the lock stays with the original further down the chain. So each page's
+ * chain is searched for the first locked copy. Returns the number of
+ * pages unlocked.
+ */
+uint32_t
+pagefault_unlock(vmarea_t *vma, uint32_t lopage, uint32_t hipage)
+{
+    uint32_t pn, nunlocked = 0;
+    mmobj_t *o;
+    pframe_t *pf;
+
+    /* pagefault_populate locked nothing here, and any lock found would
+     * belong to someone else */
+    if (!(vma->vma_prot & (PROT_READ | PROT_WRITE))) {
+        return 0;
+    }
+    for (pn = lopage; pn < hipage; ++pn) {
+        uint32_t objpage = vma->vma_off + (pn - vma->vma_start);
+
+        for (o = vma->vma_obj; NULL != o; o = o->mmo_shadowed) {
+            if (NULL != (pf = pframe_get_resident(o, objpage)) && pframe_is_locked(pf)) {
+                pframe_unlock(pf);
+                nunlocked++;
+                break;
+            }
+        }
+    }
+    return nunlocked;
 }
@@ -2,6 +2,7 @@
 
 #include "globals.h"
 #include "errno.h"
+#include "config.h"
 
 #include "util/string.h"
 #include "util/debug.h"
@@ -13,6 +14,7 @@
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
+#include "vm/anon.h"
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
@@ -30,6 +32,8 @@ static int shadow_singleton_count = 0;
 
 static slab_allocator_t *shadow_allocator;
 
+static int shadow_collapsing = 0; /* shadow_collapse is running */
+
 static void shadow_ref(mmobj_t *o);
 static void shadow_put(mmobj_t *o);
 static int  shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
@@ -122,7 +126,15 @@ shadow_put(mmobj_t *o)
 		pframe_free(pf);
         } list_iterate_end();
 	if (o->mmo_shadowed) {
-	    o->mmo_shadowed->mmo_ops->put(o->mmo_shadowed);
+	    /* if the object below is left with a single parent, the chain
+	     * through it can be shortened right away */
+	    mmobj_t *below = o->mmo_shadowed;
+	    int collapse = NULL != below->mmo_shadowed
+	                   && below->mmo_refcount - below->mmo_nrespages == 2;
+	    below->mmo_ops->put(below);
+	    if (collapse) {
+		shadow_collapse(below, SHADOW_COLLAPSE_WALK);
+	    }
 	}
 	mmobj_t *bottom = o->mmo_un.mmo_bottom_obj;
 	if (bottom && bottom != o->mmo_shadowed) {
@@ -134,6 +146,107 @@ shadow_put(mmobj_t *o)
 
 }
 
+/*
+ * Shortens the chain below o by merging into o every shadow object whose
+ * only parent is the object above it, which is what a fork leaves behind
+ * once either side has exited. The merged object's pages move up into o
+ * unless o already has its own copy, in which case they are freed, and o
+ * then shadows whatever the merged object did. The walk stops after
+ * maxwalk objects, at the bottom object, or at a busy or pinned page,
+ * so that it never blocks and its cost per call is bounded.
+ */
+int
+shadow_collapse(mmobj_t *o, int maxwalk)
+{
+        mmobj_t *below;
+        pframe_t *pf;
+        int removed = 0;
+
+        KASSERT(NULL != o->mmo_shadowed);
+
+        /* putting a merged object can make shadow_put call back in here;
+         * that is left to this walk rather than nested on the stack */
+        if (shadow_collapsing)
+                return 0;
+        shadow_collapsing = 1;
+
+        while (0 < maxwalk-- && NULL != (below = o->mmo_shadowed)
+               && NULL != below->mmo_shadowed) {
+                if (below->mmo_refcount - below->mmo_nrespages != 1) {
+                        o = below;
+                        continue;
+                }
+
+                while (!list_empty(&below->mmo_respages)) {
+                        pf = list_head(&below->mmo_respages, pframe_t, pf_olink);
+                        if (pframe_is_busy(pf) || pf->pf_pincount > pf->pf_lockcount
+                            || 0 > pframe_migrate(pf, o))
+                                goto out;
+                }
+
+                o->mmo_shadowed = below->mmo_shadowed;
+                o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
+                KASSERT(1 == below->mmo_refcount && 0 == below->mmo_nrespages);
+                below->mmo_ops->put(below);
+                removed++;
+        }
+out:
+        shadow_collapsing = 0;
+        return removed;
+}
+
+/*
+ * Returns whether no one but the area or areas whose top object is top
+ * can see the pages of bottom, an anonymous object at the bottom of its
+ * chain. The reference count cannot tell, since every shadow object made
+ * by fork also holds one on the bottom object, but every area whose chain
+ * ends in bottom is on its list.
+ */
+static int
+shadow_bottom_exclusive(mmobj_t *top, mmobj_t *bottom)
+{
+        vmarea_t *vma;
+
+        list_iterate_begin(&bottom->mmo_un.mmo_vmas, vma, vmarea_t, vma_olink) {
+                if (vma->vma_obj != top)
+                        return 0;
+        } list_iterate_end();
+        return 1;
+}
+
+/*
+ * Before a write to pagenum of o copies the page up from further down the
+ * chain, checks whether anyone else can still see that page. If every
+ * object between o and the one holding it has no parent but the one above
+ * it, which is what a fork followed by the exit of either side leaves
+ * behind, the page itself is moved up into o with pframe_migrate and
+ * nothing is copied. Pages of a file are never taken from it, and busy,
+ * pinned or large pages are left where they are.
+ */
+static void
+shadow_migrate_exclusive(mmobj_t *o, uint32_t pagenum)
+{
+        mmobj_t *curr;
+        pframe_t *p;
+
+        for (curr = o->mmo_shadowed; NULL != curr; curr = curr->mmo_shadowed) {
+                if (NULL == curr->mmo_shadowed) {
+                        if (!mmobj_is_anon(curr) || !shadow_bottom_exclusive(o, curr))
+                                return;
+                } else if (curr->mmo_refcount - curr->mmo_nrespages != 1) {
+                        return;
+                }
+
+                if (NULL != (p = pframe_get_resident(curr, pagenum))) {
+                        if (pframe_is_busy(p) || pframe_is_large(p)
+                            || p->pf_pincount > p->pf_lockcount)
+                                return;
+                        pframe_migrate(p, o);
+                        return;
+                }
+        }
+}
+
 /* This function looks up the given page in this shadow object. The
  * forwrite argument is true if the page is being looked up for
  * writing, false if it is being looked up for reading. This function
@@ -178,6 +291,9 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 	return pframe_get(bottom, pagenum, pf);
 #endif
     if (forwrite){
+        if (NULL == pframe_get_resident(o, pagenum)) {
+            shadow_migrate_exclusive(o, pagenum);
+        }
         return pframe_get(o, pagenum, pf);
     }
 
@@ -290,6 +406,19 @@ pframe_t *p = NULL;
     
     if (p == NULL){
         KASSERT(curr == o->mmo_un.mmo_bottom_obj);
+        /* an anonymous page which was never written is all zeroes, so
+         * there is no need to make one down there just to copy it */
+        if (mmobj_is_anon(curr) && NULL == pframe_get_resident(curr, pf->pf_pagenum)) {
+            void *zeroed = page_zero_take();
+            if (NULL != zeroed) {
+                page_free(pf->pf_addr);
+                pf->pf_addr = zeroed;
+            } else {
+                memset(pf->pf_addr, 0, PAGE_SIZE);
+            }
+            pframe_pin(pf);
+            return 0;
+        }
         int lookup_res = pframe_lookup(curr, pf->pf_pagenum, 1, &p);
 
         if (lookup_res < 0){
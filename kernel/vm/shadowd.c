@@ -76,6 +76,7 @@ shadowd(int arg1, void *arg2)
                                                 if (o->mmo_refcount - o->mmo_nrespages == 1) {
                                                         /* migrate all its pages to last, and remove it from the shadow tree */
                                                         pframe_t *pf;
+                                                        int err = 0;
                                                         list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
                                                                 /* Because the operations that could be
                                                                  * performed with an intermediate shadow object
@@ -83,8 +84,17 @@ shadowd(int arg1, void *arg2)
                                                                  * we always expect to see non-busy pages. */
                                                                 KASSERT(!pframe_is_busy(pf));
                                                                 /* o has refcount 1+nrespages, so this won't delete it yet */
-                                                                pframe_migrate(pf, last);
+                                                                if (0 > (err = pframe_migrate(pf, last))) {
+                                                                        goto migrate_done;
+                                                                }
                                                         } list_iterate_end();
+migrate_done:
+                                                        if (0 > err) {
+                                                                /* out of memory; the pages moved so far are
+                                                                 * still found through last, so just leave the
+                                                                 * rest of this branch alone for now */
+                                                                break;
+                                                        }
                                                         last->mmo_shadowed = o->mmo_shadowed;
                                                         /* Ref o's shadowed, so we don't accidentally delete it when we
                                                          * finally put o */
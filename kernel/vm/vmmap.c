@@ -3,10 +3,12 @@
 #include "kernel.h"
 #include "errno.h"
 #include "globals.h"
+#include "config.h"
 
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/pagefault.h"
 
 #include "proc/proc.h"
 
@@ -27,16 +29,32 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mmobj.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+#include "mm/tlb.h"
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
 
+/* Slab constructor for vmareas. Every user of a vmarea sets these members
+ * itself, so nothing has to be restored before it is freed. */
+static void
+vmarea_ctor(void *obj)
+{
+        vmarea_t *vma = (vmarea_t *)obj;
+        vma->vma_vmmap = NULL;
+        vma->vma_obj = NULL;
+        list_link_init(&vma->vma_plink);
+        list_link_init(&vma->vma_olink);
+}
+
 void
 vmmap_init(void)
 {
         vmmap_allocator = slab_allocator_create("vmmap", sizeof(vmmap_t));
         KASSERT(NULL != vmmap_allocator && "failed to create vmmap allocator!");
-        vmarea_allocator = slab_allocator_create("vmarea", sizeof(vmarea_t));
+        vmarea_allocator = slab_allocator_create_ctor("vmarea", sizeof(vmarea_t),
+                                                      vmarea_ctor, NULL);
         KASSERT(NULL != vmarea_allocator && "failed to create vmarea allocator!");
 }
 
@@ -46,6 +64,7 @@ vmarea_alloc(void)
         vmarea_t *newvma = (vmarea_t *) slab_obj_alloc(vmarea_allocator);
         if (newvma) {
                 newvma->vma_vmmap = NULL;
+                readahead_init(&newvma->vma_ra);
         }
         return newvma;
 }
@@ -57,6 +76,19 @@ vmarea_free(vmarea_t *vma)
         slab_obj_free(vmarea_allocator, vma);
 }
 
+/* Returns the number of objects a lookup through vma may have to search,
+ * counting its own object and the one at the bottom of the chain */
+uint32_t
+vmarea_chain_length(vmarea_t *vma)
+{
+        uint32_t len = 0;
+        mmobj_t *o;
+
+        for (o = vma->vma_obj; NULL != o; o = o->mmo_shadowed)
+                len++;
+        return len;
+}
+
 /* a debugging routine: dumps the mappings of the given address space. */
 size_t
 vmmap_mapping_info(const void *vmmap, char *buf, size_t osize)
@@ -69,9 +101,9 @@ vmmap_mapping_info(const void *vmmap, char *buf, size_t osize)
         vmarea_t *vma;
         ssize_t size = (ssize_t)osize;
 
-        int len = snprintf(buf, size, "%21s %5s %7s %8s %10s %12s\n",
+        int len = snprintf(buf, size, "%21s %5s %7s %8s %10s %12s %5s\n",
                            "VADDR RANGE", "PROT", "FLAGS", "MMOBJ", "OFFSET",
-                           "VFN RANGE");
+                           "VFN RANGE", "CHAIN");
 
         list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
                 size -= len;
@@ -81,14 +113,15 @@ vmmap_mapping_info(const void *vmmap, char *buf, size_t osize)
                 }
 
                 len = snprintf(buf, size,
-                               "%#.8x-%#.8x  %c%c%c  %7s 0x%p %#.5x %#.5x-%#.5x\n",
+                               "%#.8x-%#.8x  %c%c%c  %7s 0x%p %#.5x %#.5x-%#.5x %5u\n",
                                vma->vma_start << PAGE_SHIFT,
                                vma->vma_end << PAGE_SHIFT,
                                (vma->vma_prot & PROT_READ ? 'r' : '-'),
                                (vma->vma_prot & PROT_WRITE ? 'w' : '-'),
                                (vma->vma_prot & PROT_EXEC ? 'x' : '-'),
                                (vma->vma_flags & MAP_SHARED ? " SHARED" : "PRIVATE"),
-                               vma->vma_obj, vma->vma_off, vma->vma_start, vma->vma_end);
+                               vma->vma_obj, vma->vma_off, vma->vma_start, vma->vma_end,
+                               vmarea_chain_length(vma));
         } list_iterate_end();
 
 end:
@@ -107,6 +140,235 @@ end:
         return osize - size;
 }
 
+/*
+ * Every area of an address space is on vmm_list, in address order, for
+ * iterating over, and in an AVL tree keyed by vma_start, for finding one
+ * in O(log n). Each area also records the free pages between it and the
+ * area before it, or USER_MEM_LOW for the first one (vma_gap), and every
+ * node of the tree the largest such gap in its subtree (vma_maxgap), so
+ * that a search for a free range can pass over any subtree without a big
+ * enough gap. The gap above the last area is not in the tree and is
+ * checked on its own. Anything which moves an area's start or end has to
+ * go through vmmap_resize() to keep the gaps right.
+ */
+
+#define VMMAP_LO_PAGE   ADDR_TO_PN(USER_MEM_LOW)
+#define VMMAP_HI_PAGE   ADDR_TO_PN(USER_MEM_HIGH)
+
+static inline int
+vmmap_tree_height(vmarea_t *v)
+{
+        return (NULL == v) ? 0 : v->vma_theight;
+}
+
+static vmarea_t *
+vmmap_prev(vmmap_t *map, vmarea_t *vma)
+{
+        list_link_t *link = vma->vma_plink.l_prev;
+        return (link == &map->vmm_list) ? NULL : list_item(link, vmarea_t, vma_plink);
+}
+
+static vmarea_t *
+vmmap_next(vmmap_t *map, vmarea_t *vma)
+{
+        list_link_t *link = vma->vma_plink.l_next;
+        return (link == &map->vmm_list) ? NULL : list_item(link, vmarea_t, vma_plink);
+}
+
+/* Recomputes v's height and largest gap from its children's */
+static void
+vmmap_tree_pull(vmarea_t *v)
+{
+        uint32_t maxgap = v->vma_gap;
+
+        v->vma_theight = 1 + MAX(vmmap_tree_height(v->vma_tleft),
+                                 vmmap_tree_height(v->vma_tright));
+        if (NULL != v->vma_tleft)
+                maxgap = MAX(maxgap, v->vma_tleft->vma_maxgap);
+        if (NULL != v->vma_tright)
+                maxgap = MAX(maxgap, v->vma_tright->vma_maxgap);
+        v->vma_maxgap = maxgap;
+}
+
+/* Puts new (which may be NULL) where old is in the tree */
+static void
+vmmap_tree_replace(vmmap_t *map, vmarea_t *old, vmarea_t *new)
+{
+        vmarea_t *parent = old->vma_tparent;
+
+        if (NULL != new)
+                new->vma_tparent = parent;
+        if (NULL == parent)
+                map->vmm_root = new;
+        else if (parent->vma_tleft == old)
+                parent->vma_tleft = new;
+        else
+                parent->vma_tright = new;
+}
+
+/* Rotates v's right child up into v's place and returns it */
+static vmarea_t *
+vmmap_tree_rotate_left(vmmap_t *map, vmarea_t *v)
+{
+        vmarea_t *r = v->vma_tright;
+
+        vmmap_tree_replace(map, v, r);
+        v->vma_tright = r->vma_tleft;
+        if (NULL != v->vma_tright)
+                v->vma_tright->vma_tparent = v;
+        r->vma_tleft = v;
+        v->vma_tparent = r;
+        vmmap_tree_pull(v);
+        vmmap_tree_pull(r);
+        return r;
+}
+
+/* Rotates v's left child up into v's place and returns it */
+static vmarea_t *
+vmmap_tree_rotate_right(vmmap_t *map, vmarea_t *v)
+{
+        vmarea_t *l = v->vma_tleft;
+
+        vmmap_tree_replace(map, v, l);
+        v->vma_tleft = l->vma_tright;
+        if (NULL != v->vma_tleft)
+                v->vma_tleft->vma_tparent = v;
+        l->vma_tright = v;
+        v->vma_tparent = l;
+        vmmap_tree_pull(v);
+        vmmap_tree_pull(l);
+        return l;
+}
+
+/* Rebalances the tree and recomputes the summaries on the path from v up
+ * to the root, after v's subtree has changed */
+static void
+vmmap_tree_fixup(vmmap_t *map, vmarea_t *v)
+{
+        for (; NULL != v; v = v->vma_tparent) {
+                int balance = vmmap_tree_height(v->vma_tleft) - vmmap_tree_height(v->vma_tright);
+
+                if (balance > 1) {
+                        vmarea_t *l = v->vma_tleft;
+                        if (vmmap_tree_height(l->vma_tleft) < vmmap_tree_height(l->vma_tright))
+                                vmmap_tree_rotate_left(map, l);
+                        v = vmmap_tree_rotate_right(map, v);
+                } else if (balance < -1) {
+                        vmarea_t *r = v->vma_tright;
+                        if (vmmap_tree_height(r->vma_tright) < vmmap_tree_height(r->vma_tleft))
+                                vmmap_tree_rotate_right(map, r);
+                        v = vmmap_tree_rotate_left(map, v);
+                } else {
+                        vmmap_tree_pull(v);
+                }
+        }
+}
+
+static void
+vmmap_tree_insert(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t **link = &map->vmm_root;
+        vmarea_t *parent = NULL;
+
+        while (NULL != *link) {
+                parent = *link;
+                link = (vma->vma_start < parent->vma_start)
+                       ? &parent->vma_tleft : &parent->vma_tright;
+        }
+        vma->vma_tparent = parent;
+        vma->vma_tleft = NULL;
+        vma->vma_tright = NULL;
+        *link = vma;
+        vmmap_tree_fixup(map, vma);
+}
+
+static void
+vmmap_tree_remove(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *fix;
+
+        if (NULL != vma->vma_tleft && NULL != vma->vma_tright) {
+                /* the next area has no left child; move it into vma's place */
+                vmarea_t *next = vma->vma_tright;
+                while (NULL != next->vma_tleft)
+                        next = next->vma_tleft;
+
+                if (next->vma_tparent == vma) {
+                        fix = next;
+                } else {
+                        fix = next->vma_tparent;
+                        vmmap_tree_replace(map, next, next->vma_tright);
+                        next->vma_tright = vma->vma_tright;
+                        next->vma_tright->vma_tparent = next;
+                }
+                vmmap_tree_replace(map, vma, next);
+                next->vma_tleft = vma->vma_tleft;
+                next->vma_tleft->vma_tparent = next;
+        } else {
+                fix = vma->vma_tparent;
+                vmmap_tree_replace(map, vma, (NULL != vma->vma_tleft)
+                                   ? vma->vma_tleft : vma->vma_tright);
+        }
+        vmmap_tree_fixup(map, fix);
+}
+
+/* Recomputes the gap below vma (if there is one) from the area before it */
+static void
+vmmap_gap_update(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *prev;
+        uint32_t base;
+
+        if (NULL == vma)
+                return;
+        prev = vmmap_prev(map, vma);
+        base = (NULL == prev) ? VMMAP_LO_PAGE : prev->vma_end;
+        vma->vma_gap = (vma->vma_start > base) ? vma->vma_start - base : 0;
+        vmmap_tree_fixup(map, vma);
+}
+
+/* Returns the lowest area ending above vfn, or NULL if there is none */
+static vmarea_t *
+vmmap_tree_above(vmmap_t *map, uint32_t vfn)
+{
+        vmarea_t *v = map->vmm_root, *found = NULL;
+
+        while (NULL != v) {
+                if (v->vma_end > vfn) {
+                        found = v;
+                        v = v->vma_tleft;
+                } else {
+                        v = v->vma_tright;
+                }
+        }
+        return found;
+}
+
+/* Takes vma off the map's list and out of its tree */
+static void
+vmmap_unlink(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *next = vmmap_next(map, vma);
+
+        list_remove(&vma->vma_plink);
+        vmmap_tree_remove(map, vma);
+        vmmap_gap_update(map, next);
+}
+
+/* Moves the bounds of an area in a map to [start, end), which must not
+ * overlap any other area in it. */
+void
+vmmap_resize(vmarea_t *vma, uint32_t start, uint32_t end)
+{
+        vmmap_t *map = vma->vma_vmmap;
+
+        KASSERT(NULL != map && start < end);
+        vma->vma_start = start;
+        vma->vma_end = end;
+        vmmap_gap_update(map, vma);
+        vmmap_gap_update(map, vmmap_next(map, vma));
+}
+
 /* Create a new vmmap, which has no vmareas and does
  * not refer to a process. */
 vmmap_t *
@@ -118,6 +380,8 @@ vmmap_create(void)
 	list_init(&vm_t->vmm_list); //empty vmarea list
 
    	vm_t->vmm_proc = NULL; // no process yet
+	vm_t->vmm_nlocked = 0;
+	vm_t->vmm_root = NULL;
         return vm_t;
 }
 
@@ -132,8 +396,14 @@ vmmap_destroy(vmmap_t *map)
 
 		list_remove(&vma->vma_plink);
 
+		if (vma->vma_flags & MAP_LOCKED) {
+		    map->vmm_nlocked -= pagefault_unlock(vma, vma->vma_start, vma->vma_end);
+		}
 		if (vma->vma_obj) {
   dbg(DBG_TEST, "vmmap_destroy: vma 0x%p, obj 0x%p\n", vma, vma->vma_obj);
+		    if (list_link_is_linked(&vma->vma_olink)) {
+			list_remove(&vma->vma_olink);
+		    }
 		    vma->vma_obj->mmo_ops->put(vma->vma_obj);
 		}
 
@@ -147,6 +417,19 @@ vmmap_destroy(vmmap_t *map)
 	return;
 }
 
+/* Collapses the shadow chains of map's copy-on-write areas, a bounded
+ * amount each, after another process sharing them has gone away */
+void
+vmmap_collapse(vmmap_t *map)
+{
+        vmarea_t *vma;
+
+        list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+                if (NULL != vma->vma_obj && NULL != vma->vma_obj->mmo_shadowed)
+                        shadow_collapse(vma->vma_obj, SHADOW_COLLAPSE_WALK);
+        } list_iterate_end();
+}
+
 /* Add a vmarea to an address space. Assumes (i.e. asserts to some extent)
  * the vmarea is valid.  This involves finding where to put it in the list
  * of VM areas, and adding it. Don't forget to set the vma_vmmap for the
@@ -157,22 +440,68 @@ vmmap_insert(vmmap_t *map, vmarea_t *newvma)
 	KASSERT(map != NULL);
 	KASSERT(newvma != NULL);
 
-	vmarea_t *vma;
+	KASSERT(newvma->vma_start < newvma->vma_end);
 	newvma->vma_vmmap = map;
-	uint32_t start = newvma->vma_start;
-	uint32_t end = newvma->vma_end;
-	
-	list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
-                if(vma->vma_start > start){
-			list_insert_before(&vma->vma_plink, &newvma->vma_plink);
-			return;
+
+	/* areas do not overlap, so the first one ending above the new
+	 * area's start is the one after it */
+	vmarea_t *after = vmmap_tree_above(map, newvma->vma_start);
+	KASSERT(after == NULL || after->vma_start >= newvma->vma_end);
+	if (after != NULL) {
+		list_insert_before(&after->vma_plink, &newvma->vma_plink);
+	} else {
+		list_insert_tail(&map->vmm_list, &newvma->vma_plink);
+	}
+
+	newvma->vma_gap = 0;
+	vmmap_tree_insert(map, newvma);
+	vmmap_gap_update(map, newvma);
+	vmmap_gap_update(map, after);
+}
+
+/* Returns the lowest start, a multiple of align, of npages free pages
+ * in the gap below an area in v's subtree, or -1. Subtrees without a big
+ * enough gap are skipped; a gap which is big enough may still not fit the
+ * range once its start is aligned, in which case the search goes on. */
+static int
+vmmap_find_lohi(vmarea_t *v, uint32_t npages, uint32_t align)
+{
+	int ret;
+
+	if (v == NULL || v->vma_maxgap < npages) {
+		return -1;
+	}
+	if (-1 != (ret = vmmap_find_lohi(v->vma_tleft, npages, align))) {
+		return ret;
+	}
+	if (v->vma_gap >= npages) {
+		uint32_t start = (v->vma_start - v->vma_gap + align - 1) & ~(align - 1);
+		if (start < v->vma_start && v->vma_start - start >= npages) {
+			return start;
 		}
-			
-        } list_iterate_end();
+	}
+	return vmmap_find_lohi(v->vma_tright, npages, align);
+}
 
-	list_insert_tail(&map->vmm_list, &newvma->vma_plink);
-	
-	return;
+/* Like vmmap_find_lohi, but returns the highest start */
+static int
+vmmap_find_hilo(vmarea_t *v, uint32_t npages, uint32_t align)
+{
+	int ret;
+
+	if (v == NULL || v->vma_maxgap < npages) {
+		return -1;
+	}
+	if (-1 != (ret = vmmap_find_hilo(v->vma_tright, npages, align))) {
+		return ret;
+	}
+	if (v->vma_gap >= npages) {
+		uint32_t start = (v->vma_start - npages) & ~(align - 1);
+		if (start >= v->vma_start - v->vma_gap) {
+			return start;
+		}
+	}
+	return vmmap_find_hilo(v->vma_tleft, npages, align);
 }
 
 /* Find a contiguous range of free virtual pages of length npages in
@@ -184,70 +513,48 @@ vmmap_insert(vmmap_t *map, vmarea_t *newvma)
  * is VMMAP_DIR_LOHI, the gap should be as low as possible. */
 int
 vmmap_find_range(vmmap_t *map, uint32_t npages, int dir)
+{
+	return vmmap_find_range_aligned(map, npages, dir, 1);
+}
+
+/* Like vmmap_find_range, but the range returned starts at a multiple of
+ * align pages (a power of two). Used to place mappings which may be
+ * backed by large pages on large page boundaries. */
+int
+vmmap_find_range_aligned(vmmap_t *map, uint32_t npages, int dir, uint32_t align)
 {
 	KASSERT(map != NULL);
 	KASSERT(dir == VMMAP_DIR_HILO || dir == VMMAP_DIR_LOHI);
+	KASSERT(0 < align && 0 == (align & (align - 1)));
 	if((int)npages <= 0){
 		return -1;
 	}
-	uint32_t lo = USER_MEM_LOW >> PAGE_SHIFT;;
-        uint32_t hi = USER_MEM_HIGH >> PAGE_SHIFT;;    
-	vmarea_t *vma;
-	uint32_t start, end;
-	start = end = (uint32_t)-1;
+	uint32_t mask = ~(align - 1);
+	vmarea_t *last = list_empty(&map->vmm_list)
+	                 ? NULL : list_tail(&map->vmm_list, vmarea_t, vma_plink);
+	uint32_t top = (last == NULL) ? VMMAP_LO_PAGE : last->vma_end;
+	int ret;
+
 	if(dir == VMMAP_DIR_LOHI){
-		list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
-		        if(start != (uint32_t)-1){
-				if(vma->vma_start - end >= npages){
-					return end;
-				}
-			}else{
-				if (vma->vma_start - lo >= npages) {
-                                	return lo;
-                        	}
-			}
-			start = vma->vma_start;
-			end = vma->vma_end;
-		} list_iterate_end();
-		if (start == (uint32_t)-1) {
-		        if (hi - lo >= npages) {
-		                return lo;
-		        }
-		} else {
-		        if (hi > end && hi - end >= npages) {
-		                return end;
-		        }
+		if (-1 != (ret = vmmap_find_lohi(map->vmm_root, npages, align))) {
+			return ret;
+		}
+		uint32_t start = (top + align - 1) & mask;
+		if (start < VMMAP_HI_PAGE && VMMAP_HI_PAGE - start >= npages) {
+			return start;
 		}
 	}else{
-		list_iterate_reverse(&map->vmm_list, vma, vmarea_t, vma_plink) {
-		        if(start != (uint32_t)-1){
-				if(start - vma->vma_end >= npages){
-					return start - npages;
-				}
-			}else{
-				if (hi - vma->vma_end >= npages) {
-                                	return hi - npages;
-                        	}
-			}
-			start = vma->vma_start;
-			end = vma->vma_end;
-		} list_iterate_end();
-		if (start == (uint32_t)-1) {
-		        if (hi - lo >= npages) {
-		                return hi - npages;
-		        }
-		} else {
-		        if (lo < start && start - lo >= npages) {
-		                return start - npages;
-		        }
+		if (VMMAP_HI_PAGE - top >= npages
+		    && ((VMMAP_HI_PAGE - npages) & mask) >= top) {
+			return (VMMAP_HI_PAGE - npages) & mask;
 		}
+		return vmmap_find_hilo(map->vmm_root, npages, align);
 	}
-	
+
         return -1;
 }
 
-/* Find the vm_area that vfn lies in. Simply scan the address space
- * looking for a vma whose range covers vfn. If the page is unmapped,
+/* Find the vm_area that vfn lies in. If the page is unmapped,
  * return NULL. */
 vmarea_t *
 vmmap_lookup(vmmap_t *map, uint32_t vfn)
@@ -255,15 +562,10 @@ vmmap_lookup(vmmap_t *map, uint32_t vfn)
 	KASSERT(map != NULL);
 	if((int)vfn < 0) return NULL;
 
-	vmarea_t *vma;
-	
-	list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
-                if(vma->vma_start <= vfn && vfn < vma->vma_end){
-			return vma;
-		}
-			
-        } list_iterate_end();
-
+	vmarea_t *vma = vmmap_tree_above(map, vfn);
+	if (vma != NULL && vma->vma_start <= vfn) {
+		return vma;
+	}
         return NULL;
 }
 
@@ -292,8 +594,10 @@ vmmap_clone(vmmap_t *map)
 		newvma->vma_end = vma->vma_end;
 		newvma->vma_off = vma->vma_off;
 		newvma->vma_prot = vma->vma_prot;
-		newvma->vma_flags = vma->vma_flags;
+		/* locks are not inherited */
+		newvma->vma_flags = vma->vma_flags & ~MAP_LOCKED;
 		newvma->vma_obj = NULL;
+		readahead_init(&newvma->vma_ra);
 		list_link_init(&newvma->vma_olink);
 		vmmap_insert(newMap, newvma);
 			
@@ -315,7 +619,9 @@ vmmap_clone(vmmap_t *map)
  * of the area's fields except for vma_obj have been set before
  * calling mmap.
  *
- * If MAP_PRIVATE is specified set up a shadow object for the mmobj.
+ * If MAP_PRIVATE is specified and the area is writable set up a shadow
+ * object for the mmobj; a private area which can never be written reads
+ * the mmobj directly.
  *
  * All of the input to this function should be valid (KASSERT!).
  * See mmap(2) for for description of legal input.
@@ -349,8 +655,24 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
 	mmobj_t  *shadow = NULL;
 
 
+	/* Large pages are only used where they cannot be written through
+	 * to a file or copied on write: anonymous memory and read-only
+	 * file mappings */
+	if (file != NULL && (prot & PROT_WRITE)) {
+		flags &= ~MAP_LARGEPAGE;
+	}
+
 	if (lopage == 0) {
-		startvfn = vmmap_find_range(map, npages, dir);
+		/* a mapping of at least one large page gets to start on a
+		 * large page boundary so it can use them */
+		uint32_t align = 1;
+		if ((flags & MAP_LARGEPAGE) && npages >= PAGE_LARGE_NPAGES) {
+			align = PAGE_LARGE_NPAGES;
+		}
+		startvfn = vmmap_find_range_aligned(map, npages, dir, align);
+		if ((int)startvfn == -1 && align > 1) {
+			startvfn = vmmap_find_range(map, npages, dir);
+		}
 		if (startvfn == (uint32_t)-1 || (int)startvfn == -1) {
 		    return -ENOMEM;
 		}
@@ -398,7 +720,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
 	}
 
 
-	if (flags & MAP_PRIVATE) {
+	if (vmarea_is_cow(vma)) {
 		if (file != NULL) {
 		    shadow = shadow_create();
 		    if (shadow == NULL) {
@@ -432,6 +754,64 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
 	return 0;
 }
 
+/*
+ * Splits vma in two at pagenum, which must lie strictly inside it. vma
+ * keeps the pages below pagenum; the rest go to a new area sharing vma's
+ * object and access pattern, which is inserted into map and returned.
+ * Returns NULL if no vmarea could be allocated.
+ */
+static vmarea_t *
+vmmap_split(vmmap_t *map, vmarea_t *vma, uint32_t pagenum)
+{
+    KASSERT(vma->vma_start < pagenum && pagenum < vma->vma_end);
+
+    vmarea_t *right = vmarea_alloc();
+    if (right == NULL) {
+        return NULL;
+    }
+
+    right->vma_start = pagenum;
+    right->vma_end   = vma->vma_end;
+    right->vma_off   = vma->vma_off + (pagenum - vma->vma_start);
+    right->vma_prot  = vma->vma_prot;
+    right->vma_flags = vma->vma_flags;
+    right->vma_vmmap = NULL;
+    right->vma_obj   = vma->vma_obj;
+    right->vma_ra.ra_mode = vma->vma_ra.ra_mode;
+
+    if (right->vma_obj != NULL) {
+        right->vma_obj->mmo_ops->ref(right->vma_obj);
+        list_insert_tail(mmobj_bottom_vmas(right->vma_obj),
+                         &right->vma_olink);
+    }
+
+    vmmap_resize(vma, vma->vma_start, pagenum);
+
+    vmmap_insert(map, right);
+    return right;
+}
+
+/*
+ * Splits the areas at either end of [lopage, hipage), which must be
+ * entirely mapped, so that the range is covered by whole areas. Returns 0
+ * on success or -ENOMEM if no vmarea could be allocated.
+ */
+static int
+vmmap_split_range(vmmap_t *map, uint32_t lopage, uint32_t hipage)
+{
+    vmarea_t *vma;
+
+    vma = vmmap_lookup(map, lopage);
+    if (vma->vma_start < lopage && vmmap_split(map, vma, lopage) == NULL) {
+        return -ENOMEM;
+    }
+    vma = vmmap_lookup(map, hipage - 1);
+    if (vma->vma_end > hipage && vmmap_split(map, vma, hipage) == NULL) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
 /*
  * We have no guarantee that the region of the address space being
  * unmapped will play nicely with our list of vmareas.
@@ -473,18 +853,24 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
     uint32_t u_start = lopage;
     uint32_t u_end   = lopage + npages;
 
-    vmarea_t *vma;
+    vmarea_t *vma, *next;
 
-    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+    /* only the areas from the first one ending above the range on can
+     * overlap it */
+    for (vma = vmmap_tree_above(map, u_start); vma != NULL; vma = next) {
         uint32_t s = vma->vma_start;
         uint32_t e = vma->vma_end;
 
-        if (e <= u_start || s >= u_end) {
-            continue;
+        next = vmmap_next(map, vma);
+        if (s >= u_end) {
+            break;
         }
 
         if (u_start <= s && u_end >= e) {
-            list_remove(&vma->vma_plink);
+            if (vma->vma_flags & MAP_LOCKED) {
+                map->vmm_nlocked -= pagefault_unlock(vma, s, e);
+            }
+            vmmap_unlink(map, vma);
 
             if (vma->vma_obj != NULL) {
                 list_remove(&vma->vma_olink);
@@ -498,50 +884,278 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
         if (u_start <= s && u_end > s && u_end < e) {
             uint32_t old_start = vma->vma_start;
 
-            vma->vma_start = u_end;
+            if (vma->vma_flags & MAP_LOCKED) {
+                map->vmm_nlocked -= pagefault_unlock(vma, s, u_end);
+            }
+
+            vmmap_resize(vma, u_end, e);
             vma->vma_off  += (u_end - old_start);
 
             continue;
         }
 
         if (s < u_start && u_start < e && u_end >= e) {
-            vma->vma_end = u_start;
+            if (vma->vma_flags & MAP_LOCKED) {
+                map->vmm_nlocked -= pagefault_unlock(vma, u_start, e);
+            }
+            vmmap_resize(vma, s, u_start);
             continue;
         }
 
         if (s < u_start && u_end < e) {
-            vmarea_t *right = vmarea_alloc();
-            if (right == NULL) {
+            if (vmmap_split(map, vma, u_end) == NULL) {
                 return -ENOMEM;
             }
 
-            right->vma_start = u_end;
-            right->vma_end   = e;
-            right->vma_off   = vma->vma_off + (u_end - s);
-            right->vma_prot  = vma->vma_prot;
-            right->vma_flags = vma->vma_flags;
-            right->vma_vmmap = NULL;
-            right->vma_obj   = vma->vma_obj;
-
-            if (right->vma_obj != NULL) {
-                right->vma_obj->mmo_ops->ref(right->vma_obj);
-                list_insert_tail(mmobj_bottom_vmas(right->vma_obj),
-                                 &right->vma_olink);
+            if (vma->vma_flags & MAP_LOCKED) {
+                map->vmm_nlocked -= pagefault_unlock(vma, u_start, u_end);
             }
+            vmmap_resize(vma, s, u_start);
+
+            break;
+        }
+    }
 
-            vma->vma_end = u_start;
+    return 0;
+}
 
-            vmmap_insert(map, right);
 
+/*
+ * Marks the pages of o numbered [lopage, hipage) freeable, except those
+ * which would expose an older copy further down the shadow chain if they
+ * were discarded; those have to stay, since a discarded page must read
+ * back as either its last contents or zeros.
+ */
+static void
+vmmap_free_lazily(mmobj_t *o, uint32_t lopage, uint32_t hipage)
+{
+    pframe_t *pf;
+    mmobj_t *below;
+
+    list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+        if (pf->pf_pagenum < lopage || pf->pf_pagenum >= hipage) {
+            continue;
+        }
+        for (below = o->mmo_shadowed; below != NULL; below = below->mmo_shadowed) {
+            if (pframe_get_resident(below, pf->pf_pagenum) != NULL) {
+                break;
+            }
+        }
+        if (below == NULL) {
+            pframe_set_freeable(pf);
+        }
+    } list_iterate_end();
+}
+
+/*
+ * Applies madvise(2) advice to the pages [lopage, lopage + npages) of
+ * the address space, which must all be mapped:
+ *
+ *     MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM
+ *         set the access pattern readahead assumes for faults in the
+ *         range, splitting areas so that it applies to the range alone
+ *     MADV_WILLNEED
+ *         queues the file pages behind the range to be read in
+ *     MADV_DONTNEED
+ *         unmaps the range and frees private copies of its pages, so that
+ *         it reads back as the file's contents, or as zeros for anonymous
+ *         memory which has not been shared with a child since it was
+ *         written
+ *     MADV_FREE
+ *         unmaps the range and lets the clock discard its anonymous pages
+ *         whenever it needs memory, unless they are touched again first
+ *
+ * MADV_DONTNEED and MADV_FREE are refused for locked areas and areas
+ * mapped with MAP_LARGEPAGE. Their pages are pinned, so they could not
+ * be freed, and the next fault would map the old contents back in.
+ *
+ * Returns 0 on success, -ENOMEM if part of the range is unmapped or an
+ * area could not be split, or -EINVAL for MADV_FREE on a file or shared
+ * mapping or for MADV_DONTNEED or MADV_FREE on a locked or large page
+ * area.
+ */
+int
+vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice)
+{
+    uint32_t hipage = lopage + npages;
+    uint32_t next = lopage;
+    vmarea_t *vma;
+    tlb_batch_t tb;
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (vma->vma_end <= next || vma->vma_start >= hipage) {
+            continue;
+        }
+        if (vma->vma_start > next) {
+            return -ENOMEM;
+        }
+        if (advice == MADV_FREE
+            && (!vmarea_is_cow(vma)
+                || vnode_from_mmobj(mmobj_bottom_obj(vma->vma_obj)) != NULL)) {
+            return -EINVAL;
+        }
+        if ((advice == MADV_DONTNEED || advice == MADV_FREE)
+            && (vma->vma_flags & (MAP_LOCKED | MAP_LARGEPAGE))) {
+            return -EINVAL;
+        }
+        next = vma->vma_end;
+    } list_iterate_end();
+    if (next < hipage) {
+        return -ENOMEM;
+    }
+
+    if ((advice == MADV_NORMAL || advice == MADV_SEQUENTIAL || advice == MADV_RANDOM)
+        && vmmap_split_range(map, lopage, hipage) < 0) {
+        return -ENOMEM;
+    }
+
+    tlb_batch_init(&tb);
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (vma->vma_end <= lopage || vma->vma_start >= hipage) {
+            continue;
+        }
+        uint32_t lo = MAX(vma->vma_start, lopage);
+        uint32_t hi = MIN(vma->vma_end, hipage);
+        uint32_t objlo = vma->vma_off + (lo - vma->vma_start);
+        vnode_t *vn = vnode_from_mmobj(mmobj_bottom_obj(vma->vma_obj));
+
+        switch (advice) {
+        case MADV_NORMAL:
+            readahead_set_mode(&vma->vma_ra, READAHEAD_NORMAL);
+            break;
+        case MADV_SEQUENTIAL:
+            readahead_set_mode(&vma->vma_ra, READAHEAD_SEQUENTIAL);
+            break;
+        case MADV_RANDOM:
+            readahead_set_mode(&vma->vma_ra, READAHEAD_RANDOM);
+            break;
+        case MADV_WILLNEED:
+            if (vn != NULL) {
+                readahead_prefetch(vn, objlo, hi - lo);
+            }
+            break;
+        case MADV_DONTNEED:
+        case MADV_FREE:
+            if (map->vmm_proc != NULL) {
+                pt_unmap_range_batch(map->vmm_proc->p_pagedir, (uintptr_t)PN_TO_ADDR(lo),
+                                     (uintptr_t)PN_TO_ADDR(hi), &tb);
+            }
+            if (advice == MADV_FREE) {
+                vmmap_free_lazily(vma->vma_obj, objlo, objlo + (hi - lo));
+            } else if (vmarea_is_cow(vma)) {
+                /* an area which cannot be written may be sharing its
+                 * object, so its pages stay for whoever else maps them */
+                pframe_free_range(vma->vma_obj, objlo, objlo + (hi - lo));
+            }
             break;
         }
+    } list_iterate_end();
+    tlb_batch_flush(&tb);
+
+    return 0;
+}
+
+/*
+ * Locks the pages [lopage, lopage + npages) of the current address space,
+ * which must all be mapped, in memory (mlock(2)). The areas covering the
+ * range are split at its ends, faulted in with pagefault_populate and
+ * marked MAP_LOCKED; their pages then stay resident and mapped until they
+ * are unlocked or unmapped or the process exits. A child forked later
+ * does not inherit the locks.
+ *
+ * Returns 0 on success, -ENOMEM if part of the range is unmapped, an area
+ * could not be split, or the process would end up with more than
+ * VMMAP_MAX_LOCKED_PAGES pages locked, or the error faulting in a page
+ * failed with; the areas locked before that stay locked.
+ */
+int
+vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t hipage = lopage + npages;
+    uint32_t next = lopage;
+    uint32_t nlocking = 0;
+    vmarea_t *vma;
+    int ret;
 
+    KASSERT(curproc->p_vmmap == map);
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (vma->vma_end <= next || vma->vma_start >= hipage) {
+            continue;
+        }
+        if (vma->vma_start > next) {
+            return -ENOMEM;
+        }
+        if (!(vma->vma_flags & MAP_LOCKED)) {
+            nlocking += MIN(vma->vma_end, hipage) - MAX(vma->vma_start, lopage);
+        }
+        next = vma->vma_end;
+    } list_iterate_end();
+    if (next < hipage || map->vmm_nlocked + nlocking > VMMAP_MAX_LOCKED_PAGES) {
+        return -ENOMEM;
+    }
+    if (nlocking == 0) {
+        return 0;
+    }
+    if (vmmap_split_range(map, lopage, hipage) < 0) {
+        return -ENOMEM;
+    }
 
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (vma->vma_end <= lopage || vma->vma_start >= hipage
+            || (vma->vma_flags & MAP_LOCKED)) {
+            continue;
+        }
+        if ((ret = pagefault_populate(vma, vma->vma_start, vma->vma_end, 1)) < 0) {
+            return ret;
+        }
+        vma->vma_flags |= MAP_LOCKED;
+        map->vmm_nlocked += ret;
     } list_iterate_end();
 
     return 0;
 }
 
+/*
+ * Unlocks the pages [lopage, lopage + npages) of the address space, which
+ * must all be mapped (munlock(2)), splitting locked areas at the ends of
+ * the range. Returns 0 on success or -ENOMEM if part of the range is
+ * unmapped or an area could not be split.
+ */
+int
+vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t hipage = lopage + npages;
+    uint32_t next = lopage;
+    vmarea_t *vma;
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (vma->vma_end <= next || vma->vma_start >= hipage) {
+            continue;
+        }
+        if (vma->vma_start > next) {
+            return -ENOMEM;
+        }
+        next = vma->vma_end;
+    } list_iterate_end();
+    if (next < hipage) {
+        return -ENOMEM;
+    }
+    if (vmmap_split_range(map, lopage, hipage) < 0) {
+        return -ENOMEM;
+    }
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (vma->vma_end <= lopage || vma->vma_start >= hipage
+            || !(vma->vma_flags & MAP_LOCKED)) {
+            continue;
+        }
+        map->vmm_nlocked -= pagefault_unlock(vma, vma->vma_start, vma->vma_end);
+        vma->vma_flags &= ~MAP_LOCKED;
+    } list_iterate_end();
+
+    return 0;
+}
 
 /*
  * Returns 1 if the given address space has no mappings for the
@@ -554,14 +1168,9 @@ vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
 	if(npages == 0) return 1;
 	
 	uint32_t endvfn = startvfn + npages;
-	vmarea_t *vma;
-	
-	list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
-	        if (!(vma->vma_end <= startvfn || vma->vma_start >= endvfn)) {
-		    return 0; 
-		}
-	} list_iterate_end();
-        return 1;
+	vmarea_t *vma = vmmap_tree_above(map, startvfn);
+
+	return vma == NULL || vma->vma_start >= endvfn;
 }
 
 /* Read into 'buf' from the virtual address space of 'map' starting at
@@ -612,7 +1221,7 @@ vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
         cur_va += nread;
         dst    += nread;
         left   -= nread;
-        if(pf->pf_pincount > 0) pframe_unpin(pf); 
+        if(pf->pf_pincount > pf->pf_lockcount) pframe_unpin(pf); 
     }
    /* Debug: show first few bytes of what we read if it's small */
     if (count <= 256) {
@@ -678,6 +1287,21 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
             return ret;   
         }
 
+        /* The page may still be mapped read-only to a frame the lookup
+         * has just copied, such as the zero page or one shared with a
+         * forked child. That mapping would never see this write, so take
+         * it away and let the next access fault in the new frame. */
+        if (NULL != map->vmm_proc) {
+            pagedir_t *pd    = map->vmm_proc->p_pagedir;
+            uintptr_t  paddr = pt_user_to_phys(pd, (uintptr_t)PN_TO_ADDR(vfn));
+
+            if (0 != paddr && paddr != pt_virt_to_phys((uintptr_t)pf->pf_addr)) {
+                pt_unmap(pd, (uintptr_t)PN_TO_ADDR(vfn));
+                if (pd == pt_get())
+                    tlb_flush((uintptr_t)PN_TO_ADDR(vfn));
+            }
+        }
+
         size_t bytes_in_page = PAGE_SIZE - page_off;
         size_t nwrite        = (left < bytes_in_page) ? left : bytes_in_page;
 
@@ -691,7 +1315,7 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
         cur_va += nwrite;
         src    += nwrite;
         left   -= nwrite;
-	if(pf->pf_pincount > 0) pframe_unpin(pf); 
+	if(pf->pf_pincount > pf->pf_lockcount) pframe_unpin(pf); 
     }
 
     return 0;
@@ -63,10 +63,9 @@ class SlabAllocator:
 		return int(self._value["sa_objsize"])
 
 	def slabs(self):
-		next = self._value["sa_slabs"]
-		while (next != 0):
-			yield Slab(self._value, next.dereference())
-			next = next.dereference()["s_next"]
+		for name in ["sa_partial", "sa_full", "sa_empty"]:
+			for link in weenix.list.load(self._value[name], "struct slab", "s_link"):
+				yield Slab(self._value, link.item())
 
 	def objs(self, typ=None):
 		for slab in self.slabs():
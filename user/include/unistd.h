@@ -14,6 +14,8 @@
 #endif
 
 struct dirent;
+struct spawn_action;
+struct timespec;
 
 /* User exec-related */
 int     fork(void);
@@ -21,16 +23,28 @@ int     execl(const char *filename, const char *arg, ...); /* NYI */
 int     execle(const char *filename, const char *arg, ...); /* NYI */
 int     execv(const char *filename, char *const argv[]); /* NYI */
 int     execve(const char *filename, char *const argv[], char *const envp[]);
+pid_t   spawn(const char *filename, const struct spawn_action *actions, int nactions,
+              char *const argv[], char *const envp[]);
 
 /* Kern-related */
 void    _exit(int status);
 pid_t   wait(int *status);
 pid_t   waitpid(pid_t pid, int options, int *status);
+pid_t   timedwaitpid(pid_t pid, int options, int *status, int msecs);
 void    thr_exit(int status);
 int     thr_errno(void);
 void    thr_set_errno(int n);
 void    yield(void);
+void    sched_yield(void);
 pid_t   getpid(void);
+int     getpriority(pid_t pid);
+int     setpriority(pid_t pid, int prio);
+int     nice(int incr);
+int     sched_setdeadline(uint64_t runtime, uint64_t deadline, uint64_t period);
+int     nanosleep(const struct timespec *req, struct timespec *rem);
+int     usleep(unsigned int usecs);
+unsigned int ualarm(unsigned int value, unsigned int interval);
+int     pause(void);
 int     halt(void);
 void    sync(void);
 
@@ -57,6 +71,9 @@ int     pipe(int pipefd[2]);
 /* VM-related */
 void    *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 int     munmap(void *addr, size_t len);
+int     madvise(void *addr, size_t len, int advice);
+int     mlock(const void *addr, size_t len);
+int     munlock(const void *addr, size_t len);
 int     brk(void *addr);
 void    *sbrk(int incr);
 
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "sys/types.h"
+
+/* Reads the processor's time-stamp counter. Only useful for comparing
+ * two readings taken on the same machine; the tick rate is unknown. */
+static inline uint64_t rdtsc(void)
+{
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+}
@@ -69,7 +69,6 @@ static int fdzero;
 #define INIT_MMAP() \
         { if ((fdzero = _open("/dev/zero", O_RDWR, 0000)) == -1) \
                         wrterror("open of /dev/zero"); }
-#define MADV_FREE                       MADV_DONTNEED
 
 /*
  * No user serviceable parts behind this point.
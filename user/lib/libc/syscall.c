@@ -105,17 +105,24 @@ pid_t wait(int *status)
         args.wpa_pid = -1;
         args.wpa_options = 0;
         args.wpa_status = status;
+        args.wpa_timeout = -1;
 
         return trap(SYS_waitpid, (uint32_t) &args);
 }
 
 pid_t waitpid(pid_t pid, int options, int *status)
+{
+        return timedwaitpid(pid, options, status, -1);
+}
+
+pid_t timedwaitpid(pid_t pid, int options, int *status, int msecs)
 {
         waitpid_args_t args;
 
         args.wpa_pid = pid;
         args.wpa_options = options;
         args.wpa_status = status;
+        args.wpa_timeout = msecs;
 
         return trap(SYS_waitpid, (uint32_t) &args);
 }
@@ -130,6 +137,85 @@ pid_t getpid(void)
         return trap(SYS_getpid, 0);
 }
 
+void sched_yield(void)
+{
+        trap(SYS_thr_yield, 0);
+}
+
+int getpriority(pid_t pid)
+{
+        int ret;
+
+        if (0 > (ret = trap(SYS_getpriority, (uint32_t) pid)))
+                return -1;
+        return ret + PRIO_MIN;
+}
+
+int setpriority(pid_t pid, int prio)
+{
+        priority_args_t args;
+
+        args.pa_pid = pid;
+        args.pa_prio = prio;
+        return trap(SYS_setpriority, (uint32_t) &args);
+}
+
+int sched_setdeadline(uint64_t runtime, uint64_t deadline, uint64_t period)
+{
+        deadline_args_t args;
+
+        args.dla_runtime = runtime;
+        args.dla_deadline = deadline;
+        args.dla_period = period;
+        return trap(SYS_setdeadline, (uint32_t) &args);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+        nanosleep_args_t args;
+
+        args.nsa_req = req;
+        args.nsa_rem = rem;
+        return trap(SYS_nanosleep, (uint32_t) &args);
+}
+
+int usleep(unsigned int usecs)
+{
+        struct timespec req;
+
+        req.tv_sec = usecs / 1000000;
+        req.tv_nsec = (usecs % 1000000) * 1000;
+        return nanosleep(&req, NULL);
+}
+
+unsigned int ualarm(unsigned int value, unsigned int interval)
+{
+        ualarm_args_t args;
+
+        args.ua_value = value;
+        args.ua_interval = interval;
+        return trap(SYS_ualarm, (uint32_t) &args);
+}
+
+int pause(void)
+{
+        return trap(SYS_pause, 0);
+}
+
+int nice(int incr)
+{
+        int prio;
+
+        /* -1 is a valid nice value, so errno tells the two apart */
+        errno = 0;
+        if (-1 == (prio = getpriority(0)) && errno)
+                return -1;
+        prio = MAX(PRIO_MIN, MIN(PRIO_MAX, prio + incr));
+        if (0 > setpriority(0, prio))
+                return -1;
+        return prio;
+}
+
 int halt(void)
 {
         return trap(SYS_halt, 0);
@@ -159,6 +245,37 @@ int munmap(void *addr, size_t len)
         return trap(SYS_munmap, (uint32_t) &args);
 }
 
+int madvise(void *addr, size_t len, int advice)
+{
+        madvise_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.advice = advice;
+
+        return trap(SYS_madvise, (uint32_t) &args);
+}
+
+int mlock(const void *addr, size_t len)
+{
+        mlock_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+
+        return trap(SYS_mlock, (uint32_t) &args);
+}
+
+int munlock(const void *addr, size_t len)
+{
+        mlock_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+
+        return trap(SYS_munlock, (uint32_t) &args);
+}
+
 void sync(void)
 {
         trap(SYS_sync, 0);
@@ -334,6 +451,47 @@ int execve(const char *filename, char *const argv[], char *const envp[])
         return trap(SYS_execve, (uint32_t) &args);
 }
 
+static argstr_t *build_argvec(argvec_t *vec, char *const strs[])
+{
+        int i;
+
+        for (i = 0; strs[i] != NULL; i++)
+                ;
+        vec->av_len = i;
+        if (NULL == (vec->av_vec = malloc((vec->av_len + 1) * sizeof(argstr_t))))
+                return NULL;
+        for (i = 0; strs[i] != NULL; i++) {
+                vec->av_vec[i].as_len = strlen(strs[i]);
+                vec->av_vec[i].as_str = strs[i];
+        }
+        vec->av_vec[i].as_len = 0;
+        vec->av_vec[i].as_str = NULL;
+        return vec->av_vec;
+}
+
+pid_t spawn(const char *filename, const spawn_action_t *actions, int nactions,
+            char *const argv[], char *const envp[])
+{
+        spawn_args_t            args;
+        int                     ret = -1;
+
+        args.filename.as_len = strlen(filename);
+        args.filename.as_str = filename;
+        args.actions = (spawn_action_t *) actions;
+        args.nactions = nactions;
+        args.envp.av_vec = NULL;
+
+        /* Unlike execve we are still here afterwards, so the vectors have
+         * to be freed */
+        if (NULL != build_argvec(&args.argv, argv)) {
+                if (NULL != build_argvec(&args.envp, envp))
+                        ret = trap(SYS_spawn, (uint32_t) &args);
+                free(args.argv.av_vec);
+                free(args.envp.av_vec);
+        }
+        return ret;
+}
+
 void thr_set_errno(int n)
 {
         trap(SYS_set_errno, (uint32_t) n);
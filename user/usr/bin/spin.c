@@ -1,10 +1,32 @@
 /*
- * Spins.
+ * Spins. Given a number of millions of cycles, spins for that long
+ * instead of forever, and then prints how many thousands of loops it
+ * got through, which is how much of the CPU it was given.
+ *
+ * usage: spin [megacycles]
  */
 
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <weenix/tsc.h>
+
 int main(int argc, char **argv)
 {
-        while (1);
+        volatile unsigned int i;
+        unsigned int chunks = 0;
+        uint64_t end;
+
+        if (argc < 2) {
+                while (1);
+        }
+
+        end = rdtsc() + (uint64_t)atoi(argv[1]) * 1000000;
+        while (rdtsc() < end) {
+                for (i = 0; i < 1000; i++)
+                        ;
+                chunks++;
+        }
+        printf("%u\n", chunks);
         return 0;
 }
-
@@ -0,0 +1,122 @@
+/*
+ * Measures the copy-on-write faults a process takes on its own memory
+ * after forking, the way a server forking a worker per request does. A
+ * region is written, the process forks, and then it writes every page of
+ * the region again. While the child is still alive each of those writes
+ * has to copy the page; once the child has exited and been waited for the
+ * pages belong to the parent alone and should be taken over without a
+ * copy. The memory used by the writes, taken from the drop in free
+ * memory, is what was copied.
+ *
+ * usage: cowbench [pages] [rounds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_PAGES           1024    /* 4MB */
+#define DEFAULT_ROUNDS          8
+#define PAGE_BYTES              4096
+#define WAIT_USECS              10000
+
+/* Set in a shared page once a child kept alive may exit */
+static volatile int *done;
+
+static int run(volatile unsigned int *region, int pages, int child_alive,
+               uint64_t *cycles, size_t *used)
+{
+        int i, status;
+        size_t before;
+        uint64_t start;
+        pid_t pid;
+
+        *done = 0;
+        if (0 > (pid = fork())) {
+                return -1;
+        }
+        if (0 == pid) {
+                /* a child which stays around waits for the parent to
+                 * finish writing */
+                while (child_alive && !*done) {
+                        usleep(WAIT_USECS);
+                }
+                _exit(0);
+        }
+        if (!child_alive) {
+                waitpid(pid, 0, &status);
+        }
+
+        before = get_free_mem();
+        start = rdtsc();
+        for (i = 0; i < pages; i++) {
+                region[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+        }
+        *cycles += rdtsc() - start;
+        *used += before - get_free_mem();
+
+        *done = 1;
+        if (child_alive) {
+                waitpid(pid, 0, &status);
+        }
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int pages = DEFAULT_PAGES;
+        int rounds = DEFAULT_ROUNDS;
+        volatile unsigned int *region;
+        int alive, i, round;
+        uint64_t cycles;
+        size_t used;
+
+        if (argc > 1) {
+                pages = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                rounds = atoi(argv[2]);
+        }
+        if (pages <= 0 || rounds <= 0) {
+                printf("usage: cowbench [pages] [rounds]\n");
+                return 1;
+        }
+
+        region = mmap(NULL, pages * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == region) {
+                printf("cowbench: mmap failed\n");
+                return 1;
+        }
+        done = mmap(NULL, PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+        if (MAP_FAILED == done) {
+                printf("cowbench: mmap failed\n");
+                return 1;
+        }
+        for (i = 0; i < pages; i++) {
+                region[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+        }
+
+        printf("%d pages written after each of %d forks\n", pages, rounds);
+        for (alive = 1; alive >= 0; alive--) {
+                cycles = 0;
+                used = 0;
+                for (round = 0; round < rounds; round++) {
+                        if (0 > run(region, pages, alive, &cycles, &used)) {
+                                printf("cowbench: fork failed\n");
+                                return 1;
+                        }
+                }
+                printf("child %-7s %8u cycles/fault, %7u KB copied per fork\n",
+                       alive ? "alive" : "exited",
+                       (unsigned int)(cycles / ((uint64_t)pages * rounds)),
+                       (unsigned int)(used / rounds / 1024));
+        }
+
+        munmap((void *)done, PAGE_BYTES);
+        munmap((void *)region, pages * PAGE_BYTES);
+        return 0;
+}
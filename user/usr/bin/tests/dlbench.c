@@ -0,0 +1,150 @@
+/*
+ * Counts the deadlines a periodic loop misses while other processes
+ * hog the CPU, the way a serving loop has to finish each batch within
+ * its period. Each period the loop waits for the period to start,
+ * yielding, and then does a fixed amount of work. A job is late when it
+ * finishes more than a period after the period started. The hogs are
+ * copies of spin given the highest normal priority, so the loop can
+ * only keep up if it is in the deadline class. It is run once as a
+ * normal process and once in the deadline class with a reservation a
+ * little larger than its work.
+ *
+ * usage: dlbench [hogs] [jobs] [period megacycles] [work megacycles]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <weenix/syscall.h>
+#include <weenix/tsc.h>
+
+#define DEFAULT_HOGS            4
+#define DEFAULT_JOBS            50
+#define DEFAULT_PERIOD          100     /* megacycles */
+#define DEFAULT_WORK            20      /* megacycles */
+#define MAX_HOGS                16
+#define MEGA                    1000000ULL
+#define SPIN                    "/usr/bin/spin"
+
+static unsigned int loops_per_mega;
+
+static void work(unsigned int loops)
+{
+        volatile unsigned int i;
+
+        for (i = 0; i < loops; i++)
+                ;
+}
+
+/* How many loops of work take a million cycles with the CPU to ourself */
+static void calibrate(void)
+{
+        uint64_t start = rdtsc();
+
+        work(10000000);
+        loops_per_mega = (unsigned int)(10000000ULL * MEGA / (rdtsc() - start));
+}
+
+static int start_hogs(int hogs, int megacycles, pid_t *pids)
+{
+        spawn_action_t actions[1];
+        char arg[16];
+        char *spin_argv[] = { SPIN, arg, NULL };
+        char *spin_envp[] = { NULL };
+        int i;
+
+        snprintf(arg, sizeof(arg), "%d", megacycles);
+        actions[0].sa_op = SPAWN_OPEN;
+        actions[0].sa_fd = STDOUT_FILENO;
+        actions[0].sa_path.as_str = "/dev/null";
+        actions[0].sa_path.as_len = strlen("/dev/null");
+        actions[0].sa_flags = O_WRONLY;
+        for (i = 0; i < hogs; i++) {
+                if (0 > (pids[i] = spawn(SPIN, actions, 1, spin_argv, spin_envp))) {
+                        return -1;
+                }
+                setpriority(pids[i], PRIO_MIN);
+        }
+        return 0;
+}
+
+static int run(int deadline_class, int hogs, int jobs, int period, int work_mc)
+{
+        uint64_t p = period * MEGA, reserve = (work_mc + work_mc / 2) * MEGA;
+        uint64_t t0, release, response, worst = 0;
+        pid_t pids[MAX_HOGS];
+        int k, missed = 0, status;
+
+        if (0 > start_hogs(hogs, (jobs + 1) * period, pids)) {
+                printf("dlbench: spawn failed\n");
+                return -1;
+        }
+
+        t0 = rdtsc();
+        if (deadline_class && 0 > sched_setdeadline(reserve, 0, p)) {
+                printf("dlbench: sched_setdeadline failed\n");
+                return -1;
+        }
+        for (k = 0; k < jobs; k++) {
+                release = t0 + k * p;
+                while (rdtsc() < release) {
+                        sched_yield();
+                }
+                work(work_mc * loops_per_mega);
+                response = rdtsc() - release;
+                if (response > p) {
+                        missed++;
+                }
+                if (response > worst) {
+                        worst = response;
+                }
+        }
+        if (deadline_class) {
+                sched_setdeadline(0, 0, 0);
+        }
+
+        for (k = 0; k < hogs; k++) {
+                waitpid(pids[k], 0, &status);
+        }
+        printf("%-8s class, %d hogs: %3d of %d deadlines missed, worst response %5u megacycles\n",
+               deadline_class ? "deadline" : "normal", hogs, missed, jobs,
+               (unsigned int)(worst / MEGA));
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int hogs = DEFAULT_HOGS;
+        int jobs = DEFAULT_JOBS;
+        int period = DEFAULT_PERIOD;
+        int work_mc = DEFAULT_WORK;
+
+        if (argc > 1) {
+                hogs = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                jobs = atoi(argv[2]);
+        }
+        if (argc > 3) {
+                period = atoi(argv[3]);
+        }
+        if (argc > 4) {
+                work_mc = atoi(argv[4]);
+        }
+        if (hogs < 0 || hogs > MAX_HOGS || jobs <= 0 || work_mc <= 0
+            || work_mc + work_mc / 2 > period) {
+                printf("usage: dlbench [hogs] [jobs] [period megacycles] [work megacycles]\n");
+                return 1;
+        }
+
+        calibrate();
+        printf("%d jobs of %d megacycles, one every %d megacycles\n", jobs, work_mc, period);
+        if (0 > run(0, hogs, jobs, period, work_mc)
+            || 0 > run(1, hogs, jobs, period, work_mc)) {
+                return 1;
+        }
+        return 0;
+}
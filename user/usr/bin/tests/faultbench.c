@@ -0,0 +1,115 @@
+/*
+ * Measures what page faults and unmapping cost the rest of a program
+ * through the TLB. A small hot set of pages is read over and over while
+ * a larger anonymous region is faulted in one page at a time; if every
+ * fault flushes the whole TLB, each pass over the hot set has to refill
+ * it. A second phase repeatedly maps, touches and unmaps a few pages
+ * between passes over the hot set, which exercises munmap's invalidation.
+ *
+ * usage: faultbench [fault pages] [hot pages]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_FAULT_PAGES     4096
+#define DEFAULT_HOT_PAGES       48
+#define MUNMAP_ROUNDS           1024
+#define MUNMAP_PAGES            4
+#define PAGE_BYTES              4096
+
+static unsigned int hot_pass(volatile unsigned int *hot, int hot_pages)
+{
+        unsigned int sum = 0;
+        int i;
+
+        for (i = 0; i < hot_pages; i++) {
+                sum += hot[i * (PAGE_BYTES / sizeof(unsigned int))];
+        }
+        return sum;
+}
+
+int main(int argc, char **argv)
+{
+        int fault_pages = DEFAULT_FAULT_PAGES;
+        int hot_pages = DEFAULT_HOT_PAGES;
+        volatile unsigned int *hot, *region;
+        uint64_t start, fault_cycles = 0, hot_cycles = 0, unmap_cycles = 0;
+        unsigned int sum = 0;
+        int i, j;
+
+        if (argc > 1) {
+                fault_pages = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                hot_pages = atoi(argv[2]);
+        }
+
+        hot = mmap(NULL, hot_pages * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+        region = mmap(NULL, fault_pages * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == hot || MAP_FAILED == region) {
+                printf("faultbench: mmap failed\n");
+                return 1;
+        }
+        for (i = 0; i < hot_pages; i++) {
+                hot[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+        }
+
+        /* first-touch faults interleaved with passes over the hot set */
+        for (i = 0; i < fault_pages; i++) {
+                start = rdtsc();
+                region[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+                fault_cycles += rdtsc() - start;
+
+                start = rdtsc();
+                sum += hot_pass(hot, hot_pages);
+                hot_cycles += rdtsc() - start;
+        }
+        printf("faults:  %u cycles/fault, hot set %u cycles/pass after each fault\n",
+               (unsigned int)(fault_cycles / fault_pages),
+               (unsigned int)(hot_cycles / fault_pages));
+
+        /* small map/touch/unmap cycles interleaved with passes over the hot set */
+        hot_cycles = 0;
+        for (i = 0; i < MUNMAP_ROUNDS; i++) {
+                volatile unsigned int *p = mmap(NULL, MUNMAP_PAGES * PAGE_BYTES,
+                                                PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANON, -1, 0);
+                if (MAP_FAILED == p) {
+                        printf("faultbench: mmap failed\n");
+                        return 1;
+                }
+                for (j = 0; j < MUNMAP_PAGES; j++) {
+                        p[j * (PAGE_BYTES / sizeof(unsigned int))] = j;
+                }
+
+                start = rdtsc();
+                munmap((void *)p, MUNMAP_PAGES * PAGE_BYTES);
+                unmap_cycles += rdtsc() - start;
+
+                start = rdtsc();
+                sum += hot_pass(hot, hot_pages);
+                hot_cycles += rdtsc() - start;
+        }
+        printf("munmap:  %u cycles/call (%d pages), hot set %u cycles/pass after each\n",
+               (unsigned int)(unmap_cycles / MUNMAP_ROUNDS), MUNMAP_PAGES,
+               (unsigned int)(hot_cycles / MUNMAP_ROUNDS));
+
+        /* baseline: the hot set with nothing else going on */
+        start = rdtsc();
+        for (i = 0; i < MUNMAP_ROUNDS; i++) {
+                sum += hot_pass(hot, hot_pages);
+        }
+        printf("idle:    hot set %u cycles/pass (sum %u)\n",
+               (unsigned int)((rdtsc() - start) / MUNMAP_ROUNDS), sum);
+
+        munmap((void *)region, fault_pages * PAGE_BYTES);
+        munmap((void *)hot, hot_pages * PAGE_BYTES);
+        return 0;
+}
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <weenix/tsc.h>
+
 /* TODO add options for different ways of forkbombing
    (kind of low priority but would be fun) */
 
@@ -12,6 +14,7 @@ int main(int argc, char **argv)
         int n = 1;
         pid_t pid;
         int limit = 250;
+        uint64_t start;
 
         if (argc > 0 && strcmp(argv[argc-1], "limit250") == 0) {
                 limit = 250;
@@ -23,6 +26,9 @@ int main(int argc, char **argv)
         printf("Forking up a storm!\n");
         printf("If this runs for 10 minutes without crashing, then you ");
         printf("probably aren't \nleaking resources\n");
+        /* every process in the chain inherits this, so the last one can
+         * tell how long the chain took to grow */
+        start = rdtsc();
         if (!fork()) {
 		
                 for (;;) {
@@ -42,6 +48,9 @@ int main(int argc, char **argv)
                         ++n;
                         if (limit > 0 && n > limit) {
                                 printf("Limit (specified in the commandline) of %1d reached.\n", limit);
+                                printf("%u cycles per fork, %u KB free\n",
+                                       (unsigned int)((rdtsc() - start) / limit),
+                                       (unsigned int)(get_free_mem() / 1024));
                                 exit(0);
                         }
                 }
@@ -0,0 +1,85 @@
+/*
+ * Measures page fault latency in a process which keeps forking children
+ * that exit straight away. Every fork puts a new shadow object over each
+ * of the parent's private writable areas; unless the objects left behind
+ * by exited children are collapsed, the chain a fault has to search grows
+ * by one with every fork. After 1, 10, 100 and 1000 forks the parent
+ * reads and then writes every page of a region it wrote before the first
+ * one, and the cycles per fault are reported for both.
+ *
+ * usage: forkchain [pages]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_PAGES           256     /* 1MB */
+#define PAGE_BYTES              4096
+
+static const int checkpoints[] = { 1, 10, 100, 1000 };
+
+int main(int argc, char **argv)
+{
+        int pages = DEFAULT_PAGES;
+        volatile unsigned int *region;
+        uint64_t start, rcycles, wcycles;
+        unsigned int c, sum;
+        int forks = 0, i, status;
+        pid_t pid;
+
+        if (argc > 1) {
+                pages = atoi(argv[1]);
+        }
+        if (pages <= 0) {
+                printf("usage: forkchain [pages]\n");
+                return 1;
+        }
+
+        region = mmap(NULL, pages * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == region) {
+                printf("forkchain: mmap failed\n");
+                return 1;
+        }
+        for (i = 0; i < pages; i++) {
+                region[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+        }
+
+        printf("%d pages read and written after every so many forks\n", pages);
+        for (c = 0; c < sizeof(checkpoints) / sizeof(checkpoints[0]); c++) {
+                for (; forks < checkpoints[c]; forks++) {
+                        if (0 > (pid = fork())) {
+                                printf("forkchain: fork failed after %d forks\n", forks);
+                                return 1;
+                        }
+                        if (0 == pid) {
+                                _exit(0);
+                        }
+                        waitpid(pid, 0, &status);
+                }
+
+                /* fork write protected the parent's pages, so every write faults */
+                sum = 0;
+                start = rdtsc();
+                for (i = 0; i < pages; i++) {
+                        sum += region[i * (PAGE_BYTES / sizeof(unsigned int))];
+                }
+                rcycles = rdtsc() - start;
+                start = rdtsc();
+                for (i = 0; i < pages; i++) {
+                        region[i * (PAGE_BYTES / sizeof(unsigned int)) + 1] = i;
+                }
+                wcycles = rdtsc() - start;
+
+                printf("%5d forks: read %8u cycles/fault, write %8u cycles/fault%s\n",
+                       forks, (unsigned int)(rcycles / pages), (unsigned int)(wcycles / pages),
+                       sum == (unsigned int)pages * (pages - 1) / 2 ? "" : " (bad data!)");
+        }
+
+        munmap((void *)region, pages * PAGE_BYTES);
+        return 0;
+}
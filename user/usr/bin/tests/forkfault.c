@@ -0,0 +1,149 @@
+/*
+ * Counts the faults a process takes on its own memory after forking. A
+ * region is written, the process forks, and then every page of it is read
+ * and then written, each access timed on its own. Fork leaves the
+ * parent's pages mapped, only write protected, so the reads should not
+ * fault at all and only the writes should. An access slower than the
+ * threshold is taken to have faulted. The child is either kept alive
+ * until the parent is done or has already exited and been waited for.
+ *
+ * usage: forkfault [pages] [threshold cycles]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_PAGES           1024    /* 4MB */
+#define DEFAULT_THRESHOLD       2000
+#define PAGE_BYTES              4096
+#define WAIT_USECS              10000
+
+/* Set in a shared page once a child kept alive may exit */
+static volatile int *done;
+
+struct pass {
+        int faults;
+        uint64_t cycles;
+};
+
+static void time_reads(volatile unsigned int *region, int pages, uint64_t threshold,
+                       struct pass *p, unsigned int *sum)
+{
+        uint64_t start, t;
+        int i;
+
+        for (i = 0; i < pages; i++) {
+                start = rdtsc();
+                *sum += region[i * (PAGE_BYTES / sizeof(unsigned int))];
+                t = rdtsc() - start;
+                p->cycles += t;
+                if (t > threshold) {
+                        p->faults++;
+                }
+        }
+}
+
+static void time_writes(volatile unsigned int *region, int pages, uint64_t threshold,
+                        struct pass *p)
+{
+        uint64_t start, t;
+        int i;
+
+        for (i = 0; i < pages; i++) {
+                start = rdtsc();
+                region[i * (PAGE_BYTES / sizeof(unsigned int)) + 1] = i;
+                t = rdtsc() - start;
+                p->cycles += t;
+                if (t > threshold) {
+                        p->faults++;
+                }
+        }
+}
+
+static int run(volatile unsigned int *region, int pages, uint64_t threshold, int child_alive)
+{
+        struct pass reads = { 0, 0 }, writes = { 0, 0 };
+        unsigned int sum = 0;
+        int status;
+        pid_t pid;
+
+        *done = 0;
+        if (0 > (pid = fork())) {
+                return -1;
+        }
+        if (0 == pid) {
+                while (child_alive && !*done) {
+                        usleep(WAIT_USECS);
+                }
+                _exit(0);
+        }
+        if (!child_alive) {
+                waitpid(pid, 0, &status);
+        }
+
+        time_reads(region, pages, threshold, &reads, &sum);
+        time_writes(region, pages, threshold, &writes);
+
+        *done = 1;
+        if (child_alive) {
+                waitpid(pid, 0, &status);
+        }
+
+        printf("child %-7s read %5d faults %6u cycles/page, write %5d faults %6u cycles/page%s\n",
+               child_alive ? "alive" : "exited",
+               reads.faults, (unsigned int)(reads.cycles / pages),
+               writes.faults, (unsigned int)(writes.cycles / pages),
+               sum == (unsigned int)pages * (pages - 1) / 2 ? "" : " (bad data!)");
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int pages = DEFAULT_PAGES;
+        int threshold = DEFAULT_THRESHOLD;
+        volatile unsigned int *region;
+        int alive, i;
+
+        if (argc > 1) {
+                pages = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                threshold = atoi(argv[2]);
+        }
+        if (pages <= 0 || threshold <= 0) {
+                printf("usage: forkfault [pages] [threshold cycles]\n");
+                return 1;
+        }
+
+        region = mmap(NULL, pages * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == region) {
+                printf("forkfault: mmap failed\n");
+                return 1;
+        }
+        done = mmap(NULL, PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+        if (MAP_FAILED == done) {
+                printf("forkfault: mmap failed\n");
+                return 1;
+        }
+
+        printf("%d pages read and then written after fork, over %d cycles is a fault\n",
+               pages, threshold);
+        for (alive = 1; alive >= 0; alive--) {
+                for (i = 0; i < pages; i++) {
+                        region[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+                }
+                if (0 > run(region, pages, threshold, alive)) {
+                        printf("forkfault: fork failed\n");
+                        return 1;
+                }
+        }
+
+        munmap((void *)done, PAGE_BYTES);
+        munmap((void *)region, pages * PAGE_BYTES);
+        return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Forks a pool of workers which each read the whole of a file mapped by
+ * their parent, the way model server workers share one copy of the
+ * weights. The file is mapped read-only, shared, and private but
+ * writable. Only the last needs copy-on-write, so only it gets a shadow
+ * object put over it on every fork, and the workers have to look through
+ * the whole chain for each page they read. Each worker times its own
+ * reads and leaves the result in a shared anonymous page for the parent.
+ *
+ * usage: forkread [file pages] [workers]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_FILE_PAGES      8192    /* 32MB */
+#define DEFAULT_WORKERS         100
+#define PAGE_BYTES              4096
+#define READ_FILE               "/tmp/forkread"
+
+static const struct {
+        const char *name;
+        int prot;
+        int flags;
+} modes[] = {
+        { "private ro", PROT_READ, MAP_PRIVATE },
+        { "shared", PROT_READ, MAP_SHARED },
+        { "private rw", PROT_READ | PROT_WRITE, MAP_PRIVATE },
+};
+
+static int make_file(int pages)
+{
+        static unsigned int page[PAGE_BYTES / sizeof(unsigned int)];
+        int fd, i;
+
+        if (0 > (fd = open(READ_FILE, O_RDWR | O_CREAT, 0))) {
+                return -1;
+        }
+        for (i = 0; i < pages; i++) {
+                page[0] = i;
+                if (PAGE_BYTES != write(fd, page, PAGE_BYTES)) {
+                        close(fd);
+                        return -1;
+                }
+        }
+        return fd;
+}
+
+static int run(int fd, int pages, int workers, int m, uint64_t *results)
+{
+        volatile unsigned int *w;
+        uint64_t start, fork_cycles = 0, read_cycles = 0, total;
+        unsigned int sum;
+        int i, j, status;
+        pid_t pid;
+
+        w = mmap(NULL, pages * PAGE_BYTES, modes[m].prot, modes[m].flags, fd, 0);
+        if (MAP_FAILED == w) {
+                return -1;
+        }
+
+        total = rdtsc();
+        for (i = 0; i < workers; i++) {
+                start = rdtsc();
+                pid = fork();
+                if (0 == pid) {
+                        sum = 0;
+                        start = rdtsc();
+                        for (j = 0; j < pages; j++) {
+                                sum += w[j * (PAGE_BYTES / sizeof(unsigned int))];
+                        }
+                        results[i] = rdtsc() - start;
+                        _exit(sum == (unsigned int)pages * (pages - 1) / 2 ? 0 : 1);
+                }
+                fork_cycles += rdtsc() - start;
+                if (0 > pid) {
+                        printf("forkread: fork failed\n");
+                        workers = i;
+                        break;
+                }
+        }
+        for (i = 0; i < workers; i++) {
+                wait(&status);
+                if (0 != status) {
+                        printf("forkread: a worker read the wrong data\n");
+                }
+        }
+        total = rdtsc() - total;
+        for (i = 0; i < workers; i++) {
+                read_cycles += results[i];
+        }
+
+        if (workers > 0) {
+                printf("%-10s fork %8u cycles, read %6u cycles/page, %u Mcycles in all\n",
+                       modes[m].name, (unsigned int)(fork_cycles / workers),
+                       (unsigned int)(read_cycles / workers / pages),
+                       (unsigned int)(total / 1000000));
+        }
+        munmap((void *)w, pages * PAGE_BYTES);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int pages = DEFAULT_FILE_PAGES;
+        int workers = DEFAULT_WORKERS;
+        uint64_t *results;
+        unsigned int m;
+        int fd;
+
+        if (argc > 1) {
+                pages = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                workers = atoi(argv[2]);
+        }
+        if (pages <= 0 || workers <= 0) {
+                printf("usage: forkread [file pages] [workers]\n");
+                return 1;
+        }
+
+        results = mmap(NULL, workers * sizeof(*results), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANON, -1, 0);
+        if (MAP_FAILED == results) {
+                printf("forkread: mmap failed\n");
+                return 1;
+        }
+        if (0 > (fd = make_file(pages))) {
+                printf("forkread: could not create %s\n", READ_FILE);
+                return 1;
+        }
+
+        printf("%d workers each reading %d pages\n", workers, pages);
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                if (0 > run(fd, pages, workers, m, results)) {
+                        printf("forkread: %s mapping failed\n", modes[m].name);
+                }
+        }
+
+        close(fd);
+        unlink(READ_FILE);
+        munmap(results, workers * sizeof(*results));
+        return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Measures the cost of a context switch between two processes, first
+ * when neither of them touches the FPU and then when both of them do
+ * floating point work between every switch. The second run also checks
+ * that neither process sees the other's FPU registers.
+ *
+ * usage: fpubench [switches]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <weenix/trap.h>
+#include <weenix/tsc.h>
+
+#define DEFAULT_SWITCHES 10000
+
+static void yield_cpu(void)
+{
+        trap(SYS_thr_yield, 0);
+}
+
+/* cpuid leaf 1 %edx: FXSAVE/FXRSTOR and SSE. The kernel only enables SSE
+ * when the CPU has FXSAVE, so both bits are needed. */
+#define CPUID_FEAT_EDX_FXSR     0x01000000
+#define CPUID_FEAT_EDX_SSE      0x02000000
+
+static int has_sse(void)
+{
+        uint32_t eax = 1, ebx, ecx, edx;
+
+        __asm__ volatile("cpuid"
+                         : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        return (edx & (CPUID_FEAT_EDX_FXSR | CPUID_FEAT_EDX_SSE))
+               == (CPUID_FEAT_EDX_FXSR | CPUID_FEAT_EDX_SSE);
+}
+
+/* The values yield_live_fpu loads into and reads back out of the FPU and
+ * SSE registers. They are reached from one base register, since i386 has
+ * too few registers to give every slot its own. */
+typedef struct fpu_slots {
+        uint64_t        fs_fin;         /* loaded onto the x87 stack */
+        uint64_t        fs_xin;         /* loaded into %xmm0 */
+        uint64_t        fs_fout;        /* x87 stack top after the yield */
+        uint64_t        fs_xout;        /* %xmm0 after the yield */
+        int             fs_sse;         /* nonzero if %xmm0 may be used */
+} fpu_slots_t;
+
+/* Loads fs_fin onto the x87 stack and, if fs_sse is set, fs_xin into
+ * %xmm0, then yields with both still in the registers and stores what
+ * the registers hold afterwards. Nothing is spilled to memory across the
+ * switch, so any register state lost or leaked by the kernel shows up
+ * here. The function is built for SSE so that %xmm0 can be named as
+ * clobbered; it only touches %xmm0 when the caller has checked for SSE. */
+__attribute__((target("sse")))
+static void yield_live_fpu(fpu_slots_t *fs)
+{
+        int ret;
+
+        __asm__ volatile(
+                "fldl %c[fin](%[fs])\n\t"
+                "cmpl $0, %c[sse](%[fs])\n\t"
+                "je 1f\n\t"
+                "movlps %c[xin](%[fs]), %%xmm0\n"
+                "1:\n\t"
+                "int $" TRAP_INTR_STRING "\n\t"
+                "cmpl $0, %c[sse](%[fs])\n\t"
+                "je 2f\n\t"
+                "movlps %%xmm0, %c[xout](%[fs])\n"
+                "2:\n\t"
+                "fstpl %c[fout](%[fs])"
+                : "=a"(ret)
+                : "a"(SYS_thr_yield), "d"(0), [fs] "r"(fs),
+                  [fin] "i"(offsetof(fpu_slots_t, fs_fin)),
+                  [xin] "i"(offsetof(fpu_slots_t, fs_xin)),
+                  [fout] "i"(offsetof(fpu_slots_t, fs_fout)),
+                  [xout] "i"(offsetof(fpu_slots_t, fs_xout)),
+                  [sse] "i"(offsetof(fpu_slots_t, fs_sse))
+                : "xmm0", "cc", "memory");
+}
+
+/* Yields n times, doing a little integer work before each yield or,
+ * with use_fpu, holding a per-process value in the FPU (and SSE)
+ * registers across each yield. Returns nonzero if a register did not
+ * come back as it was left. The values are compared bit for bit. */
+static int switch_loop(int n, int use_fpu, int scale)
+{
+        fpu_slots_t fs;
+        volatile int iacc = 0;
+        int bad = 0;
+        int i;
+
+        fs.fs_sse = use_fpu && has_sse();
+        for (i = 0; i < n; i++) {
+                if (use_fpu) {
+                        union {
+                                double          d;
+                                uint64_t        u;
+                        } fin;
+
+                        fin.d = (double)i * scale + 0.5;
+                        fs.fs_fin = fin.u;
+                        fs.fs_xin = ((uint64_t)scale << 32) | (uint32_t)i;
+                        fs.fs_xout = fs.fs_xin;
+                        yield_live_fpu(&fs);
+                        bad |= (fs.fs_fout != fs.fs_fin) || (fs.fs_xout != fs.fs_xin);
+                } else {
+                        iacc += i * scale;
+                        yield_cpu();
+                }
+        }
+
+        return bad;
+}
+
+static int run(const char *name, int n, int use_fpu)
+{
+        int status;
+        pid_t pid;
+        uint64_t start, end;
+        int bad;
+
+        if (0 > (pid = fork())) {
+                printf("fork failed\n");
+                return 1;
+        }
+        if (0 == pid) {
+                exit(switch_loop(n, use_fpu, 7));
+        }
+
+        start = rdtsc();
+        bad = switch_loop(n, use_fpu, 3);
+        end = rdtsc();
+        waitpid(pid, 0, &status);
+
+        /* each loop iteration is two switches: to the child and back */
+        printf("%-8s %d round trips, %u cycles per switch\n", name, n,
+               (unsigned int)((end - start) / (2 * (uint64_t)n)));
+
+        if (bad || status) {
+                printf("%-8s FPU state corrupted (parent %d, child %d)\n",
+                       name, bad, status);
+                return 1;
+        }
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int n = DEFAULT_SWITCHES;
+        int err = 0;
+
+        if (argc > 1) {
+                n = atoi(argv[1]);
+        }
+
+        err |= run("no-fpu", n, 0);
+        err |= run("fpu", n, 1);
+
+        return err;
+}
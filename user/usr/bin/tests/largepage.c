@@ -0,0 +1,76 @@
+/*
+ * Measures random-access read throughput over a large anonymous buffer
+ * mapped with 4 KB pages and with the MAP_LARGEPAGE hint. With small
+ * pages almost every access needs a TLB refill; a 64 MB buffer is only
+ * 16 large pages, which fit in the TLB. The time to fault the buffer in
+ * is reported separately.
+ *
+ * usage: largepage [megabytes] [accesses]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_MB              64
+#define DEFAULT_ACCESSES        4000000
+#define PAGE_BYTES              4096
+
+static int run(const char *name, size_t len, int accesses, int flags)
+{
+        volatile unsigned int *buf;
+        unsigned int nwords = len / sizeof(unsigned int);
+        unsigned int seed = 1, sum = 0;
+        uint64_t start, fault_cycles, access_cycles;
+        size_t off;
+        int i;
+
+        buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON | flags, -1, 0);
+        if (MAP_FAILED == buf) {
+                printf("%s: mmap of %u bytes failed\n", name, (unsigned int)len);
+                return 1;
+        }
+
+        start = rdtsc();
+        for (off = 0; off < len; off += PAGE_BYTES) {
+                buf[off / sizeof(unsigned int)] = off;
+        }
+        fault_cycles = rdtsc() - start;
+
+        start = rdtsc();
+        for (i = 0; i < accesses; i++) {
+                seed = seed * 1103515245 + 12345;
+                sum += buf[(seed >> 4) % nwords];
+        }
+        access_cycles = rdtsc() - start;
+
+        printf("%-7s fault-in %u cycles/page, random read %u cycles/access (sum %u)\n",
+               name, (unsigned int)(fault_cycles / (len / PAGE_BYTES)),
+               (unsigned int)(access_cycles / accesses), sum);
+
+        munmap((void *)buf, len);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        size_t len = DEFAULT_MB << 20;
+        int accesses = DEFAULT_ACCESSES;
+        int err = 0;
+
+        if (argc > 1) {
+                len = (size_t)atoi(argv[1]) << 20;
+        }
+        if (argc > 2) {
+                accesses = atoi(argv[2]);
+        }
+
+        err |= run("small", len, accesses, 0);
+        err |= run("large", len, accesses, MAP_LARGEPAGE);
+
+        return err;
+}
@@ -601,6 +601,490 @@ static int test_mmap_beyond(void)
 
 /* TODO Figure out a way to not have these be repeated. */
 /* Copied from vfstest. Linking stuff prevents use of the same file. */
+static int test_madvise(void)
+{
+        char *addr, *shared, *large;
+        int i;
+
+        printf("Testing madvise()\n");
+
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 16,
+                                               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        for (i = 0; i < 16; i++) {
+                *(addr + PAGE_SIZE * i) = 'x';
+        }
+
+        /* Access pattern advice splits nothing visible and keeps the contents */
+        syscall_success(madvise(addr + PAGE_SIZE * 4, PAGE_SIZE * 4, MADV_SEQUENTIAL));
+        syscall_success(madvise(addr + PAGE_SIZE * 10, PAGE_SIZE * 2, MADV_RANDOM));
+        syscall_success(madvise(addr, PAGE_SIZE * 16, MADV_NORMAL));
+        syscall_success(madvise(addr, PAGE_SIZE * 16, MADV_WILLNEED));
+        for (i = 0; i < 16; i++) {
+                test_assert('x' == *(addr + PAGE_SIZE * i), NULL);
+        }
+
+        /* Dropped anonymous pages read back as zeros, the rest are untouched */
+        syscall_success(madvise(addr + PAGE_SIZE * 2, PAGE_SIZE * 3, MADV_DONTNEED));
+        test_assert('x' == *(addr + PAGE_SIZE * 1), NULL);
+        test_assert('\0' == *(addr + PAGE_SIZE * 2), NULL);
+        test_assert('\0' == *(addr + PAGE_SIZE * 4), NULL);
+        test_assert('x' == *(addr + PAGE_SIZE * 5), NULL);
+        assert_nofault(*(addr + PAGE_SIZE * 3) = 'a', "");
+
+        /* Freeable pages keep their contents or become zeros; writing one
+         * again keeps it */
+        syscall_success(madvise(addr + PAGE_SIZE * 8, PAGE_SIZE * 8, MADV_FREE));
+        *(addr + PAGE_SIZE * 8) = 'y';
+        test_assert('y' == *(addr + PAGE_SIZE * 8), NULL);
+        test_assert('x' == *(addr + PAGE_SIZE * 9) || '\0' == *(addr + PAGE_SIZE * 9), NULL);
+
+        /* Bad arguments */
+        test_assert(-1 == madvise(addr + 1, PAGE_SIZE, MADV_DONTNEED) && EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, 0, MADV_DONTNEED) && EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE, 77) && EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE * 17, MADV_DONTNEED) && ENOMEM == errno, NULL);
+
+        /* MADV_FREE is only for private memory */
+        test_assert(MAP_FAILED != (shared = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_ANON, -1, 0)), NULL);
+        test_assert(-1 == madvise(shared, PAGE_SIZE, MADV_FREE) && EINVAL == errno, NULL);
+
+        /* Large page mappings cannot have their pages dropped, and keep
+         * their contents */
+        test_assert(MAP_FAILED != (large = mmap(NULL, PAGE_LARGE_SIZE, PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANON | MAP_LARGEPAGE, -1, 0)), NULL);
+        *large = 'g';
+        *(large + PAGE_SIZE * 5) = 'h';
+        test_assert(-1 == madvise(large, PAGE_SIZE, MADV_DONTNEED) && EINVAL == errno, NULL);
+        test_assert(-1 == madvise(large, PAGE_LARGE_SIZE, MADV_FREE) && EINVAL == errno, NULL);
+        test_assert('g' == *large && 'h' == *(large + PAGE_SIZE * 5), NULL);
+        test_assert(0 == munmap(large, PAGE_LARGE_SIZE), NULL);
+
+        test_assert(0 == munmap(shared, PAGE_SIZE), NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 16), NULL);
+        return 0;
+}
+
+static int test_zero_page(void)
+{
+        char *addr;
+        int fd, i, status;
+
+        printf("Testing reads of untouched anonymous memory\n");
+
+        /* Reads of untouched pages are zeros, and writing one page leaves
+         * the others zero */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 16, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        for (i = 0; i < 16; i++) {
+                test_assert('\0' == *(addr + PAGE_SIZE * i), NULL);
+        }
+        for (i = 0; i < 16; i += 2) {
+                *(addr + PAGE_SIZE * i) = 'w';
+        }
+        for (i = 0; i < 16; i++) {
+                test_assert((i % 2 ? '\0' : 'w') == *(addr + PAGE_SIZE * i), NULL);
+        }
+
+        /* A child writing the pages still zero in both leaves the
+         * parent's alone */
+        test_fork_begin() {
+                for (i = 1; i < 16; i += 2) {
+                        test_assert('\0' == *(addr + PAGE_SIZE * i), NULL);
+                        *(addr + PAGE_SIZE * i) = 'c';
+                }
+                return 0;
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+        for (i = 1; i < 16; i += 2) {
+                test_assert('\0' == *(addr + PAGE_SIZE * i), NULL);
+        }
+
+        /* Pages which were only ever read can be locked */
+        syscall_success(mlock(addr, PAGE_SIZE * 16));
+        test_assert('\0' == *(addr + PAGE_SIZE) && 'w' == *addr, NULL);
+        syscall_success(munlock(addr, PAGE_SIZE * 16));
+
+        test_assert(0 == munmap(addr, PAGE_SIZE * 16), NULL);
+
+        /* The kernel writing into a page only ever read, as read() does,
+         * is seen by the process afterwards */
+        test_assert(-1 != (fd = open("zeroread", O_RDWR | O_CREAT, 0)), NULL);
+        test_assert(8 == write(fd, "zeroread", 8), NULL);
+        test_assert(0 == lseek(fd, 0, SEEK_SET), NULL);
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        test_assert('\0' == *addr, NULL);
+        test_assert(8 == read(fd, addr, 8), NULL);
+        test_assert(0 == memcmp(addr, "zeroread", 8) && '\0' == *(addr + 8), NULL);
+        syscall_success(close(fd));
+        syscall_success(unlink("zeroread"));
+        test_assert(0 == munmap(addr, PAGE_SIZE), NULL);
+        return 0;
+}
+
+static int test_cow_exit(void)
+{
+        char *addr;
+        volatile int *done;
+        int fd, i, n, same, pid, status;
+
+        printf("Testing copy-on-write after a fork and exit\n");
+
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 16, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        for (i = 0; i < 16; i++) {
+                *(addr + PAGE_SIZE * i) = 'a';
+        }
+
+        /* Once the child has gone the parent's pages are its own again,
+         * and writing them keeps what was there */
+        test_fork_begin() {
+                for (i = 0; i < 16; i++) {
+                        test_assert('a' == *(addr + PAGE_SIZE * i), NULL);
+                        *(addr + PAGE_SIZE * i) = 'c';
+                }
+                return 0;
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+        for (i = 0; i < 16; i += 2) {
+                *(addr + PAGE_SIZE * i + 1) = 'p';
+        }
+        for (i = 0; i < 16; i++) {
+                test_assert('a' == *(addr + PAGE_SIZE * i), NULL);
+                test_assert((i % 2 ? '\0' : 'p') == *(addr + PAGE_SIZE * i + 1), NULL);
+        }
+
+        /* and the next child sees them as they are now */
+        test_fork_begin() {
+                for (i = 0; i < 16; i++) {
+                        test_assert('a' == *(addr + PAGE_SIZE * i), NULL);
+                        test_assert((i % 2 ? '\0' : 'p') == *(addr + PAGE_SIZE * i + 1), NULL);
+                }
+                *addr = 'c';
+                return 0;
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+        test_assert('a' == *addr, NULL);
+
+        /* The kernel writing into a page the parent still shares with a
+         * live child, as read() does, is seen by the parent */
+        test_assert(MAP_FAILED != (done = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_ANON, -1, 0)), NULL);
+        *done = 0;
+        test_assert(-1 != (fd = open("cowread", O_RDWR | O_CREAT, 0)), NULL);
+        test_assert(8 == write(fd, "cowread!", 8), NULL);
+        test_assert(0 == lseek(fd, 0, SEEK_SET), NULL);
+        syscall_success(pid = fork());
+        if (0 == pid) {
+                while (!*done) {
+                        usleep(10000);
+                }
+                exit(0);
+        }
+        n = read(fd, addr, 8);
+        same = 0 == memcmp(addr, "cowread!", 8);
+        *done = 1;
+        test_assert(pid == waitpid(pid, 0, &status), NULL);
+        test_assert(8 == n && same, NULL);
+        test_assert('a' == *(addr + PAGE_SIZE), NULL);
+        syscall_success(close(fd));
+        syscall_success(unlink("cowread"));
+        test_assert(0 == munmap((void *)done, PAGE_SIZE), NULL);
+
+        test_assert(0 == munmap(addr, PAGE_SIZE * 16), NULL);
+        return 0;
+}
+
+static int test_readonly_fork(void)
+{
+        char *addr;
+        int fd, i, status;
+
+        printf("Testing read-only private mappings across fork\n");
+
+        test_assert(-1 != (fd = open("readonly", O_RDWR | O_CREAT, 0)), NULL);
+        for (i = 0; i < 8; i++) {
+                char c = 'a' + i;
+                test_assert((off_t)(PAGE_SIZE * i) == lseek(fd, PAGE_SIZE * i, SEEK_SET), NULL);
+                test_assert(1 == write(fd, &c, 1), NULL);
+        }
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 8, PROT_READ, MAP_PRIVATE, fd, 0)), NULL);
+        syscall_success(close(fd));
+
+        /* Parent and child read the same pages, and dropping them in one
+         * leaves the file and the other alone */
+        test_fork_begin() {
+                for (i = 0; i < 8; i++) {
+                        test_assert('a' + i == *(addr + PAGE_SIZE * i), NULL);
+                }
+                syscall_success(madvise(addr, PAGE_SIZE * 8, MADV_DONTNEED));
+                test_assert('a' == *addr, NULL);
+                test_assert(-1 == madvise(addr, PAGE_SIZE, MADV_FREE) && EINVAL == errno, NULL);
+                return 0;
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+        for (i = 0; i < 8; i++) {
+                test_assert('a' + i == *(addr + PAGE_SIZE * i), NULL);
+        }
+
+        test_assert(0 == munmap(addr, PAGE_SIZE * 8), NULL);
+        syscall_success(unlink("readonly"));
+        return 0;
+}
+
+static int test_spawn(void)
+{
+        char *argv[] = { "/usr/bin/hello", NULL };
+        char *envp[] = { NULL };
+        spawn_action_t actions[2];
+        char buf[32];
+        int fd, status;
+        pid_t pid;
+
+        printf("Testing spawn()\n");
+
+        /* A program which cannot be loaded is an error in the parent, and
+         * the child which tried is already gone */
+        test_assert(-1 == spawn("/nonexistent", NULL, 0, argv, envp) && ENOENT == errno, NULL);
+        test_assert(-1 == wait(&status) && ECHILD == errno, NULL);
+
+        actions[0].sa_op = SPAWN_DUP2;
+        actions[0].sa_fd = NFILES - 1;
+        actions[0].sa_newfd = 1;
+        test_assert(-1 == spawn(argv[0], actions, 1, argv, envp) && EBADF == errno, NULL);
+        test_assert(-1 == wait(&status) && ECHILD == errno, NULL);
+
+        /* hello opens the terminal as its standard input and output only
+         * where nothing is open, so its output lands in the file */
+        actions[0].sa_op = SPAWN_CLOSE;
+        actions[0].sa_fd = 0;
+        actions[1].sa_op = SPAWN_OPEN;
+        actions[1].sa_fd = 1;
+        actions[1].sa_path.as_str = "spawnout";
+        actions[1].sa_path.as_len = strlen("spawnout");
+        actions[1].sa_flags = O_WRONLY | O_CREAT;
+        syscall_success(pid = spawn(argv[0], actions, 2, argv, envp));
+        test_assert(pid == waitpid(pid, 0, &status), NULL);
+        test_assert(0 == status, NULL);
+
+        test_assert(-1 != (fd = open("spawnout", O_RDONLY, 0)), NULL);
+        test_assert(14 == read(fd, buf, sizeof(buf)), NULL);
+        test_assert(0 == strncmp(buf, "Hello, world!\n", 14), NULL);
+        syscall_success(close(fd));
+        syscall_success(unlink("spawnout"));
+        return 0;
+}
+
+static int test_priority(void)
+{
+        int status;
+        pid_t pid;
+
+        printf("Testing getpriority(), setpriority() and nice()\n");
+
+        test_assert(0 == getpriority(0), NULL);
+        syscall_success(setpriority(0, 5));
+        test_assert(5 == getpriority(0), NULL);
+        test_assert(5 == getpriority(getpid()), NULL);
+        test_assert(3 == nice(-2), NULL);
+
+        /* out of range values are clamped */
+        syscall_success(setpriority(0, PRIO_MAX + 100));
+        test_assert(PRIO_MAX == getpriority(0), NULL);
+        test_assert(PRIO_MIN == nice(-1000), NULL);
+
+        /* children start with their parent's value */
+        syscall_success(setpriority(0, 7));
+        test_fork_begin() {
+                exit(7 == getpriority(0) ? 0 : 1);
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+
+        /* and can be changed from outside */
+        syscall_success(pid = fork());
+        if (0 == pid) {
+                yield();
+                exit(0);
+        }
+        syscall_success(setpriority(pid, -3));
+        test_assert(-3 == getpriority(pid), NULL);
+        test_assert(pid == waitpid(pid, 0, &status), NULL);
+
+        test_assert(-1 == getpriority(pid) && ESRCH == errno, NULL);
+        test_assert(-1 == setpriority(pid, 0) && ESRCH == errno, NULL);
+        syscall_success(setpriority(0, 0));
+        return 0;
+}
+
+static int test_deadline(void)
+{
+        int status;
+
+        printf("Testing sched_setdeadline()\n");
+
+        /* the budget has to fit before the deadline, and that in the period */
+        test_assert(-1 == sched_setdeadline(0, 0, 1000000) && EINVAL == errno, NULL);
+        test_assert(-1 == sched_setdeadline(2000000, 1000000, 4000000) && EINVAL == errno, NULL);
+        test_assert(-1 == sched_setdeadline(1000000, 4000000, 2000000) && EINVAL == errno, NULL);
+
+        /* nothing may have all of the CPU */
+        test_assert(-1 == sched_setdeadline(4000000, 0, 4000000) && EBUSY == errno, NULL);
+
+        syscall_success(sched_setdeadline(1000000, 0, 10000000));
+        syscall_success(sched_setdeadline(2000000, 5000000, 10000000));
+        /* yielding waits for the next period */
+        sched_yield();
+        sched_yield();
+
+        /* the reservation is not inherited, so a child can not take more
+         * than is left */
+        test_fork_begin() {
+                exit(-1 == sched_setdeadline(3000000, 0, 5000000) && EBUSY == errno ? 0 : 1);
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+
+        syscall_success(sched_setdeadline(0, 0, 0));
+        syscall_success(sched_setdeadline(0, 0, 0));
+        return 0;
+}
+
+static int test_timers(void)
+{
+        struct timespec req, rem;
+        unsigned int left;
+        int status, pid;
+
+        printf("Testing nanosleep(), ualarm(), pause() and timedwaitpid()\n");
+
+        req.tv_sec = 0;
+        req.tv_nsec = 1000000000;
+        test_assert(-1 == nanosleep(&req, &rem) && EINVAL == errno, NULL);
+        req.tv_nsec = 0;
+        syscall_success(nanosleep(&req, &rem));
+        req.tv_nsec = 20000000;
+        syscall_success(nanosleep(&req, NULL));
+        syscall_success(usleep(1));
+
+        /* turning the alarm off says how long it had left */
+        test_assert(0 == ualarm(0, 0), NULL);
+        test_assert(0 == ualarm(10000000, 0), NULL);
+        left = ualarm(0, 0);
+        test_assert(0 < left && left <= 10000000, "%u usecs left", left);
+        test_assert(0 == ualarm(0, 0), NULL);
+
+        /* a one shot alarm which has gone off is counted once */
+        ualarm(10000, 0);
+        syscall_success(usleep(100000));
+        test_assert(1 == pause(), NULL);
+
+        /* a periodic one wakes pause each time */
+        ualarm(20000, 20000);
+        test_assert(1 <= pause(), NULL);
+        test_assert(1 <= pause(), NULL);
+        ualarm(0, 0);
+
+        /* the alarm is not inherited */
+        ualarm(10000000, 0);
+        test_fork_begin() {
+                exit(0 == ualarm(0, 0) ? 0 : 1);
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+        ualarm(0, 0);
+
+        /* waiting for a child can time out */
+        syscall_success(pid = fork());
+        if (0 == pid) {
+                usleep(200000);
+                exit(3);
+        }
+        test_assert(-1 == timedwaitpid(pid, 0, &status, 0) && ETIMEDOUT == errno, NULL);
+        test_assert(-1 == timedwaitpid(-1, 0, &status, 20) && ETIMEDOUT == errno, NULL);
+        test_assert(pid == timedwaitpid(pid, 0, &status, 10000), NULL);
+        test_assert(3 == status, NULL);
+        test_assert(-1 == timedwaitpid(-1, 0, &status, 0) && ECHILD == errno, NULL);
+        return 0;
+}
+
+static int test_mlock(void)
+{
+        char *addr, *locked, *big;
+        int fd, i, status;
+
+        printf("Testing mlock() and MAP_POPULATE/MAP_LOCKED\n");
+
+        /* A populated file mapping reads the file */
+        test_assert(-1 != (fd = open("populate", O_RDWR | O_CREAT, 0)), NULL);
+        for (i = 0; i < 8; i++) {
+                char c = 'a' + i;
+                test_assert((off_t)(PAGE_SIZE * i) == lseek(fd, PAGE_SIZE * i, SEEK_SET), NULL);
+                test_assert(1 == write(fd, &c, 1), NULL);
+        }
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 8, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_POPULATE, fd, 0)), NULL);
+        for (i = 0; i < 8; i++) {
+                test_assert('a' + i == *(addr + PAGE_SIZE * i), NULL);
+        }
+        *addr = 'z';
+        syscall_success(close(fd));
+
+        /* Locking part of a mapping keeps its contents, and unlocking it
+         * again or unmapping it while locked is fine */
+        syscall_success(mlock(addr + PAGE_SIZE * 2, PAGE_SIZE * 3));
+        syscall_success(mlock(addr + PAGE_SIZE * 3, PAGE_SIZE * 3));
+        test_assert('z' == *addr && 'c' == *(addr + PAGE_SIZE * 2), NULL);
+        syscall_success(munlock(addr + PAGE_SIZE * 4, 1));
+        test_assert('e' == *(addr + PAGE_SIZE * 4), NULL);
+        syscall_success(munlock(addr, PAGE_SIZE * 8));
+        syscall_success(mlock(addr + PAGE_SIZE, PAGE_SIZE * 6));
+        test_assert(0 == munmap(addr + PAGE_SIZE * 3, PAGE_SIZE * 2), NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 8), NULL);
+
+        /* A locked anonymous mapping is zeros, keeps what is written to it,
+         * and its copy in a child is independent of it */
+        test_assert(MAP_FAILED != (locked = mmap(NULL, PAGE_SIZE * 16, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANON | MAP_LOCKED, -1, 0)), NULL);
+        for (i = 0; i < 16; i++) {
+                test_assert('\0' == *(locked + PAGE_SIZE * i), NULL);
+                *(locked + PAGE_SIZE * i) = 'l';
+        }
+        test_fork_begin() {
+                for (i = 0; i < 16; i++) {
+                        test_assert('l' == *(locked + PAGE_SIZE * i), NULL);
+                        *(locked + PAGE_SIZE * i) = 'c';
+                }
+                syscall_success(mlock(locked, PAGE_SIZE * 16));
+                return 0;
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+        for (i = 0; i < 16; i++) {
+                test_assert('l' == *(locked + PAGE_SIZE * i), NULL);
+        }
+
+        /* Locked pages cannot be dropped until they are unlocked */
+        test_assert(-1 == madvise(locked + PAGE_SIZE * 2, PAGE_SIZE * 2, MADV_DONTNEED)
+                    && EINVAL == errno, NULL);
+        test_assert(-1 == madvise(locked, PAGE_SIZE * 16, MADV_FREE) && EINVAL == errno, NULL);
+        test_assert('l' == *(locked + PAGE_SIZE * 2) && 'l' == *(locked + PAGE_SIZE * 3), NULL);
+        syscall_success(munlock(locked, PAGE_SIZE * 16));
+        syscall_success(madvise(locked + PAGE_SIZE * 2, PAGE_SIZE * 2, MADV_DONTNEED));
+        test_assert('l' == *(locked + PAGE_SIZE * 4), NULL);
+
+        /* Too much locked memory, or an unmapped range, is refused */
+        test_assert(MAP_FAILED != (big = mmap(NULL, PAGE_SIZE * 8192, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        test_assert(-1 == mlock(big, PAGE_SIZE * 8192) && ENOMEM == errno, NULL);
+        test_assert(MAP_FAILED == mmap(NULL, PAGE_SIZE * 8192, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANON | MAP_LOCKED, -1, 0)
+                    && ENOMEM == errno, NULL);
+        test_assert(0 == munmap(big, PAGE_SIZE * 8192), NULL);
+        test_assert(-1 == mlock(big, PAGE_SIZE) && ENOMEM == errno, NULL);
+
+        test_assert(0 == munmap(locked, PAGE_SIZE * 16), NULL);
+        syscall_success(unlink("populate"));
+        return 0;
+}
+
 static void
 make_rootdir(void)
 {
@@ -741,6 +1225,15 @@ int main(int argc, char **argv)
         childtest(test_mmap_fill);
         childtest(test_mmap_repeat);
         childtest(test_mmap_beyond);
+        childtest(test_madvise);
+        childtest(test_mlock);
+        childtest(test_zero_page);
+        childtest(test_cow_exit);
+        childtest(test_readonly_fork);
+        childtest(test_spawn);
+        childtest(test_priority);
+        childtest(test_deadline);
+        childtest(test_timers);
         syscall_success(chdir(".."));
         destroy_rootdir();
 
@@ -0,0 +1,138 @@
+/*
+ * Measures how long a process which mostly sleeps takes to get the CPU
+ * when it wakes while others are busy computing. The parent sleeps for
+ * the shortest time it can, which is two clock ticks, over and over and
+ * times from one wakeup to the next. Meanwhile the worker children spin
+ * in chunks of the given number of cycles, yielding after each. Threads
+ * which wake from a sleep should be run ahead of those which used up
+ * their slices, so the time between wakeups should stay what it is with
+ * no workers at all. The run is repeated with the workers at their
+ * default nice value and at the nicest; the chunks the workers got
+ * through show what they lost.
+ *
+ * usage: schedlat [workers] [sleeps] [chunk cycles]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_WORKERS         4
+#define DEFAULT_SLEEPS          200
+#define DEFAULT_CHUNK           1000000
+#define MAX_WORKERS             64
+#define PAGE_BYTES              4096
+
+/* Shared with the workers */
+struct board {
+        volatile int stop;
+        volatile unsigned int chunks[MAX_WORKERS];
+};
+
+static void spin(uint64_t cycles)
+{
+        uint64_t start = rdtsc();
+
+        while (rdtsc() - start < cycles)
+                ;
+}
+
+static void worker(struct board *b, int id, int prio, uint64_t chunk)
+{
+        if (0 > setpriority(0, prio)) {
+                _exit(1);
+        }
+        while (!b->stop) {
+                spin(chunk);
+                b->chunks[id]++;
+                sched_yield();
+        }
+        _exit(0);
+}
+
+static int run(struct board *b, int workers, int prio, int sleeps, uint64_t chunk)
+{
+        uint64_t last, now, t, total = 0, worst = 0;
+        unsigned int chunks = 0;
+        int i, status;
+        pid_t pid;
+
+        b->stop = 0;
+        for (i = 0; i < workers; i++) {
+                b->chunks[i] = 0;
+                if (0 > (pid = fork())) {
+                        return -1;
+                }
+                if (0 == pid) {
+                        worker(b, i, prio, chunk);
+                }
+        }
+
+        /* start just after a tick */
+        usleep(1);
+        last = rdtsc();
+        for (i = 0; i < sleeps; i++) {
+                usleep(1);
+                now = rdtsc();
+                t = now - last;
+                last = now;
+                total += t;
+                if (t > worst) {
+                        worst = t;
+                }
+        }
+
+        b->stop = 1;
+        for (i = 0; i < workers; i++) {
+                wait(&status);
+        }
+        for (i = 0; i < workers; i++) {
+                chunks += b->chunks[i];
+        }
+
+        printf("%2d workers at nice %3d: woke every %10u cycles, worst %10u, worker chunks %6u\n",
+               workers, prio, (unsigned int)(total / sleeps), (unsigned int)worst, chunks);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int workers = DEFAULT_WORKERS;
+        int sleeps = DEFAULT_SLEEPS;
+        int chunk = DEFAULT_CHUNK;
+        struct board *b;
+
+        if (argc > 1) {
+                workers = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                sleeps = atoi(argv[2]);
+        }
+        if (argc > 3) {
+                chunk = atoi(argv[3]);
+        }
+        if (workers < 0 || workers > MAX_WORKERS || sleeps <= 0 || chunk <= 0) {
+                printf("usage: schedlat [workers] [sleeps] [chunk cycles]\n");
+                return 1;
+        }
+
+        b = mmap(NULL, PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+        if (MAP_FAILED == b) {
+                printf("schedlat: mmap failed\n");
+                return 1;
+        }
+
+        printf("%d sleeps, workers spinning %d cycles between yields\n", sleeps, chunk);
+        if (0 > run(b, 0, 0, sleeps, chunk)
+            || 0 > run(b, workers, 0, sleeps, chunk)
+            || 0 > run(b, workers, PRIO_MAX, sleeps, chunk)) {
+                printf("schedlat: fork failed\n");
+                return 1;
+        }
+
+        munmap(b, PAGE_BYTES);
+        return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Measures the memory a mostly untouched buffer costs when it is read. A
+ * large anonymous region is read a word per page, as a sparse embedding
+ * table or a freshly allocated tensor would be, and only every so often
+ * is a page written. Reading a private mapping should leave every page it
+ * never wrote on the shared zero page, so only the written pages take
+ * memory; a shared mapping gets no such treatment and serves as the
+ * baseline. The footprint is the drop in free memory while the region is
+ * mapped.
+ *
+ * usage: sparseread [pages] [write every n pages]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_PAGES           4096    /* 16MB */
+#define DEFAULT_WRITE_STRIDE    64
+#define PAGE_BYTES              4096
+
+static const struct {
+        const char *name;
+        int flags;
+} modes[] = {
+        { "shared", MAP_SHARED },
+        { "private", MAP_PRIVATE },
+};
+
+static int run(const char *name, int flags, int pages, int stride)
+{
+        volatile unsigned int *region;
+        unsigned int sum = 0;
+        size_t before, after;
+        uint64_t start, cycles;
+        int i, written = 0;
+
+        before = get_free_mem();
+        region = mmap(NULL, pages * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                      flags | MAP_ANON, -1, 0);
+        if (MAP_FAILED == region) {
+                return -1;
+        }
+
+        start = rdtsc();
+        for (i = 0; i < pages; i++) {
+                sum += region[i * (PAGE_BYTES / sizeof(unsigned int))];
+        }
+        cycles = rdtsc() - start;
+        for (i = 0; i < pages; i += stride) {
+                region[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+                written++;
+        }
+        after = get_free_mem();
+
+        printf("%-8s %8u cycles/read, %5d pages written, %7u KB used%s\n",
+               name, (unsigned int)(cycles / pages), written,
+               (unsigned int)((before - after) / 1024), sum ? " (nonzero read!)" : "");
+        munmap((void *)region, pages * PAGE_BYTES);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int pages = DEFAULT_PAGES;
+        int stride = DEFAULT_WRITE_STRIDE;
+        unsigned int m;
+
+        if (argc > 1) {
+                pages = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                stride = atoi(argv[2]);
+        }
+        if (pages <= 0 || stride <= 0) {
+                printf("usage: sparseread [pages] [write every n pages]\n");
+                return 1;
+        }
+
+        printf("%d pages (%d KB) read, one in %d written\n",
+               pages, pages * (PAGE_BYTES / 1024), stride);
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                if (0 > run(modes[m].name, modes[m].flags, pages, stride)) {
+                        printf("sparseread: %s mapping failed\n", modes[m].name);
+                        return 1;
+                }
+        }
+        return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Measures how fast a process can start short-lived workers, the way sh
+ * and init start every program. Each worker is this program run again
+ * with -x, which exits straight away, started either with fork and execve
+ * as fork-and-wait does or with spawn, and then waited for. fork has to
+ * copy the parent's address space only for execve to throw it away, so
+ * the parent first writes a region of the given size to give fork
+ * something to copy; spawn should not care how big the parent is.
+ *
+ * usage: spawnbench [workers] [parent pages]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_WORKERS         200
+#define DEFAULT_PAGES           2048    /* 8MB */
+#define PAGE_BYTES              4096
+#define SELF                    "/usr/bin/spawnbench"
+
+static char *child_argv[] = { SELF, "-x", NULL };
+static char *child_envp[] = { NULL };
+
+static int fork_exec(void)
+{
+        pid_t pid;
+
+        if (0 > (pid = fork())) {
+                return -1;
+        }
+        if (0 == pid) {
+                execve(SELF, child_argv, child_envp);
+                _exit(1);
+        }
+        return pid;
+}
+
+static int spawn_one(void)
+{
+        return spawn(SELF, NULL, 0, child_argv, child_envp);
+}
+
+static const struct {
+        const char *name;
+        int (*start)(void);
+} modes[] = {
+        { "fork+exec", fork_exec },
+        { "spawn", spawn_one },
+};
+
+static int run(unsigned int m, int workers, int pages)
+{
+        uint64_t start, cycles;
+        int i, status, failed = 0;
+        pid_t pid;
+
+        start = rdtsc();
+        for (i = 0; i < workers; i++) {
+                if (0 > (pid = modes[m].start())) {
+                        return -1;
+                }
+                waitpid(pid, 0, &status);
+                if (0 != status) {
+                        failed++;
+                }
+        }
+        cycles = rdtsc() - start;
+
+        printf("%-9s %5d parent pages: %8u cycles/worker%s\n", modes[m].name, pages,
+               (unsigned int)(cycles / workers), failed ? " (some workers failed!)" : "");
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int workers = DEFAULT_WORKERS;
+        int pages = DEFAULT_PAGES;
+        volatile unsigned int *region;
+        unsigned int m;
+        int i;
+
+        if (argc > 1 && !strcmp(argv[1], "-x")) {
+                return 0;
+        }
+        if (argc > 1) {
+                workers = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                pages = atoi(argv[2]);
+        }
+        if (workers <= 0 || pages < 0) {
+                printf("usage: spawnbench [workers] [parent pages]\n");
+                return 1;
+        }
+
+        printf("%d workers started and waited for\n", workers);
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                if (0 > run(m, workers, 0)) {
+                        printf("spawnbench: %s failed\n", modes[m].name);
+                        return 1;
+                }
+        }
+
+        if (0 == pages) {
+                return 0;
+        }
+        region = mmap(NULL, pages * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == region) {
+                printf("spawnbench: mmap failed\n");
+                return 1;
+        }
+        for (i = 0; i < pages; i++) {
+                region[i * (PAGE_BYTES / sizeof(unsigned int))] = i;
+        }
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                if (0 > run(m, workers, pages)) {
+                        printf("spawnbench: %s failed\n", modes[m].name);
+                        return 1;
+                }
+        }
+        munmap((void *)region, pages * PAGE_BYTES);
+        return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Measures how evenly the CPU is shared between processes which never
+ * give it up. A number of copies of spin are started at once, each
+ * told to spin for the same number of cycles and then print how many
+ * loops it got through into a file of its own. Without preemption the first one to run keeps
+ * the CPU until it is done and the rest get almost nothing; with it
+ * each should get about the same share. The shares are reported with
+ * Jain's fairness index, which is 1000 here when all are equal and
+ * 1000 / spinners when one process got everything.
+ *
+ * usage: spinfair [spinners] [megacycles]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <weenix/syscall.h>
+
+#define DEFAULT_SPINNERS        4
+#define DEFAULT_MEGACYCLES      4000
+#define MAX_SPINNERS            32
+#define SPIN                    "/usr/bin/spin"
+
+/* Reads the count a spinner left in its file, and removes the file */
+static int read_count(const char *path, unsigned int *count)
+{
+        char buf[16];
+        int fd, len, i;
+
+        if (0 > (fd = open(path, O_RDONLY, 0))) {
+                return -1;
+        }
+        len = read(fd, buf, sizeof(buf));
+        close(fd);
+        unlink(path);
+
+        *count = 0;
+        for (i = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++) {
+                *count = *count * 10 + (buf[i] - '0');
+        }
+        return (i > 0 && i < len && '\n' == buf[i]) ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+        int spinners = DEFAULT_SPINNERS;
+        int megacycles = DEFAULT_MEGACYCLES;
+        unsigned int counts[MAX_SPINNERS], lo, hi;
+        uint64_t sum = 0, squares = 0;
+        spawn_action_t actions[1];
+        char arg[16], paths[MAX_SPINNERS][16];
+        char *spin_argv[] = { SPIN, arg, NULL };
+        char *spin_envp[] = { NULL };
+        int i, n = 0, status;
+
+        if (argc > 1) {
+                spinners = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                megacycles = atoi(argv[2]);
+        }
+        if (spinners <= 0 || spinners > MAX_SPINNERS || megacycles <= 0) {
+                printf("usage: spinfair [spinners] [megacycles]\n");
+                return 1;
+        }
+        snprintf(arg, sizeof(arg), "%d", megacycles);
+
+        /* each spinner prints its count into its own file */
+        actions[0].sa_op = SPAWN_OPEN;
+        actions[0].sa_fd = STDOUT_FILENO;
+        actions[0].sa_flags = O_WRONLY | O_CREAT;
+        for (i = 0; i < spinners; i++) {
+                snprintf(paths[i], sizeof(paths[i]), "spinfair.%d", i);
+                actions[0].sa_path.as_str = paths[i];
+                actions[0].sa_path.as_len = strlen(paths[i]);
+                if (0 > spawn(SPIN, actions, 1, spin_argv, spin_envp)) {
+                        printf("spinfair: spawn failed\n");
+                        return 1;
+                }
+        }
+
+        for (i = 0; i < spinners; i++) {
+                wait(&status);
+        }
+        for (i = 0; i < spinners; i++) {
+                if (0 == read_count(paths[i], &counts[n])) {
+                        n++;
+                }
+        }
+        if (n != spinners) {
+                printf("spinfair: only %d of %d spinners reported\n", n, spinners);
+                return 1;
+        }
+
+        lo = hi = counts[0];
+        for (i = 0; i < n; i++) {
+                printf("spinner %2d: %8u thousand loops\n", i, counts[i]);
+                lo = MIN(lo, counts[i]);
+                hi = MAX(hi, counts[i]);
+                sum += counts[i];
+                squares += (uint64_t)counts[i] * counts[i];
+        }
+        printf("%d spinners for %d megacycles: least %u, most %u, fairness %u/1000\n",
+               n, megacycles, lo, hi,
+               squares ? (unsigned int)(sum * sum * 1000 / (squares * n)) : 0);
+        return 0;
+}
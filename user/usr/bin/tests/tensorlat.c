@@ -0,0 +1,170 @@
+/*
+ * Measures the latency of the first requests served from a freshly mapped
+ * model. A file of weights is mapped privately and read-only, an
+ * activation buffer is mapped anonymously, and a stream of requests each
+ * reads a few random weight pages and writes a few activation pages. With
+ * demand paging the first requests pay for the page faults, which shows up
+ * in the tail of the latency distribution; mapping with MAP_POPULATE or
+ * MAP_LOCKED moves that cost into the mmap call, which is reported
+ * separately.
+ *
+ * usage: tensorlat [weight pages] [requests]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <weenix/tsc.h>
+
+#define DEFAULT_WEIGHT_PAGES    1024    /* 4MB */
+#define DEFAULT_REQUESTS        256
+#define ACT_PAGES               64
+#define REQUEST_PAGES           8
+#define ROUNDS                  4
+#define PAGE_BYTES              4096
+#define WEIGHTS_FILE            "/tmp/tensorlat"
+
+static const struct {
+        const char *name;
+        int flags;
+} modes[] = {
+        { "demand", 0 },
+        { "populate", MAP_POPULATE },
+        { "locked", MAP_LOCKED },
+};
+
+static uint64_t *samples;
+
+/* Shell sort, since there is no qsort */
+static void sort_samples(int n)
+{
+        int gap, i, j;
+        uint64_t v;
+
+        for (gap = n / 2; gap > 0; gap /= 2) {
+                for (i = gap; i < n; i++) {
+                        v = samples[i];
+                        for (j = i; j >= gap && samples[j - gap] > v; j -= gap) {
+                                samples[j] = samples[j - gap];
+                        }
+                        samples[j] = v;
+                }
+        }
+}
+
+static int make_weights(int weight_pages)
+{
+        static unsigned int page[PAGE_BYTES / sizeof(unsigned int)];
+        unsigned int i, j;
+        int fd;
+
+        if (0 > (fd = open(WEIGHTS_FILE, O_RDWR | O_CREAT, 0))) {
+                return -1;
+        }
+        for (i = 0; i < (unsigned int)weight_pages; i++) {
+                for (j = 0; j < PAGE_BYTES / sizeof(unsigned int); j++) {
+                        page[j] = i ^ j;
+                }
+                if (PAGE_BYTES != write(fd, page, PAGE_BYTES)) {
+                        close(fd);
+                        return -1;
+                }
+        }
+        return fd;
+}
+
+static int run(int fd, int weight_pages, int requests, int flags,
+               uint64_t *map_cycles, unsigned int *sum)
+{
+        volatile unsigned int *w, *act;
+        uint64_t start;
+        int i, j, page;
+
+        start = rdtsc();
+        w = mmap(NULL, weight_pages * PAGE_BYTES, PROT_READ, MAP_PRIVATE | flags, fd, 0);
+        act = mmap(NULL, ACT_PAGES * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON | flags, -1, 0);
+        *map_cycles += rdtsc() - start;
+        if (MAP_FAILED == w || MAP_FAILED == act) {
+                return -1;
+        }
+
+        for (i = 0; i < requests; i++) {
+                start = rdtsc();
+                for (j = 0; j < REQUEST_PAGES; j++) {
+                        page = rand() % weight_pages;
+                        *sum += w[page * (PAGE_BYTES / sizeof(unsigned int)) + j];
+                        act[((i * REQUEST_PAGES + j) % ACT_PAGES)
+                            * (PAGE_BYTES / sizeof(unsigned int))] = *sum;
+                }
+                samples[i] += rdtsc() - start;
+        }
+
+        munmap((void *)act, ACT_PAGES * PAGE_BYTES);
+        munmap((void *)w, weight_pages * PAGE_BYTES);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int weight_pages = DEFAULT_WEIGHT_PAGES;
+        int requests = DEFAULT_REQUESTS;
+        unsigned int sum = 0;
+        uint64_t map_cycles;
+        unsigned int m;
+        int fd, i, round;
+
+        if (argc > 1) {
+                weight_pages = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                requests = atoi(argv[2]);
+        }
+        if (NULL == (samples = malloc(requests * sizeof(*samples)))) {
+                printf("tensorlat: out of memory\n");
+                return 1;
+        }
+        if (0 > (fd = make_weights(weight_pages))) {
+                printf("tensorlat: could not create %s\n", WEIGHTS_FILE);
+                return 1;
+        }
+
+        printf("%d requests of %d pages over %d weight pages, %d rounds each\n",
+               requests, REQUEST_PAGES, weight_pages, ROUNDS);
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                map_cycles = 0;
+                for (i = 0; i < requests; i++) {
+                        samples[i] = 0;
+                }
+                /* every round replays the same requests, so that each
+                 * sample is the mean of one request over the rounds */
+                for (round = 0; round < ROUNDS; round++) {
+                        srand(1);
+                        if (0 > run(fd, weight_pages, requests, modes[m].flags,
+                                    &map_cycles, &sum)) {
+                                printf("tensorlat: %s mapping failed\n", modes[m].name);
+                                break;
+                        }
+                }
+                if (round < ROUNDS) {
+                        continue;
+                }
+                printf("%-9s mmap %10u cycles, first request %8u, ",
+                       modes[m].name, (unsigned int)(map_cycles / ROUNDS),
+                       (unsigned int)(samples[0] / ROUNDS));
+                sort_samples(requests);
+                printf("p50 %8u, p99 %8u, max %8u cycles/request\n",
+                       (unsigned int)(samples[requests / 2] / ROUNDS),
+                       (unsigned int)(samples[requests * 99 / 100] / ROUNDS),
+                       (unsigned int)(samples[requests - 1] / ROUNDS));
+        }
+
+        printf("(checksum %u)\n", sum);
+        close(fd);
+        unlink(WEIGHTS_FILE);
+        free(samples);
+        return 0;
+}